@@ -0,0 +1,619 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "adb_dev.h"
+#include "hid_codes.h"
+
+// A count is a count; the host accelerates.
+static const MouseShaperConfig s_mouse_shaping = {
+    .scale_q16 = MOUSE_Q16_ONE,
+    .max_delta = ADB_MOUSE_MAX_DELTA,
+};
+
+static const uint8_t s_adb_keycodes[256];
+
+static uint32_t
+rng_next(AdbDev *d)
+{
+    d->rng ^= d->rng << 13;
+    d->rng ^= d->rng >> 17;
+    d->rng ^= d->rng << 5;
+    return d->rng;
+}
+
+static void
+id_reset(AdbDevId *id)
+{
+    id->addr = id->default_addr;
+    id->handler = id->default_handler;
+    id->srq_enable = true;
+    id->collided = false;
+}
+
+static void
+reset(AdbDev *d)
+{
+    id_reset(&d->kbd);
+    id_reset(&d->mouse);
+
+    d->key_head = 0;
+    d->key_count = 0;
+    d->caps_locked = false;
+    d->leds = ADB_R2_LEDS;
+
+    // whatever buttons are down get sent again
+    mouse_shaper_clear(&d->motion);
+    d->left_click = d->right_click = false;
+    d->left_sent = d->right_sent = false;
+
+    d->have_command = false;
+    d->talking = NULL;
+    d->polled = 0;
+}
+
+void
+adb_dev_init(AdbDev *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->kbd.default_addr = ADB_ADDR_KEYBOARD;
+    d->kbd.default_handler = ADB_HANDLER_KBD_EXTENDED;
+    d->mouse.default_addr = ADB_ADDR_MOUSE;
+    d->mouse.default_handler = ADB_HANDLER_MOUSE_100;
+    mouse_shaper_init(&d->motion, &s_mouse_shaping);
+    d->rng = 0x2d1b5a3u;
+    reset(d);
+}
+
+static AdbDevId *
+dev_at(AdbDev *d, uint8_t addr)
+{
+    if (d->kbd.addr == addr)
+        return &d->kbd;
+    if (d->mouse.addr == addr)
+        return &d->mouse;
+    return NULL;
+}
+
+//
+// keyboard
+//
+
+uint8_t
+adb_dev_keycode(uint8_t hid_keycode)
+{
+    uint8_t v = s_adb_keycodes[hid_keycode];
+    return v ? v - 1 : ADB_KEY_NONE;
+}
+
+static void
+key_put(AdbDev *d, uint8_t code)
+{
+    if (d->key_count == ADB_KEY_QUEUE) {
+        d->keys_dropped++;
+        return;
+    }
+    d->keys[(d->key_head + d->key_count++) % ADB_KEY_QUEUE] = code;
+}
+
+static uint8_t
+key_take(AdbDev *d)
+{
+    uint8_t code = d->keys[d->key_head];
+    d->key_head = (d->key_head + 1) % ADB_KEY_QUEUE;
+    d->key_count--;
+    return code;
+}
+
+// back at the front, for a reply that didn't get through
+static void
+key_unget(AdbDev *d, uint8_t code)
+{
+    if (d->key_count == ADB_KEY_QUEUE) {
+        d->keys_dropped++;
+        return;
+    }
+    d->key_head = (d->key_head + ADB_KEY_QUEUE - 1) % ADB_KEY_QUEUE;
+    d->keys[d->key_head] = code;
+    d->key_count++;
+}
+
+// register 2's bit for a key that's held, if it has one
+static uint16_t
+held_bit(uint8_t code)
+{
+    switch (code) {
+    case 0x33: return ADB_R2_DELETE;
+    case 0x7f: return ADB_R2_RESET;
+    case 0x36: case 0x7d: return ADB_R2_CONTROL;
+    case 0x38: case 0x7b: return ADB_R2_SHIFT;
+    case 0x3a: case 0x7c: return ADB_R2_OPTION;
+    case 0x37: return ADB_R2_COMMAND;
+    case 0x47: return ADB_R2_NUM_LOCK;
+    case 0x6b: return ADB_R2_SCROLL_LOCK;
+    }
+    return 0;
+}
+
+void
+adb_dev_key(AdbDev *d, uint8_t hid_keycode, bool down)
+{
+    uint8_t code = adb_dev_keycode(hid_keycode);
+    if (code == ADB_KEY_NONE)
+        return;
+
+    if (code == ADB_KEY_CAPS_LOCK) {
+        if (!down)
+            return;
+        d->caps_locked = !d->caps_locked;
+        key_put(d, code | (d->caps_locked ? 0 : ADB_KEY_UP));
+        return;
+    }
+
+    if (down)
+        d->held |= held_bit(code);
+    else
+        d->held &= ~held_bit(code);
+    key_put(d, code | (down ? 0 : ADB_KEY_UP));
+}
+
+bool
+adb_dev_kbd_pending(const AdbDev *d)
+{
+    return d->key_count != 0;
+}
+
+// The right modifiers are the left ones unless the host asked otherwise.
+static uint8_t
+sent_code(const AdbDev *d, uint8_t code)
+{
+    if (d->kbd.handler == ADB_HANDLER_KBD_EXTENDED_LR)
+        return code;
+    switch (code & 0x7f) {
+    case 0x7b: return (code & ADB_KEY_UP) | 0x38;
+    case 0x7c: return (code & ADB_KEY_UP) | 0x3a;
+    case 0x7d: return (code & ADB_KEY_UP) | 0x36;
+    }
+    return code;
+}
+
+static uint8_t
+talk_keys(AdbDev *d, uint8_t *out)
+{
+    if (!d->key_count)
+        return 0;
+
+    // the power key is 0x7f7f down and 0xffff up, on its own
+    uint8_t a = key_take(d);
+    if ((a & 0x7f) == ADB_KEY_POWER) {
+        out[0] = out[1] = a;
+        return 2;
+    }
+
+    out[0] = sent_code(d, a);
+    out[1] = ADB_KEY_NONE;
+    if (d->key_count && (d->keys[d->key_head] & 0x7f) != ADB_KEY_POWER)
+        out[1] = sent_code(d, key_take(d));
+    return 2;
+}
+
+static uint8_t
+talk_kbd_reg2(AdbDev *d, uint8_t *out)
+{
+    uint16_t down = d->held | (d->caps_locked ? ADB_R2_CAPS_LOCK : 0);
+    uint16_t r2 = (uint16_t) (~down & ~ADB_R2_LEDS) | (d->leds & ADB_R2_LEDS);
+    out[0] = r2 >> 8;
+    out[1] = r2 & 0xff;
+    return 2;
+}
+
+uint8_t
+adb_dev_leds_to_hid(uint8_t adb_leds)
+{
+    // KEYBOARD_LED_NUMLOCK, _CAPSLOCK, _SCROLLLOCK; 0 is on
+    uint8_t hid = 0;
+    if (!(adb_leds & 0x01))
+        hid |= 0x01;
+    if (!(adb_leds & 0x02))
+        hid |= 0x02;
+    if (!(adb_leds & 0x04))
+        hid |= 0x04;
+    return hid;
+}
+
+//
+// mouse
+//
+
+void
+adb_dev_mouse(AdbDev *d, int32_t dx, int32_t dy, bool left, bool right, uint32_t now_us)
+{
+    if (dx || dy)
+        mouse_shaper_add(&d->motion, dx, dy, now_us);
+
+    // a click between two Talks still goes down before it goes up
+    if (left && !d->left)
+        d->left_click = true;
+    if (right && !d->right)
+        d->right_click = true;
+    d->left = left;
+    d->right = right;
+}
+
+static bool
+left_now(const AdbDev *d)
+{
+    return d->left || d->left_click;
+}
+
+static bool
+right_now(const AdbDev *d)
+{
+    return d->right || d->right_click;
+}
+
+bool
+adb_dev_mouse_pending(const AdbDev *d)
+{
+    return mouse_shaper_pending(&d->motion) || left_now(d) != d->left_sent || right_now(d) != d->right_sent;
+}
+
+static uint8_t
+talk_mouse(AdbDev *d, uint8_t *out)
+{
+    if (!adb_dev_mouse_pending(d))
+        return 0;
+
+    int16_t dx, dy;
+    mouse_shaper_take(&d->motion, &dx, &dy);
+    bool left = left_now(d), right = right_now(d);
+    d->left_click = d->right_click = false;
+    d->left_before = d->left_sent;
+    d->right_before = d->right_sent;
+    d->left_sent = left;
+    d->right_sent = right;
+
+    out[0] = (left ? 0 : 0x80) | (dy & 0x7f);
+    out[1] = (right ? 0 : 0x80) | (dx & 0x7f);
+    return 2;
+}
+
+static int
+field(uint8_t bits)
+{
+    return bits & 0x40 ? (int) (bits & 0x7f) - 0x80 : (int) (bits & 0x7f);
+}
+
+//
+// register 3 and the bus
+//
+
+static uint8_t
+talk_reg3(AdbDev *d, const AdbDevId *id, uint8_t *out)
+{
+    // a random address, so another device here sends something different
+    out[0] = ADB_R3_EXCEPTION | (id->srq_enable ? ADB_R3_SRQ_ENABLE : 0) | (rng_next(d) & 0x0f);
+    out[1] = id->handler;
+    return 2;
+}
+
+static bool
+handler_ok(const AdbDev *d, const AdbDevId *id, uint8_t handler)
+{
+    if (id == &d->kbd)
+        return handler >= ADB_HANDLER_KBD_STANDARD && handler <= ADB_HANDLER_KBD_EXTENDED_LR;
+    return handler == ADB_HANDLER_MOUSE_100 || handler == ADB_HANDLER_MOUSE_200;
+}
+
+static bool
+listen_reg3(AdbDev *d, AdbDevId *id, const uint8_t *data)
+{
+    uint8_t addr = data[0] & 0x0f;
+    switch (data[1]) {
+    case ADB_R3_SELF_TEST:
+    case ADB_R3_MOVE_IF_ACTIVATED:
+        return false;
+    case ADB_R3_MOVE_IF_NO_COLLISION:
+        // another device answered the last Talk 3 along with this one;
+        // the host moves one of them at a time
+        if (id->collided)
+            return false;
+        id->addr = addr;
+        return true;
+    case ADB_R3_MOVE_AND_ENABLE:
+        id->addr = addr;
+        id->srq_enable = data[0] & ADB_R3_SRQ_ENABLE;
+        return true;
+    default:
+        if (!handler_ok(d, id, data[1]))
+            return false;
+        id->handler = data[1];
+        id->srq_enable = data[0] & ADB_R3_SRQ_ENABLE;
+        return true;
+    }
+}
+
+static void
+flush(AdbDev *d, AdbDevId *id)
+{
+    if (id == &d->kbd) {
+        d->key_count = 0;
+    } else {
+        mouse_shaper_clear(&d->motion);
+        d->left_click = d->right_click = false;
+        d->left_sent = d->left;
+        d->right_sent = d->right;
+    }
+}
+
+// The host polls the same device again next, most likely; ask for service
+// if the other one has something.
+static void
+srq_point(AdbDev *d, AdbDevResult *res)
+{
+    if ((adb_dev_kbd_pending(d) && d->kbd.srq_enable && d->kbd.addr != d->polled) ||
+        (adb_dev_mouse_pending(d) && d->mouse.srq_enable && d->mouse.addr != d->polled)) {
+        res->actions |= AdbDevActSrq;
+        d->srqs++;
+    }
+}
+
+// Our reply didn't come back off the bus as it went out: another device
+// was talking at the same time. Register 0's data goes back to be sent
+// again, and a Listen 3 0xfe leaves this one where it is.
+static void
+collided(AdbDev *d)
+{
+    AdbDevId *id = d->talking;
+    d->talking = NULL;
+    d->collisions++;
+    id->collided = true;
+
+    if ((d->command & 3) != 0)
+        return;
+    if (id == &d->kbd) {
+        if (d->sent[0] == d->sent[1] && (d->sent[0] & 0x7f) == ADB_KEY_POWER) {
+            key_unget(d, d->sent[0]);
+            return;
+        }
+        if (d->sent[1] != ADB_KEY_NONE)
+            key_unget(d, d->sent[1]);
+        key_unget(d, d->sent[0]);
+    } else {
+        mouse_shaper_add(&d->motion, field(d->sent[1]), field(d->sent[0]), 0);
+        if (!(d->sent[0] & 0x80) && !d->left)
+            d->left_click = true;
+        if (!(d->sent[1] & 0x80) && !d->right)
+            d->right_click = true;
+        d->left_sent = d->left_before;
+        d->right_sent = d->right_before;
+    }
+}
+
+static void
+command(AdbDev *d, uint8_t c, AdbDevResult *res)
+{
+    if (d->talking)
+        collided(d);
+
+    d->command = c;
+    d->have_command = true;
+    uint8_t reg = c & 3;
+    AdbDevId *id = dev_at(d, c >> 4);
+
+    if ((c & 0x0f) == ADB_SEND_RESET) {
+        reset(d);
+        res->actions |= AdbDevActReset;
+        srq_point(d, res);
+        return;
+    }
+    if ((c & 0x0f) == ADB_FLUSH(0)) {
+        if (id)
+            flush(d, id);
+        srq_point(d, res);
+        return;
+    }
+    if ((c & 0x0c) != 0x0c)
+        return;
+
+    // Talk
+    if (reg == 0)
+        d->polled = c >> 4;
+    if (!id)
+        return;
+
+    uint8_t len = 0;
+    if (reg == 3)
+        len = talk_reg3(d, id, res->reply);
+    else if (reg == 0)
+        len = id == &d->kbd ? talk_keys(d, res->reply) : talk_mouse(d, res->reply);
+    else if (reg == 2 && id == &d->kbd)
+        len = talk_kbd_reg2(d, res->reply);
+
+    if (!len) {
+        // nobody else is at this address to answer
+        srq_point(d, res);
+        return;
+    }
+    res->actions |= AdbDevActReply;
+    res->reply_len = len;
+    memcpy(d->sent, res->reply, len);
+    d->sent_len = len;
+    d->talking = id;
+    d->replies++;
+}
+
+static void
+data(AdbDev *d, const AdbFrame *f, AdbDevResult *res)
+{
+    bool have_command = d->have_command;
+    d->have_command = false;
+
+    if (d->talking) {
+        if (f->len != d->sent_len || memcmp(f->data, d->sent, f->len)) {
+            collided(d);
+        } else {
+            if ((d->command & 3) == 3)
+                d->talking->collided = false;
+            d->talking = NULL;
+        }
+    } else if (have_command && (d->command & 0x0c) == 0x08 && f->len == 2) {
+        AdbDevId *id = dev_at(d, d->command >> 4);
+        uint8_t reg = d->command & 3;
+        if (id && reg == 3 && listen_reg3(d, id, f->data))
+            res->actions |= AdbDevActReg3;
+        else if (id == &d->kbd && reg == 2) {
+            d->leds = f->data[1] & ADB_R2_LEDS;
+            res->actions |= AdbDevActLeds;
+        }
+    }
+    srq_point(d, res);
+}
+
+void
+adb_dev_frame(AdbDev *d, const AdbFrame *f, AdbDevResult *res)
+{
+    res->actions = 0;
+    res->reply_len = 0;
+
+    switch (f->type) {
+    case AdbFrameReset:
+        reset(d);
+        res->actions |= AdbDevActReset;
+        break;
+    case AdbFrameCommand:
+        command(d, f->command, res);
+        break;
+    case AdbFrameData:
+        data(d, f, res);
+        break;
+    }
+}
+
+// HID_KEY_* to ADB key code + 1, so 0 is none
+#define K(code) ((code) + 1)
+
+static const uint8_t s_adb_keycodes[256] = {
+    [HID_KEY_A]                             = K(0x00),
+    [HID_KEY_S]                             = K(0x01),
+    [HID_KEY_D]                             = K(0x02),
+    [HID_KEY_F]                             = K(0x03),
+    [HID_KEY_H]                             = K(0x04),
+    [HID_KEY_G]                             = K(0x05),
+    [HID_KEY_Z]                             = K(0x06),
+    [HID_KEY_X]                             = K(0x07),
+    [HID_KEY_C]                             = K(0x08),
+    [HID_KEY_V]                             = K(0x09),
+    [HID_KEY_NONUS_BACK_SLASH_VERTICAL_BAR] = K(0x0a),
+    [HID_KEY_B]                             = K(0x0b),
+    [HID_KEY_Q]                             = K(0x0c),
+    [HID_KEY_W]                             = K(0x0d),
+    [HID_KEY_E]                             = K(0x0e),
+    [HID_KEY_R]                             = K(0x0f),
+    [HID_KEY_Y]                             = K(0x10),
+    [HID_KEY_T]                             = K(0x11),
+    [HID_KEY_1_EXCLAMATION_MARK]            = K(0x12),
+    [HID_KEY_2_AT]                          = K(0x13),
+    [HID_KEY_3_NUMBER_SIGN]                 = K(0x14),
+    [HID_KEY_4_DOLLAR]                      = K(0x15),
+    [HID_KEY_6_CARET]                       = K(0x16),
+    [HID_KEY_5_PERCENT]                     = K(0x17),
+    [HID_KEY_EQUAL_PLUS]                    = K(0x18),
+    [HID_KEY_9_OPARENTHESIS]                = K(0x19),
+    [HID_KEY_7_AMPERSAND]                   = K(0x1a),
+    [HID_KEY_MINUS_UNDERSCORE]              = K(0x1b),
+    [HID_KEY_8_ASTERISK]                    = K(0x1c),
+    [HID_KEY_0_CPARENTHESIS]                = K(0x1d),
+    [HID_KEY_CBRACKET_AND_CBRACE]           = K(0x1e),
+    [HID_KEY_O]                             = K(0x1f),
+    [HID_KEY_U]                             = K(0x20),
+    [HID_KEY_OBRACKET_AND_OBRACE]           = K(0x21),
+    [HID_KEY_I]                             = K(0x22),
+    [HID_KEY_P]                             = K(0x23),
+    [HID_KEY_ENTER]                         = K(0x24),
+    [HID_KEY_L]                             = K(0x25),
+    [HID_KEY_J]                             = K(0x26),
+    [HID_KEY_SINGLE_AND_DOUBLE_QUOTE]       = K(0x27),
+    [HID_KEY_K]                             = K(0x28),
+    [HID_KEY_SEMICOLON_COLON]               = K(0x29),
+    [HID_KEY_BACKSLASH_VERTICAL_BAR]        = K(0x2a),
+    [HID_KEY_NONUS_NUMBER_SIGN_TILDE]       = K(0x2a),
+    [HID_KEY_COMMA_AND_LESS]                = K(0x2b),
+    [HID_KEY_SLASH_QUESTION]                = K(0x2c),
+    [HID_KEY_N]                             = K(0x2d),
+    [HID_KEY_M]                             = K(0x2e),
+    [HID_KEY_DOT_GREATER]                   = K(0x2f),
+    [HID_KEY_TAB]                           = K(0x30),
+    [HID_KEY_SPACEBAR]                      = K(0x31),
+    [HID_KEY_GRAVE_ACCENT_AND_TILDE]        = K(0x32),
+    [HID_KEY_BACKSPACE]                     = K(0x33),
+    [HID_KEY_ESCAPE]                        = K(0x35),
+    [HID_KEY_LEFT_CONTROL]                  = K(0x36),
+    [HID_KEY_LEFT_GUI]                      = K(0x37),
+    [HID_KEY_LEFT_SHIFT]                    = K(0x38),
+    [HID_KEY_CAPS_LOCK]                     = K(0x39),
+    [HID_KEY_LEFT_ALT]                      = K(0x3a),
+    [HID_KEY_LEFTARROW]                     = K(0x3b),
+    [HID_KEY_RIGHTARROW]                    = K(0x3c),
+    [HID_KEY_DOWNARROW]                     = K(0x3d),
+    [HID_KEY_UPARROW]                       = K(0x3e),
+
+    // hid_codes.h has HID_KEY_KEYPAD_DECIMAL twice, the second as 0xdc
+    [0x63]                                  = K(0x41),
+    [HID_KEY_KEYPAD_ASTERISK]               = K(0x43),
+    [HID_KEY_KEYPAD_PLUS]                   = K(0x45),
+    [HID_KEY_KEYPAD_NUM_LOCK_AND_CLEAR]     = K(0x47),
+    [HID_KEY_KEYPAD_SLASH]                  = K(0x4b),
+    [HID_KEY_KEYPAD_ENTER]                  = K(0x4c),
+    [HID_KEY_KEYPAD_MINUS]                  = K(0x4e),
+    [HID_KEY_KEYPAD_EQUAL]                  = K(0x51),
+    [HID_KEY_KEYPAD_EQUAL_SIGN]             = K(0x51),
+    [HID_KEY_KEYPAD_0_INSERT]               = K(0x52),
+    [HID_KEY_KEYPAD_1_END]                  = K(0x53),
+    [HID_KEY_KEYPAD_2_DOWN_ARROW]           = K(0x54),
+    [HID_KEY_KEYPAD_3_PAGEDN]               = K(0x55),
+    [HID_KEY_KEYPAD_4_LEFT_ARROW]           = K(0x56),
+    [HID_KEY_KEYPAD_5]                      = K(0x57),
+    [HID_KEY_KEYPAD_6_RIGHT_ARROW]          = K(0x58),
+    [HID_KEY_KEYPAD_7_HOME]                 = K(0x59),
+    [HID_KEY_KEYPAD_8_UP_ARROW]             = K(0x5b),
+    [HID_KEY_KEYPAD_9_PAGEUP]               = K(0x5c),
+
+    [HID_KEY_F1]                            = K(0x7a),
+    [HID_KEY_F2]                            = K(0x78),
+    [HID_KEY_F3]                            = K(0x63),
+    [HID_KEY_F4]                            = K(0x76),
+    [HID_KEY_F5]                            = K(0x60),
+    [HID_KEY_F6]                            = K(0x61),
+    [HID_KEY_F7]                            = K(0x62),
+    [HID_KEY_F8]                            = K(0x64),
+    [HID_KEY_F9]                            = K(0x65),
+    [HID_KEY_F10]                           = K(0x6d),
+    [HID_KEY_F11]                           = K(0x67),
+    [HID_KEY_F12]                           = K(0x6f),
+    // F13-F15 where a PC keyboard has print screen, scroll lock, pause
+    [HID_KEY_F13]                           = K(0x69),
+    [HID_KEY_F14]                           = K(0x6b),
+    [HID_KEY_F15]                           = K(0x71),
+    [HID_KEY_PRINTSCREEN]                   = K(0x69),
+    [HID_KEY_SCROLL_LOCK]                   = K(0x6b),
+    [HID_KEY_PAUSE]                         = K(0x71),
+
+    [HID_KEY_INSERT]                        = K(0x72),  // help
+    [HID_KEY_HELP]                          = K(0x72),
+    [HID_KEY_HOME]                          = K(0x73),
+    [HID_KEY_PAGEUP]                        = K(0x74),
+    [HID_KEY_DELETE]                        = K(0x75),
+    [HID_KEY_END1]                          = K(0x77),
+    [HID_KEY_PAGEDOWN]                      = K(0x79),
+
+    [HID_KEY_RIGHT_CONTROL]                 = K(0x7d),
+    [HID_KEY_RIGHT_SHIFT]                   = K(0x7b),
+    [HID_KEY_RIGHT_ALT]                     = K(0x7c),
+    [HID_KEY_RIGHT_GUI]                     = K(0x37),
+    [HID_KEY_POWER]                         = K(0x7f),
+};
@@ -0,0 +1,187 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The ADB keyboard (address 2) and mouse (address 3) we pretend to be:
+ * what each answers to a Talk, what a Listen does to it, and when to ask
+ * for service. Each frame off the bus (adb_frame.h) does a fixed amount
+ * of work and says what the caller should do, like sun_kbd_cmd.h.
+ *
+ * Keyboard register 0 is a buffer of key transitions, handed out two to a
+ * Talk (the second 0xff if there's only one), with the power key's 0x7f7f
+ * and 0xffff on their own. Caps Lock locks, as on an Apple keyboard: a
+ * press locks or unlocks it, and the release is never sent. Register 2 is
+ * the modifiers held and the LEDs the host last wrote.
+ *
+ * Mouse register 0 is motion in 7 bits of two's complement on each axis,
+ * with the button bits on top (0 = down). Motion builds up between Talks
+ * and each takes what fits; the rest is carried to the next one rather
+ * than dropped (mouse_shaper.h).
+ *
+ * Register 3 has the address, SRQ enable and handler. A Talk 3 reply has
+ * a random address in it, so two devices at the same address collide;
+ * a reply that doesn't come back off the bus as it went out is one, and
+ * the device won't move for the Listen 3 that follows (handler 0xfe), so
+ * the host can sort them out. A Listen 3 with a handler the device knows
+ * changes to it: 1-3 for the keyboard (3 sends right shift, option and
+ * control as their own keys), 1-2 for the mouse.
+ *
+ * SRQ: adb_tx can only hold the stop bit of the next command, so whether
+ * to ask is worked out at the end of each frame the host follows with a
+ * command (adb_pio_srq()): a data frame, a Flush, a SendReset, or a Talk
+ * to one of ours that it isn't answering. The host polls the same device
+ * again next, most likely, so ask if the other one has something. A
+ * Talk to some other address might be answered, so it isn't one of those
+ * points; with another device on the bus that the host keeps polling, a
+ * request waits for the next frame that is.
+ */
+
+#ifndef ADB_DEV_H_
+#define ADB_DEV_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "adb_frame.h"
+#include "mouse_shaper.h"
+
+#define ADB_ADDR_KEYBOARD 2
+#define ADB_ADDR_MOUSE 3
+
+// command bytes: address, then 0000 SendReset, 0001 Flush, 10 Listen and
+// 11 Talk, each with a register
+#define ADB_SEND_RESET          0x00
+#define ADB_FLUSH(addr)         ((uint8_t) ((addr) << 4 | 0x01))
+#define ADB_LISTEN(addr, reg)   ((uint8_t) ((addr) << 4 | 0x08 | (reg)))
+#define ADB_TALK(addr, reg)     ((uint8_t) ((addr) << 4 | 0x0c | (reg)))
+
+// Apple Extended Keyboard; _LR sends the right modifiers as their own keys
+#define ADB_HANDLER_KBD_STANDARD    1
+#define ADB_HANDLER_KBD_EXTENDED    2
+#define ADB_HANDLER_KBD_EXTENDED_LR 3
+// 100 and 200 counts per inch
+#define ADB_HANDLER_MOUSE_100       1
+#define ADB_HANDLER_MOUSE_200       2
+
+// Listen 3 handler values that aren't handlers
+#define ADB_R3_MOVE_AND_ENABLE      0x00
+#define ADB_R3_MOVE_IF_ACTIVATED    0xfd
+#define ADB_R3_MOVE_IF_NO_COLLISION 0xfe
+#define ADB_R3_SELF_TEST            0xff
+
+// register 3's top byte
+#define ADB_R3_EXCEPTION    0x40
+#define ADB_R3_SRQ_ENABLE   0x20
+
+// keyboard register 0's key codes, bit 7 set for a release
+#define ADB_KEY_UP          0x80
+#define ADB_KEY_NONE        0xff
+#define ADB_KEY_CAPS_LOCK   0x39
+#define ADB_KEY_POWER       0x7f
+
+// keyboard register 2, 0 = down/on there; bits 5-3 and 15 are always 1
+#define ADB_R2_DELETE       (1u << 14)
+#define ADB_R2_CAPS_LOCK    (1u << 13)
+#define ADB_R2_RESET        (1u << 12)
+#define ADB_R2_CONTROL      (1u << 11)
+#define ADB_R2_SHIFT        (1u << 10)
+#define ADB_R2_OPTION       (1u << 9)
+#define ADB_R2_COMMAND      (1u << 8)
+#define ADB_R2_NUM_LOCK     (1u << 7)
+#define ADB_R2_SCROLL_LOCK  (1u << 6)
+#define ADB_R2_LEDS         0x07        // scroll lock, caps lock, num lock
+
+// the most a mouse Talk's 7-bit fields hold
+#define ADB_MOUSE_MAX_DELTA 63
+
+#define ADB_KEY_QUEUE 16
+
+typedef enum {
+    AdbDevActReply  = 1 << 0,   // answer the Talk with reply[0..reply_len)
+    AdbDevActSrq    = 1 << 1,   // ask for service on the next command
+    AdbDevActLeds   = 1 << 2,   // the host wrote the keyboard LEDs
+    AdbDevActReg3   = 1 << 3,   // an address or handler changed
+    AdbDevActReset  = 1 << 4,   // back to power-on state
+} AdbDevAction;
+
+typedef struct {
+    uint8_t actions;            // AdbDevAction
+    uint8_t reply_len;
+    uint8_t reply[ADB_MAX_DATA];
+} AdbDevResult;
+
+// register 3
+typedef struct {
+    uint8_t addr;
+    uint8_t handler;
+    bool srq_enable;
+    bool collided;              // its last Talk 3 reply didn't come back as sent
+
+    uint8_t default_addr;
+    uint8_t default_handler;
+} AdbDevId;
+
+typedef struct {
+    AdbDevId kbd;
+    AdbDevId mouse;
+
+    // keyboard register 0, oldest first
+    uint8_t keys[ADB_KEY_QUEUE];
+    uint8_t key_head;
+    uint8_t key_count;
+    bool caps_locked;
+
+    // keyboard register 2: modifiers held (ADB_R2_* bits, 1 = down) and
+    // the LEDs as the host wrote them (0 = on)
+    uint16_t held;
+    uint8_t leds;
+
+    // mouse register 0
+    MouseShaper motion;
+    bool left, right;           // now
+    bool left_click, right_click;   // went down since the last reply
+    bool left_sent, right_sent; // as of the last reply
+    bool left_before, right_before; // and the one before, if it collided
+
+    // the frame in progress, from its command
+    uint8_t command;
+    bool have_command;
+    AdbDevId *talking;          // one of ours answered it
+    uint8_t sent[ADB_MAX_DATA];
+    uint8_t sent_len;
+
+    uint8_t polled;             // the address of the last Talk 0
+    uint32_t rng;
+
+    uint32_t replies;
+    uint32_t srqs;
+    uint32_t collisions;
+    uint32_t keys_dropped;
+} AdbDev;
+
+void adb_dev_init(AdbDev *d);
+
+// A frame off the bus. res is filled in; actions 0 means there's nothing
+// to do.
+void adb_dev_frame(AdbDev *d, const AdbFrame *f, AdbDevResult *res);
+
+// A USB keyboard usage (HID_KEY_*) going down or up. Keys with no ADB
+// code are ignored.
+void adb_dev_key(AdbDev *d, uint8_t hid_keycode, bool down);
+
+// A USB mouse report's motion and buttons, at now_us.
+void adb_dev_mouse(AdbDev *d, int32_t dx, int32_t dy, bool left, bool right, uint32_t now_us);
+
+// Whether the keyboard or mouse has something for a Talk 0.
+bool adb_dev_kbd_pending(const AdbDev *d);
+bool adb_dev_mouse_pending(const AdbDev *d);
+
+// HID_KEY_* to an ADB key code, or ADB_KEY_NONE
+uint8_t adb_dev_keycode(uint8_t hid_keycode);
+
+// The LED bits of keyboard register 2 to the HID output report's
+// (KEYBOARD_LED_*)
+uint8_t adb_dev_leds_to_hid(uint8_t adb_leds);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "adb_frame.h"
+
+void
+adb_frame_rx_init(AdbFrameRx *r)
+{
+    memset(r, 0, sizeof(*r));
+}
+
+uint32_t
+adb_frame_long_us(uint32_t word)
+{
+    return ADB_PIO_LONG_US + (0x7fffffffu - word) * ADB_PIO_LONG_STEP_US;
+}
+
+static void
+restart(AdbFrameRx *r, bool attention)
+{
+    r->count = 0;
+    r->overrun = false;
+    r->attention = attention;
+    r->srq = false;
+}
+
+// A command is its byte, then its stop bit (nothing, if an SRQ took it).
+static bool
+command(AdbFrameRx *r, AdbFrame *f)
+{
+    if (r->count != 2 || r->words[1] != 0)
+        return false;
+
+    f->type = AdbFrameCommand;
+    f->command = r->words[0];
+    f->srq = r->srq;
+    return true;
+}
+
+// A data frame is a start bit, the data and a stop bit, so its words are
+// a bit out from the bytes: the first has the start bit on top, and the
+// last two bits, the last data bit and the stop bit, are what's left over.
+static bool
+data(AdbFrameRx *r, AdbFrame *f)
+{
+    uint8_t len = r->count - 1;
+    uint32_t tail = r->words[len];
+    if (len < 2 || len > ADB_MAX_DATA || !(r->words[0] & 0x80) || tail > 3 || (tail & 1))
+        return false;
+
+    f->type = AdbFrameData;
+    f->len = len;
+    for (uint8_t i = 0; i < len; i++) {
+        uint32_t next = i + 1 < len ? r->words[i + 1] >> 7 : tail >> 1;
+        f->data[i] = (r->words[i] << 1 | next) & 0xff;
+    }
+    return true;
+}
+
+bool
+adb_frame_rx(AdbFrameRx *r, uint32_t word, AdbFrame *f)
+{
+    if (word == ADB_PIO_END) {
+        // A reset's low is pushed whole, so the push at the end of it has
+        // an empty ISR: a lone 0, and nothing to go on.
+        bool idle = r->count == 1 && !r->attention && r->words[0] == 0;
+        bool ok = false;
+        if (r->count && !idle) {
+            ok = !r->overrun && (r->attention ? command(r, f) : data(r, f));
+            if (ok)
+                r->frames++;
+            else
+                r->errors++;
+        }
+        restart(r, false);
+        return ok;
+    }
+
+    if (word > 0xff) {
+        uint32_t us = adb_frame_long_us(word);
+        if (us > ADB_ATTENTION_MAX_US) {
+            restart(r, false);
+            f->type = AdbFrameReset;
+            r->frames++;
+            return true;
+        }
+        if (us > ADB_SRQ_MAX_US) {
+            // whatever came before wasn't finished; this is a new command
+            if (r->count)
+                r->errors++;
+            restart(r, true);
+        } else if (r->attention && r->count == 1) {
+            r->srq = true;
+        } else {
+            r->overrun = true;
+        }
+        return false;
+    }
+
+    if (r->count < sizeof(r->words) / sizeof(r->words[0]))
+        r->words[r->count++] = word;
+    else
+        r->overrun = true;
+    return false;
+}
+
+unsigned
+adb_frame_talk_job(const uint8_t *data, uint8_t len, uint32_t *words)
+{
+    // start bit, data, stop bit
+    unsigned bits = 8 * len + 2;
+    words[0] = bits - 1;
+
+    unsigned n = 1;
+    uint32_t w = 1;
+    unsigned used = 1;
+    for (uint8_t i = 0; i < len; i++) {
+        for (int b = 7; b >= 0; b--) {
+            w = w << 1 | ((data[i] >> b) & 1);
+            if (++used == 32) {
+                words[n++] = w;
+                w = 0;
+                used = 0;
+            }
+        }
+    }
+    // then the stop bit's 0; 8 * len + 2 bits never fill the last word
+    w <<= 1;
+    used++;
+    words[n++] = w << (32 - used);
+    return n;
+}
@@ -0,0 +1,83 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * ADB frames to and from the adb_rx/adb_tx PIO programs (src/adb.pio).
+ *
+ * adb_rx pushes data bits eight at a time, a marker word for each long
+ * low, and an END when the bus has been high long enough that the frame
+ * is over. AdbFrameRx puts those back together into what the bus said: a
+ * reset, a command (attention, sync, eight bits and a stop bit, which
+ * another device may have stretched into an SRQ), or a data frame of 2-8
+ * bytes from the host after a Listen or from a device answering a Talk.
+ * Anything that doesn't add up is counted and dropped.
+ *
+ * The other way, adb_frame_talk_job() builds the words adb_tx takes to
+ * send a Talk reply.
+ */
+
+#ifndef ADB_FRAME_H_
+#define ADB_FRAME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ADB_MAX_DATA 8
+
+// adb_rx's word for the end of a frame
+#define ADB_PIO_END 0xffffffffu
+
+// A long low's word from adb_rx is 0x7fffffff - n, for a low of about
+// ADB_PIO_LONG_US + n * ADB_PIO_LONG_STEP_US
+#define ADB_PIO_LONG_US 135
+#define ADB_PIO_LONG_STEP_US 17
+
+// Where one kind of long low ends and the next starts: SRQ is 300 us,
+// attention 800 us, reset 3 ms
+#define ADB_SRQ_MAX_US 550
+#define ADB_ATTENTION_MAX_US 2000
+
+// adb_tx's job for an SRQ on the next command
+#define ADB_TX_SRQ_JOB 0u
+// the most words a Talk reply's job takes: the bit count, then 66 bits
+#define ADB_TX_JOB_WORDS 4
+
+typedef enum {
+    AdbFrameReset,
+    AdbFrameCommand,
+    AdbFrameData,
+} AdbFrameType;
+
+typedef struct {
+    AdbFrameType type;
+    uint8_t command;            // AdbFrameCommand
+    bool srq;                   // a device held the command's stop bit for service
+    uint8_t len;                // AdbFrameData: 2-8
+    uint8_t data[ADB_MAX_DATA];
+} AdbFrame;
+
+typedef struct {
+    // the current frame's words: data bytes, then what's left over
+    uint32_t words[ADB_MAX_DATA + 1];
+    uint8_t count;
+    bool overrun;
+    bool attention;             // started with one: it's a command
+    bool srq;
+
+    uint32_t frames;
+    uint32_t errors;
+} AdbFrameRx;
+
+void adb_frame_rx_init(AdbFrameRx *r);
+
+// The next word from adb_rx. true if it finished a frame, which is in *f.
+bool adb_frame_rx(AdbFrameRx *r, uint32_t word, AdbFrame *f);
+
+// How long the low a marker word stands for was, in us
+uint32_t adb_frame_long_us(uint32_t word);
+
+// adb_tx's job to send len (2-8) bytes; returns the number of words
+unsigned adb_frame_talk_job(const uint8_t *data, uint8_t len, uint32_t *words);
+
+#endif
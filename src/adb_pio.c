@@ -0,0 +1,142 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <pico/stdlib.h>
+#include <hardware/pio.h>
+#include <hardware/irq.h>
+#include <hardware/clocks.h>
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "adbpio"
+
+#include "babelfish.h"
+#include "adb_pio.h"
+#include "adb.pio.h"
+
+// Assumption: pio0 is taken by tinyusb. host_next and the PIO UARTs use
+// pio1 too, but never alongside ADB; the two programs fill it.
+#define ADB_PIO pio1
+
+static int s_rx_sm = -1;
+static int s_tx_sm = -1;
+static int s_tx_offset = -1;
+
+static AdbPioFrameHandler s_handler;
+static AdbFrameRx s_rx;
+static uint32_t s_tx_dropped;
+
+static void
+tx_put(const uint32_t *words, unsigned n)
+{
+    // joined, the TX FIFO holds two replies
+    if (pio_sm_get_tx_fifo_level(ADB_PIO, s_tx_sm) + n > 8) {
+        s_tx_dropped++;
+        return;
+    }
+    for (unsigned i = 0; i < n; i++)
+        pio_sm_put(ADB_PIO, s_tx_sm, words[i]);
+}
+
+// Drop anything queued and let go of the bus, e.g. for a reset.
+static void
+tx_restart(void)
+{
+    pio_sm_set_enabled(ADB_PIO, s_tx_sm, false);
+    pio_sm_clear_fifos(ADB_PIO, s_tx_sm);
+    pio_sm_restart(ADB_PIO, s_tx_sm);
+    pio_sm_exec(ADB_PIO, s_tx_sm, pio_encode_jmp(s_tx_offset + adb_tx_offset_start) | pio_encode_sideset(1, 0));
+    pio_sm_set_enabled(ADB_PIO, s_tx_sm, true);
+}
+
+static void __not_in_flash_func(adb_pio_irq)(void)
+{
+    while (!pio_sm_is_rx_fifo_empty(ADB_PIO, s_rx_sm)) {
+        AdbFrame f;
+        if (!adb_frame_rx(&s_rx, pio_sm_get(ADB_PIO, s_rx_sm), &f))
+            continue;
+        if (f.type == AdbFrameReset)
+            tx_restart();
+        s_handler(&f);
+    }
+}
+
+void
+adb_pio_talk(const uint8_t *data, uint8_t len)
+{
+    uint32_t words[ADB_TX_JOB_WORDS];
+    tx_put(words, adb_frame_talk_job(data, len, words));
+}
+
+void
+adb_pio_srq(void)
+{
+    uint32_t job = ADB_TX_SRQ_JOB;
+    tx_put(&job, 1);
+}
+
+uint32_t
+adb_pio_rx_errors(void)
+{
+    return s_rx.errors;
+}
+
+uint32_t
+adb_pio_tx_dropped(void)
+{
+    return s_tx_dropped;
+}
+
+bool
+adb_pio_init(unsigned gpio, AdbPioFrameHandler handler)
+{
+    if (s_rx_sm < 0)
+        s_rx_sm = pio_claim_unused_sm(ADB_PIO, false);
+    if (s_tx_sm < 0)
+        s_tx_sm = pio_claim_unused_sm(ADB_PIO, false);
+    if (s_rx_sm < 0 || s_tx_sm < 0 || !pio_can_add_program(ADB_PIO, &adb_rx_program) ||
+        !pio_can_add_program(ADB_PIO, &adb_tx_program)) {
+        DBG("no room in pio1 for ADB\n");
+        return false;
+    }
+
+    s_handler = handler;
+    adb_frame_rx_init(&s_rx);
+    s_tx_dropped = 0;
+
+    // open-drain: the pin only ever outputs 0, and is an input until then
+    pio_sm_set_pins_with_mask(ADB_PIO, s_tx_sm, 0, 1u << gpio);
+    pio_sm_set_consecutive_pindirs(ADB_PIO, s_tx_sm, gpio, 1, false);
+    pio_gpio_init(ADB_PIO, gpio);
+
+    uint rx_offset = pio_add_program(ADB_PIO, &adb_rx_program);
+    pio_sm_config cfg = adb_rx_program_get_default_config(rx_offset);
+    sm_config_set_in_pins(&cfg, gpio);
+    sm_config_set_jmp_pin(&cfg, gpio);
+    sm_config_set_in_shift(&cfg, false, true, 8);
+    sm_config_set_fifo_join(&cfg, PIO_FIFO_JOIN_RX);
+    sm_config_set_clkdiv(&cfg, (float) clock_get_hz(clk_sys) / 1000000);
+    pio_sm_init(ADB_PIO, s_rx_sm, rx_offset + adb_rx_offset_start, &cfg);
+    pio_sm_exec(ADB_PIO, s_rx_sm, pio_encode_mov_not(pio_osr, pio_null));
+
+    s_tx_offset = pio_add_program(ADB_PIO, &adb_tx_program);
+    cfg = adb_tx_program_get_default_config(s_tx_offset);
+    sm_config_set_in_pins(&cfg, gpio);
+    sm_config_set_sideset_pins(&cfg, gpio);
+    sm_config_set_out_shift(&cfg, false, true, 32);
+    sm_config_set_fifo_join(&cfg, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&cfg, (float) clock_get_hz(clk_sys) / 200000);
+    pio_sm_init(ADB_PIO, s_tx_sm, s_tx_offset + adb_tx_offset_start, &cfg);
+
+    irq_set_exclusive_handler(PIO1_IRQ_0, adb_pio_irq);
+    irq_set_enabled(PIO1_IRQ_0, true);
+    pio_set_irq0_source_enabled(ADB_PIO, pis_sm0_rx_fifo_not_empty + s_rx_sm, true);
+
+    pio_sm_set_enabled(ADB_PIO, s_rx_sm, true);
+    pio_sm_set_enabled(ADB_PIO, s_tx_sm, true);
+
+    DBG("ADB on gpio %u, sm %d/%d\n", gpio, s_rx_sm, s_tx_sm);
+    return true;
+}
@@ -0,0 +1,43 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The ADB bus on a pair of pio1 state machines (src/adb.pio). adb_rx does
+ * all the bit timing, so the CPU takes an interrupt per byte rather than
+ * two per bit, and only sees whole frames (adb_frame.h); adb_tx drives
+ * the bus open-drain for Talk replies and SRQs, timed from the bus rather
+ * than from when the CPU gets to it.
+ */
+
+#ifndef ADB_PIO_H_
+#define ADB_PIO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "adb_frame.h"
+
+// Called from the PIO interrupt for every frame on the bus, including
+// Talk replies adb_pio_talk() sent.
+typedef void (*AdbPioFrameHandler)(const AdbFrame *f);
+
+// The bus on gpio. false if there's no room in pio1.
+bool adb_pio_init(unsigned gpio, AdbPioFrameHandler handler);
+
+// Answer the Talk command the handler was just given with len (2-8)
+// bytes. From the handler, so the reply goes within Tlt.
+void adb_pio_talk(const uint8_t *data, uint8_t len);
+
+// Ask for service on the next command. Only from the handler, at the end
+// of a frame the host follows with a command: a data frame, a Flush or
+// SendReset, or a Talk nobody is answering. After a Listen or another
+// device's Talk, data comes next, and adb_tx would count it as the
+// command.
+void adb_pio_srq(void);
+
+// frames that didn't add up, and replies and SRQs with no room in the FIFO
+uint32_t adb_pio_rx_errors(void);
+uint32_t adb_pio_tx_dropped(void);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include <pico/stdlib.h>
+
+#include "apollo_cmd.h"
+
+// No entry may be a prefix of another; the shorter one would always win.
+const ApolloCmdDef apollo_cmd_table[ApolloCmdCount] = {
+    [ApolloCmdMode0]        = { 1, { 0x00 },             "mode 0" },
+    [ApolloCmdMode1]        = { 1, { 0x01 },             "mode 1" },
+    [ApolloCmdIdent]        = { 2, { 0x12, 0x21 },       "ident" },
+    [ApolloCmdBeeperOn]     = { 2, { 0x21, 0x81 },       "beeper on" },
+    [ApolloCmdBeeperOff]    = { 2, { 0x21, 0x82 },       "beeper off" },
+    [ApolloCmd1116]         = { 2, { 0x11, 0x16 },       "1116" },
+    [ApolloCmd1117]         = { 2, { 0x11, 0x17 },       "1117" },
+    [ApolloCmd1166]         = { 2, { 0x11, 0x66 },       "1166" },
+    [ApolloCmdMouseEnable]  = { 3, { 0x10, 0x04, 0x5e }, "mouse enable" },
+};
+
+#define ALL_COMMANDS ((1u << ApolloCmdCount) - 1)
+
+static ApolloCmd *s_current = NULL;
+
+void
+apollo_cmd_init(ApolloCmd *p, const ApolloCmdHandler *handlers)
+{
+    memset(p, 0, sizeof(*p));
+    p->handlers = handlers;
+    s_current = p;
+}
+
+static void
+start(ApolloCmd *p, uint32_t now_us)
+{
+    p->in_cmd = true;
+    p->len = 0;
+    p->candidates = ALL_COMMANDS;
+    p->start_us = now_us;
+}
+
+static void
+complete(ApolloCmd *p, ApolloCmdId id)
+{
+    p->in_cmd = false;
+    p->stats.commands++;
+    p->stats.counts[id]++;
+
+    ApolloCmdHandler h = p->handlers ? p->handlers[id] : NULL;
+    if (!h || !h(id))
+        return;
+
+    // after the handler, so what it took to queue the reply is counted
+    uint32_t us = time_us_32() - p->start_us;
+    p->stats.replies++;
+    p->stats.latency_total_us += us;
+    if (us > p->stats.latency_max_us)
+        p->stats.latency_max_us = us;
+}
+
+void
+apollo_cmd_feed(ApolloCmd *p, uint8_t byte, uint32_t now_us)
+{
+    if (!p->in_cmd) {
+        if (byte == APOLLO_CMD_START)
+            start(p, now_us);
+        else if (byte != 0x00)
+            p->stats.stray++;
+        return;
+    }
+
+    uint32_t next = 0;
+    for (uint32_t c = p->candidates; c; c &= c - 1) {
+        int i = __builtin_ctz(c);
+        if (apollo_cmd_table[i].bytes[p->len] == byte)
+            next |= 1u << i;
+    }
+    p->bytes[p->len++] = byte;
+
+    if (!next) {
+        uint32_t bytes = 0;
+        for (uint8_t i = 0; i < p->len; i++)
+            bytes = (bytes << 8) | p->bytes[i];
+        p->stats.unknown++;
+        p->stats.last_unknown = bytes;
+        p->in_cmd = false;
+
+        // an 0xff that doesn't fit is the start of the next command
+        if (byte == APOLLO_CMD_START)
+            start(p, now_us);
+        return;
+    }
+
+    for (uint32_t c = next; c; c &= c - 1) {
+        int i = __builtin_ctz(c);
+        if (apollo_cmd_table[i].len == p->len) {
+            complete(p, (ApolloCmdId) i);
+            return;
+        }
+    }
+    p->candidates = next;
+}
+
+bool
+apollo_cmd_get_stats(ApolloCmdStats *stats)
+{
+    if (!s_current)
+        return false;
+    *stats = s_current->stats;
+    return true;
+}
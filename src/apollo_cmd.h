@@ -0,0 +1,95 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Apollo keyboard commands from the host, shared by the Apollo and DN300
+ * backends. From reading domain_os disassembly:
+ *
+ * - Commands start with 0xff.
+ * - Bytes are read after 0xff until a valid command is received.
+ * - It is immediately processed.
+ * - 0x00 outside of a preceding 0xff is ignored.
+ *
+ * The commands are a table; each byte narrows down which entries can
+ * still match, so a byte costs at most one pass over the table, and a
+ * command nothing can match is given up on at the first byte that rules
+ * out everything. Complete commands go to the backend's handler, which
+ * only queues its reply.
+ */
+
+#ifndef APOLLO_CMD_H_
+#define APOLLO_CMD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define APOLLO_CMD_START 0xff
+
+// bytes after the 0xff
+#define APOLLO_CMD_MAX_LEN 3
+
+typedef enum {
+    ApolloCmdMode0 = 0,         // ff 00: compatibility mode
+    ApolloCmdMode1,             // ff 01: keystate mode
+    ApolloCmdIdent,             // ff 12 21: keyboard identification
+    ApolloCmdBeeperOn,          // ff 21 81: beeper on for 300ms
+    ApolloCmdBeeperOff,         // ff 21 82
+    ApolloCmd1116,              // unclear; mame doesn't echo the 0x16
+    ApolloCmd1117,              // shows up at boot; mame doesn't echo the 0x17
+    ApolloCmd1166,              // unknown
+    ApolloCmdMouseEnable,       // ff 10 04 5e, maybe; the PC waits for a reply
+    ApolloCmdCount
+} ApolloCmdId;
+
+typedef struct {
+    uint8_t len;
+    uint8_t bytes[APOLLO_CMD_MAX_LEN];
+    const char *name;
+} ApolloCmdDef;
+
+extern const ApolloCmdDef apollo_cmd_table[ApolloCmdCount];
+
+// Runs in the RX interrupt, so it only queues; true if it did.
+typedef bool (*ApolloCmdHandler)(ApolloCmdId id);
+
+typedef struct {
+    uint32_t commands;
+    uint32_t unknown;           // 0xff and then nothing in the table
+    uint32_t stray;             // bytes outside of a command, other than 0x00
+    uint32_t last_unknown;      // its bytes after the 0xff, first in the high byte
+    uint32_t counts[ApolloCmdCount];
+
+    // the 0xff arriving to its command's handler returning, having queued
+    // the reply
+    uint32_t replies;
+    uint64_t latency_total_us;
+    uint32_t latency_max_us;
+} ApolloCmdStats;
+
+typedef struct {
+    // [ApolloCmdCount]; NULL entries are accepted and otherwise ignored
+    const ApolloCmdHandler *handlers;
+
+    bool in_cmd;
+    uint8_t len;
+    uint8_t bytes[APOLLO_CMD_MAX_LEN];
+    uint32_t candidates;        // table entries that still match, a bit each
+    uint32_t start_us;
+
+    ApolloCmdStats stats;
+} ApolloCmd;
+
+// Also makes p the one apollo_cmd_get_stats() reports on.
+void apollo_cmd_init(ApolloCmd *p, const ApolloCmdHandler *handlers);
+
+// One byte from the host, received at now_us. Calls the handler if it
+// completes a command, and times the reply against time_us_32() once the
+// handler returns.
+void apollo_cmd_feed(ApolloCmd *p, uint8_t byte, uint32_t now_us);
+
+// For the debug console: the running backend's recognizer. false if the
+// backend doesn't use one.
+bool apollo_cmd_get_stats(ApolloCmdStats *stats);
+
+#endif
@@ -15,6 +15,7 @@
 #include "events.h"
 #include "host.h"
 #include "debug.h"
+#include "boot.h"
 
 extern uint8_t const ascii_to_hid[128][2];
 extern uint8_t const hid_to_ascii[128][2];
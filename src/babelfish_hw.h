@@ -42,6 +42,12 @@
 #define USB_5V_STAT_GPIO 23
 #endif
 
+// Run channels set to ChannelModeUART on the PIO engine (ChannelModePIO)
+// instead, leaving both hardware UARTs free, e.g. for DEBUG_DIRECT_UART.
+#ifndef CHANNEL_UART_ON_PIO
+#define CHANNEL_UART_ON_PIO 0
+#endif
+
 typedef enum {
     ChannelModeDirect = 0,
     ChannelModeLevelShifter = 1,
@@ -50,10 +56,13 @@ typedef enum {
 
     ChannelModeGPIO = 0 << 4, // configure this channel as bare GPIO
     ChannelModeUART = 1 << 4, // configure this channel as a UART
+    ChannelModePIO = 2 << 4, // configure this channel as a UART on PIO state machines (chan_uart_pio.c)
     ChannelModeOutputTypeMask = 0xf0,
 
     ChannelModeNoInvert = 0 << 8, // don't invert output
     ChannelModeInvert = 1 << 8, // invert output
+    ChannelModeInvertTX = 2 << 8, // invert the TX pin only
+    ChannelModeInvertRX = 3 << 8, // invert the RX pin only
     ChannelModeInvertMask = 0xf00,
 
     // Direct GPIO, 3.3v
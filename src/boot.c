@@ -0,0 +1,41 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <pico/stdlib.h>
+
+#include "boot.h"
+
+static volatile uint32_t s_stage_us[BootStageCount];
+
+static const char *const s_stage_names[BootStageCount] = {
+    "host init",
+    "first host byte",
+    "usb host",
+    "debug console",
+};
+
+void
+boot_mark(BootStage stage)
+{
+    if (stage >= BootStageCount || s_stage_us[stage])
+        return;
+
+    // 0 means not reached
+    uint32_t now = time_us_32();
+    s_stage_us[stage] = now ? now : 1;
+}
+
+uint32_t
+boot_stage_us(BootStage stage)
+{
+    return stage < BootStageCount ? s_stage_us[stage] : 0;
+}
+
+const char *
+boot_stage_name(BootStage stage)
+{
+    return stage < BootStageCount ? s_stage_names[stage] : "?";
+}
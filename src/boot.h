@@ -0,0 +1,32 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Boot timeline: when each stage of startup was first reached, in
+ * microseconds on the system timer (which starts with the clocks, a few
+ * ms after reset), so changes to the startup order can be measured.
+ */
+
+#ifndef BOOT_H_
+#define BOOT_H_
+
+#include <stdint.h>
+
+typedef enum {
+    BootHostInit = 0,   // host->init() returned; the channel is listening
+    BootHostRx,         // first byte from the host handled
+    BootUsbHost,        // TinyUSB host running on core1
+    BootDebug,          // debug console attached
+    BootStageCount
+} BootStage;
+
+// The first call for a stage wins. Any core, and from IRQs.
+void boot_mark(BootStage stage);
+
+// 0 if the stage hasn't been reached.
+uint32_t boot_stage_us(BootStage stage);
+
+const char *boot_stage_name(BootStage stage);
+
+#endif
@@ -7,6 +7,50 @@
 #define UP 0
 #define DOWN 1
 
+#define WRITE_EVENT(page, code, downval) \
+	do { \
+		KeyboardEvent evt = {page, code, .down = downval}; \
+		enqueue_kbd_event(&evt); \
+	} while (0)
+
+// Modifiers go down before keys and up after them; both keyboard paths
+// call this between their key ups and key downs.
+static void
+write_modifier_events(uint8_t new_mod_up, uint8_t new_mod_down)
+{
+	// the released modifiers
+	if (new_mod_up) {
+		if (new_mod_up & KEYBOARD_MODIFIER_LEFTSHIFT)
+			WRITE_EVENT(0, HID_KEY_LEFT_SHIFT, UP);
+		if (new_mod_up & KEYBOARD_MODIFIER_RIGHTSHIFT)
+			WRITE_EVENT(0, HID_KEY_RIGHT_SHIFT, UP);
+		if (new_mod_up & KEYBOARD_MODIFIER_LEFTCTRL)
+			WRITE_EVENT(0, HID_KEY_LEFT_CONTROL, UP);
+		if (new_mod_up & KEYBOARD_MODIFIER_RIGHTCTRL)
+			WRITE_EVENT(0, HID_KEY_RIGHT_CONTROL, UP);
+		if (new_mod_up & KEYBOARD_MODIFIER_LEFTALT)
+			WRITE_EVENT(0, HID_KEY_LEFT_ALT, UP);
+		if (new_mod_up & KEYBOARD_MODIFIER_RIGHTALT)
+			WRITE_EVENT(0, HID_KEY_RIGHT_ALT, UP);
+	}
+
+	// now new down modifiers
+	if (new_mod_down) {
+		if (new_mod_down & KEYBOARD_MODIFIER_LEFTSHIFT)
+			WRITE_EVENT(0, HID_KEY_LEFT_SHIFT, DOWN);
+        if (new_mod_down & KEYBOARD_MODIFIER_RIGHTSHIFT)
+			WRITE_EVENT(0, HID_KEY_RIGHT_SHIFT, DOWN);
+        if (new_mod_down & KEYBOARD_MODIFIER_LEFTCTRL)
+			WRITE_EVENT(0, HID_KEY_LEFT_CONTROL, DOWN);
+        if (new_mod_down & KEYBOARD_MODIFIER_RIGHTCTRL)
+			WRITE_EVENT(0, HID_KEY_RIGHT_CONTROL, DOWN);
+        if (new_mod_down & KEYBOARD_MODIFIER_LEFTALT)
+			WRITE_EVENT(0, HID_KEY_LEFT_ALT, DOWN);
+        if (new_mod_down & KEYBOARD_MODIFIER_RIGHTALT)
+			WRITE_EVENT(0, HID_KEY_RIGHT_ALT, DOWN);
+	}
+}
+
 void
 translate_boot_kbd_report(hid_keyboard_report_t const *report)
 {
@@ -62,13 +106,6 @@ translate_boot_kbd_report(hid_keyboard_report_t const *report)
 
 	mod_down_state = report->modifier;
 
-    uint32_t written_events = 0;
-#define WRITE_EVENT(page, code, downval) \
-	do { \
-		KeyboardEvent evt = {page, code, .down = downval}; \
-		enqueue_kbd_event(&evt); \
-	} while (0)
-
 	// write all the released keys
 	for (int i = 0; i < up_key_count; i++) {
 		uint8_t hidcode = up_keys[i];
@@ -77,37 +114,7 @@ translate_boot_kbd_report(hid_keyboard_report_t const *report)
 		WRITE_EVENT(0, hidcode, UP);
 	}
 
-	// then the released modifiers
-	if (new_mod_up) {
-		if (new_mod_up & KEYBOARD_MODIFIER_LEFTSHIFT)
-			WRITE_EVENT(0, HID_KEY_LEFT_SHIFT, UP);
-		if (new_mod_up & KEYBOARD_MODIFIER_RIGHTSHIFT)
-			WRITE_EVENT(0, HID_KEY_RIGHT_SHIFT, UP);
-		if (new_mod_up & KEYBOARD_MODIFIER_LEFTCTRL)
-			WRITE_EVENT(0, HID_KEY_LEFT_CONTROL, UP);
-		if (new_mod_up & KEYBOARD_MODIFIER_RIGHTCTRL)
-			WRITE_EVENT(0, HID_KEY_RIGHT_CONTROL, UP);
-		if (new_mod_up & KEYBOARD_MODIFIER_LEFTALT)
-			WRITE_EVENT(0, HID_KEY_LEFT_ALT, UP);
-		if (new_mod_up & KEYBOARD_MODIFIER_RIGHTALT)
-			WRITE_EVENT(0, HID_KEY_RIGHT_ALT, UP);
-	}
-
-	// now new down modifiers
-	if (new_mod_down) {
-		if (new_mod_down & KEYBOARD_MODIFIER_LEFTSHIFT)
-			WRITE_EVENT(0, HID_KEY_LEFT_SHIFT, DOWN);
-        if (new_mod_down & KEYBOARD_MODIFIER_RIGHTSHIFT)
-			WRITE_EVENT(0, HID_KEY_RIGHT_SHIFT, DOWN);
-        if (new_mod_down & KEYBOARD_MODIFIER_LEFTCTRL)
-			WRITE_EVENT(0, HID_KEY_LEFT_CONTROL, DOWN);
-        if (new_mod_down & KEYBOARD_MODIFIER_RIGHTCTRL)
-			WRITE_EVENT(0, HID_KEY_RIGHT_CONTROL, DOWN);
-        if (new_mod_down & KEYBOARD_MODIFIER_LEFTALT)
-			WRITE_EVENT(0, HID_KEY_LEFT_ALT, DOWN);
-        if (new_mod_down & KEYBOARD_MODIFIER_RIGHTALT)
-			WRITE_EVENT(0, HID_KEY_RIGHT_ALT, DOWN);
-	}
+	write_modifier_events(new_mod_up, new_mod_down);
 
 	for (int i = 0; i < 6; i++) {
 		uint8_t hidcode = keycodes[i];
@@ -117,23 +124,78 @@ translate_boot_kbd_report(hid_keyboard_report_t const *report)
 	}
 }
 
+// Key state as a 256 bit map, one bit per keyboard page usage: what NKRO
+// keyboards send in report protocol. The diff is a word-wide XOR, and the
+// changed keys come out of it with count-trailing-zeros, so a report costs
+// the same however many keys are down.
 void
-translate_boot_mouse_report(hid_mouse_report_t const *report)
+translate_nkro_kbd_report(const uint32_t keys[NKRO_WORDS])
+{
+	static uint32_t down_bits[NKRO_WORDS] = { 0 };
+
+	uint32_t up_bits[NKRO_WORDS];
+	uint32_t new_bits[NKRO_WORDS];
+
+	for (int w = 0; w < NKRO_WORDS; w++) {
+		uint32_t changed = keys[w] ^ down_bits[w];
+		up_bits[w] = changed & down_bits[w];
+		new_bits[w] = changed & keys[w];
+		down_bits[w] = keys[w];
+	}
+
+	// usages 0-3 are "no event" and error codes, not keys
+	up_bits[0] &= ~0xfu;
+	new_bits[0] &= ~0xfu;
+
+	// modifiers are usages 0xE0-0xE7, the low byte of the last word, in
+	// the same bit order as the boot report modifier byte
+	uint8_t new_mod_up = up_bits[NKRO_MODIFIER_WORD] & 0xff;
+	uint8_t new_mod_down = new_bits[NKRO_MODIFIER_WORD] & 0xff;
+	up_bits[NKRO_MODIFIER_WORD] &= ~0xffu;
+	new_bits[NKRO_MODIFIER_WORD] &= ~0xffu;
+
+	for (int w = 0; w < NKRO_WORDS; w++) {
+		for (uint32_t m = up_bits[w]; m; m &= m - 1)
+			WRITE_EVENT(0, w * 32 + __builtin_ctz(m), UP);
+	}
+
+	write_modifier_events(new_mod_up, new_mod_down);
+
+	for (int w = 0; w < NKRO_WORDS; w++) {
+		for (uint32_t m = new_bits[w]; m; m &= m - 1)
+			WRITE_EVENT(0, w * 32 + __builtin_ctz(m), DOWN);
+	}
+}
+
+static inline int32_t
+clamp(int32_t v, int32_t lo, int32_t hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+void
+translate_mouse_report(uint16_t buttons, int32_t dx, int32_t dy, int32_t wheel)
 {
     static uint16_t buttons_down = 0;
 
-    uint16_t current_buttons_state = report->buttons;
+    uint16_t current_buttons_state = buttons;
     uint16_t changed_buttons = current_buttons_state ^ buttons_down;
 
     MouseEvent event;
-    event.dx = report->x;
-    event.dy = report->y;
-    event.dwheel = report->wheel;
+    event.dx = clamp(dx, INT16_MIN, INT16_MAX);
+    event.dy = clamp(dy, INT16_MIN, INT16_MAX);
+    event.dwheel = clamp(wheel, INT8_MIN, INT8_MAX);
     event.buttons_down = changed_buttons & current_buttons_state;
     event.buttons_up = changed_buttons & ~current_buttons_state;
-	event.buttons = report->buttons;
+	event.buttons = buttons;
 
     buttons_down = current_buttons_state;
 
 	enqueue_mouse_event(&event);
 }
+
+void
+translate_boot_mouse_report(hid_mouse_report_t const *report)
+{
+	translate_mouse_report(report->buttons, report->x, report->y, report->wheel);
+}
@@ -0,0 +1,502 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include <pico/stdlib.h>
+#include <hardware/uart.h>
+#include <hardware/irq.h>
+#include <hardware/sync.h>
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "chan"
+
+#include "babelfish.h"
+#include "chan_uart.h"
+#if CHAN_UART_PIO
+#include "chan_uart_pio.h"
+#endif
+
+#define RING_MASK (CHAN_UART_TX_RING_SIZE - 1)
+
+_Static_assert((CHAN_UART_TX_RING_SIZE & RING_MASK) == 0, "TX ring size must be a power of two");
+
+typedef struct {
+    uart_inst_t *uart;          // NULL on the PIO engine
+    bool pio;
+    ChanUartRxHandler on_rx;
+    bool tx_irq;
+
+    uint8_t ring[CHAN_UART_TX_RING_SIZE];
+    // a bit per ring slot, set for bytes from chan_uart_write_paced()
+    uint32_t paced[CHAN_UART_TX_RING_SIZE / 32];
+    volatile uint16_t head;     // next byte to send
+    volatile uint16_t count;
+
+    uint32_t byte_us;
+    uint32_t gap_us;
+    // one frame at the baud and format chan_uart_set_format() was given
+    uint32_t frame_us;
+    // when the bytes handed to the UART so far will be off the wire
+    uint32_t wire_free_us;
+    bool alarm_pending;
+    // no alarm could be had; chan_uart_task() tries the fill again
+    volatile bool alarm_retry;
+
+    ChanUartStats stats;
+    // the PIO engine counts its own; at the last stats reset
+    uint32_t rx_errors_base;
+} ChanUart;
+
+static ChanUart s_chans[NUM_CHANNELS];
+
+// outside of ChanUart, so a host's chan_uart_init() doesn't clear them
+static ChanUartTxTap s_tx_taps[NUM_CHANNELS];
+
+// by UART number, for the interrupt handlers; a channel's UART need not
+// have its index
+static ChanUart *s_by_uart[2];
+
+static void
+set_tx_irq(ChanUart *cu, bool enabled)
+{
+    if (cu->tx_irq == enabled)
+        return;
+    cu->tx_irq = enabled;
+    uart_set_irq_enables(cu->uart, cu->on_rx != NULL, enabled);
+}
+
+static bool
+is_paced(const ChanUart *cu, uint16_t slot)
+{
+    return cu->paced[slot / 32] & (1u << (slot % 32));
+}
+
+static void fill_fifo(ChanUart *cu);
+
+static int64_t
+paced_alarm(alarm_id_t id, void *user_data)
+{
+    (void) id;
+    ChanUart *cu = user_data;
+    cu->alarm_pending = false;
+    cu->stats.alarms++;
+    fill_fifo(cu);
+    return 0;
+}
+
+// A paced byte in slot that isn't due yet; arms the alarm for it. If the
+// time has passed by the time the alarm is asked for, the byte is due after
+// all. With no alarm free, the mainloop retries.
+static bool
+paced_wait(ChanUart *cu, uint16_t slot, uint32_t now)
+{
+    if (!cu->byte_us || !is_paced(cu, slot))
+        return false;
+
+    int32_t until = (int32_t) (cu->wire_free_us + cu->gap_us - now);
+    if (until <= 0)
+        return false;
+
+    if (!cu->alarm_pending) {
+        alarm_id_t id = add_alarm_in_us(until, paced_alarm, cu, false);
+        if (id == 0)
+            return false;
+        if (id > 0)
+            cu->alarm_pending = true;
+        else
+            cu->alarm_retry = true;
+    }
+    return true;
+}
+
+// the pacing byte time if there is one, else the format's
+static uint32_t
+wire_byte_us(const ChanUart *cu)
+{
+    return cu->byte_us ? cu->byte_us : cu->frame_us;
+}
+
+static void
+note_sent(ChanUart *cu, uint16_t len, uint32_t now)
+{
+    uint16_t head = cu->head;
+    uint32_t byte_us = wire_byte_us(cu);
+    cu->head = (cu->head + len) & RING_MASK;
+    cu->count -= len;
+    if (byte_us) {
+        if ((int32_t) (cu->wire_free_us - now) < 0)
+            cu->wire_free_us = now;
+        cu->wire_free_us += len * byte_us;
+    }
+
+    ChanUartTxTap tap = s_tx_taps[cu - s_chans];
+    if (tap) {
+        uint32_t done = byte_us ? cu->wire_free_us - (len - 1) * byte_us : now;
+        for (uint16_t i = 0; i < len; i++)
+            tap(cu - s_chans, cu->ring[(head + i) & RING_MASK], done + i * byte_us);
+    }
+}
+
+#if CHAN_UART_PIO
+// The PIO engine takes a burst at a time and calls back once it's in the
+// FIFO. A paced byte goes out in a burst of its own.
+static void
+fill_pio(ChanUart *cu)
+{
+    uint8_t ch = cu - s_chans;
+    uint8_t burst[CHAN_UART_PIO_TX_BURST];
+    uint16_t len = 0;
+    uint32_t now = time_us_32();
+
+    if (chan_uart_pio_tx_busy(ch))
+        return;
+
+    while (len < cu->count && len < CHAN_UART_PIO_TX_BURST) {
+        uint16_t slot = (cu->head + len) & RING_MASK;
+        if (cu->byte_us && is_paced(cu, slot)) {
+            if (len == 0 && !paced_wait(cu, slot, now))
+                burst[len++] = cu->ring[slot];
+            break;
+        }
+        burst[len++] = cu->ring[slot];
+    }
+
+    if (len) {
+        chan_uart_pio_tx(ch, burst, len);
+        note_sent(cu, len, now);
+    }
+    cu->stats.level = cu->count;
+}
+
+static void
+pio_tx_done(uint8_t ch)
+{
+    s_chans[ch].stats.irqs++;
+    fill_fifo(&s_chans[ch]);
+}
+#endif
+
+// Moves what the FIFO has room for out of the ring. The TX interrupt
+// (FIFO down to 4 bytes) stays on only while something is left, so
+// there's no interrupt at all for writes that fit in the FIFO. A paced
+// byte that isn't due yet stops the fill and leaves it to the alarm.
+static void
+fill_fifo(ChanUart *cu)
+{
+    bool waiting = false;
+
+#if CHAN_UART_PIO
+    if (cu->pio) {
+        fill_pio(cu);
+        return;
+    }
+#endif
+
+    while (cu->count && uart_is_writable(cu->uart)) {
+        uint32_t now = time_us_32();
+        if (paced_wait(cu, cu->head, now)) {
+            waiting = true;
+            break;
+        }
+
+        uart_putc_raw(cu->uart, cu->ring[cu->head]);
+        note_sent(cu, 1, now);
+    }
+    cu->stats.level = cu->count;
+    set_tx_irq(cu, cu->count != 0 && !waiting);
+}
+
+static void
+chan_uart_irq(ChanUart *cu)
+{
+    if (cu->on_rx && uart_is_readable(cu->uart))
+        cu->on_rx();
+
+    if (cu->tx_irq) {
+        cu->stats.irqs++;
+        fill_fifo(cu);
+    }
+}
+
+static void chan_uart0_irq(void) { chan_uart_irq(s_by_uart[0]); }
+static void chan_uart1_irq(void) { chan_uart_irq(s_by_uart[1]); }
+
+void
+chan_uart_init(uint8_t ch, ChanUartRxHandler on_rx)
+{
+    if (ch >= NUM_CHANNELS)
+        return;
+
+    ChanUart *cu = &s_chans[ch];
+    uint8_t uart_num = channels[ch].uart_num;
+    uint irq = uart_num == 0 ? UART0_IRQ : UART1_IRQ;
+
+    memset(cu, 0, sizeof(*cu));
+    cu->on_rx = on_rx;
+
+#if CHAN_UART_PIO
+    // no UART interrupt; the engine comes up in chan_uart_set_format()
+    if ((channels[ch].mode & ChannelModeOutputTypeMask) == ChannelModePIO) {
+        cu->pio = true;
+        return;
+    }
+#endif
+
+    irq_set_enabled(irq, false);
+
+    cu->uart = uart_num == 0 ? uart0 : uart1;
+    s_by_uart[uart_num] = cu;
+
+    irq_set_exclusive_handler(irq, uart_num == 0 ? chan_uart0_irq : chan_uart1_irq);
+    uart_set_irq_enables(cu->uart, on_rx != NULL, false);
+    irq_set_enabled(irq, true);
+}
+
+void
+chan_uart_set_format(uint8_t ch, uint32_t baud, uint8_t data_bits, uint8_t stop_bits, uart_parity_t parity)
+{
+    if (ch >= NUM_CHANNELS)
+        return;
+
+    ChanUart *cu = &s_chans[ch];
+    uint32_t bits = 1 + data_bits + (parity != UART_PARITY_NONE) + stop_bits;
+    cu->wire_free_us = time_us_32();
+
+#if CHAN_UART_PIO
+    if (cu->pio) {
+        cu->frame_us = (bits * 1000000 + baud / 2) / baud;
+        ChanUartPioFormat fmt = { .data_bits = data_bits, .stop_bits = stop_bits, .parity = parity };
+        if (chan_uart_pio_init(ch, baud, &fmt, pio_tx_done)) {
+            cu->rx_errors_base = 0;
+            // anything written before now
+            uint32_t ints = save_and_disable_interrupts();
+            fill_fifo(cu);
+            restore_interrupts(ints);
+        }
+        return;
+    }
+#endif
+
+    if (!cu->uart)
+        return;
+
+    // uart_init() resets the interrupt enables along with everything else;
+    // the frame time is at the baud it could actually get
+    uint32_t actual = uart_init(cu->uart, baud);
+    cu->frame_us = (bits * 1000000 + actual / 2) / actual;
+    uart_set_hw_flow(cu->uart, false, false);
+    uart_set_format(cu->uart, data_bits, stop_bits, parity);
+    uart_set_irq_enables(cu->uart, cu->on_rx != NULL, cu->tx_irq);
+}
+
+void
+chan_uart_set_tx_tap(uint8_t ch, ChanUartTxTap tap)
+{
+    if (ch < NUM_CHANNELS)
+        s_tx_taps[ch] = tap;
+}
+
+void
+chan_uart_set_pacing(uint8_t ch, uint32_t byte_us, uint32_t gap_us)
+{
+    if (ch >= NUM_CHANNELS)
+        return;
+
+    uint32_t ints = save_and_disable_interrupts();
+    s_chans[ch].byte_us = byte_us;
+    s_chans[ch].gap_us = gap_us;
+    s_chans[ch].wire_free_us = time_us_32();
+    restore_interrupts(ints);
+}
+
+uint32_t
+chan_uart_frame_us(uint8_t ch)
+{
+    return ch < NUM_CHANNELS ? wire_byte_us(&s_chans[ch]) : 0;
+}
+
+static bool
+queue_write(uint8_t ch, const uint8_t *data, uint16_t len, bool paced)
+{
+    if (ch >= NUM_CHANNELS || (!s_chans[ch].uart && !s_chans[ch].pio))
+        return false;
+
+    ChanUart *cu = &s_chans[ch];
+
+    if (len > CHAN_UART_TX_RING_SIZE) {
+        cu->stats.dropped += len;
+        cu->stats.dropped_writes++;
+        return false;
+    }
+
+    uint32_t ints = save_and_disable_interrupts();
+
+    if (CHAN_UART_TX_RING_SIZE - cu->count >= len) {
+        uint16_t tail = (cu->head + cu->count) & RING_MASK;
+        for (uint16_t i = 0; i < len; i++) {
+            uint16_t slot = (tail + i) & RING_MASK;
+            cu->ring[slot] = data[i];
+            if (paced)
+                cu->paced[slot / 32] |= 1u << (slot % 32);
+            else
+                cu->paced[slot / 32] &= ~(1u << (slot % 32));
+        }
+        cu->count += len;
+        cu->stats.queued += len;
+        if (cu->count > cu->stats.level_max)
+            cu->stats.level_max = cu->count;
+        fill_fifo(cu);
+        restore_interrupts(ints);
+        return true;
+    }
+
+    // with interrupts off (or from the RX handler) nothing else will
+    // drain the ring for us
+    fill_fifo(cu);
+    restore_interrupts(ints);
+
+    cu->stats.dropped += len;
+    cu->stats.dropped_writes++;
+    DBG_V("channel %c: TX ring full, dropped %u bytes\n", 'A' + ch, len);
+    return false;
+}
+
+bool
+chan_uart_write(uint8_t ch, const uint8_t *data, uint16_t len)
+{
+    return queue_write(ch, data, len, false);
+}
+
+bool
+chan_uart_write_paced(uint8_t ch, const uint8_t *data, uint16_t len)
+{
+    return queue_write(ch, data, len, true);
+}
+
+bool
+chan_uart_putc(uint8_t ch, uint8_t c)
+{
+    return queue_write(ch, &c, 1, false);
+}
+
+bool
+chan_uart_is_readable(uint8_t ch)
+{
+    if (ch >= NUM_CHANNELS)
+        return false;
+
+#if CHAN_UART_PIO
+    if (s_chans[ch].pio)
+        return chan_uart_pio_rx_ready(ch);
+#endif
+    return s_chans[ch].uart && uart_is_readable(s_chans[ch].uart);
+}
+
+uint8_t
+chan_uart_getc(uint8_t ch)
+{
+    if (ch >= NUM_CHANNELS)
+        return 0;
+
+#if CHAN_UART_PIO
+    if (s_chans[ch].pio) {
+        uint8_t c;
+        while (!chan_uart_pio_getc(ch, &c))
+            tight_loop_contents();
+        return c;
+    }
+#endif
+    return s_chans[ch].uart ? uart_getc(s_chans[ch].uart) : 0;
+}
+
+void
+chan_uart_task(void)
+{
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        ChanUart *cu = &s_chans[ch];
+        if (!cu->alarm_retry)
+            continue;
+        uint32_t ints = save_and_disable_interrupts();
+        cu->alarm_retry = false;
+        fill_fifo(cu);
+        restore_interrupts(ints);
+    }
+
+#if CHAN_UART_PIO
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        ChanUart *cu = &s_chans[ch];
+        if (cu->pio && cu->on_rx && chan_uart_pio_rx_ready(ch))
+            cu->on_rx();
+    }
+#endif
+}
+
+uint16_t
+chan_uart_tx_free(uint8_t ch)
+{
+    if (ch >= NUM_CHANNELS)
+        return 0;
+    return CHAN_UART_TX_RING_SIZE - s_chans[ch].count;
+}
+
+bool
+chan_uart_tx_empty(uint8_t ch)
+{
+    return ch >= NUM_CHANNELS || s_chans[ch].count == 0;
+}
+
+uint32_t
+chan_uart_tx_backlog_us(uint8_t ch)
+{
+    if (ch >= NUM_CHANNELS)
+        return 0;
+
+    ChanUart *cu = &s_chans[ch];
+    uint32_t ints = save_and_disable_interrupts();
+    uint32_t byte_us = wire_byte_us(cu);
+    // the ring, and what's been handed to the UART but isn't out yet
+    uint32_t us = cu->count * byte_us;
+    int32_t sending = (int32_t) (cu->wire_free_us - time_us_32());
+    if (byte_us && sending > 0)
+        us += sending;
+    restore_interrupts(ints);
+    return us;
+}
+
+void
+chan_uart_get_stats(uint8_t ch, ChanUartStats *stats)
+{
+    if (ch >= NUM_CHANNELS) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    uint32_t ints = save_and_disable_interrupts();
+    *stats = s_chans[ch].stats;
+    stats->level = s_chans[ch].count;
+#if CHAN_UART_PIO
+    if (s_chans[ch].pio)
+        stats->rx_errors = chan_uart_pio_rx_errors(ch) - s_chans[ch].rx_errors_base;
+#endif
+    restore_interrupts(ints);
+}
+
+void
+chan_uart_reset_stats(uint8_t ch)
+{
+    if (ch >= NUM_CHANNELS)
+        return;
+
+    uint32_t ints = save_and_disable_interrupts();
+    memset(&s_chans[ch].stats, 0, sizeof(s_chans[ch].stats));
+    s_chans[ch].stats.level = s_chans[ch].stats.level_max = s_chans[ch].count;
+#if CHAN_UART_PIO
+    if (s_chans[ch].pio)
+        s_chans[ch].rx_errors_base = chan_uart_pio_rx_errors(ch);
+#endif
+    restore_interrupts(ints);
+}
@@ -0,0 +1,108 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Non-blocking transmit for a channel in UART mode. uart_putc_raw() spins
+ * once the 32-byte hardware FIFO is full, which at 1200 baud is ~8 ms per
+ * byte of the mainloop. Writes here go into a per-channel ring instead and
+ * the UART's TX interrupt moves them to the FIFO as it drains.
+ *
+ * The channel's UART interrupt belongs to this module once it's set up; a
+ * host that wants RX gives it a handler, called from the same interrupt
+ * when there's data to read.
+ *
+ * A ChannelModePIO channel is the same from the host's side, but runs on
+ * the PIO engine (chan_uart_pio.h) rather than a hardware UART: there's
+ * no UART interrupt, and its RX handler is called from chan_uart_task()
+ * in the mainloop.
+ *
+ * Paced writes are for hosts that can't take a full-rate stream: each of
+ * their bytes waits for the line to have been idle for the channel's gap,
+ * and a timer alarm releases it, so the writer (often the RX handler,
+ * answering a command) never waits.
+ */
+
+#ifndef CHAN_UART_H_
+#define CHAN_UART_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <hardware/uart.h>
+
+// line_sim models the hardware UARTs only, and builds without the PIO engine
+#ifndef CHAN_UART_PIO
+#define CHAN_UART_PIO 1
+#endif
+
+// per channel; a power of two. ~2 s of output at 1200 baud 8N1.
+#define CHAN_UART_TX_RING_SIZE 256
+
+typedef struct {
+    uint32_t queued;        // bytes accepted
+    uint32_t dropped;       // bytes refused with the ring full
+    uint32_t dropped_writes;
+    uint32_t irqs;          // TX refills from the interrupt
+    uint32_t alarms;        // paced bytes released by the alarm
+    uint32_t rx_errors;     // parity and framing; PIO engine only
+    uint16_t level;         // bytes in the ring now
+    uint16_t level_max;
+} ChanUartStats;
+
+typedef void (*ChanUartRxHandler)(void);
+
+// Sees each byte as it's handed to the UART, with when it'll be off the
+// wire: estimated from the channel's byte time (chan_uart_frame_us()), or
+// the hand-off time if it has none. From the TX interrupt, the pacing alarm, or a write.
+typedef void (*ChanUartTxTap)(uint8_t ch, uint8_t byte, uint32_t done_us);
+
+// After channel_config(), which picks the engine. on_rx may be NULL for
+// transmit-only use. Empties the ring and resets the stats.
+void chan_uart_init(uint8_t ch, ChanUartRxHandler on_rx);
+
+// Brings the UART up at baud and format, after chan_uart_init(). A hardware
+// UART channel may instead be set up with uart_init() and friends before
+// chan_uart_init(), as the tests do.
+void chan_uart_set_format(uint8_t ch, uint32_t baud, uint8_t data_bits, uint8_t stop_bits, uart_parity_t parity);
+
+// For the line sniffer; NULL to remove. Kept across chan_uart_init().
+void chan_uart_set_tx_tap(uint8_t ch, ChanUartTxTap tap);
+
+// byte_us is one frame in the channel's line format; gap_us is the idle
+// time the line gets before each paced byte.
+void chan_uart_set_pacing(uint8_t ch, uint32_t byte_us, uint32_t gap_us);
+
+// One byte's time on the wire: the pacing byte_us if set, otherwise from
+// the baud and format chan_uart_set_format() was given. 0 for a channel
+// set up some other way without pacing.
+uint32_t chan_uart_frame_us(uint8_t ch);
+
+// Core0, mainloop or the RX handler. A write is queued as a whole or not
+// at all, so a multi-byte packet never goes out torn; false if dropped.
+bool chan_uart_write(uint8_t ch, const uint8_t *data, uint16_t len);
+bool chan_uart_putc(uint8_t ch, uint8_t c);
+// Queued in order with everything else; sent at full rate if the channel
+// has no pacing set.
+bool chan_uart_write_paced(uint8_t ch, const uint8_t *data, uint16_t len);
+
+// For the RX handler; chan_uart_getc() waits for a byte, as uart_getc() does
+bool chan_uart_is_readable(uint8_t ch);
+uint8_t chan_uart_getc(uint8_t ch);
+
+// Mainloop; calls the RX handler of PIO channels that have received data,
+// and releases paced bytes that couldn't get an alarm.
+void chan_uart_task(void);
+
+uint16_t chan_uart_tx_free(uint8_t ch);
+// nothing left in the ring; the FIFO may still be sending
+bool chan_uart_tx_empty(uint8_t ch);
+// How long until everything written so far is off the wire, ring and
+// FIFO, at chan_uart_frame_us() a byte; gaps before paced bytes aren't
+// counted. 0 if the channel has no byte time.
+uint32_t chan_uart_tx_backlog_us(uint8_t ch);
+
+void chan_uart_get_stats(uint8_t ch, ChanUartStats *stats);
+void chan_uart_reset_stats(uint8_t ch);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include <pico/stdlib.h>
+#include <hardware/pio.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
+#include <hardware/clocks.h>
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "chanpio"
+
+#include "babelfish.h"
+#include "chan_uart_pio.h"
+#include "chan_uart.pio.h"
+
+// Assumption: pio0 is taken by tinyusb. host_next uses pio1 too, but never
+// alongside a UART host.
+#define CHAN_PIO pio1
+#define CHAN_PIO_DMA_IRQ DMA_IRQ_1
+
+typedef struct {
+    bool ready;
+    ChanUartPioFormat fmt;
+    ChanUartPioTxDone tx_done;
+
+    int tx_sm;
+    int rx_sm;
+    int tx_dma;
+    int rx_dma;
+
+    uint32_t tx_words[CHAN_UART_PIO_TX_BURST];
+    volatile bool tx_busy;
+
+    uint16_t rx_tail;
+    uint32_t rx_errors;
+} ChanPio;
+
+static ChanPio s_pio[NUM_CHANNELS] = {
+    { .tx_sm = -1, .rx_sm = -1, .tx_dma = -1, .rx_dma = -1 },
+    { .tx_sm = -1, .rx_sm = -1, .tx_dma = -1, .rx_dma = -1 },
+};
+
+// the DMA write ring wraps on its size in bytes, so it has to be aligned to it
+static uint32_t s_rx_ring[NUM_CHANNELS][CHAN_UART_PIO_RX_RING] __attribute__((aligned(CHAN_UART_PIO_RX_RING * 4)));
+
+static int s_tx_offset = -1;
+static int s_rx_offset = -1;
+static bool s_dma_irq_added = false;
+
+static void
+chan_pio_dma_irq(void)
+{
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        ChanPio *p = &s_pio[ch];
+        if (!p->ready)
+            continue;
+
+        if (dma_channel_get_irq1_status(p->tx_dma)) {
+            dma_channel_acknowledge_irq1(p->tx_dma);
+            p->tx_busy = false;
+            p->tx_done(ch);
+        }
+
+        // ~2^32 frames later; pick up where it left off in the ring
+        if (dma_channel_get_irq1_status(p->rx_dma)) {
+            dma_channel_acknowledge_irq1(p->rx_dma);
+            dma_channel_set_trans_count(p->rx_dma, 0xffffffff, true);
+        }
+    }
+}
+
+static bool
+claim(ChanPio *p)
+{
+    if (p->tx_sm < 0)
+        p->tx_sm = pio_claim_unused_sm(CHAN_PIO, false);
+    if (p->rx_sm < 0)
+        p->rx_sm = pio_claim_unused_sm(CHAN_PIO, false);
+    if (p->tx_dma < 0)
+        p->tx_dma = dma_claim_unused_channel(false);
+    if (p->rx_dma < 0)
+        p->rx_dma = dma_claim_unused_channel(false);
+    if (p->tx_sm < 0 || p->rx_sm < 0 || p->tx_dma < 0 || p->rx_dma < 0)
+        return false;
+
+    if (s_tx_offset < 0 && pio_can_add_program(CHAN_PIO, &chan_uart_tx_program))
+        s_tx_offset = pio_add_program(CHAN_PIO, &chan_uart_tx_program);
+    if (s_rx_offset < 0 && pio_can_add_program(CHAN_PIO, &chan_uart_rx_program))
+        s_rx_offset = pio_add_program(CHAN_PIO, &chan_uart_rx_program);
+    return s_tx_offset >= 0 && s_rx_offset >= 0;
+}
+
+static void
+init_tx(ChanPio *p, uint pin, float div)
+{
+    uint sm = p->tx_sm;
+
+    // idle high from the start
+    pio_sm_set_pins_with_mask(CHAN_PIO, sm, 1u << pin, 1u << pin);
+    pio_sm_set_pindirs_with_mask(CHAN_PIO, sm, 1u << pin, 1u << pin);
+    pio_gpio_init(CHAN_PIO, pin);
+
+    pio_sm_config cfg = chan_uart_tx_program_get_default_config(s_tx_offset);
+    sm_config_set_out_shift(&cfg, true, false, 32);
+    sm_config_set_out_pins(&cfg, pin, 1);
+    sm_config_set_sideset_pins(&cfg, pin);
+    sm_config_set_fifo_join(&cfg, PIO_FIFO_JOIN_TX);
+    sm_config_set_clkdiv(&cfg, div);
+    pio_sm_init(CHAN_PIO, sm, s_tx_offset, &cfg);
+    pio_sm_exec(CHAN_PIO, sm, pio_encode_set(pio_y, chan_uart_pio_tx_y(&p->fmt)));
+
+    dma_channel_config dc = dma_channel_get_default_config(p->tx_dma);
+    channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+    channel_config_set_read_increment(&dc, true);
+    channel_config_set_write_increment(&dc, false);
+    channel_config_set_dreq(&dc, pio_get_dreq(CHAN_PIO, sm, true));
+    dma_channel_configure(p->tx_dma, &dc, &CHAN_PIO->txf[sm], p->tx_words, 0, false);
+    dma_channel_set_irq1_enabled(p->tx_dma, true);
+
+    pio_sm_set_enabled(CHAN_PIO, sm, true);
+}
+
+static void
+init_rx(ChanPio *p, uint8_t ch, uint pin, float div)
+{
+    uint sm = p->rx_sm;
+
+    pio_sm_set_consecutive_pindirs(CHAN_PIO, sm, pin, 1, false);
+    pio_gpio_init(CHAN_PIO, pin);
+
+    pio_sm_config cfg = chan_uart_rx_program_get_default_config(s_rx_offset);
+    sm_config_set_in_pins(&cfg, pin);
+    sm_config_set_jmp_pin(&cfg, pin);
+    sm_config_set_in_shift(&cfg, true, true, chan_uart_pio_rx_y(&p->fmt) + 1);
+    sm_config_set_fifo_join(&cfg, PIO_FIFO_JOIN_RX);
+    sm_config_set_clkdiv(&cfg, div);
+    pio_sm_init(CHAN_PIO, sm, s_rx_offset, &cfg);
+    pio_sm_exec(CHAN_PIO, sm, pio_encode_set(pio_y, chan_uart_pio_rx_y(&p->fmt)));
+
+    dma_channel_config dc = dma_channel_get_default_config(p->rx_dma);
+    channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+    channel_config_set_read_increment(&dc, false);
+    channel_config_set_write_increment(&dc, true);
+    channel_config_set_ring(&dc, true, __builtin_ctz(CHAN_UART_PIO_RX_RING * 4));
+    channel_config_set_dreq(&dc, pio_get_dreq(CHAN_PIO, sm, false));
+    p->rx_tail = 0;
+    dma_channel_configure(p->rx_dma, &dc, s_rx_ring[ch], &CHAN_PIO->rxf[sm], 0xffffffff, true);
+    dma_channel_set_irq1_enabled(p->rx_dma, true);
+
+    pio_sm_set_enabled(CHAN_PIO, sm, true);
+}
+
+bool
+chan_uart_pio_init(uint8_t ch, uint32_t baud, const ChanUartPioFormat *fmt, ChanUartPioTxDone tx_done)
+{
+    if (ch >= NUM_CHANNELS)
+        return false;
+
+    ChanPio *p = &s_pio[ch];
+    if (!claim(p)) {
+        DBG("channel %c: no room in pio1 for a UART\n", 'A' + ch);
+        return false;
+    }
+
+    // set up again, e.g. for a new format: stop everything first
+    p->ready = false;
+    pio_sm_set_enabled(CHAN_PIO, p->tx_sm, false);
+    pio_sm_set_enabled(CHAN_PIO, p->rx_sm, false);
+    dma_channel_abort(p->tx_dma);
+    dma_channel_abort(p->rx_dma);
+    dma_channel_acknowledge_irq1(p->tx_dma);
+    dma_channel_acknowledge_irq1(p->rx_dma);
+    p->tx_busy = false;
+    p->rx_errors = 0;
+
+    p->fmt = *fmt;
+    p->tx_done = tx_done;
+
+    if (!s_dma_irq_added) {
+        irq_add_shared_handler(CHAN_PIO_DMA_IRQ, chan_pio_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+        irq_set_enabled(CHAN_PIO_DMA_IRQ, true);
+        s_dma_irq_added = true;
+    }
+
+    float div = (float) clock_get_hz(clk_sys) / (8.0f * baud);
+    init_tx(p, channels[ch].tx_gpio, div);
+    init_rx(p, ch, channels[ch].rx_gpio, div);
+
+    p->ready = true;
+    DBG("channel %c: PIO UART, %lu baud %u%c%u, sm %d/%d, dma %d/%d\n", 'A' + ch, baud, fmt->data_bits,
+        "NEO"[fmt->parity], fmt->stop_bits, p->tx_sm, p->rx_sm, p->tx_dma, p->rx_dma);
+    return true;
+}
+
+bool
+chan_uart_pio_tx_busy(uint8_t ch)
+{
+    return ch >= NUM_CHANNELS || !s_pio[ch].ready || s_pio[ch].tx_busy;
+}
+
+void
+chan_uart_pio_tx(uint8_t ch, const uint8_t *data, uint16_t len)
+{
+    if (chan_uart_pio_tx_busy(ch) || len == 0 || len > CHAN_UART_PIO_TX_BURST)
+        return;
+
+    ChanPio *p = &s_pio[ch];
+    for (uint16_t i = 0; i < len; i++)
+        p->tx_words[i] = chan_uart_pio_frame(&p->fmt, data[i]);
+
+    p->tx_busy = true;
+    dma_channel_transfer_from_buffer_now(p->tx_dma, p->tx_words, len);
+}
+
+static uint16_t
+rx_head(const ChanPio *p, uint8_t ch)
+{
+    uint32_t addr = dma_hw->ch[p->rx_dma].write_addr;
+    return (addr - (uint32_t) s_rx_ring[ch]) / 4 % CHAN_UART_PIO_RX_RING;
+}
+
+// Steps over framing error words, counting them; true if a frame is next.
+// A reader that falls a whole ring behind loses those frames without
+// knowing; at the mainloop's rate that takes well past 1 Mbaud.
+static bool
+rx_next(ChanPio *p, uint8_t ch)
+{
+    uint16_t head = rx_head(p, ch);
+    while (p->rx_tail != head && s_rx_ring[ch][p->rx_tail] == CHAN_UART_PIO_FRAMING_ERROR) {
+        p->rx_errors++;
+        p->rx_tail = (p->rx_tail + 1) % CHAN_UART_PIO_RX_RING;
+    }
+    return p->rx_tail != head;
+}
+
+bool
+chan_uart_pio_rx_ready(uint8_t ch)
+{
+    return ch < NUM_CHANNELS && s_pio[ch].ready && rx_next(&s_pio[ch], ch);
+}
+
+bool
+chan_uart_pio_getc(uint8_t ch, uint8_t *c)
+{
+    if (!chan_uart_pio_rx_ready(ch))
+        return false;
+
+    ChanPio *p = &s_pio[ch];
+    if (!chan_uart_pio_unframe(&p->fmt, s_rx_ring[ch][p->rx_tail], c))
+        p->rx_errors++;
+    p->rx_tail = (p->rx_tail + 1) % CHAN_UART_PIO_RX_RING;
+    return true;
+}
+
+uint32_t
+chan_uart_pio_rx_errors(uint8_t ch)
+{
+    return ch < NUM_CHANNELS ? s_pio[ch].rx_errors : 0;
+}
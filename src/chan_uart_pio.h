@@ -0,0 +1,105 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * chan_uart's PIO engine: a channel's UART run by a pair of pio1 state
+ * machines (src/chan_uart.pio) instead of one of the two hardware UARTs,
+ * at any baud and format. Both directions go through DMA: transmit bursts
+ * are framed into a word buffer and fed to the TX FIFO, and received
+ * frames land in a ring that chan_uart_task() looks at from the mainloop,
+ * so there's no per-byte interrupt either way.
+ *
+ * The framing helpers are also used by the PIO model test.
+ */
+
+#ifndef CHAN_UART_PIO_H_
+#define CHAN_UART_PIO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <hardware/uart.h>
+
+// bytes framed per DMA transfer
+#define CHAN_UART_PIO_TX_BURST 32
+// received frames; a power of two, the DMA write ring wraps on it
+#define CHAN_UART_PIO_RX_RING 64
+
+// what the RX program pushes after a frame that had no stop bit
+#define CHAN_UART_PIO_FRAMING_ERROR 0xffffffffu
+
+typedef struct {
+    uint8_t data_bits;      // 5-8
+    uint8_t stop_bits;      // 1 or 2
+    uart_parity_t parity;
+} ChanUartPioFormat;
+
+// The TX program's Y: bits it shifts out after the start bit, less one.
+// Its pull supplies the first stop bit.
+static inline uint8_t
+chan_uart_pio_tx_y(const ChanUartPioFormat *fmt)
+{
+    return fmt->data_bits + (fmt->parity != UART_PARITY_NONE) + fmt->stop_bits - 1 - 1;
+}
+
+// The RX program's Y, and its autopush threshold less one: data and
+// parity bits, less one
+static inline uint8_t
+chan_uart_pio_rx_y(const ChanUartPioFormat *fmt)
+{
+    return fmt->data_bits + (fmt->parity != UART_PARITY_NONE) - 1;
+}
+
+static inline uint32_t
+chan_uart_pio_frame(const ChanUartPioFormat *fmt, uint8_t c)
+{
+    uint32_t data = c & ((1u << fmt->data_bits) - 1);
+    uint32_t word = data;
+    uint8_t n = fmt->data_bits;
+
+    if (fmt->parity != UART_PARITY_NONE) {
+        uint32_t odd = __builtin_parity(data);
+        word |= (fmt->parity == UART_PARITY_EVEN ? odd : !odd) << n++;
+    }
+    if (fmt->stop_bits > 1)
+        word |= 1u << n;
+    return word;
+}
+
+// A frame word from the RX program (not CHAN_UART_PIO_FRAMING_ERROR) back
+// to the byte; false if its parity is wrong.
+static inline bool
+chan_uart_pio_unframe(const ChanUartPioFormat *fmt, uint32_t word, uint8_t *c)
+{
+    uint8_t n = chan_uart_pio_rx_y(fmt) + 1;
+    uint32_t bits = word >> (32 - n);
+    uint32_t data = bits & ((1u << fmt->data_bits) - 1);
+
+    *c = data;
+    if (fmt->parity == UART_PARITY_NONE)
+        return true;
+
+    uint32_t odd = __builtin_parity(data) ^ ((bits >> fmt->data_bits) & 1);
+    return odd == (fmt->parity == UART_PARITY_ODD);
+}
+
+typedef void (*ChanUartPioTxDone)(uint8_t ch);
+
+// For a ChannelModePIO channel. tx_done is called from the DMA interrupt
+// when a burst has gone into the FIFO. false if there's no room in pio1
+// (state machines, instruction memory or DMA channels).
+bool chan_uart_pio_init(uint8_t ch, uint32_t baud, const ChanUartPioFormat *fmt, ChanUartPioTxDone tx_done);
+
+// A burst is in flight; the next may only start after tx_done
+bool chan_uart_pio_tx_busy(uint8_t ch);
+// len <= CHAN_UART_PIO_TX_BURST
+void chan_uart_pio_tx(uint8_t ch, const uint8_t *data, uint16_t len);
+
+bool chan_uart_pio_rx_ready(uint8_t ch);
+// false if nothing's been received
+bool chan_uart_pio_getc(uint8_t ch, uint8_t *c);
+// parity and framing errors since chan_uart_pio_init()
+uint32_t chan_uart_pio_rx_errors(uint8_t ch);
+
+#endif
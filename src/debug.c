@@ -3,10 +3,17 @@
 #include <hardware/uart.h>
 #include <hardware/irq.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include <tusb.h>
 #include "babelfish.h"
 #include "hid_codes.h"
+#include "loadgen.h"
+#include "plan_cache.h"
+#include "hid_poll.h"
+#include "chan_uart.h"
+#include "apollo_cmd.h"
 
 #if DEBUG
 
@@ -17,10 +24,19 @@ static void debug_queue_fake_keypress(char ch);
 static void debug_out(const char* str, int length);
 static int debug_in(char* str, int length);
 static void debug_in_char(char ch);
-static bool debug_connected();
+static void debug_command(const char* line);
+static void debug_report_loadgen();
 
 #define USB_DEBUG_TIMEOUT_US 50
 
+// what's logged before the console is first opened, replayed to it then
+#define DEBUG_BACKLOG_SIZE 2048
+static char debug_backlog[DEBUG_BACKLOG_SIZE];
+static int debug_backlog_len = 0;
+static bool debug_attached = false;
+
+static DebugTextSink debug_raw_text = NULL;
+
 #define DBG_MSG_COUNT 8
 static char main_thread_debug_msgs[64][DBG_MSG_COUNT];
 static int main_thread_debug_msg_idx = 0;
@@ -78,16 +94,23 @@ debug_init()
 
     tud_init(0);
 
-    // wait for host to connect to CDC
-    absolute_time_t until = make_timeout_time_ms(200);
-    do {
-        tud_task();
-        if (debug_connected()) {
-            sleep_ms(10);
-            break;
-        }
-        sleep_ms(5);
-    } while (!time_reached(until));
+    // don't wait for the console; debug_task() picks it up when it's opened
+}
+
+static void
+debug_attach()
+{
+    if (debug_attached || !debug_connected())
+        return;
+
+    debug_attached = true;
+    boot_mark(BootDebug);
+    if (debug_raw_text)
+        debug_raw_text(debug_backlog, debug_backlog_len);
+    else
+        debug_out(debug_backlog, debug_backlog_len);
+    if (debug_backlog_len == DEBUG_BACKLOG_SIZE)
+        DBG("(boot log truncated)\n");
 }
 
 void
@@ -95,12 +118,21 @@ debug_task()
 {
     main_thread_debug_update();
     tud_task();
+    debug_attach();
+
+    // the raw mode's owner reads the input itself
+    if (debug_raw_text) {
+        debug_report_loadgen();
+        return;
+    }
 
     static char buf[128];
     int len = debug_in(buf, sizeof(buf));
-    if (len > 0) {
-        debug_in_char(buf[0]);
+    for (int i = 0; i < len; i++) {
+        debug_in_char(buf[i]);
     }
+
+    debug_report_loadgen();
 }
 
 bool debug_connected() {
@@ -148,14 +180,26 @@ dbg(const char* tag, const char *fmt, ...)
         debug_out(bb, remaining);
 }
 
+void
+debug_set_raw(DebugTextSink text)
+{
+    debug_raw_text = text;
+}
+
 void
 debug_out(const char* buf, int length)
 {
     static uint64_t last_avail_time;
+    if (debug_raw_text && debug_attached) {
+        debug_raw_text(buf, length);
+        return;
+    }
+    // never unframed text in raw mode; the backlog waits for debug_attach()
+    bool raw = debug_raw_text != NULL;
     if (!mutex_try_enter_block_until(&debug_mutex, make_timeout_time_ms(PICO_STDIO_DEADLOCK_TIMEOUT_MS))) {
         return;
     }
-    if (debug_connected()) {
+    if (debug_connected() && !raw) {
         for (int i = 0; i < length;) {
             int n = length - i;
             int avail = (int) tud_cdc_write_available();
@@ -178,10 +222,58 @@ debug_out(const char* buf, int length)
     } else {
         // reset our timeout
         last_avail_time = 0;
+
+        if (!debug_attached) {
+            int n = DEBUG_BACKLOG_SIZE - debug_backlog_len;
+            if (n > length) n = length;
+            memcpy(debug_backlog + debug_backlog_len, buf, n);
+            debug_backlog_len += n;
+        }
     }
     mutex_exit(&debug_mutex);
 }
 
+int
+debug_write_available()
+{
+    return debug_connected() ? (int) tud_cdc_write_available() : 0;
+}
+
+int
+debug_write(const void *buf, int length)
+{
+    if (!debug_connected())
+        return 0;
+    if (!mutex_try_enter_block_until(&debug_mutex, make_timeout_time_ms(PICO_STDIO_DEADLOCK_TIMEOUT_MS)))
+        return 0;
+
+    // give the host up to the usual timeout to make room, then drop it
+    // whole; a torn frame would cost the next one too
+    uint64_t until = time_us_64() + USB_DEBUG_TIMEOUT_US;
+    while ((int) tud_cdc_write_available() < length) {
+        tud_task();
+        tud_cdc_write_flush();
+        if (!debug_connected() || time_us_64() > until) {
+            length = 0;
+            break;
+        }
+    }
+    if (length) {
+        tud_cdc_write(buf, (uint32_t) length);
+        tud_cdc_write_flush();
+    }
+
+    mutex_exit(&debug_mutex);
+    return length;
+}
+
+int
+debug_read(void *buf, int length)
+{
+    int n = debug_in(buf, length);
+    return n > 0 ? n : 0;
+}
+
 int debug_in(char *buf, int length) {
     // these are just checks of state, so we can call them while not holding the lock.
     // they may be wrong, but only if we are in the middle of a tud_task call, in which case at worst
@@ -251,11 +343,271 @@ debug_queue_fake_keypress(char ch)
 #endif
 }
 
+#define DEBUG_MOUSE_STEP 5
+#define DEBUG_LINE_MAX 64
+
+static void
+debug_print_queue_stats()
+{
+    EventQueueStats qs;
+    get_event_queue_stats(&qs);
+    DBG("queue: kbd %lu queued %lu dropped (max depth %u), mouse %lu queued %lu dropped (max depth %u)\n",
+        qs.kbd_queued, qs.kbd_dropped, qs.kbd_max_depth, qs.mouse_queued, qs.mouse_dropped, qs.mouse_max_depth);
+    DBG("queue latency: avg %lu us, max %lu us over %lu events\n",
+        qs.latency_count ? (uint32_t) (qs.latency_total_us / qs.latency_count) : 0, qs.latency_max_us, qs.latency_count);
+
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        ChanUartStats cs;
+        chan_uart_get_stats(ch, &cs);
+        if (!cs.queued && !cs.dropped)
+            continue;
+        DBG("channel %c tx: %lu bytes, %lu dropped in %lu writes, ring %u now (max %u of %u), %lu refills\n",
+            'A' + ch, cs.queued, cs.dropped, cs.dropped_writes, cs.level, cs.level_max,
+            CHAN_UART_TX_RING_SIZE, cs.irqs);
+        if (cs.rx_errors)
+            DBG("channel %c rx: %lu parity/framing errors\n", 'A' + ch, cs.rx_errors);
+    }
+
+    ApolloCmdStats as;
+    if (apollo_cmd_get_stats(&as)) {
+        DBG("apollo commands: %lu, %lu unknown (last ff %lx), %lu stray bytes\n",
+            as.commands, as.unknown, as.last_unknown, as.stray);
+        DBG("apollo replies: %lu queued, avg %lu us, max %lu us after the 0xff\n", as.replies,
+            as.replies ? (uint32_t) (as.latency_total_us / as.replies) : 0, as.latency_max_us);
+    }
+}
+
+static void
+debug_print_plan_cache_stats()
+{
+    PlanCacheStats ps;
+    get_plan_cache_stats(&ps);
+    DBG("plan cache %s: %lu hits, %lu misses, %lu rejected, %lu writes (last %lu us)\n",
+        plan_cache_enabled() ? "on" : "off", ps.hits, ps.misses, ps.rejected, ps.writes, ps.write_us);
+    DBG("plan ready in %lu us cached, %lu us compiled; first key %lu us cached, %lu us compiled\n",
+        ps.plan_us_cached, ps.plan_us_compiled, ps.first_key_us_cached, ps.first_key_us_compiled);
+}
+
+// Report rate per HID interface since the last !rate. Compare a run
+// after "!poll off" with one after "!poll 1", moving the mouse or holding
+// keys the same way for both.
+static void
+debug_print_poll_stats()
+{
+    for (uint8_t i = 0; ; i++) {
+        HidPollStats hs;
+        if (!hid_poll_get_stats(i, &hs))
+            break;
+        if (!hs.dev_addr)
+            continue;
+        uint32_t ms = hs.elapsed_us / 1000;
+        DBG("hid %u (dev %u): polled every %u ms (advertised %u), %lu reports/s, %lu repeats, min gap %lu us, decode max %lu us\n",
+            i, hs.dev_addr, hs.interval_ms, hs.advertised_ms, ms ? hs.reports * 1000 / ms : 0, hs.repeats, hs.min_gap_us,
+            hs.max_decode_us);
+    }
+    hid_poll_reset_stats();
+}
+
+static void
+debug_print_boot_timeline()
+{
+    for (int i = 0; i < BootStageCount; i++) {
+        uint32_t us = boot_stage_us(i);
+        if (us)
+            DBG("boot: %s at %lu us\n", boot_stage_name(i), us);
+        else
+            DBG("boot: %s not yet\n", boot_stage_name(i));
+    }
+}
+
+//
+// On-device version of test/host_bench: ramp the load generator until the
+// mainloop falls behind. Only the event queue is visible from here, so this
+// catches drops and queueing delay (the mainloop stuck in putc on a full
+// line), not what the host does with the bytes.
+//
+#define BENCH_STEP_MS 3000
+#define BENCH_MAX_DELAY_US 50000
+
+static const uint16_t bench_key_rates[] = { 5, 10, 15, 20, 25, 30, 40, 50, 60, 70, 80, 100, 120, 150, 200, 300, 500, 1000 };
+static const uint16_t bench_mouse_rates[] = { 5, 10, 20, 25, 30, 40, 50, 60, 80, 100, 125, 200, 250, 500, 1000 };
+
+static bool bench_active = false;
+static bool bench_mouse = false;
+static uint bench_step = 0;
+
+static void
+bench_start_step()
+{
+    LoadGenConfig cfg;
+    loadgen_default_config(&cfg);
+    cfg.duration_ms = BENCH_STEP_MS;
+    cfg.key_rate = bench_mouse ? 0 : bench_key_rates[bench_step];
+    cfg.mouse_rate = bench_mouse ? bench_mouse_rates[bench_step] : 0;
+    loadgen_start(&cfg);
+}
+
+static void
+bench_step_done(const LoadGenStats* ls, const EventQueueStats* qs)
+{
+    const uint16_t *rates = bench_mouse ? bench_mouse_rates : bench_key_rates;
+    uint count = bench_mouse ? sizeof(bench_mouse_rates) / sizeof(bench_mouse_rates[0]) : sizeof(bench_key_rates) / sizeof(bench_key_rates[0]);
+    const char *failure = NULL;
+
+    if (qs->kbd_dropped || qs->mouse_dropped || ls->late)
+        failure = "drops";
+    else if (qs->latency_max_us > BENCH_MAX_DELAY_US)
+        failure = "delay";
+
+    DBG("bench %s %u/s: queue max %lu us, %lu dropped, %lu late: %s\n", bench_mouse ? "mouse" : "keys",
+        rates[bench_step], qs->latency_max_us, qs->kbd_dropped + qs->mouse_dropped, ls->late, failure ? failure : "ok");
+
+    if (!failure && bench_step + 1 < count) {
+        bench_step++;
+        bench_start_step();
+        return;
+    }
+
+    DBG("bench %s on %s: sustained %u/s\n", bench_mouse ? "mouse" : "keys", host->name,
+        failure ? (bench_step ? rates[bench_step - 1] : 0) : rates[bench_step]);
+    bench_active = false;
+}
+
+static void
+debug_report_loadgen()
+{
+#if !BABELFISH_TEST
+    LoadGenStats ls;
+    if (!loadgen_take_finished(&ls))
+        return;
+
+    EventQueueStats qs;
+    get_event_queue_stats(&qs);
+    if (bench_active) {
+        bench_step_done(&ls, &qs);
+        return;
+    }
+
+    DBG("loadgen done after %lu ms: %lu keystrokes (%lu reports), %lu mouse reports, %lu late\n",
+        ls.elapsed_ms, ls.keystrokes, ls.kbd_reports, ls.mouse_reports, ls.late);
+    debug_print_queue_stats();
+#endif
+}
+
+//
+// Line commands, typed as "!cmd args" followed by enter:
+//   !load [k=keys/s] [r=rollover] [m=mouse reports/s] [dx=n] [dy=n] [b=none|click|drag|cycle] [t=ms]
+//   !load stop
+//   !bench keys|mouse
+//   !stats
+//   !cache [on|off|clear]
+//   !poll [dev] ms|off
+//   !rate
+//   !boot
+//
+static void
+debug_command(const char* line)
+{
+#if !BABELFISH_TEST
+    if (!strncmp(line, "load", 4)) {
+        const char *args = line + 4;
+        while (*args == ' ')
+            args++;
+
+        if (!strcmp(args, "stop")) {
+            bench_active = false;
+            loadgen_stop();
+            return;
+        }
+
+        LoadGenConfig cfg;
+        loadgen_default_config(&cfg);
+        if (!loadgen_parse(args, &cfg)) {
+            DBG("bad loadgen args: %s\n", args);
+            return;
+        }
+
+        DBG("loadgen: %u keys/s rollover %u, %u mouse/s (%d,%d) buttons %d, %lu ms\n",
+            cfg.key_rate, cfg.rollover, cfg.mouse_rate, cfg.mouse_dx, cfg.mouse_dy, cfg.buttons, cfg.duration_ms);
+        loadgen_start(&cfg);
+    } else if (!strcmp(line, "bench keys") || !strcmp(line, "bench mouse")) {
+        bench_mouse = !strcmp(line, "bench mouse");
+        bench_step = 0;
+        bench_active = true;
+        bench_start_step();
+    } else if (!strcmp(line, "stats")) {
+        debug_print_queue_stats();
+    } else if (!strncmp(line, "cache", 5)) {
+        const char *args = line + 5;
+        while (*args == ' ')
+            args++;
+
+        if (!strcmp(args, "on") || !strcmp(args, "off"))
+            plan_cache_set_enabled(!strcmp(args, "on"));
+        else if (!strcmp(args, "clear"))
+            plan_cache_clear();
+        else if (*args)
+            DBG("bad cache args: %s\n", args);
+        debug_print_plan_cache_stats();
+    } else if (!strncmp(line, "poll ", 5)) {
+        // "!poll 1" for every device, "!poll 2 1" for device 2 only; "off"
+        // or 0 ms goes back to what the device advertises
+        const char *args = line + 5;
+        char *end;
+        long first = strtol(args, &end, 0);
+        long second = 0;
+        bool per_device = false;
+        if (end != args) {
+            const char *rest = end;
+            second = strtol(rest, &end, 0);
+            per_device = end != rest;
+        } else if (strcmp(args, "off")) {
+            DBG("bad poll args: %s\n", args);
+            return;
+        }
+
+        if (per_device)
+            hid_poll_set_interval(first, second);
+        else
+            hid_poll_set_interval(0, first);
+        hid_poll_reset_stats();
+    } else if (!strcmp(line, "rate")) {
+        debug_print_poll_stats();
+    } else if (!strcmp(line, "boot")) {
+        debug_print_boot_timeline();
+    } else {
+        DBG("unknown command: %s\n", line);
+    }
+#endif
+}
+
 void
 debug_in_char(char ch)
 {
     static bool in_esc = false;
     static bool in_motion = false;
+    static bool in_line = false;
+    static char line[DEBUG_LINE_MAX];
+    static int line_len = 0;
+
+    if (in_line) {
+        if (ch == '\r' || ch == '\n') {
+            line[line_len] = '\0';
+            in_line = false;
+            debug_command(line);
+        } else if ((ch == '\b' || ch == 0x7f) && line_len > 0) {
+            line_len--;
+        } else if (line_len < DEBUG_LINE_MAX - 1) {
+            line[line_len++] = ch;
+        }
+        return;
+    }
+
+    if (ch == '!') {
+        in_line = true;
+        line_len = 0;
+        return;
+    }
 
     if (ch == 0x1B) { // ESC
         in_esc = true;
@@ -268,20 +620,19 @@ debug_in_char(char ch)
     }
 
     if (in_esc && in_motion) {
-        // translate arrow keys to mouse motion 
-        if (in_motion) {
-            hid_mouse_report_t report = { 0 };
-            if (ch == 'A') {
-                report.y = 1;
-            } else if (ch == 'B') {
-                report.y = -1;
-            } else if (ch == 'C') {
-                report.x = 1;
-            } else if (ch == 'D') {
-                report.x = -1;
-            }
-            //host->mouse_event(&report);
+        // translate arrow keys to mouse motion; HID y grows downwards
+        hid_mouse_report_t report = { 0 };
+        if (ch == 'A') {
+            report.y = -DEBUG_MOUSE_STEP;
+        } else if (ch == 'B') {
+            report.y = DEBUG_MOUSE_STEP;
+        } else if (ch == 'C') {
+            report.x = DEBUG_MOUSE_STEP;
+        } else if (ch == 'D') {
+            report.x = -DEBUG_MOUSE_STEP;
         }
+        if (report.x || report.y)
+            translate_boot_mouse_report(&report);
 
         goto reset;
     }
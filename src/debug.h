@@ -14,6 +14,19 @@ void debug_task();
 
 void dbg(const char* tag, const char *fmt, ...);
 
+bool debug_connected();
+
+// Binary mode, for the line sniffer (sniff.c): the console no longer reads
+// its input, and what would be printed goes to text instead, the backlog
+// included, which is expected to send it with debug_write().
+typedef void (*DebugTextSink)(const char *buf, int len);
+void debug_set_raw(DebugTextSink text);
+// Writes all of buf to the CDC or nothing; the bytes written.
+int debug_write(const void *buf, int len);
+int debug_write_available();
+// CDC input; up to len bytes, 0 if there's none.
+int debug_read(void *buf, int len);
+
 #ifndef DEBUG_TAG
 #define DEBUG_TAG "??"
 #endif
@@ -0,0 +1,111 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Keyboard and mouse event queues between the USB host side (core1) and
+ * mainloop (core0), plus counters for what gets dropped and how long
+ * events wait.
+ */
+
+#include <pico/stdlib.h>
+#include <pico/sync.h>
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "events"
+
+#include "babelfish.h"
+
+static KeyboardEvent kbd_event_queue[MAX_QUEUED_EVENTS];
+static MouseEvent mouse_event_queue[MAX_QUEUED_EVENTS];
+// time_us_32() at enqueue, for latency stats
+static uint32_t kbd_event_stamp[MAX_QUEUED_EVENTS];
+static uint32_t mouse_event_stamp[MAX_QUEUED_EVENTS];
+static uint8_t kbd_event_queue_count = 0;
+static uint8_t mouse_event_queue_count = 0;
+static mutex_t event_queue_mutex;
+
+static EventQueueStats s_stats;
+
+void event_queue_init(void)
+{
+  mutex_init(&event_queue_mutex);
+}
+
+void enqueue_kbd_event(const KeyboardEvent* event)
+{
+  //DBG_VV("Enqueued key %s: [%d] 0x%04x\n", event->down ? "DOWN" : "UP", event->page, event->keycode);
+  mutex_enter_blocking(&event_queue_mutex);
+  if (kbd_event_queue_count < MAX_QUEUED_EVENTS) {
+    kbd_event_stamp[kbd_event_queue_count] = time_us_32();
+    kbd_event_queue[kbd_event_queue_count++] = *event;
+    s_stats.kbd_queued++;
+    if (kbd_event_queue_count > s_stats.kbd_max_depth)
+      s_stats.kbd_max_depth = kbd_event_queue_count;
+  } else {
+    s_stats.kbd_dropped++;
+  }
+  mutex_exit(&event_queue_mutex);
+}
+
+void enqueue_mouse_event(const MouseEvent* event)
+{
+  //DBG("Enqueued mouse\n");
+  mutex_enter_blocking(&event_queue_mutex);
+  if (mouse_event_queue_count < MAX_QUEUED_EVENTS) {
+    mouse_event_stamp[mouse_event_queue_count] = time_us_32();
+    mouse_event_queue[mouse_event_queue_count++] = *event;
+    s_stats.mouse_queued++;
+    if (mouse_event_queue_count > s_stats.mouse_max_depth)
+      s_stats.mouse_max_depth = mouse_event_queue_count;
+  } else {
+    s_stats.mouse_dropped++;
+  }
+  mutex_exit(&event_queue_mutex);
+}
+
+static void record_latency(const uint32_t *stamps, uint count)
+{
+  uint32_t now = time_us_32();
+  for (uint i = 0; i < count; i++) {
+    uint32_t waited = now - stamps[i];
+    s_stats.latency_count++;
+    s_stats.latency_total_us += waited;
+    if (waited > s_stats.latency_max_us)
+      s_stats.latency_max_us = waited;
+  }
+}
+
+void get_queued_kbd_events(KeyboardEvent* events, uint* count)
+{
+  mutex_enter_blocking(&event_queue_mutex);
+  *count = kbd_event_queue_count;
+  memcpy(events, kbd_event_queue, sizeof(KeyboardEvent) * kbd_event_queue_count);
+  record_latency(kbd_event_stamp, kbd_event_queue_count);
+  kbd_event_queue_count = 0;
+  mutex_exit(&event_queue_mutex);
+}
+
+void get_queued_mouse_events(MouseEvent* events, uint* count)
+{
+  mutex_enter_blocking(&event_queue_mutex);
+  *count = mouse_event_queue_count;
+  memcpy(events, mouse_event_queue, sizeof(MouseEvent) * mouse_event_queue_count);
+  record_latency(mouse_event_stamp, mouse_event_queue_count);
+  mouse_event_queue_count = 0;
+  mutex_exit(&event_queue_mutex);
+}
+
+void get_event_queue_stats(EventQueueStats* stats)
+{
+  mutex_enter_blocking(&event_queue_mutex);
+  *stats = s_stats;
+  mutex_exit(&event_queue_mutex);
+}
+
+void reset_event_queue_stats(void)
+{
+  mutex_enter_blocking(&event_queue_mutex);
+  memset(&s_stats, 0, sizeof(s_stats));
+  mutex_exit(&event_queue_mutex);
+}
@@ -16,9 +16,9 @@ typedef struct {
 } KeyboardEvent;
 
 typedef struct {
-    // relative mouse motion
-    int8_t dx;
-    int8_t dy;
+    // relative mouse motion; report protocol mice can send more than 8 bits
+    int16_t dx;
+    int16_t dy;
 
     // relative wheel motion
     int8_t dwheel;
@@ -37,14 +37,42 @@ typedef struct {
 
 #define MAX_QUEUED_EVENTS 32
 
+typedef struct {
+    uint32_t kbd_queued;
+    uint32_t kbd_dropped;       // queue was full
+    uint32_t mouse_queued;
+    uint32_t mouse_dropped;
+    uint8_t kbd_max_depth;
+    uint8_t mouse_max_depth;
+
+    // time from enqueue until mainloop picks the event up
+    uint32_t latency_count;
+    uint64_t latency_total_us;
+    uint32_t latency_max_us;
+} EventQueueStats;
+
+void event_queue_init(void);
 void enqueue_kbd_event(const KeyboardEvent* event);
 void enqueue_mouse_event(const MouseEvent* event);
 void get_queued_kbd_events(KeyboardEvent* events, uint* count);
 void get_queued_mouse_events(MouseEvent* events, uint* count);
+void get_event_queue_stats(EventQueueStats* stats);
+void reset_event_queue_stats(void);
 
 void babelfish_uart_config(int uidx, char ab);
 
 void translate_boot_kbd_report(hid_keyboard_report_t const *report);
+
+#define NKRO_WORDS 8
+#define NKRO_MODIFIER_WORD (0xE0 / 32)
+void translate_nkro_kbd_report(const uint32_t keys[NKRO_WORDS]);
 void translate_boot_mouse_report(hid_mouse_report_t const *report);
+void translate_mouse_report(uint16_t buttons, int32_t dx, int32_t dy, int32_t wheel);
+
+// The host computer's keyboard LEDs, as HID output report bits
+// (KEYBOARD_LED_*). Any core, any context; core1 sends them on to every
+// USB keyboard, and to ones mounted later.
+void set_keyboard_leds(uint8_t leds);
+void keyboard_leds_task(void);
 
 #endif
\ No newline at end of file
@@ -6,22 +6,72 @@
  * Copyright (c) 2021, Ha Thach (tinyusb.org)
  */
 
+#include <string.h>
 #include <hardware/uart.h>
 #include <tusb.h>
 
 #define DEBUG_TAG "usb"
 #include "babelfish.h"
+#include "hid_plan.h"
+#include "hid_poll.h"
+#include "plan_cache.h"
 
-#define MAX_REPORT  4
+// compiled from the report descriptor at mount, or from the plan cache
+static HidDevicePlan hid_plan[CFG_TUH_HID];
 
-static struct
-{
-  uint8_t report_count;
-  tuh_hid_report_info_t report_info[MAX_REPORT];
-} hid_info[CFG_TUH_HID];
+// the report being decoded; TinyUSB's endpoint buffer is already
+// receiving the next one
+static uint8_t hid_report_copy[CFG_TUH_HID][CFG_TUH_HID_EPIN_BUFSIZE];
+
+// mount to first key down, for the plan cache stats
+static uint32_t hid_mount_us[CFG_TUH_HID];
+static bool hid_plan_cached[CFG_TUH_HID];
+static bool hid_waiting_key[CFG_TUH_HID];
+
+// keyboard LEDs: what the host wants, and what each keyboard has been sent
+static volatile uint8_t s_leds_wanted;
+static uint8_t hid_kbd_addr[CFG_TUH_HID];     // 0 unless a keyboard is mounted
+static int16_t hid_leds_sent[CFG_TUH_HID];    // -1 for nothing yet
+static bool hid_leds_busy[CFG_TUH_HID];
+static uint8_t hid_leds_report[CFG_TUH_HID][2];  // must last until the transfer's done
 
 static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len);
 
+// Boot protocol is what TinyUSB leaves keyboards and mice in, and what every
+// one of them gets right. A keyboard whose report descriptor has a key bitmap
+// is switched to report protocol, so it isn't limited to six keys.
+static uint8_t choose_protocol(uint8_t dev_addr, uint8_t instance)
+{
+  uint8_t const proto = tuh_hid_get_protocol(dev_addr, instance);
+  if (tuh_hid_interface_protocol(dev_addr, instance) != HID_ITF_PROTOCOL_KEYBOARD)
+    return proto;
+
+  for (int i = 0; i < hid_plan[instance].count; ++i) {
+    const HidReportPlan* rp = &hid_plan[instance].reports[i];
+    if (rp->kind == HidReportKeyboard && rp->kbd.bitmap.bit_size)
+      return HID_PROTOCOL_REPORT;
+  }
+  return proto;
+}
+
+// An all-zero keyboard report is everything up; anything else has a key down.
+static void note_key_report(uint8_t instance, uint8_t const* report, uint16_t len)
+{
+  if (!hid_waiting_key[instance])
+    return;
+
+  for (uint16_t i = 0; i < len; i++) {
+    if (report[i]) {
+      uint32_t us = time_us_32() - hid_mount_us[instance];
+      hid_waiting_key[instance] = false;
+      plan_cache_note_first_key(hid_plan_cached[instance], us);
+      DBG("HID %d first key %lu us after mount (plan %s)\r\n", instance, us,
+          hid_plan_cached[instance] ? "cached" : "compiled");
+      return;
+    }
+  }
+}
+
 // TinyUSB Callbacks
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_report, uint16_t desc_len);
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance);
@@ -42,14 +92,53 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 {
   DBG("HID device address = %d, instance = %d is mounted\r\n", dev_addr, instance);
 
+  hid_leds_busy[instance] = false;
+  hid_leds_sent[instance] = -1;
+  hid_kbd_addr[instance] = tuh_hid_interface_protocol(dev_addr, instance) == HID_ITF_PROTOCOL_KEYBOARD ? dev_addr : 0;
+
+  // TinyUSB has already sent SET_IDLE(0), so well behaved devices only
+  // report on change; poll them as often as they (and the budget) allow
+  hid_poll_mount(dev_addr, instance);
+
   // TinyUSB will always switch to boot protocol if possible. We may choose to switch
   // back if we can understand the descriptors.
 
-  hid_info[instance].report_count = tuh_hid_parse_report_descriptor(hid_info[instance].report_info, MAX_REPORT, desc_report, desc_len);
-  DBG("HID has %u reports \r\n", hid_info[instance].report_count);
-  for (int i = 0; i < hid_info[instance].report_count; ++i) {
-    const tuh_hid_report_info_t* info = &hid_info[instance].report_info[i];
-    DBG("  Report %d: id=%d, usage_page=0x%x, usage=0x%x\r\n", i, info->report_id, info->usage_page, info->usage);
+  uint32_t start_us = time_us_32();
+  uint16_t vid = 0, pid = 0;
+  tuh_vid_pid_get(dev_addr, &vid, &pid);
+
+  PlanCacheKey key;
+  plan_cache_key(&key, vid, pid, desc_report, desc_len);
+
+  uint8_t want_proto;
+  bool cached = plan_cache_lookup(&key, &hid_plan[instance], &want_proto);
+  if (!cached) {
+    hid_plan_compile(&hid_plan[instance], desc_report, desc_len);
+    want_proto = choose_protocol(dev_addr, instance);
+    plan_cache_store(&key, &hid_plan[instance], want_proto);
+  }
+
+  uint32_t plan_us = time_us_32() - start_us;
+  plan_cache_note_plan_time(cached, plan_us);
+  hid_mount_us[instance] = start_us;
+  hid_plan_cached[instance] = cached;
+  hid_waiting_key[instance] = true;
+
+  uint8_t report_count = hid_plan[instance].count;
+  DBG("HID %04x:%04x has %u input reports, plan %s in %lu us\r\n", vid, pid, report_count,
+      cached ? "cached" : "compiled", plan_us);
+  for (int i = 0; i < report_count; ++i) {
+    const HidReportPlan* rp = &hid_plan[instance].reports[i];
+    if (rp->kind == HidReportMouse) {
+      DBG("  Report %d: id=%d mouse, %u bytes: buttons %u@%u, x %u@%u, y %u@%u, wheel %u@%u\r\n", i, rp->report_id,
+          rp->length, rp->mouse.buttons.bit_size, rp->mouse.buttons.bit_offset, rp->mouse.x.bit_size, rp->mouse.x.bit_offset,
+          rp->mouse.y.bit_size, rp->mouse.y.bit_offset, rp->mouse.wheel.bit_size, rp->mouse.wheel.bit_offset);
+    } else if (rp->kind == HidReportKeyboard) {
+      DBG("  Report %d: id=%d keyboard, %u bytes: %u keys@%u, %u bitmap keys@%u\r\n", i, rp->report_id,
+          rp->length, rp->kbd.key_count, rp->kbd.keys.bit_offset, rp->kbd.bitmap_count, rp->kbd.bitmap.bit_offset);
+    } else {
+      DBG("  Report %d: id=%d, %u bytes\r\n", i, rp->report_id, rp->length);
+    }
   }
 
   uint8_t proto = tuh_hid_get_protocol(dev_addr, instance);
@@ -61,6 +150,16 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
     DBG("HID using report protocol\r\n");
   }
 
+  if (want_proto != proto) {
+    // the first report request goes out from the completion callback; if
+    // the request can't be sent, stay in the current protocol, which the
+    // report callback reads per report
+    DBG("HID switching to %s protocol\r\n", want_proto == HID_PROTOCOL_REPORT ? "report" : "boot");
+    if (tuh_hid_set_protocol(dev_addr, instance, want_proto))
+      return;
+    DBG("HID: Failed to set protocol, staying in %s\r\n", proto == HID_PROTOCOL_REPORT ? "report" : "boot");
+  }
+
   // Create first report request
   if (!tuh_hid_receive_report(dev_addr, instance)) {
     DBG("HID: Failed to request to receive report!\r\n");
@@ -72,6 +171,9 @@ void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance, uint8_t const* desc_re
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance)
 {
   DBG("HID device address = %d, instance = %d is unmounted\r\n", dev_addr, instance);
+  hid_waiting_key[instance] = false;
+  hid_kbd_addr[instance] = 0;
+  hid_poll_umount(dev_addr, instance);
 }
 
 // Invoked when received report from device via interrupt endpoint
@@ -81,14 +183,32 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
   uint8_t const protocol = tuh_hid_get_protocol(dev_addr, instance);
 
   DBG_VV("HID report (dev %d:%d, protocol %d itf_protocol %d) length %d\n", dev_addr, instance, protocol, itf_protocol, len);
+  hid_poll_report(instance, report, len);
 
-  if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
+  // Take the report out of TinyUSB's endpoint buffer and re-arm straight
+  // away, so the next IN transfer is in flight (into that buffer) while we
+  // decode this one from ours, instead of waiting for decoding and
+  // enqueueing to finish.
+  uint32_t const rearm_us = time_us_32();
+  if (len > sizeof(hid_report_copy[instance])) {
+    len = sizeof(hid_report_copy[instance]);
+  }
+  memcpy(hid_report_copy[instance], report, len);
+  report = hid_report_copy[instance];
+
+  if (!tuh_hid_receive_report(dev_addr, instance)) {
+    DBG("HID: Failed to request to receive report!\r\n");
+  }
+
+  // boot interfaces we've switched to report protocol go through their plan
+  if (protocol == HID_PROTOCOL_BOOT && itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
       translate_boot_kbd_report((hid_keyboard_report_t const*) report);
-  } else if (itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
+      note_key_report(instance, report, len);
+  } else if (protocol == HID_PROTOCOL_BOOT && itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
       translate_boot_mouse_report((hid_mouse_report_t const*) report);
   } else {
       // Generic report requires matching ReportID and contents with previous parsed report info
-      DBG("===== Generic report!\n");
+      DBG_VV("===== Generic report!\n");
       process_generic_report(dev_addr, instance, report, len);
   }
 
@@ -104,70 +224,96 @@ void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance, uint8_t cons
   } else {
 */
 
-  // Continue to request to receive a report
-  if (!tuh_hid_receive_report(dev_addr, instance)) {
-    DBG("HID: Failed to request to receive report!\r\n");
-  }
+  hid_poll_decoded(instance, rearm_us);
 }
 
 //--------------------------------------------------------------------+
-// Generic Report
+// Keyboard LEDs
 //--------------------------------------------------------------------+
-static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+void set_keyboard_leds(uint8_t leds)
 {
-  (void) dev_addr;
+  s_leds_wanted = leds;
+}
 
-  uint8_t const rpt_count = hid_info[instance].report_count;
-  tuh_hid_report_info_t* rpt_info_arr = hid_info[instance].report_info;
-  tuh_hid_report_info_t* rpt_info = NULL;
+// Only the latest state matters, so a change that comes in while a
+// keyboard's previous SET_REPORT is still going waits for it and replaces
+// anything in between. A boot protocol keyboard takes a bare LED byte; in
+// report protocol it goes in the output report the descriptor put the LEDs
+// in, its ID byte first if the device uses report IDs.
+void keyboard_leds_task(void)
+{
+  uint8_t leds = s_leds_wanted;
 
-  if (rpt_count == 1 && rpt_info_arr[0].report_id == 0) {
-    // Simple report without report ID as 1st byte
-    rpt_info = &rpt_info_arr[0];
-  } else {
-    // Composite report, 1st byte is report ID, data starts from 2nd byte
-    uint8_t const rpt_id = report[0];
-
-    // Find report id in the arrray
-    for(uint8_t i=0; i<rpt_count; i++) {
-      if (rpt_id == rpt_info_arr[i].report_id ) {
-        rpt_info = &rpt_info_arr[i];
-        break;
+  for (uint8_t i = 0; i < CFG_TUH_HID; i++) {
+    if (!hid_kbd_addr[i] || hid_leds_busy[i] || hid_leds_sent[i] == leds)
+      continue;
+
+    const HidDevicePlan *plan = &hid_plan[i];
+    uint8_t report_id = 0;
+    uint8_t *report = hid_leds_report[i];
+    uint16_t len = 0;
+    if (tuh_hid_get_protocol(hid_kbd_addr[i], i) == HID_PROTOCOL_REPORT && plan->uses_ids) {
+      if (!plan->has_leds) {
+        // nowhere to send them
+        hid_leds_sent[i] = leds;
+        continue;
       }
+      report_id = plan->led_report_id;
+      report[len++] = report_id;
     }
+    report[len++] = leds;
 
-    report++;
-    len--;
+    if (tuh_hid_set_report(hid_kbd_addr[i], i, report_id, HID_REPORT_TYPE_OUTPUT, report, len)) {
+      hid_leds_busy[i] = true;
+      hid_leds_sent[i] = leds;
+    }
   }
+}
 
-  if (!rpt_info) {
-    // printf("Couldn't find the report info for this report !\r\n");
+void tuh_hid_set_report_complete_cb(uint8_t dev_addr, uint8_t instance, uint8_t report_id, uint8_t report_type, uint16_t len)
+{
+  (void) dev_addr; (void) report_id; (void) report_type;
+  DBG_VV("HID %d: LEDs set (%u)\n", instance, len);
+  hid_leds_busy[instance] = false;
+}
+
+//--------------------------------------------------------------------+
+// Generic Report
+//--------------------------------------------------------------------+
+static void process_generic_report(uint8_t dev_addr, uint8_t instance, uint8_t const* report, uint16_t len)
+{
+  (void) dev_addr;
+
+  // moves report past the report ID, if the device uses them
+  const HidReportPlan* rp = hid_plan_lookup(&hid_plan[instance], &report, &len);
+  if (!rp) {
     return;
   }
 
-  // For complete list of Usage Page & Usage checkout src/class/hid/hid.h. For examples:
-  // - Keyboard                     : Desktop, Keyboard
-  // - Mouse                        : Desktop, Mouse
-  // - Gamepad                      : Desktop, Gamepad
-  // - Consumer Control (Media Key) : Consumer, Consumer Control
-  // - System Control (Power key)   : Desktop, System Control
-  // - Generic (vendor)             : 0xFFxx, xx
-  if (rpt_info->usage_page == HID_USAGE_PAGE_DESKTOP) {
-    switch (rpt_info->usage) {
-      case HID_USAGE_DESKTOP_KEYBOARD:
-        // TU_LOG1("HID receive keyboard report\r\n");
-        // Assume keyboard follow boot report layout
-        translate_boot_kbd_report((hid_keyboard_report_t*) report);
-        break;
-
-      case HID_USAGE_DESKTOP_MOUSE:
-        // TU_LOG1("HID receive mouse report\r\n");
-        // Assume mouse follow boot report layout
-        translate_boot_mouse_report((hid_mouse_report_t*) report);
-        break;
-
-      default:
-        break;
+  switch (rp->kind) {
+    case HidReportKeyboard: {
+      if (rp->kbd.bitmap.bit_size) {
+        // NKRO: every key, no 6 key limit
+        uint32_t keys[NKRO_WORDS];
+        hid_plan_keyboard_bits(rp, report, len, keys);
+        translate_nkro_kbd_report(keys);
+      } else {
+        hid_keyboard_report_t kbd = { 0 };
+        hid_plan_keyboard(rp, report, len, &kbd.modifier, kbd.keycode);
+        translate_boot_kbd_report(&kbd);
+      }
+      note_key_report(instance, report, len);
+      break;
     }
+
+    case HidReportMouse: {
+      HidMouseValues m;
+      hid_plan_mouse(rp, report, len, &m);
+      translate_mouse_report(m.buttons, m.dx, m.dy, m.wheel);
+      break;
+    }
+
+    default:
+      break;
   }
 }
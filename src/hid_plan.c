@@ -0,0 +1,465 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "hid_plan.h"
+
+// item types and tags, HID 1.11 section 6.2.2
+#define ITEM_MAIN   0
+#define ITEM_GLOBAL 1
+#define ITEM_LOCAL  2
+
+#define MAIN_INPUT          0x8
+#define MAIN_OUTPUT         0x9
+#define MAIN_COLLECTION     0xA
+#define MAIN_END_COLLECTION 0xC
+
+#define GLOBAL_USAGE_PAGE   0x0
+#define GLOBAL_LOGICAL_MIN  0x1
+#define GLOBAL_LOGICAL_MAX  0x2
+#define GLOBAL_REPORT_SIZE  0x7
+#define GLOBAL_REPORT_ID    0x8
+#define GLOBAL_REPORT_COUNT 0x9
+#define GLOBAL_PUSH         0xA
+#define GLOBAL_POP          0xB
+
+#define LOCAL_USAGE         0x0
+#define LOCAL_USAGE_MIN     0x1
+#define LOCAL_USAGE_MAX     0x2
+
+#define INPUT_CONSTANT  0x01
+#define INPUT_VARIABLE  0x02
+#define INPUT_RELATIVE  0x04
+
+#define COLLECTION_APPLICATION 0x01
+
+// usages, as (page << 16) | id
+#define PAGE_DESKTOP    0x01
+#define PAGE_KEYBOARD   0x07
+#define PAGE_LED        0x08
+#define PAGE_BUTTON     0x09
+#define PAGE_CONSUMER   0x0C
+
+#define USAGE_DESKTOP_MOUSE     0x00010002
+#define USAGE_DESKTOP_KEYBOARD  0x00010006
+#define USAGE_DESKTOP_KEYPAD    0x00010007
+#define USAGE_DESKTOP_X         0x00010030
+#define USAGE_DESKTOP_Y         0x00010031
+#define USAGE_DESKTOP_WHEEL     0x00010038
+#define USAGE_CONSUMER_AC_PAN   0x000C0238
+
+#define KEY_LEFT_CONTROL 0xE0
+
+#define MAX_USAGES 16
+#define MAX_GLOBAL_STACK 4
+#define MAX_COLLECTION_DEPTH 8
+
+typedef struct {
+    uint16_t usage_page;
+    int32_t logical_min;
+    int32_t logical_max;
+    uint32_t report_size;
+    uint32_t report_count;
+    uint8_t report_id;
+} GlobalState;
+
+typedef struct {
+    uint32_t usages[MAX_USAGES];
+    uint8_t usage_count;
+    uint32_t usage_min;
+    uint32_t usage_max;
+    bool has_min;
+    bool has_max;
+} LocalState;
+
+static uint32_t
+item_unsigned(const uint8_t *p, uint8_t size)
+{
+    switch (size) {
+    case 1: return p[0];
+    case 2: return p[0] | (p[1] << 8);
+    case 4: return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    default: return 0;
+    }
+}
+
+static int32_t
+item_signed(const uint8_t *p, uint8_t size)
+{
+    switch (size) {
+    case 1: return (int8_t) p[0];
+    case 2: return (int16_t) (p[0] | (p[1] << 8));
+    case 4: return (int32_t) item_unsigned(p, 4);
+    default: return 0;
+    }
+}
+
+static uint32_t
+local_usage(const LocalState *local, uint32_t i)
+{
+    if (local->has_min && local->has_max) {
+        uint32_t u = local->usage_min + i;
+        return u > local->usage_max ? local->usage_max : u;
+    }
+    if (local->usage_count == 0)
+        return 0;
+    return local->usages[i < local->usage_count ? i : local->usage_count - 1];
+}
+
+static HidField
+make_field(uint32_t bit_offset, uint32_t bit_size, bool is_signed)
+{
+    HidField f = { 0 };
+    // bigger than anything we care about, or past what we track
+    if (bit_size == 0 || bit_size > 32 || bit_offset + bit_size > 0xffff)
+        return f;
+    f.bit_offset = bit_offset;
+    f.bit_size = bit_size;
+    f.is_signed = is_signed;
+    return f;
+}
+
+static void
+add_keyboard_input(HidKeyboardPlan *kbd, const GlobalState *g, const LocalState *l, uint8_t flags, uint32_t offset)
+{
+    bool has_usages = l->usage_count || l->has_min;
+    uint32_t first = has_usages ? local_usage(l, 0) : (uint32_t) g->usage_page << 16;
+    if ((first >> 16) != PAGE_KEYBOARD)
+        return;
+    first &= 0xffff;
+
+    if (!(flags & INPUT_VARIABLE)) {
+        // the usual 6 byte keycode array
+        if (!kbd->keys.bit_size && g->report_size <= 8) {
+            kbd->keys = make_field(offset, g->report_size, false);
+            kbd->key_count = g->report_count;
+        }
+    } else if (g->report_size == 1) {
+        if (first == KEY_LEFT_CONTROL && g->report_count <= 8 && !kbd->modifiers.bit_size) {
+            kbd->modifiers = make_field(offset, g->report_count, false);
+        } else if (!kbd->bitmap.bit_size && first + g->report_count <= 256) {
+            // bit_size of a bitmap is just "present"; its length is bitmap_count
+            kbd->bitmap = make_field(offset, 1, false);
+            kbd->bitmap_first = first;
+            kbd->bitmap_count = g->report_count;
+        }
+    }
+}
+
+static void
+add_mouse_input(HidMousePlan *mouse, const GlobalState *g, const LocalState *l, uint8_t flags, uint32_t offset)
+{
+    if (!(flags & INPUT_VARIABLE))
+        return;
+
+    bool is_signed = g->logical_min < 0;
+
+    for (uint32_t i = 0; i < g->report_count; i++) {
+        uint32_t usage = local_usage(l, i);
+        uint32_t at = offset + i * g->report_size;
+
+        if ((usage >> 16) == PAGE_BUTTON) {
+            // all the buttons as one field, starting at the first one
+            if (!mouse->buttons.bit_size && g->report_size == 1) {
+                uint32_t count = g->report_count - i;
+                mouse->buttons = make_field(at, count > 16 ? 16 : count, false);
+            }
+            break;
+        }
+
+        // absolute X/Y would be a tablet or touchscreen, not motion
+        if (!(flags & INPUT_RELATIVE))
+            continue;
+
+        HidField *f = NULL;
+        switch (usage) {
+        case USAGE_DESKTOP_X: f = &mouse->x; break;
+        case USAGE_DESKTOP_Y: f = &mouse->y; break;
+        case USAGE_DESKTOP_WHEEL: f = &mouse->wheel; break;
+        case USAGE_CONSUMER_AC_PAN: f = &mouse->pan; break;
+        }
+        if (f && !f->bit_size)
+            *f = make_field(at, g->report_size, is_signed);
+    }
+}
+
+uint8_t
+hid_plan_compile(HidDevicePlan *plan, const uint8_t *desc, uint16_t desc_len)
+{
+    GlobalState global = { 0 };
+    GlobalState global_stack[MAX_GLOBAL_STACK];
+    uint8_t global_depth = 0;
+    LocalState local = { 0 };
+
+    // application collection usage for each open collection
+    uint8_t collection_kind[MAX_COLLECTION_DEPTH];
+    uint8_t collection_depth = 0;
+    uint8_t app_kind = HidReportOther;
+
+    // input bits so far in each report
+    uint32_t report_bits[HID_PLAN_MAX_REPORTS] = { 0 };
+
+    memset(plan, 0, sizeof(*plan));
+    memset(plan->by_id, HID_PLAN_NO_REPORT, sizeof(plan->by_id));
+
+    const uint8_t *p = desc;
+    const uint8_t *end = desc + desc_len;
+
+    while (p < end) {
+        uint8_t prefix = *p++;
+
+        if (prefix == 0xFE) {
+            // long item: size, tag, data; nothing we use
+            if (p >= end)
+                break;
+            p += 2 + p[0];
+            continue;
+        }
+
+        uint8_t size = prefix & 0x3;
+        if (size == 3)
+            size = 4;
+        uint8_t type = (prefix >> 2) & 0x3;
+        uint8_t tag = prefix >> 4;
+        if (p + size > end)
+            break;
+        const uint8_t *data = p;
+        p += size;
+
+        uint32_t value = item_unsigned(data, size);
+
+        if (type == ITEM_GLOBAL) {
+            switch (tag) {
+            case GLOBAL_USAGE_PAGE: global.usage_page = value; break;
+            case GLOBAL_LOGICAL_MIN: global.logical_min = item_signed(data, size); break;
+            case GLOBAL_LOGICAL_MAX: global.logical_max = item_signed(data, size); break;
+            case GLOBAL_REPORT_SIZE: global.report_size = value; break;
+            case GLOBAL_REPORT_COUNT: global.report_count = value; break;
+            case GLOBAL_REPORT_ID:
+                global.report_id = value;
+                plan->uses_ids = true;
+                break;
+            case GLOBAL_PUSH:
+                if (global_depth < MAX_GLOBAL_STACK)
+                    global_stack[global_depth++] = global;
+                break;
+            case GLOBAL_POP:
+                if (global_depth > 0)
+                    global = global_stack[--global_depth];
+                break;
+            }
+            continue;
+        }
+
+        if (type == ITEM_LOCAL) {
+            // 4 byte usages carry their own page
+            uint32_t usage = size == 4 ? value : ((uint32_t) global.usage_page << 16) | value;
+            switch (tag) {
+            case LOCAL_USAGE:
+                if (local.usage_count < MAX_USAGES)
+                    local.usages[local.usage_count++] = usage;
+                break;
+            case LOCAL_USAGE_MIN:
+                local.usage_min = usage;
+                local.has_min = true;
+                break;
+            case LOCAL_USAGE_MAX:
+                local.usage_max = usage;
+                local.has_max = true;
+                break;
+            }
+            continue;
+        }
+
+        if (type != ITEM_MAIN)
+            continue;
+
+        if (tag == MAIN_COLLECTION) {
+            if (collection_depth < MAX_COLLECTION_DEPTH)
+                collection_kind[collection_depth] = app_kind;
+            collection_depth++;
+
+            if (value == COLLECTION_APPLICATION) {
+                uint32_t usage = local_usage(&local, 0);
+                if (usage == USAGE_DESKTOP_MOUSE)
+                    app_kind = HidReportMouse;
+                else if (usage == USAGE_DESKTOP_KEYBOARD || usage == USAGE_DESKTOP_KEYPAD)
+                    app_kind = HidReportKeyboard;
+                else
+                    app_kind = HidReportOther;
+            }
+        } else if (tag == MAIN_END_COLLECTION) {
+            if (collection_depth > 0) {
+                collection_depth--;
+                if (collection_depth < MAX_COLLECTION_DEPTH)
+                    app_kind = collection_kind[collection_depth];
+            }
+        } else if (tag == MAIN_OUTPUT) {
+            bool has_usages = local.usage_count || local.has_min;
+            uint32_t usage = has_usages ? local_usage(&local, 0) : (uint32_t) global.usage_page << 16;
+            if (!(value & INPUT_CONSTANT) && (usage >> 16) == PAGE_LED && !plan->has_leds) {
+                plan->has_leds = true;
+                plan->led_report_id = global.report_id;
+            }
+        } else if (tag == MAIN_INPUT) {
+            uint8_t idx = plan->by_id[global.report_id];
+            if (idx == HID_PLAN_NO_REPORT && plan->count < HID_PLAN_MAX_REPORTS) {
+                idx = plan->count++;
+                plan->by_id[global.report_id] = idx;
+                plan->reports[idx].report_id = global.report_id;
+            }
+
+            if (idx != HID_PLAN_NO_REPORT) {
+                HidReportPlan *rp = &plan->reports[idx];
+                uint32_t offset = report_bits[idx];
+                report_bits[idx] += global.report_size * global.report_count;
+
+                if (rp->kind == HidReportOther)
+                    rp->kind = app_kind;
+
+                if (!(value & INPUT_CONSTANT) && rp->kind == app_kind) {
+                    if (rp->kind == HidReportKeyboard)
+                        add_keyboard_input(&rp->kbd, &global, &local, value, offset);
+                    else if (rp->kind == HidReportMouse)
+                        add_mouse_input(&rp->mouse, &global, &local, value, offset);
+                }
+            }
+        }
+
+        // every main item ends the local state
+        memset(&local, 0, sizeof(local));
+    }
+
+    for (uint8_t i = 0; i < plan->count; i++)
+        plan->reports[i].length = (report_bits[i] + 7) / 8;
+
+    return plan->count;
+}
+
+const HidReportPlan *
+hid_plan_lookup(const HidDevicePlan *plan, const uint8_t **report, uint16_t *len)
+{
+    uint8_t id = 0;
+
+    if (plan->uses_ids) {
+        if (*len < 1)
+            return NULL;
+        id = (*report)[0];
+        (*report)++;
+        (*len)--;
+    }
+
+    uint8_t idx = plan->by_id[id];
+    return idx == HID_PLAN_NO_REPORT ? NULL : &plan->reports[idx];
+}
+
+int32_t
+hid_plan_read(const HidField *f, const uint8_t *data, uint16_t len)
+{
+    uint32_t size = f->bit_size;
+    if (!size)
+        return 0;
+
+    uint32_t byte = f->bit_offset >> 3;
+    uint32_t shift = f->bit_offset & 7;
+    uint32_t nbytes = (shift + size + 7) >> 3;
+    if (byte + nbytes > len)
+        return 0;
+
+    uint32_t v;
+    if (shift == 0 && size == 8) {
+        v = data[byte];
+    } else if (shift == 0 && size == 16) {
+        v = data[byte] | (data[byte + 1] << 8);
+    } else {
+        uint64_t w = 0;
+        for (uint32_t i = 0; i < nbytes; i++)
+            w |= (uint64_t) data[byte + i] << (8 * i);
+        v = (uint32_t) (w >> shift);
+    }
+
+    if (size < 32) {
+        uint32_t mask = (1u << size) - 1;
+        v &= mask;
+        if (f->is_signed && (v >> (size - 1)))
+            v |= ~mask;
+    }
+    return (int32_t) v;
+}
+
+void
+hid_plan_mouse(const HidReportPlan *rp, const uint8_t *data, uint16_t len, HidMouseValues *out)
+{
+    const HidMousePlan *m = &rp->mouse;
+    out->buttons = hid_plan_read(&m->buttons, data, len);
+    out->dx = hid_plan_read(&m->x, data, len);
+    out->dy = hid_plan_read(&m->y, data, len);
+    out->wheel = hid_plan_read(&m->wheel, data, len);
+    out->pan = hid_plan_read(&m->pan, data, len);
+}
+
+void
+hid_plan_keyboard(const HidReportPlan *rp, const uint8_t *data, uint16_t len,
+                  uint8_t *modifier, uint8_t keycode[6])
+{
+    const HidKeyboardPlan *k = &rp->kbd;
+    uint8_t n = 0;
+
+    *modifier = hid_plan_read(&k->modifiers, data, len);
+    memset(keycode, 0, 6);
+
+    for (uint8_t i = 0; i < k->key_count && n < 6; i++) {
+        HidField slot = k->keys;
+        slot.bit_offset += i * k->keys.bit_size;
+        uint8_t code = hid_plan_read(&slot, data, len);
+        if (code)
+            keycode[n++] = code;
+    }
+
+    if (k->bitmap.bit_size) {
+        for (uint16_t i = 0; i < k->bitmap_count; i++) {
+            uint32_t bit = k->bitmap.bit_offset + i;
+            if ((bit >> 3) >= len)
+                break;
+            if (!(data[bit >> 3] & (1 << (bit & 7))))
+                continue;
+            uint8_t usage = k->bitmap_first + i;
+            if (usage >= KEY_LEFT_CONTROL)
+                *modifier |= 1 << (usage - KEY_LEFT_CONTROL);
+            else if (n < 6)
+                keycode[n++] = usage;
+        }
+    }
+}
+
+void
+hid_plan_keyboard_bits(const HidReportPlan *rp, const uint8_t *data, uint16_t len, uint32_t keys[8])
+{
+    const HidKeyboardPlan *k = &rp->kbd;
+
+    memset(keys, 0, 8 * sizeof(uint32_t));
+    keys[KEY_LEFT_CONTROL / 32] = hid_plan_read(&k->modifiers, data, len);
+
+    for (uint8_t i = 0; i < k->key_count; i++) {
+        HidField slot = k->keys;
+        slot.bit_offset += i * k->keys.bit_size;
+        uint8_t code = hid_plan_read(&slot, data, len);
+        keys[code >> 5] |= 1u << (code & 31);
+    }
+
+    // a word at a time, shifted from the report's bit position to the usage's
+    for (uint16_t i = 0; k->bitmap.bit_size && i < k->bitmap_count; i += 32) {
+        uint16_t n = k->bitmap_count - i;
+        HidField chunk = { k->bitmap.bit_offset + i, n > 32 ? 32 : n, 0 };
+        uint32_t v = hid_plan_read(&chunk, data, len);
+        uint32_t usage = k->bitmap_first + i;
+        uint32_t shift = usage & 31;
+        keys[usage >> 5] |= v << shift;
+        if (shift && (usage >> 5) < 7)
+            keys[(usage >> 5) + 1] |= v >> (32 - shift);
+    }
+}
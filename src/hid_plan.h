@@ -0,0 +1,101 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * HID report descriptors, compiled once at mount time into a small plan
+ * per input report ID: where the keyboard and mouse fields sit in the
+ * report (bit offset, size, signedness), so each incoming report is read
+ * with a handful of shifts instead of assuming the boot layout. Also
+ * which output report carries a keyboard's LEDs.
+ */
+
+#ifndef HID_PLAN_H_
+#define HID_PLAN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HID_PLAN_MAX_REPORTS 8
+#define HID_PLAN_NO_REPORT 0xff
+
+typedef struct {
+    uint16_t bit_offset;    // from the start of the report data, after any report ID byte
+    uint8_t bit_size;       // 0 if the report doesn't have this field
+    uint8_t is_signed;
+} HidField;
+
+typedef enum {
+    HidReportOther = 0,
+    HidReportKeyboard,
+    HidReportMouse,
+} HidReportKind;
+
+typedef struct {
+    HidField modifiers;     // 8 x 1 bit, usages 0xE0-0xE7
+    HidField keys;          // first slot of the keycode array
+    uint8_t key_count;
+    HidField bitmap;        // 1 bit per key, for NKRO keyboards
+    uint8_t bitmap_first;   // usage of the first bitmap bit
+    uint16_t bitmap_count;
+} HidKeyboardPlan;
+
+typedef struct {
+    HidField buttons;       // 1 bit per button, button 1 first
+    HidField x;
+    HidField y;
+    HidField wheel;
+    HidField pan;
+} HidMousePlan;
+
+typedef struct {
+    uint8_t report_id;      // 0 if the device doesn't use report IDs
+    uint8_t kind;           // HidReportKind
+    uint16_t length;        // bytes, not counting the report ID
+    union {
+        HidKeyboardPlan kbd;
+        HidMousePlan mouse;
+    };
+} HidReportPlan;
+
+typedef struct {
+    uint8_t count;
+    bool uses_ids;
+    // the output report with the LED usages, if the descriptor has one
+    bool has_leds;
+    uint8_t led_report_id;
+    // report ID -> index into reports[], HID_PLAN_NO_REPORT if we have no plan
+    uint8_t by_id[256];
+    HidReportPlan reports[HID_PLAN_MAX_REPORTS];
+} HidDevicePlan;
+
+typedef struct {
+    uint16_t buttons;
+    int32_t dx;
+    int32_t dy;
+    int32_t wheel;
+    int32_t pan;
+} HidMouseValues;
+
+// Returns the number of input reports found.
+uint8_t hid_plan_compile(HidDevicePlan *plan, const uint8_t *desc, uint16_t desc_len);
+
+// Finds the plan for a report as received, and moves report/len past the
+// report ID byte if there is one. NULL if there's no plan for it.
+const HidReportPlan *hid_plan_lookup(const HidDevicePlan *plan, const uint8_t **report, uint16_t *len);
+
+// Fields that are missing, or fall outside len, read as 0.
+int32_t hid_plan_read(const HidField *f, const uint8_t *data, uint16_t len);
+
+void hid_plan_mouse(const HidReportPlan *rp, const uint8_t *data, uint16_t len, HidMouseValues *out);
+
+// Fills a boot-style report from any keyboard layout. Bitmap keyboards
+// report their first six keys.
+void hid_plan_keyboard(const HidReportPlan *rp, const uint8_t *data, uint16_t len,
+                       uint8_t *modifier, uint8_t keycode[6]);
+
+// Fills a 256 bit map of every key down, one bit per usage (modifiers at
+// 0xE0-0xE7), from any keyboard layout, with no rollover limit.
+void hid_plan_keyboard_bits(const HidReportPlan *rp, const uint8_t *data, uint16_t len, uint32_t keys[8]);
+
+#endif
@@ -0,0 +1,287 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include <pico/stdlib.h>
+#include <tusb.h>
+#include <pio_usb.h>
+#include <pio_usb_ll.h>
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "poll"
+
+#include "babelfish.h"
+#include "hid_poll.h"
+
+// device addresses TinyUSB hands out, hubs included
+#define MAX_DEV_ADDR 8
+
+#define REPORT_COPY_SIZE CFG_TUH_HID_EPIN_BUFSIZE
+
+typedef struct {
+    uint8_t dev_addr;
+    uint32_t last_us;
+    uint16_t last_len;
+    uint8_t last[REPORT_COPY_SIZE];
+    HidPollStats stats;
+} InstanceState;
+
+static InstanceState s_instances[CFG_TUH_HID];
+static uint32_t s_stats_start_us;
+
+// ms per device address, 0 for the advertised interval; s_default_ms for
+// anything not set explicitly
+static uint8_t s_device_ms[MAX_DEV_ADDR];
+static bool s_device_set[MAX_DEV_ADDR];
+static uint8_t s_default_ms = HID_POLL_DEFAULT_MS;
+static volatile bool s_apply_requested = false;
+
+// bInterval of each endpoint in Pico-PIO-USB's pool, saved before we first
+// change it; s_pool_addr says which device it was saved for
+static uint8_t s_pool_advertised[PIO_USB_EP_POOL_CNT];
+static uint8_t s_pool_addr[PIO_USB_EP_POOL_CNT];
+
+// Pico-PIO-USB has no API for an endpoint's polling interval, so this
+// reaches into its endpoint pool: endpoint_t in pio_usb_ll.h, of the
+// Pico-PIO-USB that TinyUSB's tinyusb_pico_pio_usb builds. Nothing else
+// here touches its internals. If a Pico SDK update changes the fields
+// used, the build stops here rather than writing the wrong bytes.
+#define EP_FIELD_IS(field, type) __builtin_types_compatible_p(__typeof__(((endpoint_t *) 0)->field), type)
+_Static_assert(EP_FIELD_IS(dev_addr, uint8_t) && EP_FIELD_IS(ep_num, uint8_t) && EP_FIELD_IS(size, uint16_t) &&
+               EP_FIELD_IS(interval, uint8_t) && EP_FIELD_IS(interval_counter, uint8_t),
+               "Pico-PIO-USB's endpoint_t has changed; check the ep_pool accessors in hid_poll.c");
+
+static endpoint_t *
+ep_pool_at(int i)
+{
+    return &pio_usb_ep_pool[i];
+}
+
+static uint8_t
+ep_interval(const endpoint_t *ep)
+{
+    return ep->interval;
+}
+
+// takes effect from the endpoint's next frame
+static void
+ep_set_interval(endpoint_t *ep, uint8_t interval)
+{
+    ep->interval = interval;
+    ep->interval_counter = 0;
+}
+
+static bool
+is_hid_device(uint8_t dev_addr)
+{
+    for (int i = 0; i < CFG_TUH_HID; i++) {
+        if (s_instances[i].dev_addr == dev_addr)
+            return true;
+    }
+    return false;
+}
+
+static bool
+is_interrupt_in(const endpoint_t *ep, uint8_t dev_addr)
+{
+    return ep->size != 0 && ep->dev_addr == dev_addr && (ep->ep_num & 0x80) && (ep->ep_num & 0x7f) != 0;
+}
+
+static uint8_t
+requested_ms(uint8_t dev_addr)
+{
+    if (dev_addr < MAX_DEV_ADDR && s_device_set[dev_addr])
+        return s_device_ms[dev_addr];
+
+    // low speed interrupt endpoints are only guaranteed to cope with 10 ms
+    // and up, so they keep what they ask for unless set per device
+    if (tuh_speed_get(dev_addr) != TUSB_SPEED_FULL)
+        return 0;
+
+    return s_default_ms;
+}
+
+// Recomputes every HID endpoint's interval. The budget is shared evenly:
+// with more overridden endpoints than polls per frame, none of them goes
+// below the interval that keeps the total within it.
+static void
+apply_intervals(void)
+{
+    uint8_t overridden = 0;
+
+    for (int i = 0; i < PIO_USB_EP_POOL_CNT; i++) {
+        endpoint_t *ep = ep_pool_at(i);
+        if (!is_interrupt_in(ep, ep->dev_addr) || !is_hid_device(ep->dev_addr))
+            continue;
+        if (s_pool_addr[i] != ep->dev_addr) {
+            s_pool_addr[i] = ep->dev_addr;
+            s_pool_advertised[i] = ep_interval(ep);
+        }
+        if (requested_ms(ep->dev_addr))
+            overridden++;
+    }
+
+    uint8_t floor_ms = (overridden + HID_POLL_BUDGET_PER_FRAME - 1) / HID_POLL_BUDGET_PER_FRAME;
+    if (floor_ms < 1)
+        floor_ms = 1;
+
+    for (int i = 0; i < PIO_USB_EP_POOL_CNT; i++) {
+        endpoint_t *ep = ep_pool_at(i);
+        if (ep->size == 0 || s_pool_addr[i] != ep->dev_addr || !is_hid_device(ep->dev_addr))
+            continue;
+
+        uint8_t advertised = s_pool_advertised[i];
+        uint8_t ms = requested_ms(ep->dev_addr);
+        uint8_t interval = advertised;
+        if (ms) {
+            if (ms < floor_ms)
+                ms = floor_ms;
+            // never slower than the device asked for
+            if (ms < advertised)
+                interval = ms;
+        }
+
+        if (ep_interval(ep) != interval) {
+            DBG("%d ep %02x: polling every %u ms (advertised %u)\n", ep->dev_addr, ep->ep_num, interval, advertised);
+            ep_set_interval(ep, interval);
+        }
+    }
+
+    for (int i = 0; i < CFG_TUH_HID; i++) {
+        InstanceState *st = &s_instances[i];
+        if (!st->dev_addr)
+            continue;
+        for (int p = 0; p < PIO_USB_EP_POOL_CNT; p++) {
+            endpoint_t *ep = ep_pool_at(p);
+            if (s_pool_addr[p] == st->dev_addr && is_interrupt_in(ep, st->dev_addr)) {
+                st->stats.advertised_ms = s_pool_advertised[p];
+                st->stats.interval_ms = ep_interval(ep);
+                break;
+            }
+        }
+    }
+}
+
+void
+hid_poll_mount(uint8_t dev_addr, uint8_t instance)
+{
+    if (instance >= CFG_TUH_HID)
+        return;
+
+    InstanceState *st = &s_instances[instance];
+    memset(st, 0, sizeof(*st));
+    st->dev_addr = dev_addr;
+    st->stats.dev_addr = dev_addr;
+    st->stats.min_gap_us = UINT32_MAX;
+    apply_intervals();
+}
+
+void
+hid_poll_umount(uint8_t dev_addr, uint8_t instance)
+{
+    if (instance >= CFG_TUH_HID)
+        return;
+
+    s_instances[instance].dev_addr = 0;
+    s_instances[instance].stats.dev_addr = 0;
+
+    if (!is_hid_device(dev_addr)) {
+        for (int i = 0; i < PIO_USB_EP_POOL_CNT; i++) {
+            if (s_pool_addr[i] == dev_addr)
+                s_pool_addr[i] = 0;
+        }
+        if (dev_addr < MAX_DEV_ADDR)
+            s_device_set[dev_addr] = false;
+        // the endpoints that are left may have more of the budget now
+        apply_intervals();
+    }
+}
+
+void
+hid_poll_report(uint8_t instance, const uint8_t *report, uint16_t len)
+{
+    if (instance >= CFG_TUH_HID)
+        return;
+
+    InstanceState *st = &s_instances[instance];
+    uint32_t now = time_us_32();
+
+    if (st->stats.reports) {
+        uint32_t gap = now - st->last_us;
+        if (gap < st->stats.min_gap_us)
+            st->stats.min_gap_us = gap;
+    }
+    st->last_us = now;
+    st->stats.reports++;
+
+    if (len > REPORT_COPY_SIZE)
+        len = REPORT_COPY_SIZE;
+    if (len == st->last_len && !memcmp(report, st->last, len))
+        st->stats.repeats++;
+    memcpy(st->last, report, len);
+    st->last_len = len;
+}
+
+void
+hid_poll_decoded(uint8_t instance, uint32_t rearm_us)
+{
+    if (instance >= CFG_TUH_HID)
+        return;
+
+    uint32_t us = time_us_32() - rearm_us;
+    if (us > s_instances[instance].stats.max_decode_us)
+        s_instances[instance].stats.max_decode_us = us;
+}
+
+void
+hid_poll_task(void)
+{
+    if (!s_apply_requested)
+        return;
+
+    s_apply_requested = false;
+    apply_intervals();
+}
+
+void
+hid_poll_set_interval(uint8_t dev_addr, uint8_t ms)
+{
+    if (dev_addr == 0) {
+        s_default_ms = ms;
+        memset(s_device_set, 0, sizeof(s_device_set));
+    } else if (dev_addr < MAX_DEV_ADDR) {
+        s_device_ms[dev_addr] = ms;
+        s_device_set[dev_addr] = true;
+    }
+    s_apply_requested = true;
+}
+
+bool
+hid_poll_get_stats(uint8_t instance, HidPollStats *stats)
+{
+    if (instance >= CFG_TUH_HID)
+        return false;
+
+    *stats = s_instances[instance].stats;
+    stats->elapsed_us = time_us_32() - s_stats_start_us;
+    if (stats->min_gap_us == UINT32_MAX)
+        stats->min_gap_us = 0;
+    return true;
+}
+
+void
+hid_poll_reset_stats(void)
+{
+    for (int i = 0; i < CFG_TUH_HID; i++) {
+        HidPollStats *s = &s_instances[i].stats;
+        s->reports = 0;
+        s->repeats = 0;
+        s->min_gap_us = UINT32_MAX;
+        s->max_decode_us = 0;
+    }
+    s_stats_start_us = time_us_32();
+}
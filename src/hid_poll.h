@@ -0,0 +1,61 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Interrupt IN polling for HID devices. Pico-PIO-USB polls each endpoint at
+ * the bInterval the device advertises, and plenty of keyboards ask for 8 or
+ * 10 ms. A full speed endpoint may be polled more often than it asks, so we
+ * shorten the interval (default 1 ms), within a budget of polls per frame so
+ * a hub full of devices doesn't eat core1.
+ *
+ * Also counts reports per interface, for comparing the effective report
+ * rate with and without the override.
+ */
+
+#ifndef HID_POLL_H_
+#define HID_POLL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// interrupt IN polls per 1 ms frame we're willing to spend on HID
+// endpoints, across every device
+#define HID_POLL_BUDGET_PER_FRAME 4
+
+// what full speed devices get unless told otherwise; 0 leaves them alone
+#define HID_POLL_DEFAULT_MS 1
+
+typedef struct {
+    uint8_t dev_addr;           // 0 if nothing is mounted on this instance
+    uint8_t advertised_ms;      // bInterval, for the first IN endpoint of the device
+    uint8_t interval_ms;        // what it's being polled at now
+    uint32_t reports;
+    // identical to the previous report: a device repeating at its idle
+    // rate because it ignored SET_IDLE(0)
+    uint32_t repeats;
+    uint32_t min_gap_us;
+    // re-arming the endpoint to the end of decoding and enqueueing: how
+    // long the next report has to land without waiting on us
+    uint32_t max_decode_us;
+    uint32_t elapsed_us;        // since the stats were last reset
+} HidPollStats;
+
+// Core1, from the HID callbacks.
+void hid_poll_mount(uint8_t dev_addr, uint8_t instance);
+void hid_poll_umount(uint8_t dev_addr, uint8_t instance);
+void hid_poll_report(uint8_t instance, const uint8_t *report, uint16_t len);
+void hid_poll_decoded(uint8_t instance, uint32_t rearm_us);
+
+// Core1, next to tuh_task(); applies override changes.
+void hid_poll_task(void);
+
+// Any core. dev_addr 0 sets the default for every device and drops
+// per-device settings; ms 0 goes back to the advertised interval.
+void hid_poll_set_interval(uint8_t dev_addr, uint8_t ms);
+
+// false if instance is out of range
+bool hid_poll_get_stats(uint8_t instance, HidPollStats *stats);
+void hid_poll_reset_stats(void);
+
+#endif
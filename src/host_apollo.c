@@ -1,6 +1,9 @@
+#include <string.h>
+
 #include <pico/stdlib.h>
 #include <hardware/uart.h>
 #include <hardware/irq.h>
+#include <hardware/sync.h>
 #include <tusb.h>
 
 #include "hid_codes.h"
@@ -9,22 +12,19 @@
 #define DEBUG_TAG "apollo"
 
 #include "babelfish.h"
-
-/**********************
-
-From reading domain_os disassembly, the host to keyboard protocol looks like this:
-
-- Commands start with 0xff.
-- Bytes are read after 0xff until a valid command is received.
-- It is immediately processed.
-- 0x00 outside of preceiding 0xff is ignored.
-
-***********************/
+#include "chan_uart.h"
+#include "apollo_cmd.h"
+#include "mouse_shaper.h"
+#include "mouse_sched.h"
 
 #define UART_KEYBOARD_NUM 0
 #define UART_KEYBOARD uart0
 #define UART_KEYBOARD_IRQ UART0_IRQ
 
+// idle line before each byte of a kbd_tx_str() reply; unclear if the OS
+// can actually handle a true 1200 baud stream
+#define KBD_TX_STR_GAP_US 1000
+
 typedef enum {
     Mode0_Compatibility = 0,
     Mode1_Keystate = 1,
@@ -34,20 +34,22 @@ typedef enum {
 
 static void kbd_xmit_3(char a, char b, char c);
 static void on_keyboard_rx();
+// host commands; the handlers are further down
+static ApolloCmd s_cmd;
+static const ApolloCmdHandler s_cmd_handlers[ApolloCmdCount];
 static void set_mode(KeyboardMode mode);
+static void mouse_sched_setup();
 
 void apollo_init() {
 	// Apollo expects 5V serial, not RS-232 voltages.
 	channel_config(0, ChannelModeLevelShifter | ChannelModeUART);
 
-	uart_init(UART_KEYBOARD, 1200);
-	uart_set_hw_flow(UART_KEYBOARD, false, false);
-	uart_set_format(UART_KEYBOARD, 8, 1, UART_PARITY_EVEN);
 
-	irq_set_exclusive_handler(UART_KEYBOARD_IRQ, on_keyboard_rx);
-	irq_set_enabled(UART_KEYBOARD_IRQ, true);
-
-	uart_set_irq_enables(UART_KEYBOARD, true, false);
+	apollo_cmd_init(&s_cmd, s_cmd_handlers);
+	chan_uart_init(UART_KEYBOARD_NUM, on_keyboard_rx);
+	chan_uart_set_format(UART_KEYBOARD_NUM, 1200, 8, 1, UART_PARITY_EVEN);
+	chan_uart_set_pacing(UART_KEYBOARD_NUM, chan_uart_frame_us(UART_KEYBOARD_NUM), KBD_TX_STR_GAP_US);
+	mouse_sched_setup();
 
 	//sleep_ms(10);
 
@@ -79,7 +81,24 @@ typedef enum {
     StateMax
 } KeyState;
 
-static KeyboardMode kbd_mode = Mode0_Compatibility;
+static volatile KeyboardMode kbd_mode = Mode0_Compatibility;
+
+// The keyboard and mouse share the line. Keys are reported in kbd_mode,
+// mouse packets only in relative cursor mode, and 0xff <mode> switches
+// between them; line_mode is what the host was last told. Keys go out as
+// they come, switching back first if needed. Mouse motion accumulates and
+// is only sent once the line has next to nothing queued, so a key never
+// waits behind more than one packet. The line stays in cursor mode while
+// the mouse keeps moving, rather than switching back after every packet.
+// Host commands change both from the RX interrupt, so the mainloop makes a
+// switch and what follows it with interrupts off.
+static volatile KeyboardMode line_mode = Mode0_Compatibility;
+
+// After a key, motion waits this long before taking the line back to
+// cursor mode, so a key's release (or the next key of a word) doesn't pay
+// for two more switches.
+#define KEY_WINDOW_HOLD_MS 50
+static uint32_t last_key_ms = 0;
 
 // defined at end of file
 // [2] = 0 or gui
@@ -88,12 +107,24 @@ static KeyboardMode kbd_mode = Mode0_Compatibility;
 static uint16_t s_code_table[2][256][StateMax];
 
 static void kbd_xmit_uart(char c) {
-	uart_putc_raw(UART_KEYBOARD, c);
+	chan_uart_putc(UART_KEYBOARD_NUM, c);
+}
+
+// multi-byte sequences go into the ring in one piece
+static void kbd_xmit_uart_n(const uint8_t *buf, uint16_t len) {
+	chan_uart_write(UART_KEYBOARD_NUM, buf, len);
 }
 
+static void kbd_xmit_2(char a, char b);
+static void line_mode_xmit(KeyboardMode mode);
+
 static void kbd_xmit_key(char c) {
 	DBG_VV("xmit for key %02x\n", c);
+	uint32_t ints = save_and_disable_interrupts();
+	line_mode_xmit(kbd_mode);
 	kbd_xmit_uart(c);
+	restore_interrupts(ints);
+	last_key_ms = to_ms_since_boot(get_absolute_time());
 }
 
 static void kbd_xmit(char c) {
@@ -101,29 +132,30 @@ static void kbd_xmit(char c) {
 	kbd_xmit_uart(c);
 }
 
+// Paced by an alarm rather than waiting here, since this runs from the
+// RX interrupt.
 static void kbd_tx_str(const char *str) {
 	DBG_VV("xmit str '%s'\n", str);
-	while (*str) {
-		kbd_xmit_uart(*str++);
-		// slow this down, unclear if the OS can actually handle a true 1200 baud stream
-		busy_wait_ms(1);
-	}
+	chan_uart_write_paced(UART_KEYBOARD_NUM, (const uint8_t *) str, strlen(str));
 }
 
 // these are just convenience for logging to avoid spamming
 static void kbd_xmit_2(char a, char b) {
 	DBG_VV("xmit %02x %02x\n", a, b);
-	kbd_xmit_uart(a); kbd_xmit_uart(b);
+	uint8_t buf[] = { a, b };
+	kbd_xmit_uart_n(buf, sizeof(buf));
 }
 
 /*static*/ void kbd_xmit_3(char a, char b, char c) {
 	DBG_VV("xmit %02x %02x %02x\n", a, b, c);
-	kbd_xmit_uart(a); kbd_xmit_uart(b); kbd_xmit_uart(c);
+	uint8_t buf[] = { a, b, c };
+	kbd_xmit_uart_n(buf, sizeof(buf));
 }
 
 static void kbd_xmit_4(char a, char b, char c, char d) {
 	DBG_VV("xmit %02x %02x %02x %02x\n", a, b, c, d);
-	kbd_xmit_uart(a); kbd_xmit_uart(b); kbd_xmit_uart(c); kbd_xmit_uart(d);
+	uint8_t buf[] = { a, b, c, d };
+	kbd_xmit_uart_n(buf, sizeof(buf));
 }
 
 void force_set_mode(KeyboardMode mode) {
@@ -133,9 +165,21 @@ void force_set_mode(KeyboardMode mode) {
 
 static void force_mode_xmit(KeyboardMode mode) {
 	DBG("Setting keyboard mode to %d\n", mode);
-	kbd_xmit(0xff);
-	kbd_xmit((char) mode);
+	uint32_t ints = save_and_disable_interrupts();
+	kbd_xmit_2(0xff, (char) mode);
 	kbd_mode = mode;
+	line_mode = mode;
+	restore_interrupts(ints);
+}
+
+// switches the line without changing the mode keys are reported in; with
+// interrupts off, along with whatever is sent in the new mode
+static void line_mode_xmit(KeyboardMode mode) {
+	if (line_mode != mode) {
+		DBG_VV("line mode %d -> %d\n", line_mode, mode);
+		kbd_xmit_2(0xff, (char) mode);
+		line_mode = mode;
+	}
 }
 
 static void set_mode(KeyboardMode mode) {
@@ -247,52 +291,84 @@ void apollo_kbd_event(const KeyboardEvent event) {
 	kbd_xmit_key(code);
 }
 
-// report mouse at most 1000/200 times per second
-#define MOUSE_RATE_MS 100
-#define SPEED_DIV 2
+// half speed, as SPEED_DIV 2 was, with the mild curve on top; Domain/OS
+// doesn't accelerate
+static const MouseShaperConfig s_mouse_shaping = {
+	.scale_q16 = MOUSE_Q16_ONE / 2,
+	.curve = mouse_curve_mild,
+	.curve_len = MOUSE_CURVE_MILD_LEN,
+	.max_delta = 127,
+};
+
+// still mouse for this long hands the line back to the keyboard's mode, so
+// the next key doesn't pay for the switch
+#define MOUSE_WINDOW_IDLE_MS 250
+
+// A packet is three bytes, 27.5 ms at 1200 8E1. A count or two of motion
+// waits up to 100 ms, as every packet used to; 16 or more goes as fast as
+// the line takes packets. While keys are going, motion gets half the
+// line, and a packet only goes behind a byte of anything else.
+static MouseSchedConfig s_mouse_sched_cfg = {
+	.idle_us = 100000,
+	.fast_counts = 16,
+	.key_share = 50,
+};
 
-static int mouse_cdx = 0;
-static int mouse_cdy = 0;
+static MouseShaper s_mouse = { .cfg = &s_mouse_shaping };
+static MouseSched s_mouse_sched;
 static int mouse_cbtn = 0;
 static int mouse_lbtn = 0;
 static uint32_t mouse_last_report = 0;
 
+// after the channel's format is set
+static void mouse_sched_setup() {
+	s_mouse_sched_cfg.queue_us = chan_uart_frame_us(UART_KEYBOARD_NUM);
+	s_mouse_sched_cfg.packet_us = 3 * s_mouse_sched_cfg.queue_us;
+	mouse_sched_init(&s_mouse_sched, &s_mouse_sched_cfg);
+}
+
 void check_mouse_xmit() {
-	if (mouse_cdx == 0 && mouse_cdy == 0 && mouse_cbtn == mouse_lbtn)
+	uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+
+	if (!mouse_shaper_pending(&s_mouse) && mouse_cbtn == mouse_lbtn) {
+		if (line_mode == Mode2_RelativeCursorControl && kbd_mode != Mode2_RelativeCursorControl &&
+		    now_ms - mouse_last_report >= MOUSE_WINDOW_IDLE_MS && chan_uart_tx_backlog_us(UART_KEYBOARD_NUM) == 0) {
+			uint32_t ints = save_and_disable_interrupts();
+			line_mode_xmit(kbd_mode);
+			restore_interrupts(ints);
+		}
 		return;
+	}
 
 	if (kbd_mode == Mode0_Compatibility)
 		return;
 
-	uint32_t now_ms = to_ms_since_boot(get_absolute_time());
-	if (now_ms - mouse_last_report >= MOUSE_RATE_MS || mouse_cbtn != mouse_lbtn) {
-		set_mode(Mode2_RelativeCursorControl);
-
-		//DBG_V("mouse xmit: cdx %d cdy %d btn %d\n", mouse_cdx, mouse_cdy, mouse_cbtn);
-
-		// slow down
-		int cdx = mouse_cdx / SPEED_DIV;
-		int cdy = mouse_cdy / SPEED_DIV;
+	bool keys = now_ms - last_key_ms < KEY_WINDOW_HOLD_MS;
+	if (line_mode != Mode2_RelativeCursorControl && keys && mouse_cbtn == mouse_lbtn)
+		return;
 
-		// clamp
-		int8_t tdx = cdx > 127 ? 127 : cdx < -127 ? -127 : cdx;
-		int8_t tdy = cdy > 127 ? 127 : cdy < -127 ? -127 : cdy;
+	// keys written since the last packet go first; motion keeps accumulating
+	uint32_t now = time_us_32();
+	if (mouse_sched_due(&s_mouse_sched, now, mouse_shaper_pending_counts(&s_mouse), mouse_cbtn != mouse_lbtn,
+	                    chan_uart_tx_backlog_us(UART_KEYBOARD_NUM), keys)) {
+		// more than a packet's worth goes in the next ones
+		int16_t tdx, tdy;
+		mouse_shaper_take(&s_mouse, &tdx, &tdy);
 
 		DBG_VV("mouse xmit: tdx %d tdy %d\n", tdx, tdy);
 
-		set_mode(Mode2_RelativeCursorControl);
+		uint32_t ints = save_and_disable_interrupts();
+		line_mode_xmit(Mode2_RelativeCursorControl);
 
 		kbd_xmit_3(
 			0xf0 ^ (mouse_cbtn << 4),
 			tdx,
 			-tdy); // apollo Y is inverse
+		restore_interrupts(ints);
 
-		set_mode(Mode1_Keystate);
-
-		mouse_cdx = 0;
-		mouse_cdy = 0;
 		mouse_lbtn = mouse_cbtn;
 		mouse_last_report = now_ms;
+		mouse_sched_sent(&s_mouse_sched, now);
 	}
 }
 
@@ -305,8 +381,7 @@ void apollo_mouse_event(const MouseEvent event) {
 		return;
 	}
 
-	mouse_cdx += event.dx;
-	mouse_cdy += event.dy;
+	mouse_shaper_add(&s_mouse, event.dx, event.dy, time_us_32());
 	mouse_cbtn = event.buttons;
 }
 
@@ -316,128 +391,42 @@ void apollo_mouse_event(const MouseEvent event) {
 // rx: 0x00  -> if loopback, set mode0 (0xff, 0x00), loopback= off
 // rx: 0x11  -> sees data as 0xff11, puts 0x11
 // rx: 0x17  -> does nothing, clears message
+//
+// the PC sends 0xff1004 and then waits forever until
+// it gets a valid reply. 0xff seems to be a reset.
+// after mouse, sometimes the (pc?) sends 0xff10045e 00000000
 
-void on_keyboard_rx() {
-    static uint32_t kbd_cmd = 0;
-    static bool kbd_reading_cmd = false;
-    static int kbd_cmd_bytes = 0;
-	static bool first_irq = true;
-
-    while (uart_is_readable(UART_KEYBOARD)) {
-        uint8_t ch = uart_getc(UART_KEYBOARD);
+static bool cmd_mode(ApolloCmdId id) {
+	force_mode_xmit(id == ApolloCmdMode0 ? Mode0_Compatibility : Mode1_Keystate);
+	return true;
+}
 
-		DBG_VV("recv %02x\n", ch);
+static bool cmd_ident(ApolloCmdId id) {
+	DBG_V("keyboard ident request\n");
 
-        if (!kbd_reading_cmd) {
-			if (ch == 0xff) {
-				///kbd_xmit(0xff); // mame
-                kbd_reading_cmd = true;
-                kbd_cmd = 0;
-                kbd_cmd_bytes = 0;
-			} else if (ch == 0x00) {
-				// 0x00 outside of 0xff sequence -- just ignore
-            } else {
-                DBG("Unknown command start byte: %02x\n", ch);
-            }
-
-			continue;
-        }
-
-		if (kbd_cmd_bytes == 4) {
-			DBG("Too-long keyboard command: currently %08lx, got %02x\n", kbd_cmd, ch);
-			kbd_reading_cmd = false;
-			continue;
-		}
+	//kbd_tx_str("\xff\x12\x21"); // already sent as part of loopback
+	kbd_tx_str("3-@\r2-0\rSD-03863-MS\r"); // english ident
+	//kbd_tx_str("3-A\r2-0\rSD-03863-MS\r"); // german ident
+	return true;
+}
 
-		kbd_cmd = (kbd_cmd << 8) | ch;
-		kbd_cmd_bytes++;
-
-        DBG_V(" command %08lx (%d bytes)\n", kbd_cmd, kbd_cmd_bytes);
-
-        bool cmd_handled = true;
-
-		if (kbd_cmd_bytes == 1) {
-			switch (kbd_cmd) {
-				case 0x00:
-					force_mode_xmit(Mode0_Compatibility);
-					break;
-				
-				case 0x01:
-					force_mode_xmit(Mode1_Keystate);
-					break;
-				
-				default:
-					cmd_handled = false;
-			}
-		} else if (kbd_cmd_bytes == 2) {
-			switch (kbd_cmd) {
-				case 0x1221: // keyboard identification
-					DBG_V("keyboard ident request\n");
-
-					//kbd_tx_str("\xff\x12\x21"); // already sent as part of loopback
-					kbd_tx_str("3-@\r2-0\rSD-03863-MS\r"); // english ident
-					//kbd_tx_str("3-A\r2-0\rSD-03863-MS\r"); // german ident
-
-					//if (kbd_mode == Mode0_Compatibility) {
-					//	force_mode_xmit(Mode0_Compatibility);
-					//} else {
-					//	force_mode_xmit(Mode1_Keystate);
-					//}
-
-					break;
-
-				case 0x2181: // beeper on for 300ms
-				case 0x2182: // beeper off
-					//kbd_xmit(ch);
-				    // we would have echoed all this back, did we want to?
-					break;
-
-				case 0x1116: // unclear?
-				    // we would have echoed back 0xff1116 at this point
-					// mame does _not_ echo the 0x16 back before sending 0x00 0xff 0x00
-					///force_mode_xmit(Mode0_Compatibility);
-					///force_mode_xmit(Mode0_Compatibility);
-					break;
-
-				case 0x1166: // unknown
-					break;
-
-				case 0x1117: // unknown // this shows up at boot?
-					// we would have echoed back an extra 0x17
-					// mame does _not_ echo the 0x17 back
-					break;
-				
-				//case 0x1004: // maybe mouse enable?
-					//kbd_xmit(0xff);
-					//kbd_xmit(0x5e);
-					//break;
-
-				default:
-					cmd_handled = false;
-			}
-		} else if (kbd_cmd_bytes == 3) {
-			switch (kbd_cmd) {
-				case 0x10045e: // copilot thinks this is "mouse enable"?
-					break;
-
-				default:
-					cmd_handled = false;
-			}
-		} else {
-			cmd_handled = false;
-		}
+// The beeper commands would have been echoed back, and mame doesn't echo
+// the 0x16 or 0x17 of the 11xx ones; all of them are just accepted.
+static const ApolloCmdHandler s_cmd_handlers[ApolloCmdCount] = {
+	[ApolloCmdMode0] = cmd_mode,
+	[ApolloCmdMode1] = cmd_mode,
+	[ApolloCmdIdent] = cmd_ident,
+};
 
-		// the PC sends 0xff1004 and then waits forever until
-		// it gets a valid reply. 0xff seems to be a reset.
-		// after mouse, sometimes the (pc?) sends 0xff10045e 00000000
+void on_keyboard_rx() {
+	while (chan_uart_is_readable(UART_KEYBOARD_NUM)) {
+		uint8_t ch = chan_uart_getc(UART_KEYBOARD_NUM);
+		uint32_t now = time_us_32();
+		boot_mark(BootHostRx);
 
-		if (cmd_handled) {
-			DBG_V(" command handled\n");
-			kbd_reading_cmd = false;
-			kbd_cmd = 0;
-			kbd_cmd_bytes = 0;
-		}
-    }
+		DBG_VV("recv %02x\n", ch);
+		apollo_cmd_feed(&s_cmd, ch, now);
+	}
 }
 
 #define Yes 1
@@ -1,3 +1,5 @@
+#include <string.h>
+
 #include <pico/stdlib.h>
 #include <hardware/uart.h>
 #include <hardware/irq.h>
@@ -9,21 +11,31 @@
 #define DEBUG_TAG "apollo"
 
 #include "babelfish.h"
+#include "chan_uart.h"
+#include "apollo_cmd.h"
 
 #define UART_KEYBOARD_NUM 0
 #define UART_KEYBOARD uart0
 #define UART_KEYBOARD_IRQ UART0_IRQ
 
+// idle line before each byte of a kbd_tx_str() string; unclear if the OS
+// can actually handle a true 1200 baud stream
+#define KBD_TX_STR_GAP_US 1000
+
 static void on_keyboard_rx();
+// host commands; the handlers are further down
+static ApolloCmd s_cmd;
+static const ApolloCmdHandler s_cmd_handlers[ApolloCmdCount];
 
 void apollo_dn300_init() {
 	DBG_VV("in apollo_dn300_init!\n");
 	// Apollo expects 5V serial, not RS-232 voltages.
 	channel_config(0, ChannelModeLevelShifter | ChannelModeUART);
 
-	uart_init(UART_KEYBOARD, 1200);
-	uart_set_hw_flow(UART_KEYBOARD, false, false);
-	uart_set_format(UART_KEYBOARD, 8, 1, UART_PARITY_NONE);
+	apollo_cmd_init(&s_cmd, s_cmd_handlers);
+	chan_uart_init(UART_KEYBOARD_NUM, on_keyboard_rx);
+	chan_uart_set_format(UART_KEYBOARD_NUM, 1200, 8, 1, UART_PARITY_NONE);
+	chan_uart_set_pacing(UART_KEYBOARD_NUM, chan_uart_frame_us(UART_KEYBOARD_NUM), KBD_TX_STR_GAP_US);
 }
 
 typedef enum {
@@ -42,7 +54,7 @@ typedef enum {
 static uint16_t s_code_table[2][256][StateMax];
 
 static void kbd_xmit_uart(char c) {
-	uart_putc_raw(UART_KEYBOARD, c);
+	chan_uart_putc(UART_KEYBOARD_NUM, c);
 }
 
 static void kbd_xmit_key(char c) {
@@ -57,11 +69,7 @@ static void kbd_xmit(char c) {
 
 static void kbd_tx_str(const char *str) {
 	DBG_VV("xmit str '%s'\n", str);
-	while (*str) {
-		kbd_xmit_uart(*str++);
-		// slow this down, unclear if the OS can actually handle a true 1200 baud stream
-		busy_wait_ms(1);
-	}
+	chan_uart_write_paced(UART_KEYBOARD_NUM, (const uint8_t *) str, strlen(str));
 }
 
 void apollo_dn300_update() {
@@ -132,6 +140,34 @@ void apollo_dn300_mouse_event(const MouseEvent event) {
 	// TBD once it's booting and we can run the mouse test
 }
 
+// Keys only ever go out in compatibility mode, so that's the one mode
+// acknowledged; the rest of the commands are just accepted.
+static bool cmd_mode0(ApolloCmdId id) {
+	uint8_t buf[] = { 0xff, 0x00 };
+	return chan_uart_write(UART_KEYBOARD_NUM, buf, sizeof(buf));
+}
+
+static bool cmd_ident(ApolloCmdId id) {
+	kbd_tx_str("3-@\r2-0\rSD-03863-MS\r"); // english ident
+	return true;
+}
+
+static const ApolloCmdHandler s_cmd_handlers[ApolloCmdCount] = {
+	[ApolloCmdMode0] = cmd_mode0,
+	[ApolloCmdIdent] = cmd_ident,
+};
+
+void on_keyboard_rx() {
+	while (chan_uart_is_readable(UART_KEYBOARD_NUM)) {
+		uint8_t ch = chan_uart_getc(UART_KEYBOARD_NUM);
+		uint32_t now = time_us_32();
+		boot_mark(BootHostRx);
+
+		DBG_VV("recv %02x\n", ch);
+		apollo_cmd_feed(&s_cmd, ch, now);
+	}
+}
+
 #define Yes 1
 #define No 0
 #define NONE 0
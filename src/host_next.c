@@ -4,7 +4,9 @@
 #include <tusb.h>
 
 #include <hardware/pio.h>
+#include <hardware/dma.h>
 #include <hardware/clocks.h>
+#include <hardware/sync.h>
 #include "next.pio.h"
 
 #include "hid_codes.h"
@@ -13,6 +15,8 @@
 #define DEBUG_TAG "next"
 
 #include "babelfish.h"
+#include "mouse_shaper.h"
+#include "next_poll.h"
 
 #define SOUNDBOX_OUT_GPIO TX_B_GPIO
 #define SOUNDBOX_IN_GPIO TX_A_GPIO
@@ -31,6 +35,8 @@
 
 // Assumption: pio0 is taken by tinyusb
 #define NEXT_PIO pio1
+// shared with chan_uart_pio, which is never in use alongside
+#define NEXT_DMA_IRQ DMA_IRQ_1
 
 //
 // NeXT protocol values/codes
@@ -77,15 +83,37 @@
 #define KD_VALID	0x80 /* only set for scancode keys ? */
 #define KD_MODS		0x4f
 
-#define MAX_NUM_WORDS 8
-static uint32_t s_recv_words[MAX_NUM_WORDS];
-static uint32_t s_recv_next_index = 0;
-
-static void next_rx_irq(void);
+// Frames from next_rx, two words each, DMA'd out of the RX FIFO as
+// they're pushed. A power of two in words; the DMA write ring wraps on
+// its size in bytes, so it has to be aligned to it.
+#define RX_RING_WORDS 64
+static uint32_t s_rx_ring[RX_RING_WORDS] __attribute__((aligned(RX_RING_WORDS * 4)));
+static int s_rx_dma = -1;
+// Words the DMA has written (as of its last re-arm) and that
+// process_incoming() has taken, since next_init(), mod 2^32. Frames the
+// DMA wrote over before they were taken are lost.
+static volatile uint32_t s_rx_base = 0;
+static uint32_t s_rx_taken = 0;
+static uint32_t s_rx_lost = 0;
+
+// Words for the TX state machine: a bit count and one or two data words
+// per frame. Its FIFO is only 4 deep, so frames queue here and the FIFO
+// not-full interrupt feeds them in rather than pio_sm_put() spinning.
+#define TX_RING_WORDS 64
+static uint32_t s_tx_ring[TX_RING_WORDS];
+static volatile uint16_t s_tx_head = 0;
+static volatile uint16_t s_tx_count = 0;
+static uint32_t s_tx_dropped = 0;
+
+// the host's keyboard/mouse polls
+static NextPoll s_poll;
+
+static void next_rx_dma_irq(void);
+static void next_tx_irq(void);
 static void send_command_with_data(uint8_t command, uint32_t data);
 static void send_command(uint8_t command);
 static void send_key(uint8_t modifiers, uint8_t keycode, bool down);
-static void check_mouse_xmit(void);
+static bool mouse_reply(void);
 
 // Some helpers
 
@@ -140,6 +168,8 @@ static void decode_words(const uint32_t* words, uint32_t* cmdp, uint32_t* datap)
 void next_init() {
     DBG("Configuring NeXT\n");
 
+    next_poll_init(&s_poll);
+
     channel_config(0, ChannelModeGPIO | ChannelModeNoInvert | ChannelModeLevelShifter); // RX & CLK.  We're going to use TX as RX.
     channel_config(1, ChannelModeGPIO | ChannelModeNoInvert | ChannelModeDirect); // TX -- note no shifter, we're using TTL into CMOS
 
@@ -174,11 +204,9 @@ void next_init() {
     pio_sm_set_pin_as_output(NEXT_PIO, SM_TX, SOUNDBOX_OUT_GPIO);
     pio_sm_set_pin_as_input(NEXT_PIO, SM_TX, SOUNDBOX_CLK_IN_GPIO);
 
-    irq_set_exclusive_handler(PIO1_IRQ_0, next_rx_irq);
-    irq_set_enabled(PIO1_IRQ_0, true);
-
-    pio_set_irq0_source_enabled(NEXT_PIO, pis_interrupt0, true);
-    pio_interrupt_clear(NEXT_PIO, 0);
+    // TX FIFO refills; the source is only enabled while words are queued
+    irq_set_exclusive_handler(PIO1_IRQ_1, next_tx_irq);
+    irq_set_enabled(PIO1_IRQ_1, true);
 
     pio_sm_config cfg;
     
@@ -186,13 +214,30 @@ void next_init() {
     cfg = next_rx_program_get_default_config(offset_rx);
     sm_config_set_clkdiv(&cfg, clk_div);
     sm_config_set_in_pins(&cfg, SOUNDBOX_IN_GPIO);
+    sm_config_set_jmp_pin(&cfg, SOUNDBOX_IN_GPIO);
     sm_config_set_in_shift(&cfg, false /* false: shift left */, false /* enabled */, 0);
+    sm_config_set_fifo_join(&cfg, PIO_FIFO_JOIN_RX);
 
     //sm_config_set_sideset(&cfg, 1, /* optional */ true, /* pindirs */ false);
     //sm_config_set_sideset_pins(&cfg, LED_AUX_GPIO);
 
     pio_sm_init(NEXT_PIO, SM_RX, offset_rx, &cfg);
 
+    // RX words go straight into s_rx_ring; process_incoming() looks at
+    // how far the DMA has got
+    s_rx_dma = dma_claim_unused_channel(true);
+    dma_channel_config dc = dma_channel_get_default_config(s_rx_dma);
+    channel_config_set_transfer_data_size(&dc, DMA_SIZE_32);
+    channel_config_set_read_increment(&dc, false);
+    channel_config_set_write_increment(&dc, true);
+    channel_config_set_ring(&dc, true, __builtin_ctz(RX_RING_WORDS * 4));
+    channel_config_set_dreq(&dc, pio_get_dreq(NEXT_PIO, SM_RX, false));
+    dma_channel_configure(s_rx_dma, &dc, s_rx_ring, &NEXT_PIO->rxf[SM_RX], 0xffffffff, true);
+    dma_channel_set_irq1_enabled(s_rx_dma, true);
+
+    irq_add_shared_handler(NEXT_DMA_IRQ, next_rx_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(NEXT_DMA_IRQ, true);
+
     uint offset_tx = pio_add_program(NEXT_PIO, &next_tx_program);
     cfg = next_tx_program_get_default_config(offset_tx);
     sm_config_set_clkdiv(&cfg, clk_div);
@@ -209,35 +254,91 @@ void next_init() {
     pio_sm_set_enabled(NEXT_PIO, SM_TX, true);
 }
 
-void next_rx_irq(void)
+// ~2^32 words later; pick up where it left off in the ring
+void next_rx_dma_irq(void)
+{
+    if (s_rx_dma < 0 || !dma_channel_get_irq1_status(s_rx_dma))
+        return;
+    dma_channel_acknowledge_irq1(s_rx_dma);
+    s_rx_base += 0xffffffffu;
+    dma_channel_set_trans_count(s_rx_dma, 0xffffffff, true);
+}
+
+static uint32_t rx_produced(void)
+{
+    uint32_t ints = save_and_disable_interrupts();
+    uint32_t n = s_rx_base + (0xffffffffu - dma_channel_hw_addr(s_rx_dma)->transfer_count);
+    restore_interrupts(ints);
+    return n;
+}
+
+// The next whole frame in the ring, into words[2]; false if there isn't
+// one yet. Frames the DMA got a whole ring ahead of, or wrote over while
+// they were being copied, are counted in s_rx_lost and skipped.
+static bool rx_take(uint32_t *words)
+{
+    for (;;) {
+        uint32_t ahead = rx_produced() - s_rx_taken;
+        if (ahead > RX_RING_WORDS) {
+            uint32_t over = (ahead - RX_RING_WORDS + 1) & ~1u;
+            s_rx_lost += over / 2;
+            s_rx_taken += over;
+            ahead -= over;
+        }
+        if (ahead < 2)
+            return false;
+
+        words[0] = s_rx_ring[s_rx_taken % RX_RING_WORDS];
+        words[1] = s_rx_ring[(s_rx_taken + 1) % RX_RING_WORDS];
+        bool intact = rx_produced() - s_rx_taken <= RX_RING_WORDS;
+        s_rx_taken += 2;
+        if (intact)
+            return true;
+        s_rx_lost++;
+    }
+}
+
+static void next_tx_fill(void)
+{
+    while (s_tx_count && !pio_sm_is_tx_fifo_full(NEXT_PIO, SM_TX)) {
+        pio_sm_put(NEXT_PIO, SM_TX, s_tx_ring[s_tx_head]);
+        s_tx_head = (s_tx_head + 1) % TX_RING_WORDS;
+        s_tx_count--;
+    }
+    pio_set_irq1_source_enabled(NEXT_PIO, pis_sm0_tx_fifo_not_full + SM_TX, s_tx_count != 0);
+}
+
+void next_tx_irq(void)
 {
-    // There will always be two words ready to read. There shouldn't
-    // ever be _more_ than two for now given how we synchronize.
-    while (!pio_sm_is_rx_fifo_empty(NEXT_PIO, SM_RX)) {
-        s_recv_words[s_recv_next_index++] = pio_sm_get(NEXT_PIO, SM_RX);
-        s_recv_words[s_recv_next_index++] = pio_sm_get(NEXT_PIO, SM_RX);
-        s_recv_next_index = s_recv_next_index % MAX_NUM_WORDS;
+    next_tx_fill();
+}
+
+// Queues a whole frame or, if there's no room for all of it, none of it.
+static void next_tx_words(const uint32_t *words, uint count)
+{
+    uint32_t ints = save_and_disable_interrupts();
+    bool room = TX_RING_WORDS - s_tx_count >= count;
+    if (room) {
+        for (uint i = 0; i < count; i++)
+            s_tx_ring[(s_tx_head + s_tx_count + i) % TX_RING_WORDS] = words[i];
+        s_tx_count += count;
     }
-    pio_interrupt_clear(NEXT_PIO, 0);
+    next_tx_fill();
+    restore_interrupts(ints);
+
+    if (!room)
+        DBG("TX ring full, dropped frame (%lu so far)\n", ++s_tx_dropped);
 }
 
 static bool next_ready = false;
 static bool saw_reset = false;
 
-static void process_incoming()
+static void handle_frame(const uint32_t *words)
 {
-    uint32_t words[8];
     uint32_t cmd;
     uint32_t data;
 
-    if (!s_recv_next_index)
-        return;
-
-    // copy the buffer and let pio keep receiving
-    int cnt = s_recv_next_index;
-    memcpy(words, s_recv_words, cnt * 4);
-    s_recv_next_index = 0;
-    pio_sm_put(NEXT_PIO, SM_RX, 0);
+    boot_mark(BootHostRx);
 
     decode_words(words, &cmd, &data);
 
@@ -267,21 +368,43 @@ static void process_incoming()
                 send_command_with_data(0xc6, 0x70000000);
             }
             break;
-        case 0xc6:
-            //DBG("set poll mask and interval (0x%08x)\n", data);
-            send_command(0x00); // ?? sometimes this is a 0x00, sometimes a 0x01
+        case NEXT_CMD_POLL: {
+            uint8_t mask = s_poll.mask;
+            uint32_t speed = s_poll.speed;
+            next_poll_seen(&s_poll, data, time_us_32());
+            if (s_poll.mask != mask || s_poll.speed != speed)
+                DBG("poll mask 0x%02x speed 0x%06lx\n", s_poll.mask, s_poll.speed);
+
+            // mouse data if there's any, otherwise nothing to report
+            if (!mouse_reply())
+                send_command(0x00); // ?? sometimes this is a 0x00, sometimes a 0x01
             next_ready = true;
             break;
+        }
         default:
             DBG("unknown cmd: 0x%02x data: 0x%08x\n", cmd, data);
             break;
     }
 }
 
+// Every frame the DMA has brought in since the last time around
+static void process_incoming()
+{
+    uint32_t words[2];
+    while (rx_take(words))
+        handle_frame(words);
+}
+
 void next_update() {
+    static uint32_t s_lost_logged = 0;
+
     // process incoming commands
     process_incoming();
-    check_mouse_xmit();
+
+    if (s_rx_lost != s_lost_logged) {
+        DBG("%lu frames lost, mainloop a whole RX ring behind\n", s_rx_lost - s_lost_logged);
+        s_lost_logged = s_rx_lost;
+    }
 }
 
 void send_command_with_data(uint8_t command, uint32_t data)
@@ -295,16 +418,15 @@ void send_command_with_data(uint8_t command, uint32_t data)
   // dddddddd dQQ...... ........ ........
   uint32_t d1 = data << 23;
 
-  pio_sm_put(pio1, SM_TX, 8+32+3);
-  pio_sm_put(pio1, SM_TX, d0);
-  pio_sm_put(pio1, SM_TX, d1);
+  uint32_t words[] = { 8+32+3, d0, d1 };
+  next_tx_words(words, 3);
 }
 
 void send_command(uint8_t command)
 {
   uint32_t d0 = (1u<<31) | (command << 23) | 0;
-  pio_sm_put(pio1, SM_TX, 8+3);
-  pio_sm_put(pio1, SM_TX, d0);
+  uint32_t words[] = { 8+3, d0 };
+  next_tx_words(words, 2);
 }
 
 void send_key(uint8_t modifiers, uint8_t keycode, bool down)
@@ -354,46 +476,41 @@ void next_kbd_event(const KeyboardEvent event) {
     }
 }
 
-// report mouse at most 1000/200 times per second
-#define MOUSE_RATE_MS 100
-#define SPEED_DIV 2
+// half speed, as SPEED_DIV 2 was; NeXTSTEP has its own acceleration
+static const MouseShaperConfig s_mouse_shaping = {
+	.scale_q16 = MOUSE_Q16_ONE / 2,
+	.max_delta = NEXT_MOUSE_MAX_DELTA,
+};
 
-static int mouse_cdx = 0;
-static int mouse_cdy = 0;
+// Motion accumulates here between polls, and each poll takes a packet's
+// worth; more than that goes in the following ones.
+static MouseShaper s_mouse = { .cfg = &s_mouse_shaping };
 static int mouse_cbtn = 0;
 static int mouse_lbtn = 0;
-static uint32_t mouse_last_report = 0;
-
-void check_mouse_xmit() {
-	if (mouse_cdx == 0 && mouse_cdy == 0 && mouse_cbtn == mouse_lbtn)
-		return;
-
-	uint32_t now_ms = to_ms_since_boot(get_absolute_time());
-	if (now_ms - mouse_last_report >= MOUSE_RATE_MS || mouse_cbtn != mouse_lbtn) {
 
-		// slow down
-		int cdx = mouse_cdx / SPEED_DIV;
-		int cdy = mouse_cdy / SPEED_DIV;
+// From the poll, in process_incoming(); false if there's nothing to send.
+static bool mouse_reply() {
+	if (!next_poll_wants_mouse(&s_poll))
+		return false;
+	if (!mouse_shaper_pending(&s_mouse) && mouse_cbtn == mouse_lbtn)
+		return false;
 
-		// clamp
-		int8_t tdx = cdx > 127 ? 127 : cdx < -127 ? -127 : cdx;
-		int8_t tdy = cdy > 127 ? 127 : cdy < -127 ? -127 : cdy;
+	int16_t tdx, tdy;
+	mouse_shaper_take(&s_mouse, &tdx, &tdy);
 
-		DBG_VV("mouse xmit: tdx %d tdy %d\n", tdx, tdy);
+	DBG_VV("mouse reply: tdx %d tdy %d, poll every %lu us\n", tdx, tdy, s_poll.interval_us);
 
-        // .. send ..
+	send_command_with_data(NEXT_CMD_POLL, next_mouse_word(tdx, tdy,
+		mouse_cbtn & MOUSE_BUTTON_LEFT, mouse_cbtn & MOUSE_BUTTON_RIGHT));
+	s_poll.mouse_replies++;
 
-		mouse_cdx = 0;
-		mouse_cdy = 0;
-		mouse_lbtn = mouse_cbtn;
-		mouse_last_report = now_ms;
-	}
+	mouse_lbtn = mouse_cbtn;
+	return true;
 }
 
 void next_mouse_event(const MouseEvent event)
 {
-	mouse_cdx += event.dx;
-	mouse_cdy += event.dy;
+	mouse_shaper_add(&s_mouse, event.dx, event.dy, time_us_32());
 	mouse_cbtn = event.buttons;
 }
 
@@ -1,6 +1,7 @@
 extern void sun_keyboard_uart_init();
 extern void sun_mouse_uart_init();
 extern void sun_mouse_tx();
+extern void sun_keyboard_update();
 
 void sun_init() {
     sun_keyboard_uart_init();
@@ -8,5 +9,6 @@ void sun_init() {
 }
 
 void sun_update() {
+    sun_keyboard_update();
     sun_mouse_tx();
 }
\ No newline at end of file
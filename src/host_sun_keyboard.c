@@ -3,11 +3,14 @@
 #include <pico/stdlib.h>
 #include <hardware/uart.h>
 #include <hardware/irq.h>
+#include <hardware/sync.h>
 
 #define DEBUG_TAG "sun"
 #include "babelfish.h"
+#include "chan_uart.h"
 
 #include "host_sun_keycodes.h"
+#include "sun_kbd_cmd.h"
 
 #define UART_KEYBOARD_NUM 0
 #define UART_KEYBOARD uart0
@@ -15,65 +18,71 @@
 
 static void on_keyboard_rx();
 
+static SunKbdCmd s_cmd;
+
+// keys held, for the 0x7f sent when the last one goes up; a host reset
+// forgets them
+static volatile uint32_t keys_down = 0;
+
+// SunCmdActLeds/SunCmdActClick seen by the RX interrupt, for
+// sun_keyboard_update() to log
+static volatile uint8_t s_log_actions = 0;
+
 void sun_keyboard_uart_init() {
 	// Apollo expects 5V serial, not RS-232 voltages.
 	channel_config(0, ChannelModeLevelShifter | ChannelModeUART | ChannelModeInvert);
 
-  uart_init(UART_KEYBOARD, 1200);
-  uart_set_hw_flow(UART_KEYBOARD, false, false);
-  uart_set_format(UART_KEYBOARD, 8, 1, UART_PARITY_NONE);
-  irq_set_exclusive_handler(UART_KEYBOARD_IRQ, on_keyboard_rx);
-  irq_set_enabled(UART_KEYBOARD_IRQ, true);
-  uart_set_irq_enables(UART_KEYBOARD, true, false);
+  sun_kbd_cmd_init(&s_cmd, SUN_LAYOUT_US4);
+
+  chan_uart_init(UART_KEYBOARD_NUM, on_keyboard_rx);
+  chan_uart_set_format(UART_KEYBOARD_NUM, 1200, 8, 1, UART_PARITY_NONE);
 }
 
-// RX interrupt handler
+// RX interrupt handler. Never waits on the line: a command's argument is
+// picked up by whichever interrupt it arrives in, and replies are queued.
+// At most a FIFO's worth of bytes, each a fixed amount of work.
 void on_keyboard_rx() {
-    while (uart_is_readable(UART_KEYBOARD)) {
-        // printf("System command: ");
-        uint8_t ch = uart_getc(UART_KEYBOARD);
-
-        switch (ch) {
-          case 0x01: // reset
-            // printf("Reset\n");
-            uart_putc_raw(UART_KEYBOARD, 0xff);
-            uart_putc_raw(UART_KEYBOARD, 0x04);
-            uart_putc_raw(UART_KEYBOARD, 0x7f);
-            break;
-          case 0x02: // bell on
-            // printf("Bell on\n");
-            break;
-          case 0x03: // bell off
-            // printf("Bell off\n");
-            break;
-          case 0x0a: // click on
-            // printf("Click on\n");
-            break;
-          case 0x0b: // click off
-            // printf("Click off\n");
-            break;
-          case 0x0e: // led command
-            // printf("Led\n");
-            {
-              uint8_t led = uart_getc(UART_KEYBOARD);
-            }
-            break;
-          case 0x0f: // layout command
-            // printf("Layout\n");
-            uart_putc_raw(UART_KEYBOARD, 0xfe);
-            uart_putc_raw(UART_KEYBOARD, 0x00);
-            break;
-          default:
-            // printf("Unknown system command: 0x%02x\n", ch);
-            break;
-        };
+    uint32_t now = time_us_32();
+
+    while (chan_uart_is_readable(UART_KEYBOARD_NUM)) {
+        uint8_t ch = chan_uart_getc(UART_KEYBOARD_NUM);
+        boot_mark(BootHostRx);
+
+        SunCmdResult res;
+        sun_kbd_cmd_feed(&s_cmd, ch, now, &res);
+
+        if (res.actions & SunCmdActReply)
+          chan_uart_write(UART_KEYBOARD_NUM, res.reply, res.reply_len);
+        if (res.actions & SunCmdActLeds)
+          set_keyboard_leds(sun_kbd_leds_to_hid(s_cmd.leds));
+        // nothing to beep with; the bell shows on the aux LED
+        if (res.actions & SunCmdActBell)
+          gpio_put(LED_AUX_GPIO, s_cmd.bell);
+        if (res.actions & SunCmdActReset)
+          keys_down = 0;
+        s_log_actions |= res.actions & (SunCmdActLeds | SunCmdActClick);
     }
 }
 
+// Mainloop
+void sun_keyboard_update() {
+    if (!s_log_actions)
+        return;
+
+    uint32_t ints = save_and_disable_interrupts();
+    uint8_t actions = s_log_actions;
+    s_log_actions = 0;
+    restore_interrupts(ints);
+
+    if (actions & SunCmdActLeds)
+      DBG("leds 0x%02x\n", s_cmd.leds);
+    if (actions & SunCmdActClick)
+      DBG("click %s\n", s_cmd.click ? "on" : "off");
+}
+
 void sun_kbd_event(const KeyboardEvent event) {
   // if the gui/sun-extra-keys modifier is pressed
   static bool gui = false;
-  static uint32_t keys_down = 0;
 
   if (event.page != 0)
     return;
@@ -85,11 +94,12 @@ void sun_kbd_event(const KeyboardEvent event) {
 
   if (event.down) {
     keys_down++;
-  } else {
+  } else if (keys_down) {
+    // keys held across a reset come up without having been counted
     keys_down--;
   }
 
-#define SEND_SUN_KEY(suncode, down) uart_putc_raw(UART_KEYBOARD, down ? (suncode) : ((suncode) | 0x80))
+#define SEND_SUN_KEY(suncode, down) chan_uart_putc(UART_KEYBOARD_NUM, down ? (suncode) : ((suncode) | 0x80))
 
   if (gui) {
     switch (event.keycode) {
@@ -113,6 +123,6 @@ void sun_kbd_event(const KeyboardEvent event) {
   }
 
   if (keys_down == 0) {
-    uart_putc_raw(UART_KEYBOARD, 0x7f);
+    chan_uart_putc(UART_KEYBOARD_NUM, 0x7f);
   }
 }
\ No newline at end of file
@@ -4,14 +4,33 @@
 
 #define DEBUG_TAG "sun"
 #include "babelfish.h"
+#include "chan_uart.h"
+#include "mouse_shaper.h"
+#include "mouse_sched.h"
+
+// 1:1; the packet's deltas are signed bytes, and the Sun's own software
+// accelerates
+static const MouseShaperConfig s_mouse_shaping = {
+  .scale_q16 = MOUSE_Q16_ONE,
+  .max_delta = 127,
+};
+
+// The line is the mouse's own. A five byte packet is 41.7 ms at 1200 8N1;
+// a count or two waits up to 50 ms, about the old 25 + 15 ms cadence, and
+// 8 or more goes as fast as the line takes packets. The next head only
+// goes in once the last tail is a byte from done, so motion is taken as
+// late as it can be without the line going idle.
+static MouseSchedConfig s_mouse_sched_cfg = {
+  .idle_us = 50000,
+  .fast_counts = 8,
+};
 
 static bool serial_data_in_tail = false;
-static bool updated = false;
-static int32_t delta_x = 0;
-static int32_t delta_y = 0;
+static MouseShaper s_mouse = { .cfg = &s_mouse_shaping };
+static MouseSched s_mouse_sched;
 #define NO_BUTTONS 0x7
 static char btns = NO_BUTTONS;
-static uint32_t interval = 40;
+static char sent_btns = NO_BUTTONS;
 
 #define UART_MOUSE_NUM 1
 #define UART_MOUSE uart1
@@ -19,51 +38,47 @@ static uint32_t interval = 40;
 void sun_mouse_uart_init() {
   channel_config(UART_MOUSE_NUM, ChannelModeLevelShifter | ChannelModeUART | ChannelModeInvert);
 
-  uart_init(UART_MOUSE, 1200);
-  uart_set_hw_flow(UART_MOUSE, false, false);
-  uart_set_format(UART_MOUSE, 8, 1, UART_PARITY_NONE);
-}
+  chan_uart_init(UART_MOUSE_NUM, NULL);
+  chan_uart_set_format(UART_MOUSE_NUM, 1200, 8, 1, UART_PARITY_NONE);
 
-static inline int32_t clamp(int32_t value, int32_t min, int32_t max) {
-  if      (value < min) return min;
-  else if (value > max) return max;
-  return value;
+  uint32_t byte_us = chan_uart_frame_us(UART_MOUSE_NUM);
+  s_mouse_sched_cfg.packet_us = 5 * byte_us;
+  s_mouse_sched_cfg.queue_us = byte_us;
+  mouse_sched_init(&s_mouse_sched, &s_mouse_sched_cfg);
 }
 
-static uint32_t push_head_packet() {
-  uart_putc_raw(UART_MOUSE, btns | 0x80);
-  uart_putc_raw(UART_MOUSE, delta_x);
-  uart_putc_raw(UART_MOUSE, delta_y);
-  btns = NO_BUTTONS;
-  delta_x = 0;
-  delta_y = 0;
+static void push_head_packet() {
+  int16_t dx, dy;
+  mouse_shaper_take(&s_mouse, &dx, &dy);
+  uint8_t packet[3] = { btns | 0x80, dx, dy };
+  chan_uart_write(UART_MOUSE_NUM, packet, sizeof(packet));
+  sent_btns = btns;
   serial_data_in_tail = true;
-  return 25;
 }
 
-static uint32_t push_tail_packet() {
-  uart_putc_raw(UART_MOUSE, delta_x);
-  uart_putc_raw(UART_MOUSE, delta_y);
-  delta_x = 0;
-  delta_y = 0;
+static void push_tail_packet() {
+  int16_t dx, dy;
+  mouse_shaper_take(&s_mouse, &dx, &dy);
+  uint8_t packet[2] = { dx, dy };
+  chan_uart_write(UART_MOUSE_NUM, packet, sizeof(packet));
   serial_data_in_tail = false;
-  return 15;
 }
 
 void sun_mouse_tx() {
-  static uint32_t start_ms = 0;
-  if ((to_ms_since_boot(get_absolute_time()) - start_ms) < interval) {
+  uint32_t backlog = chan_uart_tx_backlog_us(UART_MOUSE_NUM);
+
+  // the tail always follows its head, with whatever came in while the
+  // head was going out
+  if (serial_data_in_tail) {
+    if (backlog <= s_mouse_sched.cfg.queue_us)
+      push_tail_packet();
     return;
   }
-  start_ms += interval;
 
-  if (updated) {
-    if (serial_data_in_tail) {
-      interval = push_tail_packet();
-      updated = (btns != NO_BUTTONS);
-    } else {
-      interval = push_head_packet();
-    }
+  uint32_t now = time_us_32();
+  if (mouse_sched_due(&s_mouse_sched, now, mouse_shaper_pending_counts(&s_mouse), btns != sent_btns, backlog, false)) {
+    push_head_packet();
+    mouse_sched_sent(&s_mouse_sched, now);
   }
 }
 
@@ -72,9 +87,5 @@ void sun_mouse_event(const MouseEvent event) {
       | ((event.buttons & MOUSE_BUTTON_MIDDLE) ? 0 : 2)
       | ((event.buttons & MOUSE_BUTTON_RIGHT)  ? 0 : 1)
   ;
-  delta_x += event.dx;
-  delta_y += -event.dy;
-  delta_x = clamp(delta_x, -127, 127);
-  delta_y = clamp(delta_y, -127, 127);
-  updated = true;
+  mouse_shaper_add(&s_mouse, event.dx, -event.dy, time_us_32());
 }
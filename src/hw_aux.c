@@ -49,8 +49,7 @@ void led_init(void)
         gpio_put(leds[i], 1);
     }
 
-    sleep_ms(100);
-    gpio_put(LED_P_OK_GPIO, 0);
-    gpio_put(LED_AUX_GPIO, 0);
+    // they're turned off again by whoever owns them, once they've been
+    // seen; waiting here would hold up boot
 }
 
@@ -0,0 +1,259 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pico/stdlib.h>
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "loadgen"
+
+#include "babelfish.h"
+#include "loadgen.h"
+
+// if we fall more than this many periods behind, give up on catching up
+#define MAX_BEHIND_PERIODS 4
+#define MOUSE_DIRECTION_REPORTS 64
+#define BUTTON_PATTERN_REPORTS 16
+
+// set on one core, picked up by loadgen_task on the other
+static LoadGenConfig s_pending;
+static volatile bool s_start_requested = false;
+static volatile bool s_stop_requested = false;
+static volatile bool s_running = false;
+static volatile bool s_finished = false;
+
+static LoadGenConfig s_cfg;
+static LoadGenStats s_stats;
+static uint64_t s_start_us;
+static uint64_t s_next_key_us;
+static uint64_t s_next_mouse_us;
+
+static uint8_t s_held[6];
+static uint8_t s_held_count;
+static uint8_t s_next_letter;
+static uint8_t s_mouse_buttons;
+
+void
+loadgen_default_config(LoadGenConfig *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->key_rate = 20;
+    cfg->rollover = 1;
+    cfg->mouse_rate = 0;
+    cfg->mouse_dx = 4;
+    cfg->mouse_dy = 0;
+    cfg->buttons = LOADGEN_BUTTONS_NONE;
+    cfg->duration_ms = 5000;
+}
+
+bool
+loadgen_parse(const char *args, LoadGenConfig *cfg)
+{
+    const char *p = args;
+
+    while (*p) {
+        while (*p == ' ')
+            p++;
+        if (!*p)
+            break;
+
+        const char *eq = strchr(p, '=');
+        if (!eq)
+            return false;
+        const char *val = eq + 1;
+        int keylen = eq - p;
+        long n = strtol(val, NULL, 0);
+
+        if (keylen == 1 && p[0] == 'k') {
+            cfg->key_rate = n;
+        } else if (keylen == 1 && p[0] == 'r') {
+            if (n < 1 || n > 6)
+                return false;
+            cfg->rollover = n;
+        } else if (keylen == 1 && p[0] == 'm') {
+            cfg->mouse_rate = n;
+        } else if (keylen == 2 && !strncmp(p, "dx", 2)) {
+            cfg->mouse_dx = n;
+        } else if (keylen == 2 && !strncmp(p, "dy", 2)) {
+            cfg->mouse_dy = n;
+        } else if (keylen == 1 && p[0] == 't') {
+            cfg->duration_ms = n;
+        } else if (keylen == 1 && p[0] == 'b') {
+            if (!strncmp(val, "none", 4))
+                cfg->buttons = LOADGEN_BUTTONS_NONE;
+            else if (!strncmp(val, "click", 5))
+                cfg->buttons = LOADGEN_BUTTONS_CLICK;
+            else if (!strncmp(val, "drag", 4))
+                cfg->buttons = LOADGEN_BUTTONS_DRAG;
+            else if (!strncmp(val, "cycle", 5))
+                cfg->buttons = LOADGEN_BUTTONS_CYCLE;
+            else
+                return false;
+        } else {
+            return false;
+        }
+
+        p = val;
+        while (*p && *p != ' ')
+            p++;
+    }
+
+    return true;
+}
+
+void
+loadgen_start(const LoadGenConfig *cfg)
+{
+    s_pending = *cfg;
+    s_stop_requested = false;
+    s_start_requested = true;
+}
+
+void
+loadgen_stop(void)
+{
+    s_stop_requested = true;
+}
+
+bool
+loadgen_running(void)
+{
+    return s_running || s_start_requested;
+}
+
+bool
+loadgen_take_finished(LoadGenStats *stats)
+{
+    if (!s_finished)
+        return false;
+    *stats = s_stats;
+    s_finished = false;
+    return true;
+}
+
+static void
+send_kbd_report(void)
+{
+    hid_keyboard_report_t report = { 0 };
+    memcpy(report.keycode, s_held, s_held_count);
+    translate_boot_kbd_report(&report);
+    s_stats.kbd_reports++;
+}
+
+static void
+generate_keystroke(void)
+{
+    if (s_held_count >= s_cfg.rollover) {
+        memmove(s_held, s_held + 1, s_held_count - 1);
+        s_held_count--;
+    }
+
+    // letters only, so nothing we send is a modifier or a babelfish command key
+    s_held[s_held_count++] = HID_KEY_A + s_next_letter;
+    s_next_letter = (s_next_letter + 1) % 26;
+    s_stats.keystrokes++;
+
+    send_kbd_report();
+}
+
+static void
+generate_mouse_report(void)
+{
+    uint32_t n = s_stats.mouse_reports;
+    int sign = ((n / MOUSE_DIRECTION_REPORTS) & 1) ? -1 : 1;
+
+    switch (s_cfg.buttons) {
+    case LOADGEN_BUTTONS_NONE:
+        s_mouse_buttons = 0;
+        break;
+    case LOADGEN_BUTTONS_CLICK:
+        s_mouse_buttons = (n % BUTTON_PATTERN_REPORTS) == 0 ? MOUSE_BUTTON_LEFT : 0;
+        break;
+    case LOADGEN_BUTTONS_DRAG:
+        s_mouse_buttons = MOUSE_BUTTON_LEFT;
+        break;
+    case LOADGEN_BUTTONS_CYCLE:
+        s_mouse_buttons = 1 << ((n / BUTTON_PATTERN_REPORTS) % 3);
+        break;
+    }
+
+    hid_mouse_report_t report = { 0 };
+    report.buttons = s_mouse_buttons;
+    report.x = sign * s_cfg.mouse_dx;
+    report.y = sign * s_cfg.mouse_dy;
+    translate_boot_mouse_report(&report);
+    s_stats.mouse_reports++;
+}
+
+// Returns true if it's time to generate, and moves the deadline on.
+static bool
+due(uint64_t now, uint64_t *next_us, uint32_t period_us)
+{
+    if (now < *next_us)
+        return false;
+
+    *next_us += period_us;
+    if (now > *next_us + MAX_BEHIND_PERIODS * period_us) {
+        s_stats.late += (now - *next_us) / period_us;
+        *next_us = now + period_us;
+    }
+    return true;
+}
+
+static void
+finish(uint64_t now)
+{
+    // leave nothing held down
+    if (s_held_count) {
+        s_held_count = 0;
+        send_kbd_report();
+    }
+    if (s_mouse_buttons) {
+        hid_mouse_report_t report = { 0 };
+        translate_boot_mouse_report(&report);
+        s_mouse_buttons = 0;
+    }
+
+    s_stats.elapsed_ms = (now - s_start_us) / 1000;
+    s_running = false;
+    s_finished = true;
+}
+
+void
+loadgen_task(void)
+{
+    uint64_t now = time_us_64();
+
+    if (s_start_requested) {
+        s_cfg = s_pending;
+        memset(&s_stats, 0, sizeof(s_stats));
+        s_held_count = 0;
+        s_next_letter = 0;
+        s_mouse_buttons = 0;
+        s_start_us = s_next_key_us = s_next_mouse_us = now;
+        reset_event_queue_stats();
+        s_finished = false;
+        s_running = true;
+        s_start_requested = false;
+    }
+
+    if (!s_running)
+        return;
+
+    if (s_stop_requested || (s_cfg.duration_ms && now - s_start_us >= s_cfg.duration_ms * 1000ull)) {
+        s_stop_requested = false;
+        finish(now);
+        return;
+    }
+
+    if (s_cfg.key_rate && due(now, &s_next_key_us, 1000000 / s_cfg.key_rate))
+        generate_keystroke();
+
+    if (s_cfg.mouse_rate && due(now, &s_next_mouse_us, 1000000 / s_cfg.mouse_rate))
+        generate_mouse_report();
+}
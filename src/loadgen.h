@@ -0,0 +1,71 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Synthetic input load generator. Feeds boot protocol keyboard and mouse
+ * reports into translate_boot_kbd_report() / translate_boot_mouse_report()
+ * at a fixed rate, as if a USB device were sending them, so the whole
+ * pipeline down to the host line can be saturated without anyone typing.
+ * Drops and queue latency are read back from the event queue stats.
+ */
+
+#ifndef LOADGEN_H_
+#define LOADGEN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    LOADGEN_BUTTONS_NONE = 0,
+    LOADGEN_BUTTONS_CLICK,      // left click every 16 reports
+    LOADGEN_BUTTONS_DRAG,       // left held for the whole run
+    LOADGEN_BUTTONS_CYCLE,      // left, right, middle in turn, 16 reports each
+} LoadGenButtons;
+
+typedef struct {
+    // keystrokes per second; each one is a report pressing a new key
+    uint16_t key_rate;
+    // keys held down at once (1-6); the oldest is released as a new one goes down
+    uint8_t rollover;
+
+    // mouse reports per second
+    uint16_t mouse_rate;
+    // motion per report; direction flips every 64 reports so the pointer
+    // stays in place
+    int8_t mouse_dx;
+    int8_t mouse_dy;
+    LoadGenButtons buttons;
+
+    // 0 runs until loadgen_stop()
+    uint32_t duration_ms;
+} LoadGenConfig;
+
+typedef struct {
+    uint32_t kbd_reports;
+    uint32_t keystrokes;
+    uint32_t mouse_reports;
+    // reports we couldn't generate on time because loadgen_task() wasn't
+    // called often enough
+    uint32_t late;
+    uint32_t elapsed_ms;
+} LoadGenStats;
+
+void loadgen_default_config(LoadGenConfig *cfg);
+
+// Parses "k=<keys/s> r=<rollover> m=<reports/s> dx=<n> dy=<n>
+// b=none|click|drag|cycle t=<ms>" on top of whatever is in cfg.
+bool loadgen_parse(const char *args, LoadGenConfig *cfg);
+
+// Called from any core; the generation itself happens in loadgen_task().
+void loadgen_start(const LoadGenConfig *cfg);
+void loadgen_stop(void);
+bool loadgen_running(void);
+
+// Runs on the core that talks to the USB devices, next to tuh_task().
+void loadgen_task(void);
+
+// Returns true once after a run has ended, with its stats.
+bool loadgen_take_finished(LoadGenStats *stats);
+
+#endif
@@ -20,6 +20,10 @@
 #define DEBUG_TAG "main"
 
 #include "babelfish.h"
+#include "loadgen.h"
+#include "hid_poll.h"
+#include "plan_cache.h"
+#include "chan_uart.h"
 
 // Whether to run USB host on core1
 #define USB_ON_CORE1 1
@@ -30,6 +34,7 @@ HOST_PROTOTYPES(apollo);
 HOST_PROTOTYPES(apollo_dn300);
 HOST_PROTOTYPES(next);
 HOST_PROTOTYPES(test_3v3);
+HOST_PROTOTYPES(sniff);
 
 HostDevice hosts[] = {
   HOST_ENTRY(sun, "Sun emulation. Ch A RX/TX for keyboard, Ch B TX for mouse. Shifter setting 5V."),
@@ -38,37 +43,14 @@ HostDevice hosts[] = {
   HOST_ENTRY(apollo_dn300, "Apollo DN300 emulation. Ch A RX/TX for keyboard and mouse. Shifter setting 5V."),
   HOST_ENTRY(next, "NeXT emulation. Ch A used for MOUT/CLK, Ch B used for MIN. Shifter setting 5V for A TX+RX, 3v3 for B TX."),
   HOST_ENTRY(test_3v3, "3v3 TTL test. Transmits A on Ch A TX and B on Ch B TX every 0.5s, 1200 baud 8n1."),
+  HOST_ENTRY(sniff, "Line sniffer. Ch A and B RX captured to the CDC, decode with test/sniff_decode. CDC input sent on Ch A TX."),
   { 0 }
 };
 
-ChannelConfig channels[NUM_CHANNELS] = {
-  {
-    .channel_num = 0,
-    .uart_num = 0,
-    .tx_gpio = TX_A_GPIO,
-    .rx_gpio = RX_A_GPIO,
-    .mux_s0_gpio = CH_A_S0_GPIO,
-    .mux_s1_gpio = CH_A_S1_GPIO,
-  },
-  {
-    .channel_num = 1,
-    .uart_num = 1,
-    .tx_gpio = TX_B_GPIO,
-    .rx_gpio = RX_B_GPIO,
-    .mux_s0_gpio = CH_B_S0_GPIO,
-    .mux_s1_gpio = CH_B_S1_GPIO,
-  }
-};
-
 // TODO read from flash
 int g_current_host_index = 2;
 
 HostDevice *host = NULL;
-KeyboardEvent kbd_event_queue[MAX_QUEUED_EVENTS];
-MouseEvent mouse_event_queue[MAX_QUEUED_EVENTS];
-uint8_t kbd_event_queue_count = 0;
-uint8_t mouse_event_queue_count = 0;
-mutex_t event_queue_mutex;
 
 uint8_t const ascii_to_hid[128][2] = { HID_ASCII_TO_KEYCODE };
 uint8_t const hid_to_ascii[128][2] = { HID_KEYCODE_TO_ASCII };
@@ -82,49 +64,54 @@ void led_init(void);
 void usb_aux_init(void);
 bool cmd_process_event(KeyboardEvent ev);
 
+// AUX USB power has to settle before core1 starts the PIO USB host
+#define AUX_POWER_SETTLE_MS 100
+// how long the LEDs stay lit at power on
+#define LED_TEST_MS 100
+
+static absolute_time_t s_aux_power_on;
+
 int main(void)
 {
   // need 120MHz for USB
   set_sys_clock_khz(120000, true);
 
-  led_init();
-
+  // The host may be talking to us from power on (a Sun sends reset and
+  // wants 0xff 0x04 0x7f back, an Apollo expects its ident handshake), so
+  // the channel and host protocol come up first, and nothing before them
+  // waits. The debug console attaches whenever something opens it; what's
+  // logged before then is kept for it.
   tud_init(0);
-
+  DEBUG_INIT();
   stdio_nusb_init();
 
-  for (int i = 0; i < 10 && !stdio_nusb_connected(); i++) {
-    sleep_ms(100);
-  }
+  led_init();
 
-  sleep_ms(100);
+  channel_init();
 
-  DEBUG_INIT();
+  event_queue_init();
 
-  DBG("==== B A B E L F I S H ====\n");
+  host = &hosts[g_current_host_index];
 
-  usb_aux_init();
+  // TODO: read hostid from storage
+  host->init();
+  boot_mark(BootHostInit);
 
-  DBG("Enabled AUX USB\n");
+  DBG("==== B A B E L F I S H ====\n");
+  DBG("Selecting host '%s'\n", host->name);
+  DBG("%s\n", host->notes);
 
-  sleep_ms(100);
+  plan_cache_init();
 
-  channel_init();
+  usb_aux_init();
+  s_aux_power_on = get_absolute_time();
 
-  mutex_init(&event_queue_mutex);
+  DBG("Enabled AUX USB\n");
 
   // Initialize Core 1, and put PIO-USB on it with TinyUSB
   multicore_reset_core1();
   multicore_launch_core1(core1_main);
 
-  host = &hosts[g_current_host_index];
-
-  DBG("Selecting host '%s'\n", host->name);
-  DBG("%s\n", host->notes);
-
-  // TODO: read hostid from storage
-  host->init();
-
   mainloop();
 
   return 0;
@@ -136,6 +123,8 @@ _Noreturn void mainloop(void)
   MouseEvent mouse_events[MAX_QUEUED_EVENTS];
   uint kbd_event_count = 0;
   uint mouse_event_count = 0;
+  bool led_test_done = false;
+  bool boot_reported = false;
 
   while (true) {
     DEBUG_TASK();
@@ -157,6 +146,22 @@ _Noreturn void mainloop(void)
 
     host->update();
 
+    chan_uart_task();
+    plan_cache_task();
+
+    if (!led_test_done) {
+      if (to_ms_since_boot(get_absolute_time()) < LED_TEST_MS)
+        continue;
+      gpio_put(LED_AUX_GPIO, 0);
+      led_test_done = true;
+    }
+
+    if (!boot_reported && boot_stage_us(BootHostRx)) {
+      DBG("boot: host ready at %lu us, first host byte at %lu us\n",
+          boot_stage_us(BootHostInit), boot_stage_us(BootHostRx));
+      boot_reported = true;
+    }
+
     gpio_put(LED_P_OK_GPIO, !gpio_get(USB_5V_STAT_GPIO));
     //gpio_put(LED_AUX_GPIO, tud_cdc_connected());
   }
@@ -178,49 +183,18 @@ void usb_host_setup()
 //
 void core1_main(void)
 {
-  sleep_ms(10);
+  // core0 parks us while it writes the plan cache to flash
+  multicore_lockout_victim_init();
+
+  sleep_until(delayed_by_ms(s_aux_power_on, AUX_POWER_SETTLE_MS));
 
   usb_host_setup();
+  boot_mark(BootUsbHost);
 
   while (true) {
     tuh_task(); // tinyusb host task
+    hid_poll_task();
+    keyboard_leds_task();
+    loadgen_task();
   }
 }
-
-void enqueue_kbd_event(const KeyboardEvent* event)
-{
-  //DBG_VV("Enqueued key %s: [%d] 0x%04x\n", event->down ? "DOWN" : "UP", event->page, event->keycode);
-  mutex_enter_blocking(&event_queue_mutex);
-  if (kbd_event_queue_count < MAX_QUEUED_EVENTS) {
-    kbd_event_queue[kbd_event_queue_count++] = *event;
-  }
-  mutex_exit(&event_queue_mutex);
-}
-
-void enqueue_mouse_event(const MouseEvent* event)
-{
-  //DBG("Enqueued mouse\n");
-  mutex_enter_blocking(&event_queue_mutex);
-  if (mouse_event_queue_count < MAX_QUEUED_EVENTS) {
-    mouse_event_queue[mouse_event_queue_count++] = *event;
-  }
-  mutex_exit(&event_queue_mutex);
-}
-
-void get_queued_kbd_events(KeyboardEvent* events, uint* count)
-{
-  mutex_enter_blocking(&event_queue_mutex);
-  *count = kbd_event_queue_count;
-  memcpy(events, kbd_event_queue, sizeof(KeyboardEvent) * kbd_event_queue_count);
-  kbd_event_queue_count = 0;
-  mutex_exit(&event_queue_mutex);
-}
-
-void get_queued_mouse_events(MouseEvent* events, uint* count)
-{
-  mutex_enter_blocking(&event_queue_mutex);
-  *count = mouse_event_queue_count;
-  memcpy(events, mouse_event_queue, sizeof(MouseEvent) * mouse_event_queue_count);
-  mouse_event_queue_count = 0;
-  mutex_exit(&event_queue_mutex);
-}
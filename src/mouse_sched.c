@@ -0,0 +1,77 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "mouse_sched.h"
+
+void
+mouse_sched_init(MouseSched *s, const MouseSchedConfig *cfg)
+{
+    memset(s, 0, sizeof(*s));
+    s->cfg = *cfg;
+}
+
+static uint32_t
+key_floor_us(const MouseSched *s)
+{
+    if (!s->cfg.key_share)
+        return 0;
+    return s->cfg.packet_us * 100 / s->cfg.key_share;
+}
+
+uint32_t
+mouse_sched_interval_us(const MouseSched *s, uint32_t pending, bool keys)
+{
+    const MouseSchedConfig *c = &s->cfg;
+    uint32_t iv;
+
+    // from idle_us for a count down to packet_us for fast_counts, in a line
+    if (pending >= c->fast_counts || c->fast_counts <= 1 || c->idle_us <= c->packet_us) {
+        iv = c->packet_us;
+    } else {
+        uint32_t n = pending ? pending - 1 : 0;
+        iv = c->idle_us - (uint64_t) (c->idle_us - c->packet_us) * n / (c->fast_counts - 1);
+    }
+
+    if (keys && iv < key_floor_us(s))
+        iv = key_floor_us(s);
+    return iv;
+}
+
+bool
+mouse_sched_due(MouseSched *s, uint32_t now_us, uint32_t pending, bool buttons, uint32_t backlog_us, bool keys)
+{
+    if (!pending && !buttons)
+        return false;
+
+    // what's queued goes first; motion keeps accumulating meanwhile
+    if (backlog_us > s->cfg.queue_us)
+        return false;
+
+    if (buttons || !s->have_last)
+        return true;
+
+    uint32_t since = now_us - s->last_us;
+    if (since >= mouse_sched_interval_us(s, pending, keys))
+        return true;
+    if (keys && since >= mouse_sched_interval_us(s, pending, false))
+        s->held = true;
+    return false;
+}
+
+void
+mouse_sched_sent(MouseSched *s, uint32_t now_us)
+{
+    if (s->have_last && now_us - s->last_us < s->cfg.packet_us + s->cfg.packet_us / 4)
+        s->line_rate++;
+    if (s->held)
+        s->yielded++;
+    s->held = false;
+    s->last_us = now_us;
+    s->have_last = true;
+    s->packets++;
+}
@@ -0,0 +1,63 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * When a serial mouse backend sends its next packet.
+ *
+ * A packet costs its time on the wire, which at 1200 baud is tens of
+ * milliseconds, so there's no fixed rate that's right for both a slow
+ * drag and a flick. The interval between packets here follows how much
+ * motion is waiting to go: a count or two waits up to idle_us so it goes
+ * in one packet rather than several, and fast_counts or more goes as soon
+ * as the line can take another packet. On a line shared with the
+ * keyboard, motion gets at most key_share percent of it while keys are
+ * going, and never goes behind more than queue_us of anything already
+ * queued. A button change doesn't wait for the interval.
+ *
+ * Nothing pending, nothing sent: an idle mouse leaves the line alone.
+ */
+
+#ifndef MOUSE_SCHED_H_
+#define MOUSE_SCHED_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    uint32_t packet_us;         // a packet's time on the wire, from the line format
+    uint32_t idle_us;           // the longest between packets, for the slowest motion
+    uint16_t fast_counts;       // pending motion that goes at the line's rate
+    uint8_t key_share;          // percent of the line for motion while keys go; 0 if it's the mouse's own
+    uint32_t queue_us;          // the most already queued a packet goes behind
+} MouseSchedConfig;
+
+typedef struct {
+    MouseSchedConfig cfg;
+    uint32_t last_us;
+    bool have_last;
+    bool held;                  // would have gone by now, but for keys
+
+    // for the tests and the debug console
+    uint32_t packets;
+    uint32_t line_rate;         // sent at packet_us, as fast as the line goes
+    uint32_t yielded;           // sent late for key traffic
+} MouseSched;
+
+// cfg is copied: a host fills in packet_us once its channel's format is set.
+void mouse_sched_init(MouseSched *s, const MouseSchedConfig *cfg);
+
+// The interval for this much pending motion, in the larger axis's counts.
+uint32_t mouse_sched_interval_us(const MouseSched *s, uint32_t pending, bool keys);
+
+// Whether a packet should go now. pending is as above; buttons is whether
+// they've changed since the last packet; backlog_us is how long what's
+// already queued has left on the wire; keys is whether the keyboard is
+// using the line.
+bool mouse_sched_due(MouseSched *s, uint32_t now_us, uint32_t pending, bool buttons, uint32_t backlog_us,
+                     bool keys);
+
+// A packet went at now_us.
+void mouse_sched_sent(MouseSched *s, uint32_t now_us);
+
+#endif
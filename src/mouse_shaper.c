@@ -0,0 +1,137 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "mouse_shaper.h"
+
+// the span a speed is measured over: a report after a pause isn't a flick,
+// and two close together aren't infinitely fast
+#define SPEED_MIN_DT_US 1000
+#define SPEED_MAX_DT_US 50000
+
+const MouseAccelPoint mouse_curve_mild[MOUSE_CURVE_MILD_LEN] = {
+    { 400, MOUSE_Q16_ONE },
+    { 1000, MOUSE_Q16_ONE * 3 / 2 },
+    { 2000, MOUSE_Q16_ONE * 2 },
+};
+
+void
+mouse_shaper_init(MouseShaper *m, const MouseShaperConfig *cfg)
+{
+    memset(m, 0, sizeof(*m));
+    m->cfg = cfg;
+}
+
+static uint32_t
+curve_gain(const MouseShaperConfig *cfg, uint32_t speed)
+{
+    const MouseAccelPoint *c = cfg->curve;
+    if (!c || !cfg->curve_len)
+        return MOUSE_Q16_ONE;
+    if (speed <= c[0].speed)
+        return c[0].gain_q16;
+
+    for (uint8_t i = 1; i < cfg->curve_len; i++) {
+        if (speed < c[i].speed) {
+            int64_t span = c[i].speed - c[i - 1].speed;
+            int64_t rise = (int64_t) c[i].gain_q16 - c[i - 1].gain_q16;
+            return c[i - 1].gain_q16 + rise * (speed - c[i - 1].speed) / span;
+        }
+    }
+    return c[cfg->curve_len - 1].gain_q16;
+}
+
+static uint32_t
+magnitude(int32_t dx, int32_t dy)
+{
+    // max + min / 2: within 12% of the distance, and no sqrt
+    uint32_t ax = dx < 0 ? -dx : dx;
+    uint32_t ay = dy < 0 ? -dy : dy;
+    return ax > ay ? ax + ay / 2 : ay + ax / 2;
+}
+
+void
+mouse_shaper_add(MouseShaper *m, int32_t dx, int32_t dy, uint32_t now_us)
+{
+    uint32_t dt = m->have_last ? now_us - m->last_us : SPEED_MAX_DT_US;
+    m->last_us = now_us;
+    m->have_last = true;
+    if (dt < SPEED_MIN_DT_US)
+        dt = SPEED_MIN_DT_US;
+    if (dt > SPEED_MAX_DT_US)
+        dt = SPEED_MAX_DT_US;
+
+    uint32_t speed = (uint64_t) magnitude(dx, dy) * 1000000 / dt;
+    // scale and gain are both Q16; their product is Q32, motion is kept in Q16
+    int64_t factor = (int64_t) m->cfg->scale_q16 * curve_gain(m->cfg, speed);
+
+    m->pending_x += (dx * factor) >> 16;
+    m->pending_y += (dy * factor) >> 16;
+    m->in_x += dx;
+    m->in_y += dy;
+}
+
+// To the nearest whole count, halves toward zero: taking a count off half
+// would leave minus a half, which rounded away would take it back again,
+// and so on for ever.
+static int64_t
+whole(int64_t q16)
+{
+    return q16 < 0 ? -((-q16 + MOUSE_Q16_ONE / 2 - 1) >> 16) : (q16 + MOUSE_Q16_ONE / 2 - 1) >> 16;
+}
+
+bool
+mouse_shaper_pending(const MouseShaper *m)
+{
+    return whole(m->pending_x) != 0 || whole(m->pending_y) != 0;
+}
+
+uint32_t
+mouse_shaper_pending_counts(const MouseShaper *m)
+{
+    int64_t x = whole(m->pending_x), y = whole(m->pending_y);
+    if (x < 0)
+        x = -x;
+    if (y < 0)
+        y = -y;
+    return x > y ? x : y;
+}
+
+static int16_t
+take_axis(MouseShaper *m, int64_t *pending, bool *split)
+{
+    int64_t v = whole(*pending);
+    int16_t max = m->cfg->max_delta;
+    if (v > max) {
+        v = max;
+        *split = true;
+    } else if (v < -max) {
+        v = -max;
+        *split = true;
+    }
+    *pending -= v * MOUSE_Q16_ONE;
+    return v;
+}
+
+void
+mouse_shaper_take(MouseShaper *m, int16_t *dx, int16_t *dy)
+{
+    bool split = false;
+    *dx = take_axis(m, &m->pending_x, &split);
+    *dy = take_axis(m, &m->pending_y, &split);
+    m->out_x += *dx;
+    m->out_y += *dy;
+    if (split)
+        m->splits++;
+}
+
+void
+mouse_shaper_clear(MouseShaper *m)
+{
+    m->pending_x = 0;
+    m->pending_y = 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Mouse motion from USB counts to a host's packets, shared by the serial
+ * mouse backends.
+ *
+ * Motion is scaled in Q16 fixed point, and the fraction of a count that
+ * doesn't make it into a packet is carried to the next one rather than
+ * dropped, so slow movements still get somewhere and a round trip comes
+ * back to where it started. An optional acceleration curve scales faster
+ * movement up. Motion past what a packet can hold is split over as many
+ * packets as it takes rather than clamped.
+ *
+ * Nothing is lost: everything added comes out of mouse_shaper_take(),
+ * give or take the under half a count still held.
+ */
+
+#ifndef MOUSE_SHAPER_H_
+#define MOUSE_SHAPER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MOUSE_Q16_ONE 0x10000
+
+// Gain at a speed, in counts per second of USB motion; between points
+// it's interpolated, and past the ends it's the end's.
+typedef struct {
+    uint32_t speed;
+    uint32_t gain_q16;
+} MouseAccelPoint;
+
+typedef struct {
+    uint32_t scale_q16;         // out counts per USB count, before the curve
+    const MouseAccelPoint *curve;   // NULL for none
+    uint8_t curve_len;
+    int16_t max_delta;          // the most a packet's field holds
+} MouseShaperConfig;
+
+// Below 400 counts/s as is, to twice as far by 2000 counts/s, for hosts
+// whose software doesn't accelerate.
+extern const MouseAccelPoint mouse_curve_mild[];
+#define MOUSE_CURVE_MILD_LEN 3
+
+typedef struct {
+    const MouseShaperConfig *cfg;
+
+    // in Q16: scaled motion not yet sent, whole counts and fraction
+    int64_t pending_x;
+    int64_t pending_y;
+
+    uint32_t last_us;
+    bool have_last;
+
+    // what went in and came out, for the tests and the debug console
+    int64_t in_x, in_y;
+    int64_t out_x, out_y;
+    uint32_t splits;            // packets sent with more motion left over
+} MouseShaper;
+
+void mouse_shaper_init(MouseShaper *m, const MouseShaperConfig *cfg);
+
+// A USB report's motion, at now_us; the speed for the curve comes from
+// the time since the last one.
+void mouse_shaper_add(MouseShaper *m, int32_t dx, int32_t dy, uint32_t now_us);
+
+// Whether there's at least a whole count to send.
+bool mouse_shaper_pending(const MouseShaper *m);
+
+// How much there is, in whole counts of the larger axis; for pacing.
+uint32_t mouse_shaper_pending_counts(const MouseShaper *m);
+
+// The next packet's motion, each within the configured max_delta; what
+// doesn't fit stays pending. Both 0 if there's nothing to send.
+void mouse_shaper_take(MouseShaper *m, int16_t *dx, int16_t *dy);
+
+// Drops whatever is pending, e.g. when the host stops taking motion.
+void mouse_shaper_clear(MouseShaper *m);
+
+#endif
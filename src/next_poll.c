@@ -0,0 +1,69 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "next_poll.h"
+
+// as in host_next.c
+#define KM_MASTER 0x10
+#define KM_MOUSE_ADDR 0x01
+
+#define MOUSE_LEFT_UP   0x0080
+#define MOUSE_RIGHT_UP  0x8000
+
+void
+next_poll_init(NextPoll *p)
+{
+    memset(p, 0, sizeof(*p));
+    // until the host says otherwise
+    p->mask = 0xff;
+}
+
+void
+next_poll_seen(NextPoll *p, uint32_t data, uint32_t now_us)
+{
+    p->mask = data >> 24;
+    p->speed = data & 0xffffff;
+    p->polls++;
+
+    if (p->have_last) {
+        uint32_t dt = now_us - p->last_us;
+        if (dt >= NEXT_POLL_RESTART_US)
+            p->interval_us = 0;
+        else if (!p->interval_us)
+            p->interval_us = dt;
+        else
+            p->interval_us = (p->interval_us * 7 + dt) / 8;
+    }
+    p->last_us = now_us;
+    p->have_last = true;
+}
+
+bool
+next_poll_wants_mouse(const NextPoll *p)
+{
+    return p->mask != 0;
+}
+
+static uint32_t
+field(int16_t v)
+{
+    if (v > NEXT_MOUSE_MAX_DELTA)
+        v = NEXT_MOUSE_MAX_DELTA;
+    if (v < -NEXT_MOUSE_MAX_DELTA)
+        v = -NEXT_MOUSE_MAX_DELTA;
+    return (uint32_t) -v & 0x7f;
+}
+
+uint32_t
+next_mouse_word(int16_t dx, int16_t dy, bool left, bool right)
+{
+    uint32_t data = (uint32_t) (KM_MASTER | KM_MOUSE_ADDR) << 24;
+    data |= field(dx) | (left ? 0 : MOUSE_LEFT_UP);
+    data |= field(dy) << 8 | (right ? 0 : MOUSE_RIGHT_UP);
+    return data;
+}
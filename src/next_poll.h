@@ -0,0 +1,58 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * NeXT keyboard/mouse polls. The host sends 0xc6 with a poll mask and
+ * speed, over and over, and each one gets a reply: a mouse event if
+ * there's motion or a button change waiting, 0x00 if not. Answering only
+ * when asked keeps mouse data off the wire while the host is sending, and
+ * the mouse moves at whatever rate the host polls.
+ *
+ * Only 0xc6 01fffff6 has been seen (NOTES.md, from Previous), so the mask
+ * and speed are kept and logged but not relied on: a zero mask turns
+ * mouse replies off, and the poll rate is measured rather than worked out
+ * from the speed field.
+ */
+
+#ifndef NEXT_POLL_H_
+#define NEXT_POLL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define NEXT_CMD_POLL 0xc6
+
+// the most a mouse event's 7-bit fields hold
+#define NEXT_MOUSE_MAX_DELTA 63
+
+// A gap longer than this is the host having stopped polling, not a slow
+// poll; the measured interval starts over.
+#define NEXT_POLL_RESTART_US 1000000
+
+typedef struct {
+    uint8_t mask;               // top byte of the poll's data
+    uint32_t speed;             // the low 24 bits, as sent
+    uint32_t interval_us;       // between polls, smoothed; 0 until two have been seen
+    uint32_t last_us;
+    bool have_last;
+
+    uint32_t polls;
+    uint32_t mouse_replies;
+} NextPoll;
+
+void next_poll_init(NextPoll *p);
+
+// A poll from the host with its data, at now_us.
+void next_poll_seen(NextPoll *p, uint32_t data, uint32_t now_us);
+
+// Whether this poll should be answered with mouse data if there is any.
+bool next_poll_wants_mouse(const NextPoll *p);
+
+// The data word of a mouse event: the master's mouse address, then each
+// delta in 7 bits of two's complement with its button's released bit
+// above it, y and right in the high byte. NeXT counts right and down as
+// negative, so the USB deltas are negated.
+uint32_t next_mouse_word(int16_t dx, int16_t dy, bool left, bool right);
+
+#endif
@@ -2,6 +2,25 @@
 #include "debug.h"
 #include "babelfish.h"
 
+ChannelConfig channels[NUM_CHANNELS] = {
+  {
+    .channel_num = 0,
+    .uart_num = 0,
+    .tx_gpio = TX_A_GPIO,
+    .rx_gpio = RX_A_GPIO,
+    .mux_s0_gpio = CH_A_S0_GPIO,
+    .mux_s1_gpio = CH_A_S1_GPIO,
+  },
+  {
+    .channel_num = 1,
+    .uart_num = 1,
+    .tx_gpio = TX_B_GPIO,
+    .rx_gpio = RX_B_GPIO,
+    .mux_s0_gpio = CH_B_S0_GPIO,
+    .mux_s1_gpio = CH_B_S1_GPIO,
+  }
+};
+
 void channel_init() {
   for (int ch = 0; ch < NUM_CHANNELS; ++ch) {
     ChannelConfig *cfg = &channels[ch];
@@ -24,6 +43,10 @@ void channel_config(int ch, ChannelMode mode) {
   DBG("Channel %c set config: 0x%08x\n", 'A' + ch, mode);
 
   ChannelConfig *cfg = &channels[ch];
+#if CHANNEL_UART_ON_PIO
+  if ((mode & ChannelModeOutputTypeMask) == ChannelModeUART)
+    mode = (mode & ~ChannelModeOutputTypeMask) | ChannelModePIO;
+#endif
   if (cfg->mode == mode)
     return;
 
@@ -36,6 +59,10 @@ void channel_config(int ch, ChannelMode mode) {
       gpio_set_function(cfg->tx_gpio, GPIO_FUNC_UART);
       gpio_set_function(cfg->rx_gpio, GPIO_FUNC_UART);
       break;
+    case ChannelModePIO:
+      gpio_set_function(cfg->tx_gpio, GPIO_FUNC_PIO1);
+      gpio_set_function(cfg->rx_gpio, GPIO_FUNC_PIO1);
+      break;
   }
 
   switch (mode & ChannelModeInvertMask) {
@@ -47,6 +74,14 @@ void channel_config(int ch, ChannelMode mode) {
       gpio_set_inover(cfg->rx_gpio, GPIO_OVERRIDE_INVERT);
       gpio_set_outover(cfg->tx_gpio, GPIO_OVERRIDE_INVERT);
       break;
+    case ChannelModeInvertTX:
+      gpio_set_inover(cfg->rx_gpio, GPIO_OVERRIDE_NORMAL);
+      gpio_set_outover(cfg->tx_gpio, GPIO_OVERRIDE_INVERT);
+      break;
+    case ChannelModeInvertRX:
+      gpio_set_inover(cfg->rx_gpio, GPIO_OVERRIDE_INVERT);
+      gpio_set_outover(cfg->tx_gpio, GPIO_OVERRIDE_NORMAL);
+      break;
   }
 
   uint8_t mux_mode = mode & ChannelModeOutputMask;
@@ -0,0 +1,361 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include <pico/stdlib.h>
+#include <pico/sync.h>
+
+#if !defined(TESTBENCH)
+#include <hardware/flash.h>
+#include <hardware/sync.h>
+#include <pico/multicore.h>
+#endif
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "plans"
+
+#include "babelfish.h"
+#include "plan_cache.h"
+
+// let a burst of mounts (every interface of a composite device, or a hub
+// full of them) land before paying for one erase
+#define PLAN_CACHE_WRITE_DELAY_MS 2000
+
+_Static_assert(sizeof(PlanCacheImage) <= PLAN_CACHE_SECTOR_SIZE, "plan cache doesn't fit in a flash sector");
+
+#if !defined(TESTBENCH)
+// the last sector of flash; nothing else uses it
+#define PLAN_CACHE_FLASH_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+#define PLAN_CACHE_PROGRAM_SIZE ((sizeof(PlanCacheImage) + FLASH_PAGE_SIZE - 1) & ~(FLASH_PAGE_SIZE - 1))
+
+static const PlanCacheImage *const flash_image = (const PlanCacheImage *) (XIP_BASE + PLAN_CACHE_FLASH_OFFSET);
+#else
+// the tests get a sector of RAM
+#define PLAN_CACHE_PROGRAM_SIZE sizeof(PlanCacheImage)
+
+static PlanCacheImage s_test_flash;
+static const PlanCacheImage *const flash_image = &s_test_flash;
+#endif
+
+static uint8_t s_write_buf[PLAN_CACHE_PROGRAM_SIZE];
+
+// what's in flash plus any stores not written yet; lookups read this, not
+// the flash, so a device re-plugged before the write still hits
+static PlanCacheImage s_image;
+static mutex_t s_mutex;
+static bool s_dirty = false;
+static uint32_t s_dirty_ms;
+static volatile bool s_enabled = true;
+static PlanCacheStats s_stats;
+
+uint32_t
+plan_cache_hash(const uint8_t *data, uint32_t len)
+{
+    uint32_t h = 0x811c9dc5;
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+static uint32_t
+entry_check(const PlanCacheEntry *e)
+{
+    return plan_cache_hash((const uint8_t *) e, offsetof(PlanCacheEntry, check));
+}
+
+static bool
+key_matches(const PlanCacheEntry *e, const PlanCacheKey *key)
+{
+    return e->vid == key->vid && e->pid == key->pid &&
+           e->desc_hash == key->desc_hash && e->desc_len == key->desc_len;
+}
+
+static bool
+field_fits(const HidField *f, uint16_t length)
+{
+    return f->bit_size <= 32 && (uint32_t) f->bit_offset + f->bit_size <= (uint32_t) length * 8;
+}
+
+// Everything hid_plan_read() and friends trust about a plan, since a plan
+// here came from flash rather than from hid_plan_compile().
+static bool
+entry_valid(const PlanCacheEntry *e)
+{
+    if (e->check != entry_check(e) || e->count > HID_PLAN_MAX_REPORTS || e->uses_ids > 1 ||
+        e->has_leds > 1)
+        return false;
+
+    for (uint8_t i = 0; i < e->count; i++) {
+        const HidReportPlan *rp = &e->reports[i];
+        if (rp->kind == HidReportKeyboard) {
+            const HidKeyboardPlan *k = &rp->kbd;
+            if (!field_fits(&k->modifiers, rp->length) ||
+                (uint32_t) k->keys.bit_offset + (uint32_t) k->key_count * k->keys.bit_size > (uint32_t) rp->length * 8 ||
+                k->keys.bit_size > 8 ||
+                (uint32_t) k->bitmap.bit_offset + k->bitmap_count > (uint32_t) rp->length * 8 ||
+                (uint32_t) k->bitmap_first + k->bitmap_count > 256)
+                return false;
+        } else if (rp->kind == HidReportMouse) {
+            const HidMousePlan *m = &rp->mouse;
+            if (!field_fits(&m->buttons, rp->length) || !field_fits(&m->x, rp->length) ||
+                !field_fits(&m->y, rp->length) || !field_fits(&m->wheel, rp->length) ||
+                !field_fits(&m->pan, rp->length))
+                return false;
+        } else if (rp->kind != HidReportOther) {
+            return false;
+        }
+
+        // report IDs must be unique, or by_id can't be rebuilt
+        for (uint8_t j = 0; j < i; j++) {
+            if (e->reports[j].report_id == rp->report_id)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void
+plan_cache_image_clear(PlanCacheImage *image)
+{
+    memset(image, 0, sizeof(*image));
+    image->magic = PLAN_CACHE_MAGIC;
+    image->entry_size = sizeof(PlanCacheEntry);
+}
+
+bool
+plan_cache_image_valid(const PlanCacheImage *image)
+{
+    return image->magic == PLAN_CACHE_MAGIC && image->entry_size == sizeof(PlanCacheEntry) &&
+           image->count <= PLAN_CACHE_ENTRIES;
+}
+
+uint16_t
+plan_cache_image_scrub(PlanCacheImage *image)
+{
+    uint16_t kept = 0;
+
+    for (uint16_t i = 0; i < image->count; i++) {
+        if (!entry_valid(&image->entries[i]))
+            continue;
+        if (kept != i)
+            image->entries[kept] = image->entries[i];
+        kept++;
+    }
+
+    uint16_t dropped = image->count - kept;
+    image->count = kept;
+    return dropped;
+}
+
+bool
+plan_cache_image_find(const PlanCacheImage *image, const PlanCacheKey *key, HidDevicePlan *plan, uint8_t *protocol)
+{
+    for (uint16_t i = 0; i < image->count; i++) {
+        const PlanCacheEntry *e = &image->entries[i];
+        if (!key_matches(e, key))
+            continue;
+
+        memset(plan->by_id, HID_PLAN_NO_REPORT, sizeof(plan->by_id));
+        plan->count = e->count;
+        plan->uses_ids = e->uses_ids;
+        plan->has_leds = e->has_leds;
+        plan->led_report_id = e->led_report_id;
+        memcpy(plan->reports, e->reports, sizeof(plan->reports));
+        for (uint8_t r = 0; r < e->count; r++)
+            plan->by_id[e->reports[r].report_id] = r;
+        *protocol = e->protocol;
+        return true;
+    }
+
+    return false;
+}
+
+void
+plan_cache_image_put(PlanCacheImage *image, const PlanCacheKey *key, const HidDevicePlan *plan, uint8_t protocol)
+{
+    PlanCacheEntry *e = NULL;
+
+    for (uint16_t i = 0; i < image->count && !e; i++) {
+        if (key_matches(&image->entries[i], key))
+            e = &image->entries[i];
+    }
+
+    if (!e && image->count < PLAN_CACHE_ENTRIES)
+        e = &image->entries[image->count++];
+
+    if (!e) {
+        e = &image->entries[0];
+        for (uint16_t i = 1; i < image->count; i++) {
+            if (image->entries[i].stamp < e->stamp)
+                e = &image->entries[i];
+        }
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->vid = key->vid;
+    e->pid = key->pid;
+    e->desc_hash = key->desc_hash;
+    e->desc_len = key->desc_len;
+    e->protocol = protocol;
+    e->count = plan->count;
+    e->uses_ids = plan->uses_ids;
+    e->has_leds = plan->has_leds;
+    e->led_report_id = plan->led_report_id;
+    e->stamp = ++image->generation;
+    memcpy(e->reports, plan->reports, sizeof(e->reports));
+    e->check = entry_check(e);
+}
+
+void
+plan_cache_key(PlanCacheKey *key, uint16_t vid, uint16_t pid, const uint8_t *desc, uint16_t desc_len)
+{
+    key->vid = vid;
+    key->pid = pid;
+    key->desc_hash = plan_cache_hash(desc, desc_len);
+    key->desc_len = desc_len;
+}
+
+void
+plan_cache_init(void)
+{
+    mutex_init(&s_mutex);
+
+    if (plan_cache_image_valid(flash_image)) {
+        memcpy(&s_image, flash_image, sizeof(s_image));
+        s_stats.rejected += plan_cache_image_scrub(&s_image);
+        DBG("plan cache: %u devices, %lu dropped\n", s_image.count, s_stats.rejected);
+    } else {
+        plan_cache_image_clear(&s_image);
+        DBG("plan cache: empty\n");
+    }
+}
+
+bool
+plan_cache_lookup(const PlanCacheKey *key, HidDevicePlan *plan, uint8_t *protocol)
+{
+    if (!s_enabled)
+        return false;
+
+    mutex_enter_blocking(&s_mutex);
+    bool found = plan_cache_image_find(&s_image, key, plan, protocol);
+    if (found)
+        s_stats.hits++;
+    else
+        s_stats.misses++;
+    mutex_exit(&s_mutex);
+
+    return found;
+}
+
+void
+plan_cache_store(const PlanCacheKey *key, const HidDevicePlan *plan, uint8_t protocol)
+{
+    if (!s_enabled)
+        return;
+
+    mutex_enter_blocking(&s_mutex);
+    plan_cache_image_put(&s_image, key, plan, protocol);
+    s_dirty = true;
+    s_dirty_ms = to_ms_since_boot(get_absolute_time());
+    mutex_exit(&s_mutex);
+}
+
+static void
+write_flash(void)
+{
+#if !defined(TESTBENCH)
+    // Nothing can run from flash on either core while it's being erased:
+    // park core1 (and with it the USB host) and keep our own interrupts off.
+    // Devices see a ~50 ms gap in SOFs, which is why this waits for mounts
+    // to settle and only happens when something new was seen.
+    multicore_lockout_start_blocking();
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_erase(PLAN_CACHE_FLASH_OFFSET, FLASH_SECTOR_SIZE);
+    flash_range_program(PLAN_CACHE_FLASH_OFFSET, s_write_buf, sizeof(s_write_buf));
+    restore_interrupts(ints);
+    multicore_lockout_end_blocking();
+#else
+    memcpy(&s_test_flash, s_write_buf, sizeof(s_test_flash));
+#endif
+}
+
+void
+plan_cache_task(void)
+{
+    if (!s_dirty)
+        return;
+
+    uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+    if (now_ms - s_dirty_ms < PLAN_CACHE_WRITE_DELAY_MS)
+        return;
+
+    mutex_enter_blocking(&s_mutex);
+    memset(s_write_buf, 0xff, sizeof(s_write_buf));
+    memcpy(s_write_buf, &s_image, sizeof(s_image));
+    s_dirty = false;
+    mutex_exit(&s_mutex);
+
+    uint32_t start_us = time_us_32();
+    write_flash();
+    s_stats.write_us = time_us_32() - start_us;
+    s_stats.writes++;
+
+    DBG("plan cache: wrote %u devices in %lu us\n", s_image.count, s_stats.write_us);
+}
+
+void
+plan_cache_set_enabled(bool enabled)
+{
+    s_enabled = enabled;
+}
+
+bool
+plan_cache_enabled(void)
+{
+    return s_enabled;
+}
+
+void
+plan_cache_clear(void)
+{
+    mutex_enter_blocking(&s_mutex);
+    plan_cache_image_clear(&s_image);
+    s_dirty = true;
+    // no reason to wait
+    s_dirty_ms = to_ms_since_boot(get_absolute_time()) - PLAN_CACHE_WRITE_DELAY_MS;
+    mutex_exit(&s_mutex);
+}
+
+void
+plan_cache_note_plan_time(bool cached, uint32_t us)
+{
+    if (cached)
+        s_stats.plan_us_cached = us;
+    else
+        s_stats.plan_us_compiled = us;
+}
+
+void
+plan_cache_note_first_key(bool cached, uint32_t us)
+{
+    if (cached)
+        s_stats.first_key_us_cached = us;
+    else
+        s_stats.first_key_us_compiled = us;
+}
+
+void
+get_plan_cache_stats(PlanCacheStats *stats)
+{
+    mutex_enter_blocking(&s_mutex);
+    *stats = s_stats;
+    mutex_exit(&s_mutex);
+}
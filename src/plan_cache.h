@@ -0,0 +1,111 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Compiled HID plans (src/hid_plan.h) and the protocol we chose for each
+ * interface, kept in the last sector of flash and keyed by VID/PID plus a
+ * hash of the report descriptor, so a device we've seen before (a KVM
+ * switching back to us) goes straight to reading reports on re-mount.
+ *
+ * Lookups happen on the USB core at mount time. Stores are collected in RAM
+ * and written from the mainloop core in one erase/program once mounts have
+ * settled, with the USB core locked out while flash is unavailable.
+ */
+
+#ifndef PLAN_CACHE_H_
+#define PLAN_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hid_plan.h"
+
+// bumped when an entry's layout changes without its size
+#define PLAN_CACHE_MAGIC 0x32434642     // "BFC2"
+#define PLAN_CACHE_ENTRIES 16
+#define PLAN_CACHE_SECTOR_SIZE 4096
+
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t desc_hash;
+    uint16_t desc_len;
+} PlanCacheKey;
+
+typedef struct {
+    uint16_t vid;
+    uint16_t pid;
+    uint32_t desc_hash;
+    uint16_t desc_len;
+    uint8_t protocol;       // HID_PROTOCOL_BOOT or HID_PROTOCOL_REPORT
+    uint8_t count;
+    uint8_t uses_ids;
+    uint8_t has_leds;
+    uint8_t led_report_id;
+    uint8_t reserved[1];
+    uint32_t stamp;         // image generation when last stored; oldest is replaced first
+    HidReportPlan reports[HID_PLAN_MAX_REPORTS];
+    uint32_t check;         // plan_cache_hash() of everything above
+} PlanCacheEntry;
+
+// The flash sector as laid out in memory. An erased sector (all 0xff) or
+// one written by a build with a different entry layout reads as empty.
+typedef struct {
+    uint32_t magic;
+    uint16_t entry_size;
+    uint16_t count;
+    uint32_t generation;
+    PlanCacheEntry entries[PLAN_CACHE_ENTRIES];
+} PlanCacheImage;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t rejected;      // entries dropped at load for not validating
+    uint32_t writes;
+    uint32_t write_us;      // last erase + program, with the USB core held
+    // mount callback, descriptor to plan ready, and mount to the first
+    // report with a key down in it, for the last device each way
+    uint32_t plan_us_cached;
+    uint32_t plan_us_compiled;
+    uint32_t first_key_us_cached;
+    uint32_t first_key_us_compiled;
+} PlanCacheStats;
+
+// FNV-1a
+uint32_t plan_cache_hash(const uint8_t *data, uint32_t len);
+
+// The image format on its own, independent of where the image lives.
+void plan_cache_image_clear(PlanCacheImage *image);
+bool plan_cache_image_valid(const PlanCacheImage *image);
+// Drops entries that fail their check or describe fields outside their
+// report, so find doesn't have to. Returns how many were dropped.
+uint16_t plan_cache_image_scrub(PlanCacheImage *image);
+bool plan_cache_image_find(const PlanCacheImage *image, const PlanCacheKey *key,
+                           HidDevicePlan *plan, uint8_t *protocol);
+void plan_cache_image_put(PlanCacheImage *image, const PlanCacheKey *key,
+                          const HidDevicePlan *plan, uint8_t protocol);
+
+void plan_cache_key(PlanCacheKey *key, uint16_t vid, uint16_t pid, const uint8_t *desc, uint16_t desc_len);
+
+// Core0, before core1 starts.
+void plan_cache_init(void);
+// Core1, from the HID mount callback.
+bool plan_cache_lookup(const PlanCacheKey *key, HidDevicePlan *plan, uint8_t *protocol);
+void plan_cache_store(const PlanCacheKey *key, const HidDevicePlan *plan, uint8_t protocol);
+// Core0, from the mainloop; writes pending stores to flash.
+void plan_cache_task(void);
+
+// Disabling makes every lookup miss (and skips storing), for comparing
+// attach times with and without the cache.
+void plan_cache_set_enabled(bool enabled);
+bool plan_cache_enabled(void);
+// Erases the sector on the next plan_cache_task().
+void plan_cache_clear(void);
+
+void plan_cache_note_plan_time(bool cached, uint32_t us);
+void plan_cache_note_first_key(bool cached, uint32_t us);
+void get_plan_cache_stats(PlanCacheStats *stats);
+
+#endif
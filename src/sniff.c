@@ -0,0 +1,358 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include <pico/stdlib.h>
+#include <hardware/uart.h>
+#include <hardware/dma.h>
+#include <hardware/timer.h>
+
+#define DEBUG_VERBOSE 0
+#define DEBUG_TAG "sniff"
+
+#include "babelfish.h"
+#include "chan_uart.h"
+#include "sniff.h"
+
+#define RX_MASK (SNIFF_RX_RING - 1)
+#define TX_MASK (SNIFF_TX_RING - 1)
+
+_Static_assert((SNIFF_RX_RING & RX_MASK) == 0, "RX ring size must be a power of two");
+_Static_assert((SNIFF_TX_RING & TX_MASK) == 0, "TX ring size must be a power of two");
+
+// how long a frame collects bytes before it's sent anyway
+#define FLUSH_US 2000
+
+#define UART_BITS (1 + SNIFF_DATA_BITS + (SNIFF_PARITY != UART_PARITY_NONE) + SNIFF_STOP_BITS)
+#define BYTE_US (UART_BITS * 1000000u / SNIFF_BAUD)
+
+// Written by DMA: the UART data register, error bits in 8-11, and the
+// timer alongside. The DMA write ring wraps on its size in bytes, so each
+// has to be aligned to it.
+static uint16_t s_rx_bytes[NUM_CHANNELS][SNIFF_RX_RING] __attribute__((aligned(SNIFF_RX_RING * 2)));
+static uint32_t s_rx_times[NUM_CHANNELS][SNIFF_RX_RING] __attribute__((aligned(SNIFF_RX_RING * 4)));
+
+typedef struct {
+    bool capturing;
+    int byte_dma;
+    int ts_dma;
+    uint16_t tail;
+} SniffRx;
+
+// filled by the TX tap, in interrupt context
+typedef struct {
+    uint8_t bytes[SNIFF_TX_RING];
+    uint32_t times[SNIFF_TX_RING];
+    volatile uint16_t head;
+    uint16_t tail;
+    volatile uint32_t lost;
+    uint32_t lost_reported;
+} SniffTx;
+
+typedef struct {
+    SniffFrame frame;
+    bool open;
+    uint32_t opened_us;
+    uint32_t lost;
+    bool lost_unknown;          // the DMA ring lapped; no telling how much
+} SniffStream;
+
+static SniffRx s_rx[NUM_CHANNELS];
+static SniffTx s_tx[NUM_CHANNELS];
+static SniffStream s_streams[SNIFF_STREAMS];
+static bool s_connected = false;
+static bool s_info_sent = false;
+
+static bool
+send_frame(const SniffFrame *f)
+{
+    uint8_t wire[SNIFF_FRAME_WIRE_MAX];
+    uint16_t len = sniff_frame_finish(f, wire);
+    return debug_write(wire, len) == len;
+}
+
+static void
+stream_flush(SniffStream *s)
+{
+    if (!s->open)
+        return;
+    if (!send_frame(&s->frame))
+        s->lost += s->frame.entries;
+    s->open = false;
+}
+
+// false if the CDC has no room for the frame this would finish; the byte
+// stays where it is, to be tried again
+static bool
+stream_add(uint8_t stream, uint8_t byte, uint8_t err, uint32_t t_us)
+{
+    SniffStream *s = &s_streams[stream];
+
+    if (s->open && sniff_frame_add_byte(&s->frame, byte, err, t_us))
+        return true;
+
+    if (debug_write_available() < SNIFF_FRAME_WIRE_MAX * 2)
+        return false;
+    stream_flush(s);
+
+    sniff_frame_begin(&s->frame, SniffFrameBytes, stream, t_us);
+    sniff_frame_add_byte(&s->frame, byte, err, t_us);
+    s->open = true;
+    s->opened_us = time_us_32();
+    return true;
+}
+
+static void
+report_lost(uint8_t stream)
+{
+    SniffStream *s = &s_streams[stream];
+    if (!s->lost && !s->lost_unknown)
+        return;
+
+    SniffFrame f;
+    sniff_frame_begin(&f, SniffFrameLost, stream, time_us_32());
+    sniff_frame_add_varint(&f, s->lost_unknown ? 0 : s->lost);
+    if (send_frame(&f)) {
+        s->lost = 0;
+        s->lost_unknown = false;
+    }
+}
+
+static bool
+send_info(void)
+{
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        for (int tx = 0; tx < 2; tx++) {
+            uint8_t flags = 0;
+            if (tx ? SNIFF_CAPTURE_TX : s_rx[ch].capturing)
+                flags |= SNIFF_INFO_CAPTURE;
+            if (tx && ch == SNIFF_BRIDGE_CH)
+                flags |= SNIFF_INFO_BRIDGE;
+
+            SniffFrame f;
+            sniff_frame_begin(&f, SniffFrameInfo, SNIFF_STREAM(ch, tx), time_us_32());
+            sniff_frame_add_varint(&f, SNIFF_BAUD);
+            uint8_t fmt[] = { SNIFF_DATA_BITS, SNIFF_PARITY, SNIFF_STOP_BITS, flags };
+            sniff_frame_add(&f, fmt, sizeof(fmt));
+            if (!send_frame(&f))
+                return false;
+        }
+    }
+    return true;
+}
+
+//
+// capture
+//
+
+static void
+rx_start(uint8_t ch)
+{
+    SniffRx *r = &s_rx[ch];
+
+    // chan_uart_pio has the RX FIFO, and its own DMA on it
+    if ((channels[ch].mode & ChannelModeOutputTypeMask) != ChannelModeUART) {
+        DBG("channel %c isn't on a hardware UART, not captured\n", 'A' + ch);
+        return;
+    }
+
+    uart_inst_t *uart = channels[ch].uart_num == 0 ? uart0 : uart1;
+    r->byte_dma = dma_claim_unused_channel(true);
+    r->ts_dma = dma_claim_unused_channel(true);
+
+    // one byte, then one timestamp, each triggering the other; a count of
+    // 1 reloads on every trigger, and the write addresses carry on around
+    // the rings
+    dma_channel_config bc = dma_channel_get_default_config(r->byte_dma);
+    channel_config_set_transfer_data_size(&bc, DMA_SIZE_16);
+    channel_config_set_read_increment(&bc, false);
+    channel_config_set_write_increment(&bc, true);
+    channel_config_set_ring(&bc, true, __builtin_ctz(SNIFF_RX_RING * 2));
+    channel_config_set_dreq(&bc, uart_get_dreq(uart, false));
+    channel_config_set_chain_to(&bc, r->ts_dma);
+
+    dma_channel_config tc = dma_channel_get_default_config(r->ts_dma);
+    channel_config_set_transfer_data_size(&tc, DMA_SIZE_32);
+    channel_config_set_read_increment(&tc, false);
+    channel_config_set_write_increment(&tc, true);
+    channel_config_set_ring(&tc, true, __builtin_ctz(SNIFF_RX_RING * 4));
+    channel_config_set_dreq(&tc, DREQ_FORCE);
+    channel_config_set_chain_to(&tc, r->byte_dma);
+
+    memset(s_rx_times[ch], 0, sizeof(s_rx_times[ch]));
+    r->tail = 0;
+    dma_channel_configure(r->ts_dma, &tc, s_rx_times[ch], &timer_hw->timerawl, 1, false);
+    dma_channel_configure(r->byte_dma, &bc, s_rx_bytes[ch], &uart_get_hw(uart)->dr, 1, true);
+    r->capturing = true;
+}
+
+// where the DMA writes its next timestamp; every entry before it is whole
+static uint16_t
+rx_head(const SniffRx *r, uint8_t ch)
+{
+    uint32_t addr = dma_hw->ch[r->ts_dma].write_addr;
+    return (addr - (uint32_t) s_rx_times[ch]) / 4 & RX_MASK;
+}
+
+static void
+drain_rx(uint8_t ch)
+{
+    SniffRx *r = &s_rx[ch];
+    uint8_t stream = SNIFF_STREAM(ch, false);
+    if (!r->capturing)
+        return;
+
+    uint16_t head = rx_head(r, ch);
+    uint16_t n = (head - r->tail) & RX_MASK;
+
+    // Read entries have their stamp zeroed, so a stamp where the DMA
+    // writes next means it's been all the way around since: the ring is
+    // the newest SNIFF_RX_RING bytes, oldest at head.
+    if (s_rx_times[ch][head] && rx_head(r, ch) == head) {
+        s_streams[stream].lost_unknown = true;
+        r->tail = head;
+        n = SNIFF_RX_RING;
+    }
+
+    for (; n; n--) {
+        uint16_t i = r->tail;
+        uint16_t v = s_rx_bytes[ch][i];
+        if (!stream_add(stream, v & 0xff, (v >> 8) & 0x0f, s_rx_times[ch][i]))
+            break;
+        s_rx_times[ch][i] = 0;
+        r->tail = (i + 1) & RX_MASK;
+    }
+}
+
+static void
+tx_tap(uint8_t ch, uint8_t byte, uint32_t done_us)
+{
+    SniffTx *t = &s_tx[ch];
+    uint16_t next = (t->head + 1) & TX_MASK;
+    if (next == t->tail) {
+        t->lost++;
+        return;
+    }
+    t->bytes[t->head] = byte;
+    t->times[t->head] = done_us;
+    t->head = next;
+}
+
+static void
+drain_tx(uint8_t ch)
+{
+    SniffTx *t = &s_tx[ch];
+    uint8_t stream = SNIFF_STREAM(ch, true);
+
+    uint32_t lost = t->lost;
+    s_streams[stream].lost += lost - t->lost_reported;
+    t->lost_reported = lost;
+
+    while (t->tail != t->head) {
+        if (!stream_add(stream, t->bytes[t->tail], 0, t->times[t->tail]))
+            break;
+        t->tail = (t->tail + 1) & TX_MASK;
+    }
+}
+
+// console output, from any core or interrupt; a frame per call or so
+static void
+sniff_text(const char *buf, int len)
+{
+    while (len > 0) {
+        SniffFrame f;
+        sniff_frame_begin(&f, SniffFrameText, 0, time_us_32());
+        uint16_t n = sniff_frame_add(&f, buf, len);
+        send_frame(&f);
+        buf += n;
+        len -= n;
+    }
+}
+
+//
+// the host
+//
+
+void
+sniff_init()
+{
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        channel_config(ch, SNIFF_CHANNEL_MODE);
+        // no RX handler: the RX FIFO is left to the DMA
+        chan_uart_init(ch, NULL);
+        chan_uart_set_format(ch, SNIFF_BAUD, SNIFF_DATA_BITS, SNIFF_STOP_BITS, SNIFF_PARITY);
+        // no gap, but the byte time, so sent bytes have a time on the wire
+        chan_uart_set_pacing(ch, BYTE_US, 0);
+#if SNIFF_CAPTURE_TX
+        chan_uart_set_tx_tap(ch, tx_tap);
+#endif
+        rx_start(ch);
+    }
+
+    DBG("sniffing both channels at %u baud, bridge on %c\n", SNIFF_BAUD,
+        SNIFF_BRIDGE_CH >= 0 ? 'A' + SNIFF_BRIDGE_CH : '-');
+    debug_set_raw(sniff_text);
+}
+
+void
+sniff_update()
+{
+    bool connected = debug_connected();
+    if (!connected) {
+        // nothing is read, so the boot traffic waits in the rings
+        s_connected = s_info_sent = false;
+        return;
+    }
+    if (!s_connected) {
+        // ends whatever the PC's tty had before, so the first frame reads
+        static const uint8_t delimiter = 0x00;
+        debug_write(&delimiter, 1);
+        s_connected = true;
+        for (int i = 0; i < SNIFF_STREAMS; i++)
+            s_streams[i].open = false;
+    }
+    if (!s_info_sent) {
+        s_info_sent = send_info();
+        if (!s_info_sent)
+            return;
+    }
+
+#if SNIFF_BRIDGE_CH >= 0
+    // only what the channel has room for, so a PC sending faster than the
+    // line is held off by the CDC instead
+    uint8_t buf[64];
+    uint16_t room = chan_uart_tx_free(SNIFF_BRIDGE_CH);
+    if (room > sizeof(buf))
+        room = sizeof(buf);
+    int n = room ? debug_read(buf, room) : 0;
+    if (n > 0)
+        chan_uart_write(SNIFF_BRIDGE_CH, buf, n);
+#endif
+
+    for (uint8_t ch = 0; ch < NUM_CHANNELS; ch++) {
+        drain_rx(ch);
+        drain_tx(ch);
+    }
+
+    uint32_t now = time_us_32();
+    for (uint8_t i = 0; i < SNIFF_STREAMS; i++) {
+        SniffStream *s = &s_streams[i];
+        if (s->open && now - s->opened_us >= FLUSH_US)
+            stream_flush(s);
+        report_lost(i);
+    }
+}
+
+void
+sniff_kbd_event(const KeyboardEvent event)
+{
+}
+
+void
+sniff_mouse_event(const MouseEvent event)
+{
+}
@@ -0,0 +1,57 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Line sniffer: the "sniff" host. Instead of emulating a keyboard, both
+ * channels listen, and every byte received goes to the CDC console with
+ * its time, in the binary framing of sniff_frame.h. test/sniff_decode
+ * turns a capture back into annotated text.
+ *
+ * Each channel's RX is a pair of chained DMA channels: one moves the byte
+ * out of the UART's data register, error bits and all, and triggers the
+ * other, which copies the timer's low word alongside it. Capture costs no
+ * interrupt and no mainloop time per byte, and a byte's timestamp is when
+ * the UART had it, not when the mainloop got around to it; the rings hold
+ * a few seconds at 1200 baud while the CDC catches up.
+ *
+ * Bytes we send ourselves are captured too (SNIFF_CAPTURE_TX), stamped
+ * with when chan_uart expects them to be off the wire.
+ *
+ * Bridge mode: what the PC sends on the CDC goes out on SNIFF_BRIDGE_CH at
+ * line rate. The CDC is only read as fast as the channel's TX ring empties,
+ * so the PC is held off by USB rather than bytes being dropped here.
+ *
+ * The console's commands are gone while sniffing; its log output is sent
+ * as text frames.
+ */
+
+#ifndef SNIFF_H_
+#define SNIFF_H_
+
+#include "sniff_frame.h"
+
+// both channels' line; a listener has to be told, as it can't ask
+#ifndef SNIFF_BAUD
+#define SNIFF_BAUD 1200
+#endif
+#define SNIFF_DATA_BITS 8
+#define SNIFF_STOP_BITS 1
+#define SNIFF_PARITY UART_PARITY_EVEN
+#define SNIFF_CHANNEL_MODE (ChannelModeLevelShifter | ChannelModeUART)
+
+#ifndef SNIFF_CAPTURE_TX
+#define SNIFF_CAPTURE_TX 1
+#endif
+
+// -1 for no bridge
+#ifndef SNIFF_BRIDGE_CH
+#define SNIFF_BRIDGE_CH 0
+#endif
+
+// per channel, entries; powers of two. The RX rings are written by DMA and
+// have to be aligned to their size in bytes.
+#define SNIFF_RX_RING 512
+#define SNIFF_TX_RING 256
+
+#endif
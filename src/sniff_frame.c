@@ -0,0 +1,230 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "sniff_frame.h"
+
+// the longest varint a uint32_t needs
+#define VARINT_MAX 5
+
+// frame contents, leaving room for the CRC
+#define BODY_MAX (SNIFF_FRAME_MAX - 1)
+
+static uint8_t
+crc8(const uint8_t *p, uint16_t len)
+{
+    uint8_t crc = 0;
+    for (uint16_t i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (int b = 0; b < 8; b++)
+            crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+    return crc;
+}
+
+static uint16_t
+put_varint(uint8_t *p, uint32_t v)
+{
+    uint16_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+void
+sniff_frame_begin(SniffFrame *f, SniffFrameKind kind, uint8_t stream, uint32_t t_us)
+{
+    f->buf[0] = (kind << 4) | (stream & 0x0f);
+    f->len = 1 + put_varint(f->buf + 1, t_us);
+    f->last_us = t_us;
+    f->entries = 0;
+}
+
+bool
+sniff_frame_add_byte(SniffFrame *f, uint8_t byte, uint8_t err, uint32_t t_us)
+{
+    uint32_t delta = t_us - f->last_us;
+    // out of order by a little, from TX estimates against RX stamps
+    if (delta >= SNIFF_FRAME_MAX_DELTA_US) {
+        if ((int32_t) delta < 0 && (int32_t) delta > -(int32_t) SNIFF_FRAME_MAX_DELTA_US)
+            delta = 0;
+        else
+            return false;
+    }
+    if (f->len + VARINT_MAX + 2 > BODY_MAX)
+        return false;
+
+    f->len += put_varint(f->buf + f->len, (delta << 1) | (err ? 1 : 0));
+    f->buf[f->len++] = byte;
+    if (err)
+        f->buf[f->len++] = err;
+    f->last_us += delta;
+    f->entries++;
+    return true;
+}
+
+uint16_t
+sniff_frame_add(SniffFrame *f, const void *data, uint16_t len)
+{
+    uint16_t room = BODY_MAX - f->len;
+    if (len > room)
+        len = room;
+    memcpy(f->buf + f->len, data, len);
+    f->len += len;
+    return len;
+}
+
+void
+sniff_frame_add_varint(SniffFrame *f, uint32_t v)
+{
+    if (f->len + VARINT_MAX <= BODY_MAX)
+        f->len += put_varint(f->buf + f->len, v);
+}
+
+uint16_t
+sniff_frame_finish(const SniffFrame *f, uint8_t *out)
+{
+    // COBS: each run of non-zero bytes is preceded by its length + 1, and
+    // the zero that ends it is implied; runs are at most 254 long
+    uint16_t code_at = 0;
+    uint16_t o = 1;
+    uint8_t code = 1;
+    uint8_t crc = crc8(f->buf, f->len);
+
+    for (uint16_t i = 0; i <= f->len; i++) {
+        uint8_t b = i < f->len ? f->buf[i] : crc;
+        if (b == 0) {
+            out[code_at] = code;
+            code_at = o++;
+            code = 1;
+            continue;
+        }
+        out[o++] = b;
+        if (++code == 0xff) {
+            out[code_at] = code;
+            code_at = o++;
+            code = 1;
+        }
+    }
+    out[code_at] = code;
+    out[o++] = 0x00;
+    return o;
+}
+
+//
+// decoding
+//
+
+void
+sniff_decoder_init(SniffDecoder *d)
+{
+    memset(d, 0, sizeof(*d));
+}
+
+bool
+sniff_frame_get_varint(const uint8_t *body, uint16_t len, uint16_t *pos, uint32_t *v)
+{
+    uint32_t r = 0;
+    for (int shift = 0; shift < 7 * VARINT_MAX; shift += 7) {
+        if (*pos >= len)
+            return false;
+        uint8_t b = body[(*pos)++];
+        r |= (uint32_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = r;
+            return true;
+        }
+    }
+    return false;
+}
+
+// un-COBS raw into frame; the length, or -1 if it's malformed
+static int
+cobs_decode(const uint8_t *raw, uint16_t len, uint8_t *frame)
+{
+    uint16_t i = 0, o = 0;
+    while (i < len) {
+        uint8_t code = raw[i++];
+        if (code == 0 || i + code - 1 > len)
+            return -1;
+        for (uint8_t k = 1; k < code; k++) {
+            if (o >= SNIFF_FRAME_MAX)
+                return -1;
+            frame[o++] = raw[i++];
+        }
+        if (code != 0xff && i < len) {
+            if (o >= SNIFF_FRAME_MAX)
+                return -1;
+            frame[o++] = 0;
+        }
+    }
+    return o;
+}
+
+bool
+sniff_decoder_push(SniffDecoder *d, uint8_t b, SniffFrameView *v)
+{
+    if (b != 0x00) {
+        if (d->raw_len < sizeof(d->raw))
+            d->raw[d->raw_len++] = b;
+        else
+            d->overflow = true;
+        return false;
+    }
+
+    uint16_t raw_len = d->raw_len;
+    bool overflow = d->overflow;
+    d->raw_len = 0;
+    d->overflow = false;
+
+    // back to back delimiters, e.g. from starting mid-stream
+    if (raw_len == 0 && !overflow)
+        return false;
+
+    int len = overflow ? -1 : cobs_decode(d->raw, raw_len, d->frame);
+    uint16_t pos = 1;
+    uint32_t t0;
+    if (len < 3 || crc8(d->frame, len - 1) != d->frame[len - 1]) {
+        d->bad++;
+        return false;
+    }
+    len--;
+    if (!sniff_frame_get_varint(d->frame, len, &pos, &t0)) {
+        d->bad++;
+        return false;
+    }
+
+    d->frames++;
+    v->kind = (SniffFrameKind) (d->frame[0] >> 4);
+    v->stream = d->frame[0] & 0x0f;
+    v->t_us = t0;
+    v->body = d->frame + pos;
+    v->body_len = len - pos;
+    return true;
+}
+
+bool
+sniff_frame_next_byte(const SniffFrameView *v, uint16_t *pos, uint32_t *t_us, uint8_t *byte, uint8_t *err)
+{
+    uint32_t e;
+    if (!sniff_frame_get_varint(v->body, v->body_len, pos, &e))
+        return false;
+    if (*pos >= v->body_len)
+        return false;
+    *byte = v->body[(*pos)++];
+    *err = 0;
+    if (e & 1) {
+        if (*pos >= v->body_len)
+            return false;
+        *err = v->body[(*pos)++];
+    }
+    *t_us += e >> 1;
+    return true;
+}
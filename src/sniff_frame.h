@@ -0,0 +1,126 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The line sniffer's stream over CDC (sniff.c), and its decoder for the
+ * Linux tool (test/sniff_decode.c).
+ *
+ * Each frame is COBS encoded and ends in a 0x00, so a reader can pick the
+ * stream up anywhere, and a frame lost to a full CDC buffer costs only
+ * itself. Decoded, a frame is
+ *
+ *   kind << 4 | stream     one byte
+ *   t0                     varint, time_us_32() of the frame
+ *   body
+ *   crc                    CRC-8 (polynomial 0x07) of all of the above
+ *
+ * The CRC is for the decoder picking up mid-frame, or after a torn one;
+ * bytes lost inside a frame otherwise decode as a shorter valid one.
+ *
+ * and the bodies are:
+ *
+ *   SniffFrameBytes   entries of varint (us since the previous entry, or
+ *                     since t0 for the first) << 1 | has_error, the byte,
+ *                     then the error bits if has_error
+ *   SniffFrameText    log text, as the console would have printed it
+ *   SniffFrameLost    varint count of bytes lost; 0 if not known
+ *   SniffFrameInfo    varint baud, data bits, parity (uart_parity_t),
+ *                     stop bits, SNIFF_INFO_* flags; for stream
+ *
+ * Varints are little endian, 7 bits a byte, high bit set on all but the
+ * last. A byte on a busy line costs four at 1200 baud, three at 115200.
+ * Byte times are when the stop bit ended: from the DMA that took it out
+ * of the UART for received bytes, and chan_uart's estimate for sent ones.
+ */
+
+#ifndef SNIFF_FRAME_H_
+#define SNIFF_FRAME_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum {
+    SniffFrameBytes = 1,
+    SniffFrameText = 2,
+    SniffFrameLost = 3,
+    SniffFrameInfo = 4,
+} SniffFrameKind;
+
+// channel A or B, received or sent by us
+#define SNIFF_STREAM(ch, tx) ((ch) | ((tx) ? 2 : 0))
+#define SNIFF_STREAM_CH(s) ((s) & 1)
+#define SNIFF_STREAM_TX(s) (((s) & 2) != 0)
+#define SNIFF_STREAMS 4
+
+// a byte's error bits: the UART's, from the top of its data register
+#define SNIFF_ERR_FRAMING 0x01
+#define SNIFF_ERR_PARITY  0x02
+#define SNIFF_ERR_BREAK   0x04
+#define SNIFF_ERR_OVERRUN 0x08
+
+// SniffFrameInfo flags
+#define SNIFF_INFO_CAPTURE  0x01    // the stream is being captured
+#define SNIFF_INFO_BRIDGE   0x02    // TX: CDC input goes out on this channel
+
+// decoded frame with its CRC, before COBS; a couple of USB packets
+#define SNIFF_FRAME_MAX 96
+// COBS adds a byte per 254 and the terminating 0x00
+#define SNIFF_FRAME_WIRE_MAX (SNIFF_FRAME_MAX + SNIFF_FRAME_MAX / 254 + 2)
+
+// the longest gap between two entries of a frame; past it, a new frame
+#define SNIFF_FRAME_MAX_DELTA_US (1u << 24)
+
+typedef struct {
+    uint8_t buf[SNIFF_FRAME_MAX];
+    uint16_t len;
+    uint32_t last_us;
+    uint16_t entries;
+} SniffFrame;
+
+void sniff_frame_begin(SniffFrame *f, SniffFrameKind kind, uint8_t stream, uint32_t t_us);
+// A SniffFrameBytes entry; false if it doesn't fit (too long a frame or
+// too long a gap), and the caller should finish the frame and begin another.
+bool sniff_frame_add_byte(SniffFrame *f, uint8_t byte, uint8_t err, uint32_t t_us);
+// Body bytes for the other kinds; as much as fits, returns how many.
+uint16_t sniff_frame_add(SniffFrame *f, const void *data, uint16_t len);
+void sniff_frame_add_varint(SniffFrame *f, uint32_t v);
+// COBS encodes the frame into out (SNIFF_FRAME_WIRE_MAX bytes), with its
+// terminating 0x00; returns the length.
+uint16_t sniff_frame_finish(const SniffFrame *f, uint8_t *out);
+
+//
+// decoding
+//
+
+typedef struct {
+    SniffFrameKind kind;
+    uint8_t stream;
+    uint32_t t_us;
+    const uint8_t *body;
+    uint16_t body_len;
+} SniffFrameView;
+
+typedef struct {
+    uint8_t raw[SNIFF_FRAME_WIRE_MAX];
+    uint16_t raw_len;
+    bool overflow;
+    uint8_t frame[SNIFF_FRAME_MAX];
+
+    uint32_t frames;
+    uint32_t bad;               // didn't decode, or too long
+} SniffDecoder;
+
+void sniff_decoder_init(SniffDecoder *d);
+// One byte off the wire; true when it completes a frame, described by v
+// until the next call.
+bool sniff_decoder_push(SniffDecoder *d, uint8_t b, SniffFrameView *v);
+
+// The next entry of a SniffFrameBytes frame; pos starts at 0, t_us at the
+// frame's t0. false at the end, or if the rest is malformed.
+bool sniff_frame_next_byte(const SniffFrameView *v, uint16_t *pos, uint32_t *t_us, uint8_t *byte, uint8_t *err);
+
+// A varint out of a frame body; false if it runs off the end.
+bool sniff_frame_get_varint(const uint8_t *body, uint16_t len, uint16_t *pos, uint32_t *v);
+
+#endif
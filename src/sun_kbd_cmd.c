@@ -0,0 +1,95 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "sun_kbd_cmd.h"
+
+void
+sun_kbd_cmd_init(SunKbdCmd *s, uint8_t layout)
+{
+    memset(s, 0, sizeof(*s));
+    s->layout = layout;
+}
+
+static void
+reply(SunCmdResult *res, const uint8_t *bytes, uint8_t len)
+{
+    memcpy(res->reply, bytes, len);
+    res->reply_len = len;
+    res->actions |= SunCmdActReply;
+}
+
+void
+sun_kbd_cmd_feed(SunKbdCmd *s, uint8_t byte, uint32_t now_us, SunCmdResult *res)
+{
+    res->actions = 0;
+    res->reply_len = 0;
+
+    if (s->want_led_arg) {
+        s->want_led_arg = false;
+        if (now_us - s->cmd_us < SUN_CMD_ARG_TIMEOUT_US) {
+            s->leds = byte;
+            res->actions |= SunCmdActLeds;
+            return;
+        }
+        s->arg_timeouts++;
+    }
+
+    s->commands++;
+    switch (byte) {
+        case SUN_CMD_RESET: {
+            // held keys would go between the type and the idle; the reset
+            // lets them all go
+            static const uint8_t r[] = { SUN_RESP_RESET, SUN_KBD_TYPE_4, SUN_RESP_IDLE };
+            s->bell = false;
+            s->want_led_arg = false;
+            reply(res, r, sizeof(r));
+            res->actions |= SunCmdActReset | SunCmdActBell;
+            break;
+        }
+        case SUN_CMD_BELL_ON:
+        case SUN_CMD_BELL_OFF:
+            s->bell = byte == SUN_CMD_BELL_ON;
+            res->actions |= SunCmdActBell;
+            break;
+        case SUN_CMD_CLICK_ON:
+        case SUN_CMD_CLICK_OFF:
+            s->click = byte == SUN_CMD_CLICK_ON;
+            res->actions |= SunCmdActClick;
+            break;
+        case SUN_CMD_LED:
+            s->want_led_arg = true;
+            s->cmd_us = now_us;
+            break;
+        case SUN_CMD_LAYOUT: {
+            uint8_t r[] = { SUN_RESP_LAYOUT, s->layout };
+            reply(res, r, sizeof(r));
+            break;
+        }
+        default:
+            // a real keyboard ignores these too
+            s->commands--;
+            s->unknown++;
+            break;
+    }
+}
+
+uint8_t
+sun_kbd_leds_to_hid(uint8_t sun_leds)
+{
+    // KEYBOARD_LED_NUMLOCK, _CAPSLOCK, _SCROLLLOCK, _COMPOSE
+    uint8_t hid = 0;
+    if (sun_leds & SUN_LED_NUM_LOCK)
+        hid |= 0x01;
+    if (sun_leds & SUN_LED_CAPS_LOCK)
+        hid |= 0x02;
+    if (sun_leds & SUN_LED_SCROLL_LOCK)
+        hid |= 0x04;
+    if (sun_leds & SUN_LED_COMPOSE)
+        hid |= 0x08;
+    return hid;
+}
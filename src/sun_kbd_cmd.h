@@ -0,0 +1,86 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Sun type 4/5 keyboard: the commands the host sends us, taken a byte at
+ * a time so nothing ever waits on the line for the rest of a command.
+ * Each byte does a fixed amount of work and says what the caller should
+ * do: queue a reply, forward the LEDs, sound the bell.
+ */
+
+#ifndef SUN_KBD_CMD_H_
+#define SUN_KBD_CMD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// host -> keyboard
+#define SUN_CMD_RESET       0x01
+#define SUN_CMD_BELL_ON     0x02
+#define SUN_CMD_BELL_OFF    0x03
+#define SUN_CMD_CLICK_ON    0x0a
+#define SUN_CMD_CLICK_OFF   0x0b
+#define SUN_CMD_LED         0x0e    // followed by the LED byte
+#define SUN_CMD_LAYOUT      0x0f
+
+// keyboard -> host
+#define SUN_RESP_LAYOUT     0xfe
+#define SUN_RESP_RESET      0xff
+#define SUN_RESP_IDLE       0x7f
+#define SUN_KBD_TYPE_4      0x04    // type 5s say 4 as well
+
+// the LED byte
+#define SUN_LED_NUM_LOCK    0x01
+#define SUN_LED_COMPOSE     0x02
+#define SUN_LED_SCROLL_LOCK 0x04
+#define SUN_LED_CAPS_LOCK   0x08
+
+// US type 4; a type 5 US keyboard is 0x21
+#define SUN_LAYOUT_US4      0x00
+
+// An LED byte that doesn't show up within this long of its 0x0e (~8 ms
+// apart at 1200 baud) isn't coming; whatever does come is a new command.
+#define SUN_CMD_ARG_TIMEOUT_US 100000
+
+#define SUN_CMD_MAX_REPLY 3
+
+typedef enum {
+    SunCmdActReply  = 1 << 0,   // send reply[0..reply_len)
+    SunCmdActLeds   = 1 << 1,   // the host set the LEDs
+    SunCmdActBell   = 1 << 2,   // bell turned on or off
+    SunCmdActClick  = 1 << 3,   // keyclick turned on or off
+    SunCmdActReset  = 1 << 4,   // forget held keys, as a keyboard would
+} SunCmdAction;
+
+typedef struct {
+    uint8_t actions;            // SunCmdAction
+    uint8_t reply_len;
+    uint8_t reply[SUN_CMD_MAX_REPLY];
+} SunCmdResult;
+
+typedef struct {
+    uint8_t layout;             // what the layout command answers
+
+    bool want_led_arg;
+    uint32_t cmd_us;            // when the 0x0e came
+
+    uint8_t leds;               // SUN_LED_*
+    bool bell;
+    bool click;
+
+    uint32_t commands;
+    uint32_t unknown;
+    uint32_t arg_timeouts;
+} SunKbdCmd;
+
+void sun_kbd_cmd_init(SunKbdCmd *s, uint8_t layout);
+
+// One byte from the host, received at now_us. res is filled in; actions 0
+// means there's nothing to do (yet).
+void sun_kbd_cmd_feed(SunKbdCmd *s, uint8_t byte, uint32_t now_us, SunCmdResult *res);
+
+// SUN_LED_* to the HID output report's LED bits (KEYBOARD_LED_*)
+uint8_t sun_kbd_leds_to_hid(uint8_t sun_leds);
+
+#endif
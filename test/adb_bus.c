@@ -0,0 +1,174 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <string.h>
+
+#include "adb_bus.h"
+#include "adb.pio.h"
+
+// pio_encode_mov_not(pio_osr, pio_null)
+#define ENCODE_MOV_OSR_NOT_NULL 0xa0ebu
+
+static void
+tx_init(AdbBus *b)
+{
+    pio_emu *pio = &b->pio;
+    pio_emu_sm_config cfg = pio_emu_default_config(b->tx_offset, adb_tx_wrap_target, adb_tx_wrap);
+    cfg.clkdiv_int = 5 * b->steps_per_us;
+    cfg.in_base = ADB_BUS_PIN;
+    cfg.sideset_base = ADB_BUS_PIN;
+    cfg.sideset_bits = 1;
+    cfg.sideset_pindirs = true;
+    cfg.out_shift_right = false;
+    cfg.autopull = true;
+    cfg.pull_threshold = 32;
+    pio_emu_set_pindirs(pio, ADB_BUS_PIN, 1, false);
+    pio_emu_sm_init(pio, ADB_BUS_SM_TX, b->tx_offset + adb_tx_offset_start, &cfg);
+    pio_emu_sm_set_enabled(pio, ADB_BUS_SM_TX, true);
+}
+
+void
+adb_bus_init(AdbBus *b, unsigned steps_per_us, AdbBusFrameFn on_frame, void *ctx)
+{
+    memset(b, 0, sizeof(*b));
+    b->steps_per_us = steps_per_us;
+    b->on_frame = on_frame;
+    b->ctx = ctx;
+    b->level = true;
+    adb_frame_rx_init(&b->rx);
+
+    pio_emu *pio = &b->pio;
+    pio_emu_init(pio);
+    if (steps_per_us == 1)
+        pio->input_sync_bypass = 1u << ADB_BUS_PIN;
+    // open-drain: the pin only ever outputs 0
+    pio->pins_out &= ~(1u << ADB_BUS_PIN);
+
+    b->rx_offset = pio_emu_add_program(pio, adb_rx_program_instructions,
+            sizeof(adb_rx_program_instructions) / 2, -1);
+    b->tx_offset = pio_emu_add_program(pio, adb_tx_program_instructions,
+            sizeof(adb_tx_program_instructions) / 2, -1);
+
+    pio_emu_sm_config cfg = pio_emu_default_config(b->rx_offset, adb_rx_wrap_target, adb_rx_wrap);
+    cfg.clkdiv_int = steps_per_us;
+    cfg.in_base = ADB_BUS_PIN;
+    cfg.jmp_pin = ADB_BUS_PIN;
+    cfg.in_shift_right = false;
+    cfg.autopush = true;
+    cfg.push_threshold = 8;
+    pio_emu_sm_init(pio, ADB_BUS_SM_RX, b->rx_offset + adb_rx_offset_start, &cfg);
+    pio_emu_sm_exec(pio, ADB_BUS_SM_RX, ENCODE_MOV_OSR_NOT_NULL);
+    pio_emu_sm_set_enabled(pio, ADB_BUS_SM_RX, true);
+
+    tx_init(b);
+}
+
+void
+adb_bus_drive(AdbBus *b, bool level)
+{
+    pio_emu_set_pin(&b->pio, ADB_BUS_PIN, level);
+}
+
+bool
+adb_bus_level(const AdbBus *b)
+{
+    return pio_emu_get_pin(&b->pio, ADB_BUS_PIN);
+}
+
+double
+adb_bus_now_us(const AdbBus *b)
+{
+    return (double) b->step / b->steps_per_us;
+}
+
+static void
+tx_put(AdbBus *b, const uint32_t *words, unsigned n)
+{
+    if (pio_emu_sm_tx_level(&b->pio, ADB_BUS_SM_TX) + n > PIO_EMU_FIFO_DEPTH) {
+        b->tx_dropped++;
+        return;
+    }
+    for (unsigned i = 0; i < n; i++)
+        pio_emu_sm_put(&b->pio, ADB_BUS_SM_TX, words[i]);
+}
+
+void
+adb_bus_talk(AdbBus *b, const uint8_t *data, uint8_t len)
+{
+    uint32_t words[ADB_TX_JOB_WORDS];
+    tx_put(b, words, adb_frame_talk_job(data, len, words));
+}
+
+void
+adb_bus_srq(AdbBus *b)
+{
+    uint32_t job = ADB_TX_SRQ_JOB;
+    tx_put(b, &job, 1);
+}
+
+uint32_t
+adb_bus_last_word(const AdbBus *b, bool (*match)(uint32_t word))
+{
+    unsigned n = b->word_count < ADB_BUS_WORD_LOG ? b->word_count : ADB_BUS_WORD_LOG;
+    for (unsigned i = 0; i < n; i++) {
+        uint32_t w = b->word_log[(b->word_count - 1 - i) % ADB_BUS_WORD_LOG];
+        if (match(w))
+            return w;
+    }
+    return 0;
+}
+
+// adb_pio_irq()
+static void
+cpu(AdbBus *b)
+{
+    b->irqs++;
+    uint32_t w;
+    while (pio_emu_sm_get(&b->pio, ADB_BUS_SM_RX, &w)) {
+        b->words++;
+        b->word_log[b->word_count++ % ADB_BUS_WORD_LOG] = w;
+        AdbFrame f;
+        if (!adb_frame_rx(&b->rx, w, &f))
+            continue;
+        if (f.type == AdbFrameReset)
+            tx_init(b);
+        if (b->on_frame)
+            b->on_frame(&f, b->ctx);
+    }
+}
+
+void
+adb_bus_run(AdbBus *b, uint32_t us)
+{
+    uint64_t end = b->step + (uint64_t) us * b->steps_per_us;
+    uint64_t latency = (uint64_t) b->irq_latency_us * b->steps_per_us;
+    while (b->step < end) {
+        pio_emu_step(&b->pio);
+        b->step++;
+
+        bool level = adb_bus_level(b);
+        if (level != b->level) {
+            b->edge_count++;
+            if (b->log_edges && b->edges < ADB_BUS_MAX_EDGES) {
+                b->edge_step[b->edges] = b->step;
+                b->edge_level[b->edges] = level;
+                b->edges++;
+            }
+            b->level = level;
+        }
+
+        if (pio_emu_sm_rx_level(&b->pio, ADB_BUS_SM_RX)) {
+            if (!b->rx_waiting) {
+                b->rx_waiting = true;
+                b->rx_waiting_since = b->step;
+            }
+            if (b->step - b->rx_waiting_since >= latency) {
+                b->rx_waiting = false;
+                cpu(b);
+            }
+        }
+    }
+}
@@ -0,0 +1,81 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * An ADB bus in the PIO model: adb_rx and adb_tx from src/adb.pio set up
+ * as adb_pio.c does on one open-drain pin, which the host computer's side
+ * pulls low too, plus adb_pio.c's CPU side: words from the RX FIFO go
+ * through AdbFrameRx to a frame callback (the PIO interrupt), and replies
+ * and SRQs go into the TX FIFO.
+ *
+ * Time is in microseconds of steps_per_us PIO model cycles each, with the
+ * state machines' dividers scaled to match, so a test can trade timing
+ * precision for speed. At 1 step per us the input synchronizer is
+ * bypassed; its two cycles are 17 ns on hardware, not 2 us.
+ */
+
+#ifndef ADB_BUS_H_
+#define ADB_BUS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pio_emu.h"
+#include "adb_frame.h"
+
+#define ADB_BUS_PIN 0
+#define ADB_BUS_SM_RX 0
+#define ADB_BUS_SM_TX 1
+
+#define ADB_BUS_MAX_EDGES 4096
+#define ADB_BUS_WORD_LOG 64
+
+typedef void (*AdbBusFrameFn)(const AdbFrame *f, void *ctx);
+
+typedef struct {
+    pio_emu pio;
+    unsigned steps_per_us;
+    uint64_t step;
+    int rx_offset;
+    int tx_offset;
+
+    AdbFrameRx rx;
+    AdbBusFrameFn on_frame;
+    void *ctx;
+    // how long the CPU takes to get to the RX FIFO once there's a word
+    uint32_t irq_latency_us;
+    uint64_t rx_waiting_since;
+    bool rx_waiting;
+
+    uint64_t words;             // taken from the RX FIFO
+    uint64_t irqs;              // times the CPU was called in for them
+    uint32_t tx_dropped;
+    uint32_t word_log[ADB_BUS_WORD_LOG];   // the last words, oldest first once full
+    unsigned word_count;
+
+    // changes of the bus level; when each was, in steps, if log_edges
+    uint64_t edge_count;
+    bool log_edges;
+    bool level;
+    unsigned edges;
+    uint64_t edge_step[ADB_BUS_MAX_EDGES];
+    bool edge_level[ADB_BUS_MAX_EDGES];
+} AdbBus;
+
+void adb_bus_init(AdbBus *b, unsigned steps_per_us, AdbBusFrameFn on_frame, void *ctx);
+
+// The host computer's side of the bus: false pulls it low
+void adb_bus_drive(AdbBus *b, bool level);
+void adb_bus_run(AdbBus *b, uint32_t us);
+bool adb_bus_level(const AdbBus *b);
+double adb_bus_now_us(const AdbBus *b);
+
+// As adb_pio_talk() and adb_pio_srq()
+void adb_bus_talk(AdbBus *b, const uint8_t *data, uint8_t len);
+void adb_bus_srq(AdbBus *b);
+
+// The last word adb_rx pushed that matched, or 0
+uint32_t adb_bus_last_word(const AdbBus *b, bool (*match)(uint32_t word));
+
+#endif
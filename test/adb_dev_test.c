@@ -0,0 +1,379 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The ADB keyboard and mouse in src/adb_dev.c, a frame at a time: key
+ * pairs, the power key and Caps Lock in register 0, register 2, mouse
+ * motion carried past 7 bits, register 3's moves and handler changes,
+ * collisions, and when it asks for service.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "adb_dev.h"
+#include "hid_codes.h"
+
+#define KBD ADB_ADDR_KEYBOARD
+#define MOUSE ADB_ADDR_MOUSE
+
+static AdbDev s_dev;
+static AdbDevResult s_res;
+
+static void
+command(uint8_t c)
+{
+    AdbFrame f = { .type = AdbFrameCommand, .command = c };
+    adb_dev_frame(&s_dev, &f, &s_res);
+}
+
+static void
+data(uint8_t a, uint8_t b)
+{
+    AdbFrame f = { .type = AdbFrameData, .len = 2, .data = { a, b } };
+    adb_dev_frame(&s_dev, &f, &s_res);
+}
+
+// A Talk, and its reply read back off the bus as sent. -1 if there's no
+// reply, otherwise the 16 bits.
+static int
+talk(uint8_t addr, uint8_t reg)
+{
+    command(ADB_TALK(addr, reg));
+    if (!(s_res.actions & AdbDevActReply))
+        return -1;
+    CHECK(s_res.reply_len == 2, "Talk $%x r%u: %u bytes", addr, reg, s_res.reply_len);
+    int v = s_res.reply[0] << 8 | s_res.reply[1];
+    data(s_res.reply[0], s_res.reply[1]);
+    return v;
+}
+
+static void
+listen(uint8_t addr, uint8_t reg, uint8_t a, uint8_t b)
+{
+    command(ADB_LISTEN(addr, reg));
+    data(a, b);
+}
+
+static void
+key(uint8_t hid, bool down)
+{
+    adb_dev_key(&s_dev, hid, down);
+}
+
+static int
+field(uint8_t bits)
+{
+    return bits & 0x40 ? (int) (bits & 0x7f) - 0x80 : (int) (bits & 0x7f);
+}
+
+static void
+test_keys(void)
+{
+    adb_dev_init(&s_dev);
+    CHECK(talk(KBD, 0) == -1, "nothing to say, but answered");
+
+    key(HID_KEY_A, true);
+    key(HID_KEY_B, true);
+    key(HID_KEY_A, false);
+    CHECK(adb_dev_kbd_pending(&s_dev), "keys not pending");
+    int v = talk(KBD, 0);
+    CHECK(v == 0x000b, "a down, b down: 0x%04x", v);
+    v = talk(KBD, 0);
+    CHECK(v == 0x80ff, "a up on its own: 0x%04x", v);
+    CHECK(talk(KBD, 0) == -1, "answered with the buffer empty");
+
+    // the power key alone in its reply, either side of others
+    key(HID_KEY_C, true);
+    key(HID_KEY_POWER, true);
+    key(HID_KEY_POWER, false);
+    key(HID_KEY_C, false);
+    v = talk(KBD, 0);
+    CHECK(v == 0x08ff, "c before power: 0x%04x", v);
+    v = talk(KBD, 0);
+    CHECK(v == 0x7f7f, "power down: 0x%04x", v);
+    v = talk(KBD, 0);
+    CHECK(v == 0xffff, "power up: 0x%04x", v);
+    v = talk(KBD, 0);
+    CHECK(v == 0x88ff, "c up after power: 0x%04x", v);
+
+    // keys with no ADB code
+    key(HID_KEY_F24, true);
+    CHECK(!adb_dev_kbd_pending(&s_dev), "F24 queued");
+
+    // a full buffer keeps the oldest
+    for (unsigned i = 0; i < ADB_KEY_QUEUE + 4; i++)
+        key(HID_KEY_Q, i % 2 == 0);
+    CHECK(s_dev.keys_dropped == 4, "%u dropped", s_dev.keys_dropped);
+    unsigned n = 0;
+    while ((v = talk(KBD, 0)) >= 0) {
+        CHECK(v == 0x0c8c, "reply %u: 0x%04x", n, v);
+        n++;
+    }
+    CHECK(n == ADB_KEY_QUEUE / 2, "%u replies for a full buffer", n);
+}
+
+static void
+test_caps_lock(void)
+{
+    adb_dev_init(&s_dev);
+    key(HID_KEY_CAPS_LOCK, true);
+    key(HID_KEY_CAPS_LOCK, false);
+    int v = talk(KBD, 0);
+    CHECK(v == 0x39ff, "caps lock locks: 0x%04x", v);
+    CHECK(!(talk(KBD, 2) & ADB_R2_CAPS_LOCK), "register 2 doesn't have caps lock down");
+
+    key(HID_KEY_CAPS_LOCK, true);
+    key(HID_KEY_CAPS_LOCK, false);
+    v = talk(KBD, 0);
+    CHECK(v == 0xb9ff, "caps lock unlocks: 0x%04x", v);
+    CHECK(talk(KBD, 2) & ADB_R2_CAPS_LOCK, "register 2 still has caps lock down");
+}
+
+static void
+test_reg2(void)
+{
+    adb_dev_init(&s_dev);
+    int v = talk(KBD, 2);
+    CHECK(v == 0xffff, "nothing held, LEDs off: 0x%04x", v);
+
+    key(HID_KEY_LEFT_SHIFT, true);
+    key(HID_KEY_RIGHT_GUI, true);
+    key(HID_KEY_BACKSPACE, true);
+    v = talk(KBD, 2);
+    CHECK(v == (0xffff & ~(ADB_R2_SHIFT | ADB_R2_COMMAND | ADB_R2_DELETE)), "shift, command, delete: 0x%04x", v);
+    key(HID_KEY_LEFT_SHIFT, false);
+    v = talk(KBD, 2);
+    CHECK(v & ADB_R2_SHIFT, "shift still down: 0x%04x", v);
+
+    // the host writes the LEDs, 0 = on
+    listen(KBD, 2, 0xff, 0xfd);
+    CHECK(s_res.actions & AdbDevActLeds, "no LED action");
+    CHECK(adb_dev_leds_to_hid(s_dev.leds) == 0x02, "caps LED to HID 0x%02x", adb_dev_leds_to_hid(s_dev.leds));
+    v = talk(KBD, 2);
+    CHECK((v & ADB_R2_LEDS) == 0x05, "LEDs read back as 0x%x", v & ADB_R2_LEDS);
+    listen(KBD, 2, 0xff, 0xf8);
+    CHECK(adb_dev_leds_to_hid(s_dev.leds) == 0x07, "all LEDs to HID 0x%02x", adb_dev_leds_to_hid(s_dev.leds));
+
+    // Listen 2 to the mouse isn't for the keyboard
+    listen(MOUSE, 2, 0xff, 0xff);
+    CHECK(!(s_res.actions & AdbDevActLeds) && s_dev.leds == 0, "mouse Listen 2 set the LEDs");
+}
+
+static void
+test_right_modifiers(void)
+{
+    adb_dev_init(&s_dev);
+    key(HID_KEY_RIGHT_SHIFT, true);
+    key(HID_KEY_RIGHT_ALT, true);
+    key(HID_KEY_RIGHT_CONTROL, true);
+    key(HID_KEY_RIGHT_CONTROL, false);
+    int a = talk(KBD, 0), b = talk(KBD, 0);
+    CHECK(a == 0x383a && b == 0x36b6, "handler 2: 0x%04x 0x%04x", a, b);
+
+    // what Linux asks for
+    listen(KBD, 3, 0x20 | KBD, ADB_HANDLER_KBD_EXTENDED_LR);
+    CHECK(s_dev.kbd.handler == 3, "handler %u", s_dev.kbd.handler);
+    key(HID_KEY_RIGHT_SHIFT, false);
+    key(HID_KEY_RIGHT_ALT, false);
+    a = talk(KBD, 0);
+    CHECK(a == 0xfbfc, "handler 3: 0x%04x", a);
+}
+
+static void
+test_mouse(void)
+{
+    adb_dev_init(&s_dev);
+    CHECK(talk(MOUSE, 0) == -1, "answered with no motion");
+
+    // more than 7 bits goes over several Talks, nothing lost
+    adb_dev_mouse(&s_dev, 200, -150, false, false, 0);
+    int sx = 0, sy = 0, n = 0, v;
+    while ((v = talk(MOUSE, 0)) >= 0) {
+        int dx = field(v & 0x7f), dy = field((v >> 8) & 0x7f);
+        CHECK(abs(dx) <= ADB_MOUSE_MAX_DELTA && abs(dy) <= ADB_MOUSE_MAX_DELTA, "reply %d: %d,%d", n, dx, dy);
+        CHECK((v & 0x8080) == 0x8080, "buttons down in 0x%04x", v);
+        sx += dx;
+        sy += dy;
+        n++;
+    }
+    CHECK(sx == 200 && sy == -150, "moved %d,%d", sx, sy);
+    CHECK(n == 4, "%d Talks for 200 counts", n);
+
+    // a click between two Talks goes down, then up
+    adb_dev_mouse(&s_dev, 0, 0, true, false, 0);
+    adb_dev_mouse(&s_dev, 0, 0, false, false, 0);
+    v = talk(MOUSE, 0);
+    CHECK(v == 0x0080, "click down: 0x%04x", v);
+    v = talk(MOUSE, 0);
+    CHECK(v == 0x8080, "click up: 0x%04x", v);
+    CHECK(talk(MOUSE, 0) == -1, "more after the click");
+
+    adb_dev_mouse(&s_dev, -1, 1, false, true, 0);
+    v = talk(MOUSE, 0);
+    CHECK(v == 0x817f, "right down and -1,1: 0x%04x", v);
+
+    // Flush drops what's pending
+    adb_dev_mouse(&s_dev, 30, 30, false, true, 0);
+    command(ADB_FLUSH(MOUSE));
+    CHECK(talk(MOUSE, 0) == -1, "motion after a Flush");
+}
+
+static void
+test_reg3(void)
+{
+    adb_dev_init(&s_dev);
+    int v = talk(KBD, 3);
+    CHECK((v & 0xf0ff) == 0x6002, "keyboard register 3: 0x%04x", v);
+    v = talk(MOUSE, 3);
+    CHECK((v & 0xf0ff) == 0x6001, "mouse register 3: 0x%04x", v);
+
+    // the address in a Talk 3 reply is random
+    unsigned seen = 0;
+    for (unsigned i = 0; i < 32; i++)
+        seen |= 1u << ((talk(KBD, 3) >> 8) & 0xf);
+    CHECK(__builtin_popcount(seen) >= 8, "only %d addresses in 32 replies", __builtin_popcount(seen));
+
+    // Linux's scan: move to a free address if nobody else answered, and back
+    listen(KBD, 3, 0x60 | 0xf, ADB_R3_MOVE_IF_NO_COLLISION);
+    CHECK(s_dev.kbd.addr == 0xf && (s_res.actions & AdbDevActReg3), "0xfe didn't move it: $%x", s_dev.kbd.addr);
+    CHECK(talk(KBD, 0) == -1 && talk(0xf, 3) >= 0, "not at the new address");
+    listen(0xf, 3, 0x60 | KBD, ADB_R3_MOVE_IF_NO_COLLISION);
+    CHECK(s_dev.kbd.addr == KBD, "didn't move back: $%x", s_dev.kbd.addr);
+
+    // handlers the device doesn't have, and ones that aren't
+    listen(MOUSE, 3, 0x20 | MOUSE, 4);
+    CHECK(s_dev.mouse.handler == 1 && !(s_res.actions & AdbDevActReg3), "mouse took handler 4");
+    listen(MOUSE, 3, 0x20 | MOUSE, ADB_HANDLER_MOUSE_200);
+    CHECK(s_dev.mouse.handler == 2, "mouse handler %u", s_dev.mouse.handler);
+    listen(MOUSE, 3, 0x20 | 0x9, ADB_R3_SELF_TEST);
+    listen(MOUSE, 3, 0x20 | 0x9, ADB_R3_MOVE_IF_ACTIVATED);
+    CHECK(s_dev.mouse.addr == MOUSE, "moved on 0xff or 0xfd");
+
+    // 0x00 moves it and sets SRQ enable
+    listen(MOUSE, 3, 0x9, ADB_R3_MOVE_AND_ENABLE);
+    CHECK(s_dev.mouse.addr == 0x9 && !s_dev.mouse.srq_enable, "0x00: $%x srq %d", s_dev.mouse.addr,
+          s_dev.mouse.srq_enable);
+    v = talk(0x9, 3);
+    CHECK((v & 0xf0ff) == 0x4002, "moved mouse register 3: 0x%04x", v);
+
+    // a reset puts everything back
+    AdbFrame f = { .type = AdbFrameReset };
+    adb_dev_frame(&s_dev, &f, &s_res);
+    CHECK(s_dev.mouse.addr == MOUSE && s_dev.mouse.handler == 1 && s_dev.mouse.srq_enable &&
+          s_dev.kbd.addr == KBD && s_dev.kbd.handler == 2, "not reset");
+    listen(MOUSE, 3, 0x9, ADB_R3_MOVE_AND_ENABLE);
+    command(ADB_SEND_RESET);
+    CHECK(s_dev.mouse.addr == MOUSE && (s_res.actions & AdbDevActReset), "SendReset didn't reset");
+}
+
+static void
+test_collision(void)
+{
+    adb_dev_init(&s_dev);
+
+    // another device at 2, with handler 1, answers Talk 3 too, and the
+    // bus ANDs them
+    command(ADB_TALK(KBD, 3));
+    CHECK(s_res.actions & AdbDevActReply, "no Talk 3 reply");
+    data(s_res.reply[0] & 0xf0, s_res.reply[1] & 0x01);
+    CHECK(s_dev.kbd.collided && s_dev.collisions == 1, "collision not seen");
+    listen(KBD, 3, 0x6f, ADB_R3_MOVE_IF_NO_COLLISION);
+    CHECK(s_dev.kbd.addr == KBD, "moved after a collision");
+    // and the other device moved; now it's only us
+    CHECK(talk(KBD, 3) >= 0 && !s_dev.kbd.collided, "collision still set");
+    listen(KBD, 3, 0x6f, ADB_R3_MOVE_IF_NO_COLLISION);
+    CHECK(s_dev.kbd.addr == 0xf, "didn't move without a collision");
+    listen(0xf, 3, 0x60 | KBD, ADB_R3_MOVE_IF_NO_COLLISION);
+
+    // a reply that doesn't come back at all ran into something too
+    command(ADB_TALK(KBD, 3));
+    command(ADB_TALK(MOUSE, 0));
+    CHECK(s_dev.kbd.collided && s_dev.collisions == 2, "missing reply not a collision");
+
+    // register 0's data is sent again
+    key(HID_KEY_A, true);
+    key(HID_KEY_B, true);
+    key(HID_KEY_C, true);
+    command(ADB_TALK(KBD, 0));
+    data(0x00, 0x03);
+    int v = talk(KBD, 0);
+    CHECK(v == 0x000b, "keys after a collision: 0x%04x", v);
+    v = talk(KBD, 0);
+    CHECK(v == 0x08ff, "the rest after a collision: 0x%04x", v);
+
+    adb_dev_mouse(&s_dev, 10, -5, true, false, 0);
+    command(ADB_TALK(MOUSE, 0));
+    data(0x00, 0x00);
+    v = talk(MOUSE, 0);
+    CHECK(v == 0x7b8a, "mouse after a collision: 0x%04x", v);
+}
+
+// SRQ is only asked for at the end of a frame the host follows with a
+// command, and only for the device the host isn't polling
+static void
+test_srq(void)
+{
+    adb_dev_init(&s_dev);
+
+    // the host is polling the mouse, which has nothing: the Talk is where to ask
+    talk(MOUSE, 0);
+    CHECK(!(s_res.actions & AdbDevActSrq), "SRQ with nothing pending");
+    key(HID_KEY_A, true);
+    command(ADB_TALK(MOUSE, 0));
+    CHECK(s_res.actions & AdbDevActSrq, "no SRQ for a key while polling the mouse");
+
+    // polling the keyboard itself: no need
+    talk(KBD, 0);
+    key(HID_KEY_A, false);
+    command(ADB_TALK(KBD, 0));
+    CHECK(s_res.actions & AdbDevActReply, "no reply");
+    CHECK(!(s_res.actions & AdbDevActSrq), "SRQ on a Talk being answered");
+    data(s_res.reply[0], s_res.reply[1]);
+    CHECK(!(s_res.actions & AdbDevActSrq), "SRQ for the keyboard while polling it");
+
+    // mouse motion while the keyboard's polled: at the end of its reply
+    key(HID_KEY_B, true);
+    adb_dev_mouse(&s_dev, 5, 5, false, false, 0);
+    command(ADB_TALK(KBD, 0));
+    data(s_res.reply[0], s_res.reply[1]);
+    CHECK(s_res.actions & AdbDevActSrq, "no SRQ for the mouse at the end of a reply");
+
+    // never after a Listen or a Talk to someone else: data comes next
+    command(ADB_LISTEN(KBD, 2));
+    CHECK(!(s_res.actions & AdbDevActSrq), "SRQ after a Listen");
+    data(0xff, 0xff);
+    CHECK(s_res.actions & AdbDevActSrq, "no SRQ after Listen data");
+    command(ADB_TALK(0x7, 0));
+    CHECK(!(s_res.actions & AdbDevActSrq), "SRQ after a Talk to someone else");
+    command(ADB_FLUSH(0x7));
+    CHECK(s_res.actions & AdbDevActSrq, "no SRQ after a Flush");
+
+    // not with SRQ disabled
+    listen(MOUSE, 3, MOUSE, ADB_R3_MOVE_AND_ENABLE);
+    command(ADB_TALK(KBD, 0));
+    data(s_res.reply[0], s_res.reply[1]);
+    CHECK(!(s_res.actions & AdbDevActSrq), "SRQ with it disabled");
+}
+
+int main(void)
+{
+    test_keys();
+    test_caps_lock();
+    test_reg2();
+    test_right_modifiers();
+    test_mouse();
+    test_reg3();
+    test_collision();
+    test_srq();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
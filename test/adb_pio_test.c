@@ -0,0 +1,453 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Runs adb_rx/adb_tx from src/adb.pio in the PIO model (test/adb_bus.c),
+ * with frames put together and Talk replies built by src/adb_frame.c:
+ * every command byte, SRQ and reset; Listen data of every length; where
+ * adb_rx puts the line between a 1 and a 0; how long it says a long low
+ * was; and Talk replies and SRQs from adb_tx, timed on the bus, with the
+ * CPU getting to the FIFO late.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "adb_bus.h"
+#include "adb.pio.h"
+
+// tenths of a microsecond: fine enough to time edges to a step
+#define STEPS_PER_US 10
+
+#define ADB_CMD(addr, cmd, reg) ((uint8_t) (((addr) << 4) | ((cmd) << 2) | (reg)))
+#define FLUSH 1
+#define LISTEN 2
+#define TALK 3
+
+#define MAX_FRAMES 512
+
+// the CPU side: frames seen, and what it answers with
+typedef struct {
+    AdbFrame frames[MAX_FRAMES];
+    unsigned count;
+
+    uint8_t talk_addr;          // answers Talk to this address, if talk_len
+    uint8_t talk_len;
+    uint8_t talk_data[ADB_MAX_DATA];
+    bool srq_after_data;        // asks for service at the end of every data frame
+} Cpu;
+
+static AdbBus s_bus;
+static Cpu s_cpu;
+
+static void
+on_frame(const AdbFrame *f, void *ctx)
+{
+    Cpu *c = ctx;
+    if (c->count < MAX_FRAMES)
+        c->frames[c->count++] = *f;
+
+    if (f->type == AdbFrameCommand && c->talk_len && (f->command >> 2 & 3) == TALK &&
+        f->command >> 4 == c->talk_addr)
+        adb_bus_talk(&s_bus, c->talk_data, c->talk_len);
+    if (f->type == AdbFrameData && c->srq_after_data)
+        adb_bus_srq(&s_bus);
+}
+
+static void
+start(void)
+{
+    memset(&s_cpu, 0, sizeof(s_cpu));
+    adb_bus_init(&s_bus, STEPS_PER_US, on_frame, &s_cpu);
+    adb_bus_run(&s_bus, 1000);
+}
+
+//
+// the host computer's side
+//
+
+static void
+low(uint32_t us)
+{
+    adb_bus_drive(&s_bus, false);
+    adb_bus_run(&s_bus, us);
+    adb_bus_drive(&s_bus, true);
+}
+
+static void
+high(uint32_t us)
+{
+    adb_bus_run(&s_bus, us);
+}
+
+static void
+host_bit(int bit, uint32_t low_1, uint32_t low_0)
+{
+    uint32_t l = bit ? low_1 : low_0;
+    low(l);
+    high(100 - l);
+}
+
+// attention, sync, the command and its stop bit: 65 us, or 300 if
+// another device holds it for service
+static void
+host_command_at(uint8_t command, uint32_t stop_us, uint32_t low_1, uint32_t low_0)
+{
+    low(800);
+    high(70);
+    for (int i = 7; i >= 0; i--)
+        host_bit((command >> i) & 1, low_1, low_0);
+    low(stop_us);
+}
+
+static void
+host_command(uint8_t command, uint32_t stop_us)
+{
+    host_command_at(command, stop_us, 35, 65);
+}
+
+// Tlt, then a start bit, the data and a stop bit
+static void
+host_data(const uint8_t *data, uint8_t len)
+{
+    high(200);
+    host_bit(1, 35, 65);
+    for (uint8_t i = 0; i < len; i++)
+        for (int b = 7; b >= 0; b--)
+            host_bit((data[i] >> b) & 1, 35, 65);
+    low(65);
+}
+
+static void
+host_reset(void)
+{
+    low(3000);
+}
+
+// the bus idle long enough for any frame to end
+static void
+settle(void)
+{
+    high(1000);
+}
+
+//
+// tests
+//
+
+static void
+test_fit(void)
+{
+    unsigned n = sizeof(adb_rx_program_instructions) / 2 + sizeof(adb_tx_program_instructions) / 2;
+    CHECK(n <= PIO_EMU_INSTR_MEM, "adb_rx + adb_tx are %u instructions", n);
+    start();
+    CHECK(s_bus.rx_offset >= 0 && s_bus.tx_offset >= 0, "adb_rx + adb_tx don't load");
+}
+
+static void
+test_commands(void)
+{
+    start();
+    host_reset();
+    settle();
+    CHECK(s_cpu.count == 1 && s_cpu.frames[0].type == AdbFrameReset, "reset: %u frames", s_cpu.count);
+
+    for (unsigned c = 0; c < 256; c++) {
+        host_command(c, 65);
+        settle();
+    }
+    // and some with another device's SRQ
+    for (unsigned c = 0; c < 256; c += 17) {
+        host_command(c, 300);
+        settle();
+    }
+
+    unsigned bad = 0;
+    for (unsigned i = 0; i < 256 + 16; i++) {
+        const AdbFrame *f = &s_cpu.frames[1 + i];
+        unsigned c = i < 256 ? i : (i - 256) * 17;
+        bool srq = i >= 256;
+        if (1 + i >= s_cpu.count || f->type != AdbFrameCommand || f->command != c || f->srq != srq)
+            bad++;
+    }
+    CHECK(bad == 0 && s_cpu.count == 1 + 256 + 16, "commands: %u of %u wrong, %u frames", bad, 256 + 16,
+          s_cpu.count);
+    CHECK(s_bus.rx.errors == 0, "commands: %u bad frames", s_bus.rx.errors);
+    printf("commands: %.1f FIFO words each, where the GPIO interrupt took %u edges\n",
+           (double) s_bus.words / (s_cpu.count), 2 * 8 + 4);
+}
+
+static void
+test_data(void)
+{
+    start();
+    srand(47);
+    unsigned bad = 0, sent = 0;
+    for (unsigned round = 0; round < 40; round++) {
+        for (uint8_t len = 2; len <= ADB_MAX_DATA; len++) {
+            uint8_t data[ADB_MAX_DATA];
+            for (uint8_t i = 0; i < len; i++)
+                data[i] = round == 0 ? 0x00 : round == 1 ? 0xff : rand();
+
+            unsigned before = s_cpu.count;
+            host_command(ADB_CMD(2, LISTEN, round & 3), 65);
+            host_data(data, len);
+            settle();
+            sent++;
+
+            const AdbFrame *f = &s_cpu.frames[before + 1];
+            if (s_cpu.count != before + 2 || f->type != AdbFrameData || f->len != len ||
+                memcmp(f->data, data, len)) {
+                if (!bad)
+                    printf("  first bad: %u bytes, got type %d len %u\n", len, f->type, f->len);
+                bad++;
+            }
+            s_cpu.count = 0;
+        }
+    }
+    CHECK(bad == 0, "listen data: %u of %u wrong", bad, sent);
+    CHECK(s_bus.rx.errors == 0, "listen data: %u bad frames", s_bus.rx.errors);
+}
+
+// Where between 35 and 65 us of low adb_rx calls it a 0: the sample point.
+static void
+test_sample(void)
+{
+    unsigned first_zero = 0;
+    for (unsigned l = 30; l <= 70; l++) {
+        start();
+        host_command_at(0xff, 65, l, l);
+        settle();
+        bool ok = s_cpu.count == 1 && s_cpu.frames[0].type == AdbFrameCommand;
+        uint8_t got = ok ? s_cpu.frames[0].command : 0x55;
+        CHECK(got == 0xff || got == 0x00, "%u us lows read as 0x%02x", l, got);
+        if (got == 0x00 && !first_zero)
+            first_zero = l;
+    }
+    // a 1 is 35 us and a 0 65; +/- 30% from a device, they meet at 45.5
+    CHECK(first_zero >= 45 && first_zero <= 49, "a %u us low is the shortest 0", first_zero);
+    printf("sample point: lows of %u us and up are a 0\n", first_zero);
+}
+
+static bool
+is_long(uint32_t w)
+{
+    return w > 0xff && w != ADB_PIO_END;
+}
+
+static void
+test_long(void)
+{
+    unsigned bad = 0;
+    int worst = 0;
+    for (uint32_t us = 160; us <= 4000; us += 37) {
+        start();
+        low(us);
+        settle();
+        uint32_t w = adb_bus_last_word(&s_bus, is_long);
+        int err = (int) adb_frame_long_us(w) - (int) us;
+        if (abs(err) > abs(worst))
+            worst = err;
+        if (!w || abs(err) > ADB_PIO_LONG_STEP_US / 2 + 1)
+            bad++;
+    }
+    CHECK(bad == 0, "long lows: %u measured wrong, worst by %d us", bad, worst);
+    printf("long lows: measured to within %d us\n", abs(worst));
+}
+
+// the bus edges logged after step 'from'
+static unsigned
+edges_from(uint64_t from, unsigned *first)
+{
+    unsigned i = 0;
+    while (i < s_bus.edges && s_bus.edge_step[i] <= from)
+        i++;
+    *first = i;
+    return s_bus.edges - i;
+}
+
+static double
+edge_us(unsigned i)
+{
+    return (double) s_bus.edge_step[i] / STEPS_PER_US;
+}
+
+// A Talk reply as it goes on the bus: Tlt from the end of the command's
+// stop bit, then every bit cell.
+static void
+check_reply(const char *name, const uint8_t *data, uint8_t len, uint32_t latency_us)
+{
+    start();
+    s_bus.irq_latency_us = latency_us;
+    s_bus.log_edges = true;
+    s_cpu.talk_addr = 3;
+    s_cpu.talk_len = len;
+    memcpy(s_cpu.talk_data, data, len);
+
+    host_command(ADB_CMD(3, TALK, 0), 65);
+    // the stop bit's rise is seen a step after it's driven
+    uint64_t stop_end = s_bus.step + 1;
+    unsigned bits = 8 * len + 2;
+    high(latency_us + 1000 + 100 * bits);
+
+    unsigned first;
+    unsigned n = edges_from(stop_end, &first);
+    CHECK(n == 2 * bits, "%s: %u edges for %u bits", name, n, bits);
+    if (n != 2 * bits)
+        return;
+
+    double tlt = edge_us(first) - (double) stop_end / STEPS_PER_US;
+    CHECK(tlt >= 140 && tlt <= 260, "%s: Tlt %.1f us", name, tlt);
+
+    unsigned bad_low = 0, bad_cell = 0;
+    for (unsigned b = 0; b < bits; b++) {
+        int bit = b == 0 ? 1 : b == bits - 1 ? 0 : (data[(b - 1) / 8] >> (7 - (b - 1) % 8)) & 1;
+        double lo = edge_us(first + 2 * b + 1) - edge_us(first + 2 * b);
+        if (lo < (bit ? 34 : 64) || lo > (bit ? 36 : 66))
+            bad_low++;
+        if (b + 1 < bits) {
+            double cell = edge_us(first + 2 * b + 2) - edge_us(first + 2 * b);
+            if (cell < 99 || cell > 101)
+                bad_cell++;
+        }
+    }
+    CHECK(bad_low == 0 && bad_cell == 0, "%s: %u lows and %u bit cells off", name, bad_low, bad_cell);
+
+    // adb_rx reads the reply back like any other device's
+    const AdbFrame *f = &s_cpu.frames[1];
+    CHECK(s_cpu.count == 2 && f->type == AdbFrameData && f->len == len && !memcmp(f->data, data, len),
+          "%s: reply read back wrong", name);
+    if (latency_us == 0 && len == 2 && data[0] != data[1])
+        printf("talk: Tlt %.1f us\n", tlt);
+}
+
+static void
+test_talk(void)
+{
+    srand(470);
+    for (uint8_t len = 2; len <= ADB_MAX_DATA; len++) {
+        uint8_t data[ADB_MAX_DATA];
+        for (uint8_t i = 0; i < len; i++)
+            data[i] = rand();
+        char name[32];
+        sprintf(name, "%u bytes", len);
+        check_reply(name, data, len, 0);
+        // the CPU late to the FIFO by most of the Tlt
+        sprintf(name, "%u bytes, 60 us late", len);
+        check_reply(name, data, len, 60);
+    }
+
+    static const uint8_t ones[] = { 0xff, 0xff }, zeros[] = { 0x00, 0x00 };
+    check_reply("all ones", ones, 2, 0);
+    check_reply("all zeros", zeros, 2, 0);
+
+    // no reply for someone else
+    start();
+    s_cpu.talk_addr = 3;
+    s_cpu.talk_len = 2;
+    host_command(ADB_CMD(2, TALK, 0), 65);
+    settle();
+    CHECK(s_cpu.count == 1, "answered a Talk to another address");
+}
+
+// The stop bit's low, and whether adb_rx saw an SRQ in it
+static double
+stop_low_us(uint64_t from)
+{
+    unsigned first;
+    unsigned n = edges_from(from, &first);
+    // attention, sync, 8 bits, then the stop bit's fall and rise
+    if (n < 20)
+        return 0;
+    return edge_us(first + 19) - edge_us(first + 18);
+}
+
+static void
+test_srq(void)
+{
+    static const uint8_t data[] = { 0x12, 0x34 };
+
+    start();
+    s_bus.log_edges = true;
+    s_cpu.srq_after_data = true;
+    host_command(ADB_CMD(2, LISTEN, 2), 65);
+    host_data(data, 2);
+    high(300);
+
+    uint64_t from = s_bus.step;
+    host_command(ADB_CMD(2, TALK, 0), 65);
+    high(500);
+    double held = stop_low_us(from);
+    CHECK(held >= 300 && held <= 330, "SRQ: stop bit held %.1f us", held);
+    const AdbFrame *f = &s_cpu.frames[2];
+    CHECK(s_cpu.count == 3 && f->type == AdbFrameCommand && f->command == ADB_CMD(2, TALK, 0) && f->srq,
+          "SRQ: command not read back with its SRQ");
+    printf("srq: stop bit held %.1f us\n", held);
+
+    // once
+    from = s_bus.step;
+    host_command(ADB_CMD(2, TALK, 0), 65);
+    high(500);
+    held = stop_low_us(from);
+    CHECK(held < 70, "SRQ again: stop bit held %.1f us", held);
+
+    // asked for and answering a Talk on the same command: the reply waits
+    // for the stretched stop bit
+    start();
+    s_bus.log_edges = true;
+    s_cpu.srq_after_data = true;
+    s_cpu.talk_addr = 3;
+    s_cpu.talk_len = 2;
+    memcpy(s_cpu.talk_data, data, 2);
+    host_command(ADB_CMD(2, LISTEN, 2), 65);
+    host_data(data, 2);
+    high(300);
+    from = s_bus.step;
+    host_command(ADB_CMD(3, TALK, 0), 65);
+    high(3000);
+    held = stop_low_us(from);
+    CHECK(held >= 300, "SRQ and Talk: stop bit held %.1f us", held);
+    unsigned first;
+    edges_from(from, &first);
+    double tlt = edge_us(first + 20) - edge_us(first + 19);
+    CHECK(tlt >= 140 && tlt <= 260, "SRQ and Talk: Tlt %.1f us", tlt);
+    CHECK(s_cpu.count == 4 && s_cpu.frames[2].srq && s_cpu.frames[3].type == AdbFrameData &&
+          !memcmp(s_cpu.frames[3].data, data, 2), "SRQ and Talk: %u frames", s_cpu.count);
+
+    // a reset drops an SRQ that's waiting
+    start();
+    s_bus.log_edges = true;
+    s_cpu.srq_after_data = true;
+    host_command(ADB_CMD(2, LISTEN, 2), 65);
+    host_data(data, 2);
+    high(300);
+    host_reset();
+    settle();
+    from = s_bus.step;
+    host_command(ADB_CMD(2, TALK, 0), 65);
+    high(500);
+    held = stop_low_us(from);
+    CHECK(held < 70, "SRQ after a reset: stop bit held %.1f us", held);
+    CHECK(s_bus.rx.errors == 0, "SRQ: %u bad frames", s_bus.rx.errors);
+}
+
+int main(void)
+{
+    test_fit();
+    test_commands();
+    test_data();
+    test_sample();
+    test_long();
+    test_talk();
+    test_srq();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
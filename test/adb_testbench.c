@@ -0,0 +1,626 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Testbench for host_adb.c (built with TESTBENCH) on the bus as the board
+ * has it: adb_rx/adb_tx in the PIO model (test/adb_bus.c). Synthesizes the
+ * host computer's side -- reset, attention, sync, command byte, stop
+ * bit/SRQ, Tlt, listen data -- with optional per-pulse jitter, and checks
+ * what host_adb.c decodes, including the register 3 replies it sends back
+ * through adb_tx. Also counts how often the CPU is called in, against the
+ * interrupt per edge adb_isr() took.
+ *
+ * Then the keyboard and mouse (src/adb_dev.c) against a host that probes
+ * the bus as Linux's adb.c does and then polls as a Mac's autopoll does,
+ * with USB key and mouse events arriving as it goes.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "adb_bus.h"
+#include "adb_pio.h"
+#include "events.h"
+
+// host_adb.c, TESTBENCH build
+void adb_init();
+void adb_bus_frame(const AdbFrame *f);
+void adb_kbd_event(const KeyboardEvent event);
+void adb_mouse_event(const MouseEvent event);
+
+bool tb_verbose = false;
+
+//
+// bus model
+//
+
+// a step a microsecond: the host's pulses are whole microseconds anyway
+static AdbBus s_bus;
+
+static unsigned s_jitter_pct = 0;
+static uint32_t s_rng = 1;
+
+static uint32_t rng_next(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+static uint32_t jitter(uint32_t us)
+{
+    if (s_jitter_pct == 0)
+        return us;
+    int32_t span = (int32_t) (us * s_jitter_pct / 100);
+    int32_t d = (int32_t) (rng_next() % (2 * span + 1)) - span;
+    return (uint32_t) ((int32_t) us + d);
+}
+
+// hold the current level for 'us', then drive the line to 'level'
+static void hold_then(uint32_t us, int level)
+{
+    adb_bus_run(&s_bus, jitter(us));
+    adb_bus_drive(&s_bus, level);
+}
+
+static void wait_us(uint32_t us)
+{
+    adb_bus_run(&s_bus, jitter(us));
+}
+
+// what adb_pio.c does for host_adb.c, on the model
+void adb_pio_talk(const uint8_t *data, uint8_t len) { adb_bus_talk(&s_bus, data, len); }
+void adb_pio_srq(void) { adb_bus_srq(&s_bus); }
+uint32_t adb_pio_rx_errors(void) { return s_bus.rx.errors; }
+uint32_t adb_pio_tx_dropped(void) { return s_bus.tx_dropped; }
+
+uint64_t time_us_64(void) { return (uint64_t) adb_bus_now_us(&s_bus); }
+
+// the host computer's keyboard LEDs, as they'd go to the USB keyboards
+static int s_leds = -1;
+void set_keyboard_leds(uint8_t leds) { s_leds = leds; }
+
+static void on_frame(const AdbFrame *f, void *ctx)
+{
+    (void) ctx;
+    adb_bus_frame(f);
+}
+
+//
+// ADB signalling, from the timings at the top of host_adb.c
+//
+
+static void bus_reset(void)
+{
+    hold_then(1000, 0);
+    hold_then(3000, 1);
+}
+
+static void bus_bit(int bit)
+{
+    hold_then(0, 0);
+    hold_then(bit ? 35 : 65, 1);
+    wait_us(bit ? 65 : 35);
+}
+
+static void bus_stop_bit(bool srq)
+{
+    hold_then(0, 0);
+    hold_then(srq ? 300 : 65, 1);
+}
+
+// attention + sync + 8 command bits + stop bit; leaves the bus high (Tlt)
+static void bus_command(uint8_t command, bool srq)
+{
+    hold_then(400, 0);       // idle before attention
+    hold_then(800, 1);       // attention
+    wait_us(70);             // sync
+    for (int i = 7; i >= 0; i--)
+        bus_bit((command >> i) & 1);
+    bus_stop_bit(srq);
+}
+
+// Tlt + start bit + 16 data bits + stop bit: listen data from the host
+static void bus_data(uint16_t data)
+{
+    wait_us(200);            // Tlt
+    bus_bit(1);
+    for (int i = 15; i >= 0; i--)
+        bus_bit((data >> i) & 1);
+    bus_stop_bit(false);
+}
+
+// a device's reply, if any, and the bus idle after it
+static void bus_talk_reply(void)
+{
+    adb_bus_run(&s_bus, 2500);
+}
+
+//
+// decoded output
+//
+
+typedef enum { EvCommand, EvData, EvSrq } EvType;
+
+typedef struct {
+    EvType type;
+    uint16_t value;
+    uint16_t mask;              // the bits of value that have to match
+} Ev;
+
+#define MAX_EVENTS 4096
+
+static Ev s_expected[MAX_EVENTS];
+static unsigned s_expected_count = 0;
+static Ev s_got[MAX_EVENTS];
+static unsigned s_got_count = 0;
+
+// the last data frame and SRQ, for the host model
+static bool s_data_seen = false;
+static uint16_t s_data = 0;
+static bool s_srq_seen = false;
+
+static void got(EvType type, uint16_t value)
+{
+    if (s_got_count < MAX_EVENTS)
+        s_got[s_got_count++] = (Ev) { type, value, 0xffff };
+}
+
+static void expect_masked(EvType type, uint16_t value, uint16_t mask)
+{
+    if (s_expected_count < MAX_EVENTS)
+        s_expected[s_expected_count++] = (Ev) { type, value, mask };
+}
+
+static void expect(EvType type, uint16_t value)
+{
+    expect_masked(type, value, 0xffff);
+}
+
+void tb_adb_command(uint8_t command_byte) { got(EvCommand, command_byte); }
+void tb_adb_data(uint16_t data) { got(EvData, data); s_data_seen = true; s_data = data; }
+void tb_adb_srq(void) { got(EvSrq, 0); s_srq_seen = true; }
+
+static void reset_events(void)
+{
+    s_expected_count = 0;
+    s_got_count = 0;
+}
+
+// number of leading events that match
+static unsigned events_matching(void)
+{
+    unsigned n = 0;
+    while (n < s_expected_count && n < s_got_count &&
+            s_expected[n].type == s_got[n].type &&
+            ((s_expected[n].value ^ s_got[n].value) & s_expected[n].mask) == 0)
+        n++;
+    return n;
+}
+
+//
+// traffic
+//
+
+#define ADB_CMD(addr, cmd, reg) ((uint8_t) (((addr) << 4) | ((cmd) << 2) | (reg)))
+#define TALK 3
+#define LISTEN 2
+#define ADB_FLUSH_CMD(addr) ADB_CMD(addr, 0, 1)
+
+// A Mac-style startup poll plus some keyboard/mouse traffic; 'srq_every'
+// sets SRQ on every Nth command's stop bit (0 = never). The SRQ is seen
+// while the stop bit is processed, ahead of the command it follows.
+static void send_traffic(unsigned rounds, unsigned srq_every)
+{
+    unsigned n = 0;
+    for (unsigned r = 0; r < rounds; r++) {
+        // talk r3 to the keyboard: host_adb.c answers, through adb_tx,
+        // with a random address
+        bool srq = srq_every && (++n % srq_every) == 0;
+        bus_command(ADB_CMD(2, TALK, 3), srq);
+        if (srq)
+            expect(EvSrq, 0);
+        expect(EvCommand, ADB_CMD(2, TALK, 3));
+        bus_talk_reply();
+        expect_masked(EvData, 0x6002, 0xf0ff);
+
+        // listen r3 to the mouse: the first moves it to address 0xa, the
+        // rest go nowhere
+        srq = srq_every && (++n % srq_every) == 0;
+        bus_command(ADB_CMD(3, LISTEN, 3), srq);
+        if (srq)
+            expect(EvSrq, 0);
+        expect(EvCommand, ADB_CMD(3, LISTEN, 3));
+        bus_data(0x6a00 | (r & 0xff));
+        expect(EvData, 0x6a00 | (r & 0xff));
+
+        // talk r0 to an empty address, no reply
+        srq = srq_every && (++n % srq_every) == 0;
+        bus_command(ADB_CMD(7, TALK, 0), srq);
+        if (srq)
+            expect(EvSrq, 0);
+        expect(EvCommand, ADB_CMD(7, TALK, 0));
+        bus_talk_reply();
+
+        bus_command(ADB_FLUSH_CMD(2), false);
+        expect(EvCommand, ADB_FLUSH_CMD(2));
+
+        // arbitrary data values, to cover every bit pattern over time
+        bus_command(ADB_CMD(2, LISTEN, 2), false);
+        expect(EvCommand, ADB_CMD(2, LISTEN, 2));
+        uint16_t v = (uint16_t) (r * 0x9e37 + 0x1234);
+        bus_data(v);
+        expect(EvData, v);
+    }
+    // adb_rx ends a frame once the bus has been idle a while
+    wait_us(1000);
+}
+
+static void start(unsigned jitter_pct, uint32_t seed)
+{
+    adb_bus_init(&s_bus, 1, on_frame, NULL);
+    s_jitter_pct = jitter_pct;
+    s_rng = seed;
+    reset_events();
+    adb_init();
+    bus_reset();
+}
+
+static void test_clean_decode(void)
+{
+    start(0, 1);
+    send_traffic(20, 0);
+    unsigned ok = events_matching();
+    CHECK(ok == s_expected_count && s_got_count == s_expected_count,
+            "clean bus: %u of %u events matched (%u decoded)", ok, s_expected_count, s_got_count);
+    CHECK(s_bus.rx.errors == 0, "clean bus: %u bad frames", s_bus.rx.errors);
+}
+
+static void test_srq(void)
+{
+    start(0, 1);
+    send_traffic(20, 3);
+    unsigned ok = events_matching();
+    CHECK(ok == s_expected_count && s_got_count == s_expected_count,
+            "srq: %u of %u events matched (%u decoded)", ok, s_expected_count, s_got_count);
+}
+
+static void test_jitter(void)
+{
+    // adb_rx samples each bit 44-48us after it falls, so a 65us zero
+    // survives up to ~30% jitter and a 35us one up to ~25%; sweep up to
+    // and a bit past that.
+    const unsigned jitters[] = { 0, 5, 10, 20, 25, 30, 35 };
+
+    printf("jitter sweep (5 seeds x 200 transactions each):\n");
+    printf("  jitter   events ok (in order)   bad frames\n");
+    for (unsigned j = 0; j < sizeof(jitters) / sizeof(jitters[0]); j++) {
+        unsigned total = 0, ok = 0;
+        uint32_t errors = 0;
+        for (uint32_t seed = 1; seed <= 5; seed++) {
+            start(jitters[j], seed * 7919);
+            send_traffic(40, 4);
+            ok += events_matching();
+            total += s_expected_count;
+            errors += s_bus.rx.errors;
+        }
+        printf("  %5u%%   %9u/%-9u   %u\n", jitters[j], ok, total, errors);
+        if (jitters[j] <= 25)
+            CHECK(ok == total, "%u%% jitter: only %u of %u events decoded correctly", jitters[j], ok, total);
+    }
+}
+
+// The GPIO interrupt ran on every edge; with adb_rx the CPU is called in
+// once there's a word in the RX FIFO, and finishes with whole frames.
+static void bench_irqs(void)
+{
+    const unsigned rounds = 2000;
+
+    start(10, 42);
+    send_traffic(rounds, 5);
+
+    printf("irqs: %llu bus edges, %llu FIFO words, %llu interrupts (%.1f%% of one per edge)\n",
+            (unsigned long long) s_bus.edge_count, (unsigned long long) s_bus.words,
+            (unsigned long long) s_bus.irqs, 100.0 * s_bus.irqs / s_bus.edge_count);
+    CHECK(s_bus.irqs * 3 < s_bus.edge_count, "%llu interrupts for %llu edges", (unsigned long long) s_bus.irqs,
+            (unsigned long long) s_bus.edge_count);
+}
+
+//
+// a host computer polling the keyboard and mouse
+//
+
+static double s_tlt_min, s_tlt_max;
+static unsigned s_tlt_count;
+
+// A command from the host; for a Talk, the reply or -1. Tlt is from the
+// end of the stop bit (or of an SRQ held past it) to the reply's start bit.
+static int host_command(uint8_t command)
+{
+    bus_command(command, false);
+    // the frame before ends once the bus has been idle a while, so it's
+    // been seen by now
+    s_data_seen = false;
+    if ((command & 0x0c) != 0x0c)
+        return -1;
+
+    while (!adb_bus_level(&s_bus))
+        adb_bus_run(&s_bus, 1);
+    double released = adb_bus_now_us(&s_bus);
+    unsigned us = 0;
+    while (adb_bus_level(&s_bus) && us < 400) {
+        adb_bus_run(&s_bus, 1);
+        us++;
+    }
+    if (us < 400) {
+        double tlt = adb_bus_now_us(&s_bus) - released;
+        if (s_tlt_count++ == 0 || tlt < s_tlt_min)
+            s_tlt_min = tlt;
+        if (tlt > s_tlt_max)
+            s_tlt_max = tlt;
+    }
+    bus_talk_reply();
+    return s_data_seen ? s_data : -1;
+}
+
+static int host_talk(uint8_t addr, uint8_t reg)
+{
+    return host_command(ADB_CMD(addr, TALK, reg));
+}
+
+static void host_listen(uint8_t addr, uint8_t reg, uint16_t data)
+{
+    host_command(ADB_CMD(addr, LISTEN, reg));
+    bus_data(data);
+}
+
+// What Linux's adb.c does after a reset: find who answers where, move
+// each to a free address with handler 0xfe and back to make sure there's
+// one device there, then the drivers pick their handlers (adbhid.c).
+static void host_probe(void)
+{
+    bus_reset();
+    wait_us(3000);
+
+    uint16_t found = 0;
+    for (uint8_t a = 1; a < 16; a++) {
+        int r3 = host_talk(a, 3);
+        if (r3 >= 0) {
+            found |= 1u << a;
+            CHECK((r3 & 0x0f00) == 0 || (r3 & 0x4000), "Talk 3 at $%x: 0x%04x", a, r3);
+        }
+    }
+    CHECK(found == (1u << 2 | 1u << 3), "probe found 0x%04x", found);
+
+    for (uint8_t a = 2; a <= 3; a++) {
+        host_listen(a, 3, 0x6f00 | 0xfe);
+        CHECK(host_talk(0xf, 3) >= 0, "$%x didn't move to $f", a);
+        CHECK(host_talk(a, 3) < 0, "something still at $%x", a);
+        host_listen(0xf, 3, (0x60 | a) << 8 | 0xfe);
+        CHECK(host_talk(a, 3) >= 0 && host_talk(0xf, 3) < 0, "$%x didn't move back", a);
+    }
+
+    // keyboard: extended with the right modifiers; mouse: 400 cpi (4),
+    // then 200 (2)
+    host_listen(2, 3, 0x2200 | 3);
+    CHECK((host_talk(2, 3) & 0xff) == 3, "keyboard didn't take handler 3");
+    host_listen(3, 3, 0x2300 | 4);
+    CHECK((host_talk(3, 3) & 0xff) == 1, "mouse took handler 4");
+    host_listen(3, 3, 0x2300 | 2);
+    CHECK((host_talk(3, 3) & 0xff) == 2, "mouse didn't take handler 2");
+
+    // caps lock LED on (register 2's LED bits are 0 = on)
+    host_listen(2, 2, 0xff00 | (uint8_t) ~0x02);
+    CHECK(s_leds == 0x02, "LEDs to USB: %d", s_leds);
+}
+
+typedef struct {
+    uint32_t at_us;
+    bool mouse;
+    uint8_t key;                // HID, for a key
+    bool down;
+    int16_t dx, dy;
+    uint8_t buttons;
+} HostInput;
+
+#define MAX_INPUT 1024
+
+static HostInput s_input[MAX_INPUT];
+static unsigned s_input_count;
+
+// what should come out of keyboard register 0, in order, and when each
+// went in
+static uint8_t s_want_keys[MAX_INPUT];
+static uint32_t s_want_at[MAX_INPUT];
+static unsigned s_want_count;
+
+static void script_key(uint32_t at_us, uint8_t hid, uint8_t adb, bool down)
+{
+    s_input[s_input_count++] = (HostInput) { .at_us = at_us, .key = hid, .down = down };
+    s_want_at[s_want_count] = at_us;
+    s_want_keys[s_want_count++] = adb | (down ? 0 : 0x80);
+}
+
+static void script_mouse(uint32_t at_us, int16_t dx, int16_t dy, uint8_t buttons)
+{
+    s_input[s_input_count++] = (HostInput) { .at_us = at_us, .mouse = true, .dx = dx, .dy = dy,
+                                             .buttons = buttons };
+}
+
+static int field7(uint8_t bits)
+{
+    return bits & 0x40 ? (int) (bits & 0x7f) - 0x80 : (int) (bits & 0x7f);
+}
+
+// The Mac's autopoll: Talk 0 to one device every 11 ms; an SRQ on one of
+// those has it poll the other right away, and keep polling that one.
+static void test_host_poll(void)
+{
+    start(0, 1);
+    adb_bus_drive(&s_bus, 1);
+    host_probe();
+    s_tlt_count = 0;
+
+    // "hello" typed, with shift on the h, while the mouse moves at USB's
+    // 125 Hz, slow and then in 150-count flicks, and clicks
+    uint32_t t0 = (uint32_t) time_us_64() + 5000;
+    static const struct { uint8_t hid, adb; } word[] = {
+        { HID_KEY_LEFT_SHIFT, 0x38 }, { HID_KEY_H, 0x04 }, { HID_KEY_E, 0x0e }, { HID_KEY_L, 0x25 },
+        { HID_KEY_L, 0x25 }, { HID_KEY_O, 0x1f },
+    };
+    s_input_count = s_want_count = 0;
+    for (unsigned i = 0; i < sizeof(word) / sizeof(word[0]); i++) {
+        uint32_t at = t0 + 37000 + i * 53000;
+        script_key(at, word[i].hid, word[i].adb, true);
+        if (i > 0)
+            script_key(at + 29000, word[i].hid, word[i].adb, false);
+    }
+    script_key(t0 + 37000 + 6 * 53000, HID_KEY_LEFT_SHIFT, 0x38, false);
+    int want_dx = 0, want_dy = 0;
+    for (unsigned i = 0; i < 60; i++) {
+        int16_t dx = i < 40 ? 3 : 150, dy = i < 40 ? -2 : -90;
+        uint8_t buttons = i == 20 || i == 21 ? MOUSE_BUTTON_LEFT : 0;
+        script_mouse(t0 + i * 8000, dx, dy, buttons);
+        want_dx += dx;
+        want_dy += dy;
+    }
+    // sorted by time
+    for (unsigned i = 1; i < s_input_count; i++)
+        for (unsigned j = i; j > 0 && s_input[j].at_us < s_input[j - 1].at_us; j--) {
+            HostInput t = s_input[j];
+            s_input[j] = s_input[j - 1];
+            s_input[j - 1] = t;
+        }
+
+    uint8_t keys[MAX_INPUT];
+    unsigned key_count = 0;
+    uint32_t worst_latency = 0;
+    int dx = 0, dy = 0, max_delta = 0;
+    unsigned clicks = 0, srqs = 0, polls = 0;
+    bool left = false;
+
+    uint8_t polled = 2;
+    unsigned next = 0;
+    // until everything's in and register 0 has gone quiet
+    unsigned quiet = 0;
+    for (uint64_t tick = time_us_64(); next < s_input_count || quiet < 4; tick += 11000) {
+        while (time_us_64() < tick)
+            adb_bus_run(&s_bus, 1);
+        for (; next < s_input_count && s_input[next].at_us <= time_us_64(); next++) {
+            const HostInput *in = &s_input[next];
+            if (in->mouse)
+                adb_mouse_event((MouseEvent) { .dx = in->dx, .dy = in->dy, .buttons = in->buttons });
+            else
+                adb_kbd_event((KeyboardEvent) { .page = 0, .keycode = in->key, .down = in->down });
+        }
+
+        for (unsigned tries = 0; tries < 2; tries++) {
+            s_srq_seen = false;
+            int r0 = host_talk(polled, 0);
+            polls++;
+            if (r0 >= 0 && polled == 2) {
+                uint8_t b[2] = { r0 >> 8, r0 & 0xff };
+                for (unsigned i = 0; i < 2; i++) {
+                    if (b[i] == 0xff || key_count >= MAX_INPUT)
+                        continue;
+                    if (key_count < s_want_count) {
+                        uint32_t latency = (uint32_t) time_us_64() - s_want_at[key_count];
+                        if (latency > worst_latency)
+                            worst_latency = latency;
+                    }
+                    keys[key_count++] = b[i];
+                }
+            } else if (r0 >= 0) {
+                int mx = field7(r0 & 0x7f), my = field7((r0 >> 8) & 0x7f);
+                dx += mx;
+                dy += my;
+                if (abs(mx) > max_delta)
+                    max_delta = abs(mx);
+                if (abs(my) > max_delta)
+                    max_delta = abs(my);
+                bool l = !(r0 & 0x8000);
+                if (l && !left)
+                    clicks++;
+                left = l;
+            }
+            quiet = r0 >= 0 ? 0 : quiet + 1;
+            // the device asked on this command's stop bit; the next poll
+            // sees one raised during this reply
+            if (!s_srq_seen)
+                break;
+            srqs++;
+            polled = polled == 2 ? 3 : 2;
+        }
+    }
+
+    printf("host poll: %u Talks, %u SRQs, Tlt %.1f-%.1fus, worst key latency %.1fms, "
+           "mouse max %d a Talk\n", polls, srqs, s_tlt_min, s_tlt_max, worst_latency / 1000.0, max_delta);
+
+    CHECK(key_count == s_want_count && memcmp(keys, s_want_keys, key_count) == 0,
+          "host poll: %u keys, wanted %u in order", key_count, s_want_count);
+    CHECK(dx == want_dx && dy == want_dy, "host poll: mouse moved %d,%d, not %d,%d", dx, dy, want_dx, want_dy);
+    CHECK(max_delta <= 63, "host poll: %d in a 7-bit field", max_delta);
+    CHECK(clicks == 1 && !left, "host poll: %u clicks, left %s", clicks, left ? "down" : "up");
+    CHECK(s_tlt_count > 0 && s_tlt_min >= 140 && s_tlt_max <= 260, "host poll: Tlt %.1f-%.1fus",
+          s_tlt_min, s_tlt_max);
+    CHECK(worst_latency <= 25000, "host poll: a key took %.1fms", worst_latency / 1000.0);
+    CHECK(s_bus.rx.errors == 0 && s_bus.tx_dropped == 0, "host poll: %u bad frames, %u replies dropped",
+          s_bus.rx.errors, s_bus.tx_dropped);
+}
+
+// Another device at $2 answers Talk 3 along with the keyboard, at the same
+// moment: the bus ANDs the two replies, the keyboard sees its own didn't
+// come back as sent, and stays put for the Listen 3 0xfe that follows.
+static void test_collision(void)
+{
+    start(0, 1);
+    adb_bus_drive(&s_bus, 1);
+    wait_us(3000);
+
+    bus_command(ADB_CMD(2, TALK, 3), false);
+    s_data_seen = false;
+    while (adb_bus_level(&s_bus))
+        adb_bus_run(&s_bus, 1);
+    // its start bit, register 3 at address 0 with handler 1, stop bit
+    bus_bit(1);
+    for (int i = 15; i >= 0; i--)
+        bus_bit((0x6001 >> i) & 1);
+    bus_stop_bit(false);
+    bus_talk_reply();
+    CHECK(s_data_seen && (s_data & 0x0fff) == 0, "collision: the bus had 0x%04x", s_data);
+
+    host_listen(2, 3, 0x6f00 | 0xfe);
+    CHECK(host_talk(0xf, 3) < 0, "collision: the keyboard moved anyway");
+    CHECK(host_talk(2, 3) >= 0, "collision: no keyboard at $2");
+
+    // only the keyboard answered that one, so now it moves
+    host_listen(2, 3, 0x6f00 | 0xfe);
+    CHECK(host_talk(0xf, 3) >= 0, "collision: the keyboard didn't move once alone");
+    CHECK(s_bus.rx.errors == 0, "collision: %u bad frames", s_bus.rx.errors);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-v") == 0)
+        tb_verbose = true;
+
+    test_clean_decode();
+    test_srq();
+    test_jitter();
+    bench_irqs();
+    test_host_poll();
+    test_collision();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,346 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The Apollo host command recognizer in src/apollo_cmd.c: the command
+ * logs in NOTES.md replayed byte by byte, plus unknown and broken up
+ * commands, and the reply latency stats.
+ *
+ * Usage: apollo_cmd_test <path to NOTES.md>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "apollo_cmd.h"
+
+// apollo_cmd.c reads the clock once a handler returns; feed() sets it to
+// each byte's time, and a handler can take time of its own
+static uint64_t s_clock_us = 0;
+static uint32_t s_handler_us = 0;
+
+uint64_t time_us_64(void)
+{
+    return s_clock_us;
+}
+
+// what the handlers were called with, in order
+static ApolloCmdId s_calls[256];
+static unsigned s_call_count = 0;
+
+static bool
+record(ApolloCmdId id)
+{
+    if (s_call_count < sizeof(s_calls) / sizeof(s_calls[0]))
+        s_calls[s_call_count] = id;
+    s_call_count++;
+    s_clock_us += s_handler_us;
+    return true;
+}
+
+static bool
+record_silent(ApolloCmdId id)
+{
+    record(id);
+    return false;
+}
+
+// the Apollo backend's set: modes and ident reply, the rest don't
+static const ApolloCmdHandler s_handlers[ApolloCmdCount] = {
+    [ApolloCmdMode0] = record,
+    [ApolloCmdMode1] = record,
+    [ApolloCmdIdent] = record,
+    [ApolloCmdBeeperOn] = record_silent,
+    [ApolloCmdBeeperOff] = record_silent,
+    [ApolloCmd1116] = record_silent,
+    [ApolloCmd1117] = record_silent,
+    [ApolloCmd1166] = record_silent,
+    [ApolloCmdMouseEnable] = record_silent,
+};
+
+static void
+begin(ApolloCmd *p)
+{
+    apollo_cmd_init(p, s_handlers);
+    s_call_count = 0;
+    s_handler_us = 0;
+}
+
+// bytes 1 ms apart
+static void
+feed(ApolloCmd *p, const uint8_t *bytes, unsigned len, uint32_t *now)
+{
+    for (unsigned i = 0; i < len; i++) {
+        s_clock_us = *now;
+        apollo_cmd_feed(p, bytes[i], *now);
+        *now += 1000;
+    }
+}
+
+static bool
+calls_are(const ApolloCmdId *want, unsigned len)
+{
+    if (s_call_count != len)
+        return false;
+    for (unsigned i = 0; i < len; i++) {
+        if (s_calls[i] != want[i])
+            return false;
+    }
+    return true;
+}
+
+static void
+print_calls(void)
+{
+    printf("  calls:");
+    for (unsigned i = 0; i < s_call_count && i < 256; i++)
+        printf(" %s,", apollo_cmd_table[s_calls[i]].name);
+    printf("\n");
+}
+
+//
+// NOTES.md
+//
+
+// The bytes after each occurrence of tag on a line, e.g. "recv ff"; the
+// logs in NOTES.md come in two formats.
+static unsigned
+load_log(const char *path, const char *tag, uint8_t *out, unsigned max)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("can't open %s\n", path);
+        exit(1);
+    }
+
+    char line[256];
+    unsigned n = 0;
+    while (fgets(line, sizeof(line), f)) {
+        const char *p = strstr(line, tag);
+        if (!p)
+            continue;
+        unsigned v;
+        if (sscanf(p + strlen(tag), "%x", &v) == 1 && n < max)
+            out[n++] = v;
+    }
+    fclose(f);
+    return n;
+}
+
+// "[   57317] IN: ff (bytes: ...)" after boot, from an early version
+static void
+test_notes_boot_log(const char *notes)
+{
+    uint8_t bytes[256];
+    unsigned n = load_log(notes, "] IN: ", bytes, sizeof(bytes));
+    CHECK(n == 8, "%u bytes in the IN: log", n);
+
+    ApolloCmd p;
+    begin(&p);
+    uint32_t now = 0;
+    feed(&p, bytes, n, &now);
+
+    static const ApolloCmdId want[] = { ApolloCmdMode0, ApolloCmdMode0, ApolloCmdIdent };
+    CHECK(calls_are(want, 3), "IN: log commands");
+    if (!calls_are(want, 3))
+        print_calls();
+    CHECK(p.stats.unknown == 0 && p.stats.stray == 0, "%u unknown, %u stray", p.stats.unknown, p.stats.stray);
+    CHECK(p.stats.counts[ApolloCmdMode0] == 2, "mode 0 count %u", p.stats.counts[ApolloCmdMode0]);
+}
+
+// "(apollo:0) recv ff": two domain_os boots, the second followed by the
+// zeros that came after the ident
+static void
+test_notes_recv_log(const char *notes)
+{
+    uint8_t bytes[256];
+    unsigned n = load_log(notes, ") recv ", bytes, sizeof(bytes));
+    CHECK(n == 31, "%u bytes in the recv log", n);
+
+    ApolloCmd p;
+    begin(&p);
+    uint32_t now = 0;
+    feed(&p, bytes, n, &now);
+
+    static const ApolloCmdId want[] = {
+        ApolloCmdMode0, ApolloCmdMode0, ApolloCmdMode0, ApolloCmdIdent,
+        ApolloCmdMode0, ApolloCmdMode1, ApolloCmdIdent,
+    };
+    CHECK(calls_are(want, 7), "recv log commands");
+    if (!calls_are(want, 7))
+        print_calls();
+    CHECK(p.stats.commands == 7 && p.stats.unknown == 0 && p.stats.stray == 0,
+          "%u commands, %u unknown, %u stray", p.stats.commands, p.stats.unknown, p.stats.stray);
+    CHECK(!p.in_cmd, "still in a command after the trailing zeros");
+
+    // bytes 1 ms apart: ff 00 replies 1 ms after the 0xff, ff 12 21 2 ms
+    CHECK(p.stats.replies == 7, "%u replies", p.stats.replies);
+    CHECK(p.stats.latency_max_us == 2000, "latency max %u us", p.stats.latency_max_us);
+    CHECK(p.stats.latency_total_us == 5 * 1000 + 2 * 2000, "latency total %llu us",
+          (unsigned long long) p.stats.latency_total_us);
+}
+
+//
+// beyond the logs
+//
+
+static void
+test_known_and_silent(void)
+{
+    ApolloCmd p;
+    begin(&p);
+    uint32_t now = 0;
+
+    // from the comments in the old parser: mouse enable and its trailing
+    // zeros, mame's 11xx, the beeper
+    static const uint8_t in[] = {
+        0xff, 0x10, 0x04, 0x5e, 0x00, 0x00, 0x00, 0x00,
+        0xff, 0x11, 0x17, 0xff, 0x11, 0x16, 0xff, 0x11, 0x66,
+        0xff, 0x21, 0x81, 0xff, 0x21, 0x82,
+    };
+    feed(&p, in, sizeof(in), &now);
+
+    static const ApolloCmdId want[] = {
+        ApolloCmdMouseEnable, ApolloCmd1117, ApolloCmd1116, ApolloCmd1166, ApolloCmdBeeperOn, ApolloCmdBeeperOff,
+    };
+    CHECK(calls_are(want, 6), "known commands");
+    if (!calls_are(want, 6))
+        print_calls();
+    CHECK(p.stats.replies == 0 && p.stats.latency_max_us == 0, "silent handlers counted as replies");
+    CHECK(p.stats.unknown == 0 && p.stats.stray == 0, "%u unknown, %u stray", p.stats.unknown, p.stats.stray);
+
+    // NULL handlers are accepted and counted
+    apollo_cmd_init(&p, NULL);
+    static const uint8_t ident[] = { 0xff, 0x12, 0x21 };
+    feed(&p, ident, sizeof(ident), &now);
+    CHECK(p.stats.commands == 1 && p.stats.counts[ApolloCmdIdent] == 1 && p.stats.replies == 0, "no handlers");
+}
+
+static void
+test_unknown(void)
+{
+    ApolloCmd p;
+    begin(&p);
+    uint32_t now = 0;
+
+    // ruled out at the first byte that fits nothing
+    static const uint8_t a[] = { 0xff, 0x55, 0xff, 0x12, 0x22, 0xff, 0x10, 0x04, 0x5f };
+    feed(&p, a, sizeof(a), &now);
+    CHECK(s_call_count == 0, "%u calls", s_call_count);
+    CHECK(p.stats.unknown == 3, "%u unknown", p.stats.unknown);
+    CHECK(p.stats.last_unknown == 0x10045f, "last unknown %06x", p.stats.last_unknown);
+    CHECK(!p.in_cmd, "in a command");
+
+    // stray bytes outside a command; 0x00 isn't one
+    static const uint8_t b[] = { 0x00, 0x12, 0x21, 0x00, 0x01 };
+    feed(&p, b, sizeof(b), &now);
+    CHECK(p.stats.stray == 3 && s_call_count == 0, "%u stray, %u calls", p.stats.stray, s_call_count);
+
+    // a command cut off by the next one: the 0xff starts over
+    begin(&p);
+    static const uint8_t c[] = { 0xff, 0x12, 0xff, 0x12, 0x21, 0xff, 0x10, 0x04, 0xff, 0x01 };
+    feed(&p, c, sizeof(c), &now);
+    static const ApolloCmdId want[] = { ApolloCmdIdent, ApolloCmdMode1 };
+    CHECK(calls_are(want, 2), "commands after cut off ones");
+    if (!calls_are(want, 2))
+        print_calls();
+    CHECK(p.stats.unknown == 2 && p.stats.last_unknown == 0x1004ff, "%u unknown, last %06x",
+          p.stats.unknown, p.stats.last_unknown);
+
+    // ff ff 00: mame's loopback, then mode 0
+    begin(&p);
+    static const uint8_t d[] = { 0xff, 0xff, 0x00 };
+    feed(&p, d, sizeof(d), &now);
+    static const ApolloCmdId want0[] = { ApolloCmdMode0 };
+    CHECK(calls_are(want0, 1) && p.stats.unknown == 1, "ff ff 00");
+}
+
+// The latency runs to the handler returning: a command drained from the
+// FIFO in one pass still counts what queueing its reply took.
+static void
+test_handler_time(void)
+{
+    ApolloCmd p;
+    begin(&p);
+    s_handler_us = 300;
+
+    s_clock_us = 5000;
+    apollo_cmd_feed(&p, 0xff, 5000);
+    apollo_cmd_feed(&p, 0x01, 5000);
+    CHECK(p.stats.replies == 1 && p.stats.latency_max_us == 300, "%u replies, latency max %u us",
+          p.stats.replies, p.stats.latency_max_us);
+
+    uint32_t now = 10000;
+    static const uint8_t ident[] = { 0xff, 0x12, 0x21 };
+    feed(&p, ident, sizeof(ident), &now);
+    CHECK(p.stats.replies == 2 && p.stats.latency_max_us == 2300, "%u replies, latency max %u us",
+          p.stats.replies, p.stats.latency_max_us);
+    CHECK(p.stats.latency_total_us == 2600, "latency total %llu us", (unsigned long long) p.stats.latency_total_us);
+}
+
+// Every stream of up to four bytes after an 0xff: never more than
+// APOLLO_CMD_MAX_LEN bytes held, and always back to waiting for an 0xff
+// within that many.
+static void
+test_all_streams(void)
+{
+    for (uint32_t v = 0; v < (1u << 16); v++) {
+        for (unsigned hi = 0; hi < 256; hi += 0x11) {
+            ApolloCmd p;
+            begin(&p);
+            uint32_t now = 0;
+            uint8_t in[] = { 0xff, v >> 8, v, hi, 0x00 };
+            for (unsigned i = 0; i < sizeof(in); i++) {
+                apollo_cmd_feed(&p, in[i], now);
+                CHECK(p.len <= APOLLO_CMD_MAX_LEN, "%02x %02x %02x: %u bytes held", in[1], in[2], in[3], p.len);
+            }
+            bool ff_pending = in[1] == 0xff || in[2] == 0xff || in[3] == 0xff;
+            CHECK(ff_pending || !p.in_cmd, "%02x %02x %02x 00: still in a command", in[1], in[2], in[3]);
+            CHECK(p.stats.commands + p.stats.unknown >= 1, "%02x %02x %02x: the 0xff went nowhere", in[1], in[2], in[3]);
+            if (s_failures > 20)
+                return;
+        }
+    }
+}
+
+static void
+test_table(void)
+{
+    CHECK(ApolloCmdCount <= 32, "more commands than candidate bits");
+    for (int i = 0; i < ApolloCmdCount; i++) {
+        const ApolloCmdDef *a = &apollo_cmd_table[i];
+        CHECK(a->len >= 1 && a->len <= APOLLO_CMD_MAX_LEN && a->name, "entry %d", i);
+        for (int j = 0; j < ApolloCmdCount; j++) {
+            const ApolloCmdDef *b = &apollo_cmd_table[j];
+            if (i == j || a->len > b->len)
+                continue;
+            CHECK(memcmp(a->bytes, b->bytes, a->len) != 0, "%s is a prefix of %s", a->name, b->name);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: apollo_cmd_test <NOTES.md>\n");
+        return 2;
+    }
+
+    test_table();
+    test_notes_boot_log(argv[1]);
+    test_notes_recv_log(argv[1]);
+    test_known_and_silent();
+    test_unknown();
+    test_handler_time();
+    test_all_streams();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,272 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Boot (6KRO) and NKRO keyboard report diffing in src/bootmode.c: event
+ * order, agreement between the two paths, and what each costs per report.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "check.h"
+#include "babelfish.h"
+
+#define MAX_EVENTS 512
+
+static KeyboardEvent s_events[MAX_EVENTS];
+static unsigned s_event_count = 0;
+static bool s_recording = true;
+
+void enqueue_kbd_event(const KeyboardEvent* event)
+{
+    if (s_recording && s_event_count < MAX_EVENTS)
+        s_events[s_event_count++] = *event;
+    else
+        s_event_count++;
+}
+
+void enqueue_mouse_event(const MouseEvent* event)
+{
+    (void) event;
+}
+
+static bool is_modifier(uint16_t code)
+{
+    return code >= HID_KEY_LEFT_CONTROL && code <= HID_KEY_RIGHT_GUI;
+}
+
+static void set_key(uint32_t keys[NKRO_WORDS], uint8_t code)
+{
+    keys[code >> 5] |= 1u << (code & 31);
+}
+
+static void nkro_from_boot(const hid_keyboard_report_t *r, uint32_t keys[NKRO_WORDS])
+{
+    memset(keys, 0, NKRO_WORDS * sizeof(uint32_t));
+    keys[NKRO_MODIFIER_WORD] = r->modifier;
+    for (int i = 0; i < 6; i++) {
+        if (r->keycode[i])
+            set_key(keys, r->keycode[i]);
+    }
+}
+
+//
+// event order
+//
+
+static void expect(unsigned i, uint16_t code, bool down)
+{
+    CHECK(i < s_event_count && s_events[i].keycode == code && s_events[i].down == down,
+          "event %u: got %02x %s, expected %02x %s", i,
+          i < s_event_count ? s_events[i].keycode : 0, i < s_event_count && s_events[i].down ? "down" : "up",
+          code, down ? "down" : "up");
+}
+
+static void test_nkro_order(void)
+{
+    uint32_t keys[NKRO_WORDS] = { 0 };
+
+    // modifiers go down before keys
+    s_event_count = 0;
+    keys[NKRO_MODIFIER_WORD] = KEYBOARD_MODIFIER_LEFTSHIFT;
+    set_key(keys, HID_KEY_A);
+    set_key(keys, HID_KEY_B);
+    translate_nkro_kbd_report(keys);
+    CHECK(s_event_count == 3, "%u events", s_event_count);
+    expect(0, HID_KEY_LEFT_SHIFT, true);
+    expect(1, HID_KEY_A, true);
+    expect(2, HID_KEY_B, true);
+
+    // and up after them
+    s_event_count = 0;
+    memset(keys, 0, sizeof(keys));
+    set_key(keys, HID_KEY_B);
+    set_key(keys, HID_KEY_C);
+    translate_nkro_kbd_report(keys);
+    CHECK(s_event_count == 3, "%u events", s_event_count);
+    expect(0, HID_KEY_A, false);
+    expect(1, HID_KEY_LEFT_SHIFT, false);
+    expect(2, HID_KEY_C, true);
+
+    // no rollover limit
+    s_event_count = 0;
+    memset(keys, 0, sizeof(keys));
+    for (uint8_t k = HID_KEY_A; k < HID_KEY_A + 40; k++)
+        set_key(keys, k);
+    translate_nkro_kbd_report(keys);
+    CHECK(s_event_count == 38, "40 keys down with B and C already down: %u events", s_event_count);
+
+    // ErrorRollOver and friends aren't keys
+    s_event_count = 0;
+    memset(keys, 0, sizeof(keys));
+    keys[0] = 0xf;
+    translate_nkro_kbd_report(keys);
+    CHECK(s_event_count == 40, "all up, usages 0-3 ignored: %u events", s_event_count);
+}
+
+//
+// 6KRO and NKRO agree
+//
+
+// key ups, modifier changes and key downs are each a set; within a set,
+// the two paths may order keys differently
+static void canonicalize(KeyboardEvent *ev, unsigned count)
+{
+    unsigned i = 0;
+    unsigned start = 0;
+    int phase = 0;
+
+    for (i = 0; i <= count; i++) {
+        int p = i == count ? 3 : is_modifier(ev[i].keycode) ? 1 : ev[i].down ? 2 : 0;
+        if (p == phase && i < count)
+            continue;
+        // sort [start, i) by keycode when it's a key phase
+        if (phase != 1) {
+            for (unsigned a = start + 1; a < i; a++) {
+                for (unsigned b = a; b > start && ev[b - 1].keycode > ev[b].keycode; b--) {
+                    KeyboardEvent t = ev[b];
+                    ev[b] = ev[b - 1];
+                    ev[b - 1] = t;
+                }
+            }
+        }
+        start = i;
+        phase = p;
+    }
+}
+
+static void test_paths_agree(void)
+{
+    static const uint8_t pool[] = {
+        HID_KEY_A, HID_KEY_S, HID_KEY_D, HID_KEY_F, HID_KEY_J, HID_KEY_K, HID_KEY_L, HID_KEY_SPACE,
+        HID_KEY_ENTER, HID_KEY_1, HID_KEY_ARROW_UP, HID_KEY_F5, HID_KEY_KEYPAD_0,
+    };
+    KeyboardEvent boot[64], nkro[64];
+    unsigned boot_count, nkro_count;
+    hid_keyboard_report_t r = { 0 };
+    uint32_t keys[NKRO_WORDS];
+
+    // both paths start from all-up
+    translate_boot_kbd_report(&r);
+    memset(keys, 0, sizeof(keys));
+    translate_nkro_kbd_report(keys);
+
+    srand(2);
+    for (int iter = 0; iter < 5000; iter++) {
+        memset(&r, 0, sizeof(r));
+        r.modifier = rand() & 0xff;
+        int n = rand() % 7;
+        for (int i = 0; i < n; i++) {
+            uint8_t k = pool[rand() % sizeof(pool)];
+            bool dup = false;
+            for (int j = 0; j < i; j++)
+                dup |= r.keycode[j] == k;
+            r.keycode[i] = dup ? 0 : k;
+        }
+
+        s_event_count = 0;
+        translate_boot_kbd_report(&r);
+        boot_count = s_event_count;
+        memcpy(boot, s_events, boot_count * sizeof(KeyboardEvent));
+
+        s_event_count = 0;
+        nkro_from_boot(&r, keys);
+        translate_nkro_kbd_report(keys);
+        nkro_count = s_event_count;
+        memcpy(nkro, s_events, nkro_count * sizeof(KeyboardEvent));
+
+        canonicalize(boot, boot_count);
+        canonicalize(nkro, nkro_count);
+        bool same = boot_count == nkro_count;
+        for (unsigned i = 0; same && i < boot_count; i++)
+            same = boot[i].keycode == nkro[i].keycode && boot[i].down == nkro[i].down;
+        if (!same) {
+            CHECK(false, "report %d: boot path %u events, nkro path %u events", iter, boot_count, nkro_count);
+            break;
+        }
+    }
+}
+
+//
+// cost per report
+//
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Typing with n keys held, rolling: each report releases the oldest key
+// and presses a new one, so there's always one up and one down. Reports are
+// built up front so only the diff (and the stubbed enqueue) is timed.
+#define BENCH_CYCLE 60
+
+static void bench(unsigned held)
+{
+    const unsigned reports = 300000;
+    static hid_keyboard_report_t boot[BENCH_CYCLE];
+    static uint32_t nkro[BENCH_CYCLE][NKRO_WORDS];
+    double t0, boot_ns = 0, nkro_ns;
+
+    memset(boot, 0, sizeof(boot));
+    memset(nkro, 0, sizeof(nkro));
+    for (unsigned i = 0; i < BENCH_CYCLE; i++) {
+        for (unsigned j = 0; j < held; j++) {
+            uint8_t k = HID_KEY_A + (i + j) % BENCH_CYCLE;
+            if (j < 6)
+                boot[i].keycode[j] = k;
+            set_key(nkro[i], k);
+        }
+    }
+
+    s_recording = false;
+
+    if (held <= 6) {
+        t0 = now_ns();
+        for (unsigned i = 0; i < reports; i++)
+            translate_boot_kbd_report(&boot[i % BENCH_CYCLE]);
+        boot_ns = (now_ns() - t0) / reports;
+    }
+
+    t0 = now_ns();
+    for (unsigned i = 0; i < reports; i++)
+        translate_nkro_kbd_report(nkro[i % BENCH_CYCLE]);
+    nkro_ns = (now_ns() - t0) / reports;
+
+    if (held <= 6)
+        printf("  %2u keys held: 6KRO %6.1f ns/report, NKRO %6.1f ns/report\n", held, boot_ns, nkro_ns);
+    else
+        printf("  %2u keys held: 6KRO    n/a            NKRO %6.1f ns/report\n", held, nkro_ns);
+
+    // leave both paths all-up
+    hid_keyboard_report_t r = { 0 };
+    uint32_t keys[NKRO_WORDS] = { 0 };
+    translate_boot_kbd_report(&r);
+    translate_nkro_kbd_report(keys);
+    s_recording = true;
+}
+
+int main(void)
+{
+    test_nkro_order();
+    test_paths_agree();
+
+    printf("report diff cost on this machine:\n");
+    bench(1);
+    bench(6);
+    bench(20);
+    bench(60);
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,388 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Runs chan_uart_tx/chan_uart_rx from src/chan_uart.pio in the PIO model,
+ * set up as chan_uart_pio.c does, with frames built and taken apart by
+ * chan_uart_pio.h: TX bit timing against the ideal bit clock for each
+ * format, RX from a sender running fast or slow, parity, framing and
+ * break handling, and the two back to back through a wire.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "check.h"
+#include "pio_emu.h"
+#include "chan_uart.pio.h"
+#include "chan_uart_pio.h"
+
+// channel A's pins, as in babelfish_hw.h
+#define TX_GPIO 0
+#define RX_GPIO 1
+#define SM_TX 0
+#define SM_RX 1
+
+#define SYS_CLK_HZ 120000000
+
+// pio_encode_set(pio_y, n)
+#define ENCODE_SET_Y(n) (0xe040 | (n))
+
+#define MAX_BYTES 64
+#define MAX_BITS (MAX_BYTES * 13)
+
+typedef struct {
+    pio_emu pio;
+    ChanUartPioFormat fmt;
+    uint32_t baud;
+    double bit_cycles;      // system clocks per bit, as the divider has it
+} Uart;
+
+static const ChanUartPioFormat formats[] = {
+    { 8, 1, UART_PARITY_NONE },
+    { 8, 1, UART_PARITY_EVEN },     // Apollo
+    { 8, 1, UART_PARITY_ODD },
+    { 7, 1, UART_PARITY_EVEN },
+    { 8, 2, UART_PARITY_NONE },
+    { 7, 2, UART_PARITY_ODD },
+    { 5, 1, UART_PARITY_NONE },
+};
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+static const uint8_t patterns[] = { 0x00, 0xff, 0x55, 0xaa, 0x01, 0x80, 0x7f, 0xfe, 0x12, 0xed, 0x0f, 0xf0 };
+
+static void fmt_str(const ChanUartPioFormat *fmt, char *buf)
+{
+    sprintf(buf, "%u%c%u", fmt->data_bits, "NEO"[fmt->parity], fmt->stop_bits);
+}
+
+// As chan_uart_pio_init(), with sm_config_set_clkdiv()'s rounding.
+static void uart_init_emu(Uart *u, uint32_t baud, const ChanUartPioFormat *fmt)
+{
+    memset(u, 0, sizeof(*u));
+    u->fmt = *fmt;
+    u->baud = baud;
+
+    pio_emu *pio = &u->pio;
+    pio_emu_init(pio);
+
+    int tx = pio_emu_add_program(pio, chan_uart_tx_program_instructions,
+            sizeof(chan_uart_tx_program_instructions) / 2, -1);
+    int rx = pio_emu_add_program(pio, chan_uart_rx_program_instructions,
+            sizeof(chan_uart_rx_program_instructions) / 2, -1);
+    CHECK(tx >= 0 && rx >= 0, "chan_uart_tx + chan_uart_rx don't fit");
+
+    float div = (float) SYS_CLK_HZ / (8.0f * baud);
+    uint16_t div_int = (uint16_t) div;
+    uint8_t div_frac = (uint8_t) ((div - div_int) * 256);
+    u->bit_cycles = 8.0 * (div_int + div_frac / 256.0);
+
+    pio_emu_sm_config cfg = pio_emu_default_config(tx, chan_uart_tx_wrap_target, chan_uart_tx_wrap);
+    cfg.clkdiv_int = div_int;
+    cfg.clkdiv_frac = div_frac;
+    cfg.out_base = TX_GPIO;
+    cfg.out_count = 1;
+    cfg.sideset_base = TX_GPIO;
+    cfg.sideset_bits = 2;
+    cfg.sideset_opt = true;
+    cfg.out_shift_right = true;
+    pio->pins_out |= 1u << TX_GPIO;
+    pio_emu_set_pindirs(pio, TX_GPIO, 1, true);
+    pio_emu_sm_init(pio, SM_TX, tx, &cfg);
+    pio_emu_sm_exec(pio, SM_TX, ENCODE_SET_Y(chan_uart_pio_tx_y(fmt)));
+
+    cfg = pio_emu_default_config(rx, chan_uart_rx_wrap_target, chan_uart_rx_wrap);
+    cfg.clkdiv_int = div_int;
+    cfg.clkdiv_frac = div_frac;
+    cfg.in_base = RX_GPIO;
+    cfg.jmp_pin = RX_GPIO;
+    cfg.in_shift_right = true;
+    cfg.autopush = true;
+    cfg.push_threshold = chan_uart_pio_rx_y(fmt) + 1;
+    pio_emu_sm_init(pio, SM_RX, rx, &cfg);
+    pio_emu_sm_exec(pio, SM_RX, ENCODE_SET_Y(chan_uart_pio_rx_y(fmt)));
+
+    pio_emu_sm_set_enabled(pio, SM_TX, true);
+    pio_emu_sm_set_enabled(pio, SM_RX, true);
+}
+
+// The line levels for bytes sent back to back: start, data LSB first,
+// parity, stop bits.
+static unsigned frame_bits(const ChanUartPioFormat *fmt, const uint8_t *bytes, unsigned n, uint8_t *bits)
+{
+    unsigned len = 0;
+    for (unsigned i = 0; i < n; i++) {
+        uint8_t c = bytes[i] & ((1u << fmt->data_bits) - 1);
+        bits[len++] = 0;
+        for (unsigned b = 0; b < fmt->data_bits; b++)
+            bits[len++] = (c >> b) & 1;
+        if (fmt->parity != UART_PARITY_NONE)
+            bits[len++] = __builtin_parity(c) ^ (fmt->parity == UART_PARITY_ODD);
+        for (unsigned s = 0; s < fmt->stop_bits; s++)
+            bits[len++] = 1;
+    }
+    return len;
+}
+
+static unsigned frame_len(const ChanUartPioFormat *fmt)
+{
+    return 1 + fmt->data_bits + (fmt->parity != UART_PARITY_NONE) + fmt->stop_bits;
+}
+
+//
+// TX: every edge where the ideal bit clock puts it, give or take the
+// fractional divider's jitter, and the right level in the middle of
+// every bit.
+//
+
+static void check_tx(uint32_t baud, const ChanUartPioFormat *fmt, const uint8_t *bytes, unsigned n)
+{
+    static Uart u;
+    static uint8_t bits[MAX_BITS];
+    char name[8];
+    fmt_str(fmt, name);
+
+    uart_init_emu(&u, baud, fmt);
+    unsigned nbits = frame_bits(fmt, bytes, n, bits);
+
+    unsigned put = 0;
+    bool level = true;
+    bool started = false;
+    uint64_t t0 = 0;
+    unsigned edges = 0, bad_edges = 0, bad_levels = 0;
+    double max_err = 0;
+    uint64_t end = (uint64_t) ((nbits + 4) * u.bit_cycles) + 1000;
+    unsigned next_sample = 0;
+
+    for (uint64_t c = 0; c < end * 2; c++) {
+        // keep the FIFO fed, as the DMA does
+        if (put < n && pio_emu_sm_tx_level(&u.pio, SM_TX) < PIO_EMU_FIFO_DEPTH)
+            pio_emu_sm_put(&u.pio, SM_TX, chan_uart_pio_frame(fmt, bytes[put++]));
+        pio_emu_step(&u.pio);
+
+        bool now = pio_emu_get_pin(&u.pio, TX_GPIO);
+        if (!started) {
+            if (!now) {
+                started = true;
+                t0 = c;
+                end = c + (uint64_t) (nbits * u.bit_cycles) + 100;
+            }
+            level = now;
+            continue;
+        }
+
+        double at = (c - t0) / u.bit_cycles;
+        if (now != level) {
+            // an edge between bit k-1 and k
+            unsigned k = (unsigned) (at + 0.5);
+            double err = fabs((c - t0) - k * u.bit_cycles);
+            if (err > max_err)
+                max_err = err;
+            if (err > 2.0 || k == 0 || k > nbits || bits[k] != now)
+                bad_edges++;
+            edges++;
+            level = now;
+        }
+        while (next_sample < nbits && at >= next_sample + 0.5) {
+            if (level != bits[next_sample])
+                bad_levels++;
+            next_sample++;
+        }
+        if (c >= end)
+            break;
+    }
+
+    CHECK(started, "%s @ %u: no start bit", name, baud);
+    CHECK(next_sample == nbits, "%s @ %u: %u of %u bits", name, baud, next_sample, nbits);
+    CHECK(bad_levels == 0, "%s @ %u: %u bits at the wrong level", name, baud, bad_levels);
+    CHECK(bad_edges == 0, "%s @ %u: %u of %u edges off the bit clock (worst %.1f clocks)", name, baud, bad_edges,
+          edges, max_err);
+    CHECK(level, "%s @ %u: line not idle after the last stop bit", name, baud);
+}
+
+static void test_tx(void)
+{
+    for (unsigned f = 0; f < FORMAT_COUNT; f++)
+        check_tx(115200, &formats[f], patterns, sizeof(patterns));
+
+    // the Sun/Apollo rate: a clock divider of 12500
+    const uint8_t ident[] = { 0xff, 0x01 };
+    check_tx(1200, &formats[1], ident, sizeof(ident));
+}
+
+//
+// RX: a sender whose clock is off by skew
+//
+
+typedef struct {
+    uint8_t bits[MAX_BITS];
+    unsigned len;
+    uint32_t words[MAX_BYTES * 2];
+    unsigned count;
+} RxRun;
+
+static void run_rx(Uart *u, RxRun *r, double skew)
+{
+    double t = SYS_CLK_HZ / (u->baud * (1.0 + skew));
+    uint64_t start = 1000;
+    uint64_t end = start + (uint64_t) ((r->len + 4) * t);
+
+    r->count = 0;
+    for (uint64_t c = 0; c < end; c++) {
+        bool level = true;
+        if (c >= start) {
+            unsigned k = (unsigned) ((c - start) / t);
+            if (k < r->len)
+                level = r->bits[k];
+        }
+        pio_emu_set_pin(&u->pio, RX_GPIO, level);
+        pio_emu_step(&u->pio);
+
+        uint32_t w;
+        while (r->count < sizeof(r->words) / 4 && pio_emu_sm_get(&u->pio, SM_RX, &w))
+            r->words[r->count++] = w;
+    }
+}
+
+// The bytes and errors in what the RX program pushed, as
+// chan_uart_pio_getc() would take them apart.
+typedef struct {
+    uint8_t bytes[MAX_BYTES];
+    bool parity_ok[MAX_BYTES];
+    bool framing_error[MAX_BYTES];  // an error word followed this byte
+    unsigned count;
+    unsigned stray_errors;          // error words without a byte before them
+} RxBytes;
+
+static void rx_bytes(const ChanUartPioFormat *fmt, const RxRun *r, RxBytes *b)
+{
+    memset(b, 0, sizeof(*b));
+    for (unsigned i = 0; i < r->count; i++) {
+        if (r->words[i] == CHAN_UART_PIO_FRAMING_ERROR) {
+            if (b->count && !b->framing_error[b->count - 1])
+                b->framing_error[b->count - 1] = true;
+            else
+                b->stray_errors++;
+        } else if (b->count < MAX_BYTES) {
+            b->parity_ok[b->count] = chan_uart_pio_unframe(fmt, r->words[i], &b->bytes[b->count]);
+            b->count++;
+        }
+    }
+}
+
+static void test_rx(void)
+{
+    static Uart u;
+    static RxRun r;
+    static RxBytes b;
+    const double skews[] = { 0.0, -0.03, 0.03 };
+
+    for (unsigned f = 0; f < FORMAT_COUNT; f++) {
+        const ChanUartPioFormat *fmt = &formats[f];
+        char name[8];
+        fmt_str(fmt, name);
+
+        for (unsigned s = 0; s < sizeof(skews) / sizeof(skews[0]); s++) {
+            uart_init_emu(&u, 115200, fmt);
+            r.len = frame_bits(fmt, patterns, sizeof(patterns), r.bits);
+            run_rx(&u, &r, skews[s]);
+            rx_bytes(fmt, &r, &b);
+
+            unsigned wrong = 0, errors = b.stray_errors;
+            for (unsigned i = 0; i < b.count && i < sizeof(patterns); i++) {
+                wrong += b.bytes[i] != (patterns[i] & ((1u << fmt->data_bits) - 1));
+                errors += !b.parity_ok[i] + b.framing_error[i];
+            }
+            CHECK(b.count == sizeof(patterns) && wrong == 0 && errors == 0,
+                  "%s, sender %+.0f%%: %u bytes, %u wrong, %u errors", name, skews[s] * 100, b.count, wrong,
+                  errors);
+        }
+    }
+
+    // bad parity, then a missing stop bit: both reported, the byte still
+    // there, and the next frame fine once the line has gone idle
+    const ChanUartPioFormat *fmt = &formats[1];
+    const uint8_t bytes[] = { 0x5a, 0x3c, 0x42 };
+    unsigned flen = frame_len(fmt);
+    uart_init_emu(&u, 115200, fmt);
+    r.len = frame_bits(fmt, bytes, 2, r.bits);
+    r.bits[1 + 8] ^= 1;
+    r.bits[flen + 1 + 8 + 1] = 0;
+    r.bits[r.len++] = 1;
+    r.len += frame_bits(fmt, &bytes[2], 1, &r.bits[r.len]);
+    run_rx(&u, &r, 0);
+    rx_bytes(fmt, &r, &b);
+    CHECK(b.count == 3 && b.stray_errors == 0, "%u bytes, %u stray errors", b.count, b.stray_errors);
+    CHECK(b.bytes[0] == 0x5a && !b.parity_ok[0] && !b.framing_error[0], "bad parity: %02x", b.bytes[0]);
+    CHECK(b.bytes[1] == 0x3c && b.parity_ok[1] && b.framing_error[1], "no stop bit: %02x", b.bytes[1]);
+    CHECK(b.bytes[2] == 0x42 && b.parity_ok[2] && !b.framing_error[2], "after the errors: %02x", b.bytes[2]);
+
+    // a break (three frames' worth of low) is one bad frame, not a string
+    // of them, and the receiver picks up cleanly after it
+    uart_init_emu(&u, 115200, fmt);
+    r.len = 0;
+    for (unsigned i = 0; i < 3 * flen; i++)
+        r.bits[r.len++] = 0;
+    r.bits[r.len++] = 1;
+    r.len += frame_bits(fmt, &bytes[2], 1, &r.bits[r.len]);
+    run_rx(&u, &r, 0);
+    rx_bytes(fmt, &r, &b);
+    CHECK(b.count == 2 && b.framing_error[0] && b.stray_errors == 0, "break: %u bytes, framing error %d",
+          b.count, b.framing_error[0]);
+    CHECK(b.count == 2 && b.bytes[1] == 0x42 && b.parity_ok[1] && !b.framing_error[1], "after a break: %02x",
+          b.bytes[1]);
+}
+
+//
+// TX into RX through a wire
+//
+
+static void test_loopback(void)
+{
+    static Uart u;
+    const char *msg = "ident: 2-0,3-7,4-6\r";
+    unsigned n = strlen(msg);
+    uint8_t got[64];
+    unsigned count = 0, errors = 0, put = 0;
+
+    uart_init_emu(&u, 115200, &formats[1]);
+    uint64_t end = (uint64_t) ((n + 2) * frame_len(&formats[1]) * u.bit_cycles);
+    for (uint64_t c = 0; c < end; c++) {
+        if (put < n && pio_emu_sm_tx_level(&u.pio, SM_TX) < PIO_EMU_FIFO_DEPTH)
+            pio_emu_sm_put(&u.pio, SM_TX, chan_uart_pio_frame(&u.fmt, msg[put++]));
+        pio_emu_set_pin(&u.pio, RX_GPIO, pio_emu_get_pin(&u.pio, TX_GPIO));
+        pio_emu_step(&u.pio);
+
+        uint32_t w;
+        while (count < sizeof(got) && pio_emu_sm_get(&u.pio, SM_RX, &w)) {
+            if (w == CHAN_UART_PIO_FRAMING_ERROR)
+                errors++;
+            else
+                errors += !chan_uart_pio_unframe(&u.fmt, w, &got[count++]);
+        }
+    }
+    CHECK(count == n && !memcmp(got, msg, n) && errors == 0, "loopback: %u of %u bytes, %u errors", count, n,
+          errors);
+
+    printf("chan_uart_tx + chan_uart_rx: %u instructions; 115200 baud is %.3f%% off at %u MHz\n",
+           (unsigned) (sizeof(chan_uart_tx_program_instructions) + sizeof(chan_uart_rx_program_instructions)) / 2,
+           (SYS_CLK_HZ / u.bit_cycles / 115200 - 1) * 100, SYS_CLK_HZ / 1000000);
+}
+
+int main(void)
+{
+    test_tx();
+    test_rx();
+    test_loopback();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
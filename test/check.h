@@ -0,0 +1,20 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The tests' CHECK(): reports a failed condition with a printf-style
+ * message and counts it in s_failures, which main() turns into the exit
+ * status.
+ */
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include <stdio.h>
+
+static int s_failures = 0;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); s_failures++; } } while (0)
+
+#endif
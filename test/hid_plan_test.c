@@ -0,0 +1,285 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Report descriptor compiler and extractor (src/hid_plan.c) against the
+ * descriptor layouts keyboards and mice actually ship with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "hid_plan.h"
+#include "hid_corpus.h"
+
+#define CHECK_FIELD(f, off, size, sgn) \
+    CHECK((f).bit_offset == (off) && (f).bit_size == (size) && (f).is_signed == (sgn), \
+          #f ": got %u@%u%s, expected %u@%u%s", (f).bit_size, (f).bit_offset, (f).is_signed ? " signed" : "", \
+          (unsigned) (size), (unsigned) (off), (sgn) ? " signed" : "")
+
+//
+// tests
+//
+
+static const HidReportPlan *compile_one(HidDevicePlan *plan, const uint8_t *desc, unsigned len, uint8_t expect_reports)
+{
+    uint8_t n = hid_plan_compile(plan, desc, len);
+    CHECK(n == expect_reports, "%u reports, expected %u", n, expect_reports);
+    return &plan->reports[0];
+}
+
+static void test_boot_keyboard(void)
+{
+    HidDevicePlan plan;
+    const HidReportPlan *rp = compile_one(&plan, desc_boot_keyboard, sizeof(desc_boot_keyboard), 1);
+    CHECK(!plan.uses_ids, "boot keyboard has no report IDs");
+    CHECK(rp->kind == HidReportKeyboard, "kind %u", rp->kind);
+    CHECK(rp->length == 8, "length %u", rp->length);
+    CHECK_FIELD(rp->kbd.modifiers, 0, 8, 0);
+    CHECK_FIELD(rp->kbd.keys, 16, 8, 0);
+    CHECK(rp->kbd.key_count == 6, "key count %u", rp->kbd.key_count);
+    CHECK(rp->kbd.bitmap.bit_size == 0, "no bitmap");
+
+    const uint8_t report[] = { 0x22, 0x00, 0x04, 0x00, 0x05, 0x00, 0x00, 0x00 };
+    const uint8_t *r = report;
+    uint16_t len = sizeof(report);
+    CHECK(hid_plan_lookup(&plan, &r, &len) == rp && r == report && len == 8, "lookup without IDs");
+
+    uint8_t mod, keys[6];
+    hid_plan_keyboard(rp, r, len, &mod, keys);
+    CHECK(mod == 0x22 && keys[0] == 0x04 && keys[1] == 0x05 && keys[2] == 0, "mod %02x keys %02x %02x %02x",
+          mod, keys[0], keys[1], keys[2]);
+}
+
+static void test_boot_mouse(void)
+{
+    HidDevicePlan plan;
+    const HidReportPlan *rp = compile_one(&plan, desc_boot_mouse, sizeof(desc_boot_mouse), 1);
+    CHECK(rp->kind == HidReportMouse, "kind %u", rp->kind);
+    CHECK(rp->length == 3, "length %u", rp->length);
+    CHECK_FIELD(rp->mouse.buttons, 0, 3, 0);
+    CHECK_FIELD(rp->mouse.x, 8, 8, 1);
+    CHECK_FIELD(rp->mouse.y, 16, 8, 1);
+    CHECK(rp->mouse.wheel.bit_size == 0, "no wheel");
+
+    // unused padding bits set must not leak into the buttons
+    const uint8_t report[] = { 0xfd, 0x85, 0x10 };
+    HidMouseValues m;
+    hid_plan_mouse(rp, report, sizeof(report), &m);
+    CHECK(m.buttons == 5 && m.dx == -123 && m.dy == 16 && m.wheel == 0, "buttons %x dx %d dy %d wheel %d",
+          m.buttons, m.dx, m.dy, m.wheel);
+}
+
+static void test_logitech_receiver(void)
+{
+    HidDevicePlan plan;
+    const HidReportPlan *rp = compile_one(&plan, desc_logitech_receiver, sizeof(desc_logitech_receiver), 1);
+    CHECK(plan.uses_ids, "report IDs");
+    CHECK(rp->report_id == 2 && rp->kind == HidReportMouse, "id %u kind %u", rp->report_id, rp->kind);
+    CHECK(rp->length == 7, "length %u", rp->length);
+    CHECK_FIELD(rp->mouse.buttons, 0, 16, 0);
+    CHECK_FIELD(rp->mouse.x, 16, 12, 1);
+    CHECK_FIELD(rp->mouse.y, 28, 12, 1);
+    CHECK_FIELD(rp->mouse.wheel, 40, 8, 1);
+    CHECK_FIELD(rp->mouse.pan, 48, 8, 1);
+
+    // buttons 1 and 9, x = -5, y = 300, wheel -1, pan 2
+    const uint8_t report[] = { 0x02, 0x01, 0x01, 0xfb, 0xcf, 0x12, 0xff, 0x02 };
+    const uint8_t *r = report;
+    uint16_t len = sizeof(report);
+    CHECK(hid_plan_lookup(&plan, &r, &len) == rp && r == report + 1 && len == 7, "lookup by ID");
+
+    HidMouseValues m;
+    hid_plan_mouse(rp, r, len, &m);
+    CHECK(m.buttons == 0x101 && m.dx == -5 && m.dy == 300 && m.wheel == -1 && m.pan == 2,
+          "buttons %x dx %d dy %d wheel %d pan %d", m.buttons, m.dx, m.dy, m.wheel, m.pan);
+
+    const uint8_t other[] = { 0x03, 0x00 };
+    r = other;
+    len = sizeof(other);
+    CHECK(hid_plan_lookup(&plan, &r, &len) == NULL, "unknown report ID");
+}
+
+static void test_hires_mouse(void)
+{
+    HidDevicePlan plan;
+    const HidReportPlan *rp = compile_one(&plan, desc_hires_mouse, sizeof(desc_hires_mouse), 1);
+    CHECK(rp->kind == HidReportMouse, "kind %u", rp->kind);
+    CHECK(rp->length == 6, "length %u", rp->length);
+    CHECK_FIELD(rp->mouse.buttons, 0, 5, 0);
+    CHECK_FIELD(rp->mouse.x, 8, 16, 1);
+    CHECK_FIELD(rp->mouse.y, 24, 16, 1);
+    // the feature report doesn't take space in the input report
+    CHECK_FIELD(rp->mouse.wheel, 40, 8, 1);
+
+    const uint8_t report[] = { 0x10, 0x30, 0xf8, 0xe8, 0x03, 0x01 };
+    HidMouseValues m;
+    hid_plan_mouse(rp, report, sizeof(report), &m);
+    CHECK(m.buttons == 0x10 && m.dx == -2000 && m.dy == 1000 && m.wheel == 1, "buttons %x dx %d dy %d wheel %d",
+          m.buttons, m.dx, m.dy, m.wheel);
+
+    // short report: fields that run past the end read as 0
+    hid_plan_mouse(rp, report, 3, &m);
+    CHECK(m.dx == -2000 && m.dy == 0 && m.wheel == 0, "short report: dx %d dy %d wheel %d", m.dx, m.dy, m.wheel);
+}
+
+static void test_composite_keyboard(void)
+{
+    HidDevicePlan plan;
+    compile_one(&plan, desc_composite_keyboard, sizeof(desc_composite_keyboard), 2);
+    CHECK(plan.by_id[1] != HID_PLAN_NO_REPORT && plan.by_id[2] != HID_PLAN_NO_REPORT, "both IDs mapped");
+
+    const uint8_t kbd_report[] = { 0x01, 0x02, 0x00, 0x2c, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    const uint8_t *r = kbd_report;
+    uint16_t len = sizeof(kbd_report);
+    const HidReportPlan *rp = hid_plan_lookup(&plan, &r, &len);
+    CHECK(rp && rp->report_id == 1 && rp->kind == HidReportKeyboard && rp->length == 8, "keyboard report");
+
+    uint8_t mod, keys[6];
+    hid_plan_keyboard(rp, r, len, &mod, keys);
+    CHECK(mod == 0x02 && keys[0] == 0x2c && keys[1] == 0, "mod %02x key %02x", mod, keys[0]);
+
+    const uint8_t media_report[] = { 0x02, 0xe9, 0x00 };
+    r = media_report;
+    len = sizeof(media_report);
+    rp = hid_plan_lookup(&plan, &r, &len);
+    CHECK(rp && rp->report_id == 2 && rp->kind == HidReportOther && rp->length == 2, "consumer report");
+}
+
+static void test_nkro_keyboard(void)
+{
+    HidDevicePlan plan;
+    const HidReportPlan *rp = compile_one(&plan, desc_nkro_keyboard, sizeof(desc_nkro_keyboard), 1);
+    CHECK(rp->kind == HidReportKeyboard, "kind %u", rp->kind);
+    CHECK(rp->length == 16, "length %u", rp->length);
+    CHECK_FIELD(rp->kbd.modifiers, 0, 8, 0);
+    CHECK(rp->kbd.key_count == 0, "no key array");
+    CHECK(rp->kbd.bitmap.bit_offset == 8 && rp->kbd.bitmap_first == 0 && rp->kbd.bitmap_count == 120,
+          "bitmap %u keys from %02x at %u", rp->kbd.bitmap_count, rp->kbd.bitmap_first, rp->kbd.bitmap.bit_offset);
+
+    // A (0x04) and Z (0x1d) and F12 (0x45)
+    uint8_t report[16] = { 0x01 };
+    report[1 + 0x04 / 8] |= 1 << (0x04 % 8);
+    report[1 + 0x1d / 8] |= 1 << (0x1d % 8);
+    report[1 + 0x45 / 8] |= 1 << (0x45 % 8);
+    uint8_t mod, keys[6];
+    hid_plan_keyboard(rp, report, sizeof(report), &mod, keys);
+    CHECK(mod == 0x01 && keys[0] == 0x04 && keys[1] == 0x1d && keys[2] == 0x45 && keys[3] == 0,
+          "mod %02x keys %02x %02x %02x", mod, keys[0], keys[1], keys[2]);
+
+    uint32_t bits[8];
+    hid_plan_keyboard_bits(rp, report, sizeof(report), bits);
+    CHECK(bits[0] == ((1u << 0x04) | (1u << 0x1d)) && bits[2] == 1u << (0x45 - 64) && bits[7] == 0x01 &&
+          !bits[1] && !bits[3] && !bits[4] && !bits[5] && !bits[6],
+          "bits %08x %08x %08x mod %08x", bits[0], bits[1], bits[2], bits[7]);
+
+    rp = compile_one(&plan, desc_nkro_keyboard_flat, sizeof(desc_nkro_keyboard_flat), 1);
+    CHECK(rp->kbd.bitmap_count == 232 && rp->length == 29, "flat bitmap %u keys, %u bytes",
+          rp->kbd.bitmap_count, rp->length);
+    uint8_t flat[29] = { 0 };
+    flat[0x04 / 8] |= 1 << (0x04 % 8);
+    flat[0xe1 / 8] |= 1 << (0xe1 % 8);   // left shift
+    hid_plan_keyboard(rp, flat, sizeof(flat), &mod, keys);
+    CHECK(mod == 0x02 && keys[0] == 0x04 && keys[1] == 0, "flat: mod %02x key %02x", mod, keys[0]);
+    hid_plan_keyboard_bits(rp, flat, sizeof(flat), bits);
+    CHECK(bits[0] == 1u << 0x04 && bits[7] == 0x02 && !bits[1] && !bits[6],
+          "flat bits %08x mod %08x", bits[0], bits[7]);
+}
+
+// Which output report to send the LEDs in; a boot keyboard takes them
+// without a report ID
+static void test_led_report(void)
+{
+    HidDevicePlan plan;
+    compile_one(&plan, desc_boot_keyboard, sizeof(desc_boot_keyboard), 1);
+    CHECK(plan.has_leds && plan.led_report_id == 0, "boot keyboard LEDs %d on ID %u", plan.has_leds, plan.led_report_id);
+
+    const HidReportPlan *rp = compile_one(&plan, desc_nkro_keyboard_ids, sizeof(desc_nkro_keyboard_ids), 1);
+    CHECK(plan.uses_ids && plan.has_leds && plan.led_report_id == 1, "NKRO keyboard LEDs %d on ID %u",
+          plan.has_leds, plan.led_report_id);
+    // the output report doesn't add to the input one
+    CHECK(rp->report_id == 1 && rp->length == 16, "input report %u, %u bytes", rp->report_id, rp->length);
+
+    compile_one(&plan, desc_composite_keyboard, sizeof(desc_composite_keyboard), 2);
+    CHECK(!plan.has_leds, "composite keyboard has no LEDs");
+}
+
+static void test_absolute_pointer(void)
+{
+    HidDevicePlan plan;
+    const HidReportPlan *rp = compile_one(&plan, desc_absolute_pointer, sizeof(desc_absolute_pointer), 1);
+    CHECK(rp->kind == HidReportMouse, "kind %u", rp->kind);
+    CHECK_FIELD(rp->mouse.buttons, 0, 3, 0);
+    CHECK(rp->mouse.x.bit_size == 0 && rp->mouse.y.bit_size == 0, "absolute X/Y isn't motion");
+}
+
+static void test_truncated(void)
+{
+    // every prefix of a descriptor must compile without reading past it
+    HidDevicePlan plan;
+    for (unsigned n = 0; n < sizeof(desc_logitech_receiver); n++) {
+        uint8_t *copy = malloc(n ? n : 1);
+        memcpy(copy, desc_logitech_receiver, n);
+        hid_plan_compile(&plan, copy, n);
+        free(copy);
+    }
+}
+
+// reference: one bit at a time
+static int32_t slow_read(const uint8_t *data, unsigned offset, unsigned size, bool is_signed)
+{
+    uint32_t v = 0;
+    for (unsigned i = 0; i < size; i++) {
+        unsigned bit = offset + i;
+        if (data[bit / 8] & (1 << (bit % 8)))
+            v |= 1u << i;
+    }
+    if (is_signed && size < 32 && (v & (1u << (size - 1))))
+        v |= ~((1u << size) - 1);
+    return (int32_t) v;
+}
+
+static void test_read_matches_reference(void)
+{
+    uint8_t data[16];
+    srand(1);
+    for (unsigned iter = 0; iter < 20000; iter++) {
+        for (unsigned i = 0; i < sizeof(data); i++)
+            data[i] = rand();
+        HidField f = { 0 };
+        f.bit_size = 1 + rand() % 32;
+        f.bit_offset = rand() % (sizeof(data) * 8 - f.bit_size + 1);
+        f.is_signed = rand() & 1;
+        int32_t got = hid_plan_read(&f, data, sizeof(data));
+        int32_t want = slow_read(data, f.bit_offset, f.bit_size, f.is_signed);
+        if (got != want) {
+            CHECK(false, "%u bits at %u%s: got %08x, expected %08x", f.bit_size, f.bit_offset,
+                  f.is_signed ? " signed" : "", got, want);
+            break;
+        }
+    }
+}
+
+int main(void)
+{
+    test_boot_keyboard();
+    test_boot_mouse();
+    test_logitech_receiver();
+    test_hires_mouse();
+    test_composite_keyboard();
+    test_nkro_keyboard();
+    test_led_report();
+    test_absolute_pointer();
+    test_truncated();
+    test_read_matches_reference();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,358 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Sustained-throughput benchmark for a host backend. The synthetic load
+ * generator (src/loadgen.c) runs as "core1", on line_sim's background hook
+ * so it keeps generating while the mainloop is blocked in putc, and feeds
+ * boot reports through bootmode.c and the event queue as on the board. A
+ * model of mainloop() hands the queued events to the host backend, which
+ * talks to the virtual UARTs.
+ *
+ * Keystroke and mouse rates are ramped separately until a step fails:
+ *
+ *   drops     the event queue overflowed, or the generator couldn't keep
+ *             its own schedule
+ *   delay     an event waited longer than --max-delay-ms in the queue, or
+ *             the lines still had that much backlog when the input stopped
+ *   coalesce  fewer than 90% of the mouse reports made it onto the wire as
+ *             separate updates
+ *
+ * and the last passing rate is the host's sustained maximum.
+ *
+ * Usage: host_bench [options] <host>
+ *
+ *   --max-delay-ms N   delay threshold (default 50)
+ *   --seconds N        length of each step (default 3)
+ *   --check FILE       fail if the result is below the one stored in FILE
+ *   --write FILE       store the result in FILE
+ *
+ * FILE has one "<host> <keys/s> <mouse updates/s>" line per host.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "babelfish.h"
+#include "loadgen.h"
+
+#include "line_sim.h"
+
+HOST_PROTOTYPES(sun);
+HOST_PROTOTYPES(apollo);
+HOST_PROTOTYPES(apollo_dn300);
+
+typedef struct {
+    HostDevice dev;
+    // bytes the host computer sends after init, to get the keyboard into
+    // the mode it would normally be used in
+    uint8_t setup[4];
+    unsigned setup_count;
+} BenchHost;
+
+static BenchHost bench_hosts[] = {
+    { HOST_ENTRY(sun, "Sun: keyboard on uart0, mouse on uart1") },
+    { HOST_ENTRY(apollo, "Apollo: keyboard and mouse on uart0, keystate mode"), { 0xff, 0x01 }, 2 },
+    { HOST_ENTRY(apollo_dn300, "Apollo DN300: keyboard on uart0") },
+    { { { 0 } } }
+};
+
+// hosts[] entries with no line model in the host build
+static const char *const s_unmodelled[] = {
+    "adb",          // host-clocked bidirectional line; see adb_testbench
+    "next",         // PIO, not a UART
+    "test_3v3",     // output test pattern, takes no input
+};
+
+#define BASELINE_MAX_HOSTS 16
+
+typedef struct {
+    char name[32];
+    unsigned keys_per_s;
+    unsigned mouse_per_s;
+} BaselineEntry;
+
+static const unsigned s_key_rates[] = { 5, 10, 15, 20, 25, 30, 40, 50, 60, 70, 80, 100, 120, 150, 200, 300, 500, 1000 };
+static const unsigned s_mouse_rates[] = { 5, 10, 20, 25, 30, 40, 50, 60, 80, 100, 125, 200, 250, 500, 1000 };
+
+static BenchHost *s_bench = NULL;
+static HostDevice *s_host = NULL;
+static uint64_t s_loop_ns = 100000;
+static uint64_t s_core1_ns = 50000;
+static uint64_t s_max_delay_ns = 50 * 1000000ull;
+static unsigned s_seconds = 3;
+
+typedef struct {
+    LoadGenStats gen;
+    EventQueueStats queue;
+    uint64_t tx_bytes;
+    uint64_t drain_ns;          // line backlog once the input stopped
+    unsigned mouse_updates;     // host->update() calls that sent pending motion
+    const char *failure;
+} StepResult;
+
+static void core1(void)
+{
+    loadgen_task();
+}
+
+static bool lines_idle(void)
+{
+    for (unsigned u = 0; u < LINE_SIM_NUM_UARTS; u++) {
+        unsigned count;
+        const LineByte *log = line_sim_tx_log(u, &count);
+        if (count && log[count - 1].end_ns > line_sim_now_ns())
+            return false;
+    }
+    return true;
+}
+
+static uint64_t tx_total(void)
+{
+    uint64_t n = 0;
+    for (unsigned u = 0; u < LINE_SIM_NUM_UARTS; u++)
+        n += line_sim_stats(u)->tx_bytes;
+    return n;
+}
+
+static void run_step(const LoadGenConfig *cfg, StepResult *r)
+{
+    KeyboardEvent kbd_events[MAX_QUEUED_EVENTS];
+    MouseEvent mouse_events[MAX_QUEUED_EVENTS];
+    uint kbd_event_count, mouse_event_count;
+    bool mouse_pending = false;
+    uint64_t input_end_ns = 0;
+
+    memset(r, 0, sizeof(*r));
+    line_sim_reset();
+    loadgen_start(cfg);
+    line_sim_set_background(core1, s_core1_ns);
+
+    for (;;) {
+        // mainloop(), minus the debug and LED bits
+        get_queued_kbd_events(kbd_events, &kbd_event_count);
+        get_queued_mouse_events(mouse_events, &mouse_event_count);
+
+        for (uint i = 0; i < kbd_event_count; i++)
+            s_host->kbd_event(kbd_events[i]);
+        for (uint i = 0; i < mouse_event_count; i++) {
+            s_host->mouse_event(mouse_events[i]);
+            mouse_pending = true;
+        }
+
+        uint64_t before = tx_total();
+        s_host->update();
+        if (mouse_pending && tx_total() != before) {
+            r->mouse_updates++;
+            mouse_pending = false;
+        }
+
+        if (!loadgen_running()) {
+            if (!input_end_ns)
+                input_end_ns = line_sim_now_ns();
+            if (lines_idle() || line_sim_now_ns() - input_end_ns > 10 * s_max_delay_ns)
+                break;
+        }
+
+        line_sim_advance_ns(s_loop_ns);
+    }
+
+    line_sim_set_background(NULL, 0);
+    r->drain_ns = line_sim_now_ns() - input_end_ns;
+    loadgen_take_finished(&r->gen);
+    get_event_queue_stats(&r->queue);
+    r->tx_bytes = tx_total();
+
+    if (r->queue.kbd_dropped || r->queue.mouse_dropped || r->gen.late)
+        r->failure = "drops";
+    else if (r->queue.latency_max_us * 1000ull > s_max_delay_ns || r->drain_ns > s_max_delay_ns)
+        r->failure = "delay";
+    else if (r->gen.mouse_reports && r->mouse_updates * 10 < r->gen.mouse_reports * 9)
+        r->failure = "coalesce";
+}
+
+static unsigned ramp(bool mouse, const unsigned *rates, unsigned count)
+{
+    unsigned sustained = 0;
+
+    printf("%s ramp, %u s per step:\n", mouse ? "mouse" : "keystroke", s_seconds);
+    printf("  %6s  %9s  %9s  %9s  %9s  %9s  %s\n", mouse ? "rpt/s" : "keys/s", "wire B/s",
+            mouse ? "updates/s" : "q depth", "q max ms", "backlog", "dropped", "");
+
+    for (unsigned i = 0; i < count; i++) {
+        LoadGenConfig cfg;
+        loadgen_default_config(&cfg);
+        cfg.duration_ms = s_seconds * 1000;
+        cfg.key_rate = mouse ? 0 : rates[i];
+        cfg.mouse_rate = mouse ? rates[i] : 0;
+        cfg.mouse_dx = 3;
+        cfg.mouse_dy = -2;
+
+        StepResult r;
+        run_step(&cfg, &r);
+
+        printf("  %6u  %9.1f  %9.1f  %9.2f  %6.1f ms  %9u  %s\n", rates[i],
+                r.tx_bytes / (double) s_seconds,
+                mouse ? r.mouse_updates / (double) s_seconds : (double) r.queue.kbd_max_depth,
+                r.queue.latency_max_us / 1e3, r.drain_ns / 1e6,
+                r.queue.kbd_dropped + r.queue.mouse_dropped, r.failure ? r.failure : "ok");
+
+        if (r.failure)
+            break;
+        sustained = rates[i];
+    }
+
+    return sustained;
+}
+
+//
+// stored results
+//
+
+static unsigned baseline_load(const char *path, BaselineEntry *entries)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+
+    unsigned n = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), f) && n < BASELINE_MAX_HOSTS) {
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        BaselineEntry *e = &entries[n];
+        if (sscanf(line, "%31s %u %u", e->name, &e->keys_per_s, &e->mouse_per_s) == 3)
+            n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static bool baseline_write(const char *path, const BaselineEntry *result)
+{
+    BaselineEntry entries[BASELINE_MAX_HOSTS];
+    unsigned n = baseline_load(path, entries);
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(entries[i].name, result->name) == 0)
+            break;
+    }
+    if (i == n && n < BASELINE_MAX_HOSTS)
+        n++;
+    entries[i] = *result;
+
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+    fprintf(f, "# host_bench: max sustained rate with no drops, no coalesced mouse reports\n");
+    fprintf(f, "# and under 50 ms delay, in the host build's line model.\n");
+    fprintf(f, "# host          keys/s  mouse/s\n");
+    for (i = 0; i < n; i++)
+        fprintf(f, "%-15s %6u  %7u\n", entries[i].name, entries[i].keys_per_s, entries[i].mouse_per_s);
+    fclose(f);
+    return true;
+}
+
+static bool baseline_check(const char *path, const BaselineEntry *result)
+{
+    BaselineEntry entries[BASELINE_MAX_HOSTS];
+    unsigned n = baseline_load(path, entries);
+
+    for (unsigned i = 0; i < n; i++) {
+        if (strcmp(entries[i].name, result->name) != 0)
+            continue;
+
+        bool ok = result->keys_per_s >= entries[i].keys_per_s && result->mouse_per_s >= entries[i].mouse_per_s;
+        printf("baseline: %u keys/s, %u mouse/s -> %s\n", entries[i].keys_per_s, entries[i].mouse_per_s,
+                !ok ? "REGRESSION" :
+                (result->keys_per_s > entries[i].keys_per_s || result->mouse_per_s > entries[i].mouse_per_s) ?
+                "improved, update it with --write" : "unchanged");
+        return ok;
+    }
+
+    printf("baseline: no entry for %s in %s\n", result->name, path);
+    return false;
+}
+
+//
+// main
+//
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: host_bench [--max-delay-ms N] [--seconds N] [--check FILE] [--write FILE] <host>\n");
+    fprintf(stderr, "hosts:");
+    for (BenchHost *b = bench_hosts; b->dev.name[0]; b++)
+        fprintf(stderr, " %s", b->dev.name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *host_name = NULL;
+    const char *check_path = NULL;
+    const char *write_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--max-delay-ms") == 0 && i + 1 < argc) {
+            s_max_delay_ns = (uint64_t) atoi(argv[++i]) * 1000000;
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            s_seconds = (unsigned) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--check") == 0 && i + 1 < argc) {
+            check_path = argv[++i];
+        } else if (strcmp(argv[i], "--write") == 0 && i + 1 < argc) {
+            write_path = argv[++i];
+        } else if (argv[i][0] == '-' || host_name) {
+            usage();
+        } else {
+            host_name = argv[i];
+        }
+    }
+
+    if (!host_name || !s_seconds)
+        usage();
+
+    for (unsigned i = 0; i < sizeof(s_unmodelled) / sizeof(s_unmodelled[0]); i++) {
+        if (strcmp(host_name, s_unmodelled[i]) == 0) {
+            printf("%s: no line model in the host build, skipped\n", host_name);
+            return 0;
+        }
+    }
+    for (BenchHost *b = bench_hosts; b->dev.name[0]; b++) {
+        if (strcmp(b->dev.name, host_name) == 0)
+            s_bench = b;
+    }
+    if (!s_bench)
+        usage();
+    s_host = &s_bench->dev;
+
+    event_queue_init();
+    s_host->init();
+    printf("host %s (%s)\n", s_host->name, s_host->notes);
+
+    if (s_bench->setup_count)
+        line_sim_host_send(0, s_bench->setup, s_bench->setup_count);
+    line_sim_advance_ns(200 * 1000000ull);
+    s_host->update();
+    line_sim_advance_ns(200 * 1000000ull);
+
+    BaselineEntry result = { 0 };
+    snprintf(result.name, sizeof(result.name), "%s", s_host->name);
+    result.keys_per_s = ramp(false, s_key_rates, sizeof(s_key_rates) / sizeof(s_key_rates[0]));
+    result.mouse_per_s = ramp(true, s_mouse_rates, sizeof(s_mouse_rates) / sizeof(s_mouse_rates[0]));
+
+    printf("%s: sustained %u keys/s, %u mouse updates/s\n", result.name, result.keys_per_s, result.mouse_per_s);
+
+    if (write_path && !baseline_write(write_path, &result))
+        return 1;
+    if (check_path && !baseline_check(check_path, &result))
+        return 1;
+    return 0;
+}
@@ -0,0 +1,533 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/irq.h"
+
+#include "line_sim.h"
+
+typedef struct {
+    uint8_t byte;
+    uint64_t at_ns;
+} Arrival;
+
+struct uart_inst {
+    unsigned index;
+    bool initialized;
+    LineFormat fmt;
+    bool forced;
+
+    bool rx_irq_enabled;
+    bool tx_irq_enabled;
+    bool irq_enabled;
+    irq_handler_t handler;
+
+    LineByte *tx_log;
+    unsigned tx_count;
+    unsigned tx_cap;
+    uint64_t tx_free_ns;
+
+    Arrival *arrivals;
+    unsigned arrival_head;
+    unsigned arrival_count;
+    unsigned arrival_cap;
+    uint64_t host_free_ns;
+
+    uint8_t rx_fifo[LINE_SIM_FIFO_DEPTH];
+    unsigned rx_head;
+    unsigned rx_level;
+    uint64_t rx_last_ns;
+    bool rx_timeout_armed;
+
+    LineStats stats;
+};
+
+#define DEFAULT_FORMAT { 115200, 8, 1, UART_PARITY_NONE }
+
+static struct uart_inst s_uarts[LINE_SIM_NUM_UARTS] = {
+    { .index = 0, .fmt = DEFAULT_FORMAT },
+    { .index = 1, .fmt = DEFAULT_FORMAT },
+};
+uart_inst_t *const sim_uart_instances[2] = { &s_uarts[0], &s_uarts[1] };
+
+static uint64_t s_now_ns = 0;
+static bool s_in_irq = false;
+
+#define MAX_ALARMS 8
+
+typedef struct {
+    bool used;
+    uint64_t at_ns;
+    alarm_callback_t callback;
+    void *user_data;
+} Alarm;
+
+static Alarm s_alarms[MAX_ALARMS];
+
+static void (*s_background)(void) = NULL;
+static uint64_t s_background_period_ns;
+static uint64_t s_background_next_ns;
+static bool s_in_background = false;
+
+static void check_irq(struct uart_inst *u);
+
+//
+// clock
+//
+
+uint64_t line_sim_now_ns(void)
+{
+    return s_now_ns;
+}
+
+uint64_t time_us_64(void)
+{
+    return s_now_ns / 1000;
+}
+
+void busy_wait_us(uint64_t us)
+{
+    line_sim_advance_ns(us * 1000);
+}
+
+bool line_sim_in_irq(void)
+{
+    return s_in_irq;
+}
+
+void line_sim_set_background(void (*fn)(void), uint64_t period_ns)
+{
+    s_background = fn;
+    s_background_period_ns = period_ns;
+    s_background_next_ns = s_now_ns;
+}
+
+static void run_background(void)
+{
+    while (s_background && s_background_next_ns <= s_now_ns) {
+        s_background_next_ns += s_background_period_ns;
+        if (!s_in_background) {
+            s_in_background = true;
+            s_background();
+            s_in_background = false;
+        }
+    }
+}
+
+//
+// alarms
+//
+
+alarm_id_t add_alarm_at(absolute_time_t time, alarm_callback_t callback, void *user_data, bool fire_if_past)
+{
+    // as the SDK: a time already past is either run now or refused
+    if (time * 1000 <= s_now_ns) {
+        if (!fire_if_past)
+            return 0;
+        callback(0, user_data);
+        return 0;
+    }
+    for (int i = 0; i < MAX_ALARMS; i++) {
+        if (!s_alarms[i].used) {
+            s_alarms[i] = (Alarm) { true, time * 1000, callback, user_data };
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+bool cancel_alarm(alarm_id_t id)
+{
+    if (id < 1 || id > MAX_ALARMS || !s_alarms[id - 1].used)
+        return false;
+    s_alarms[id - 1].used = false;
+    return true;
+}
+
+static uint64_t next_alarm_ns(void)
+{
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < MAX_ALARMS; i++) {
+        if (s_alarms[i].used && s_alarms[i].at_ns < next)
+            next = s_alarms[i].at_ns;
+    }
+    return next;
+}
+
+static void run_alarms(void)
+{
+    if (s_in_irq)
+        return;
+
+    for (int i = 0; i < MAX_ALARMS; i++) {
+        Alarm *a = &s_alarms[i];
+        if (!a->used || a->at_ns > s_now_ns)
+            continue;
+
+        s_in_irq = true;
+        int64_t again = a->callback(i + 1, a->user_data);
+        s_in_irq = false;
+
+        if (again > 0)
+            a->at_ns += again * 1000;
+        else if (again < 0)
+            a->at_ns = s_now_ns - again * 1000;
+        else
+            a->used = false;
+    }
+}
+
+//
+// line format
+//
+
+static uint64_t bit_ns(const struct uart_inst *u)
+{
+    return 1000000000ull / u->fmt.baud;
+}
+
+static unsigned frame_bits(const struct uart_inst *u)
+{
+    return 1 + u->fmt.data_bits + (u->fmt.parity != UART_PARITY_NONE ? 1 : 0) + u->fmt.stop_bits;
+}
+
+uint64_t line_sim_frame_ns(unsigned uart)
+{
+    const struct uart_inst *u = &s_uarts[uart];
+    return (uint64_t) frame_bits(u) * 1000000000ull / u->fmt.baud;
+}
+
+LineFormat line_sim_format(unsigned uart)
+{
+    return s_uarts[uart].fmt;
+}
+
+bool line_sim_uart_initialized(unsigned uart)
+{
+    return s_uarts[uart].initialized;
+}
+
+void line_sim_format_str(unsigned uart, char *buf, unsigned len)
+{
+    const LineFormat *f = &s_uarts[uart].fmt;
+    snprintf(buf, len, "%u %u%c%u", f->baud, f->data_bits,
+            f->parity == UART_PARITY_EVEN ? 'E' : f->parity == UART_PARITY_ODD ? 'O' : 'N', f->stop_bits);
+}
+
+void line_sim_force_format(unsigned uart, const LineFormat *fmt)
+{
+    s_uarts[uart].fmt = *fmt;
+    s_uarts[uart].forced = true;
+}
+
+//
+// SDK uart API
+//
+
+unsigned uart_get_index(uart_inst_t *uart)
+{
+    return uart->index;
+}
+
+unsigned uart_init(uart_inst_t *uart, unsigned baudrate)
+{
+    uart->initialized = true;
+    if (!uart->forced) {
+        uart->fmt.baud = baudrate;
+        uart->fmt.data_bits = 8;
+        uart->fmt.stop_bits = 1;
+        uart->fmt.parity = UART_PARITY_NONE;
+    }
+    return uart->fmt.baud;
+}
+
+unsigned uart_set_baudrate(uart_inst_t *uart, unsigned baudrate)
+{
+    if (!uart->forced)
+        uart->fmt.baud = baudrate;
+    return uart->fmt.baud;
+}
+
+void uart_set_format(uart_inst_t *uart, unsigned data_bits, unsigned stop_bits, uart_parity_t parity)
+{
+    if (uart->forced)
+        return;
+    uart->fmt.data_bits = data_bits;
+    uart->fmt.stop_bits = stop_bits;
+    uart->fmt.parity = parity;
+}
+
+void uart_set_hw_flow(uart_inst_t *uart, bool cts, bool rts)
+{
+    (void) uart; (void) cts; (void) rts;
+}
+
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data, bool tx_needs_data)
+{
+    uart->rx_irq_enabled = rx_has_data;
+    uart->tx_irq_enabled = tx_needs_data;
+}
+
+static unsigned tx_fifo_level(const struct uart_inst *u)
+{
+    // bytes whose start bit hasn't gone out yet are still in the FIFO;
+    // the one on the wire is in the shift register
+    unsigned n = 0;
+    for (unsigned i = u->tx_count; i > 0 && u->tx_log[i - 1].start_ns > s_now_ns; i--)
+        n++;
+    return n;
+}
+
+bool uart_is_writable(uart_inst_t *uart)
+{
+    return tx_fifo_level(uart) < LINE_SIM_FIFO_DEPTH;
+}
+
+void uart_putc_raw(uart_inst_t *u, char c)
+{
+    uint64_t put_ns = s_now_ns;
+
+    while (tx_fifo_level(u) >= LINE_SIM_FIFO_DEPTH) {
+        uint64_t t = u->tx_log[u->tx_count - LINE_SIM_FIFO_DEPTH].start_ns;
+        u->stats.tx_blocked_ns += t - s_now_ns;
+        line_sim_advance_to_ns(t);
+    }
+
+    if (u->tx_count == u->tx_cap) {
+        u->tx_cap = u->tx_cap ? u->tx_cap * 2 : 1024;
+        u->tx_log = realloc(u->tx_log, u->tx_cap * sizeof(LineByte));
+    }
+
+    uint64_t frame = line_sim_frame_ns(u->index);
+    uint64_t start = u->tx_free_ns > s_now_ns ? u->tx_free_ns : s_now_ns;
+    LineByte *b = &u->tx_log[u->tx_count++];
+    b->byte = (uint8_t) c;
+    b->put_ns = put_ns;
+    b->start_ns = start;
+    b->end_ns = start + frame;
+    u->tx_free_ns = b->end_ns;
+
+    u->stats.tx_bytes++;
+    u->stats.tx_busy_ns += frame;
+    unsigned level = tx_fifo_level(u);
+    if (level > u->stats.tx_fifo_max)
+        u->stats.tx_fifo_max = level;
+}
+
+bool uart_is_readable(uart_inst_t *uart)
+{
+    return uart->rx_level > 0;
+}
+
+char uart_getc(uart_inst_t *u)
+{
+    // blocks until a byte arrives; if nothing is on its way, this would
+    // hang forever on hardware
+    while (u->rx_level == 0) {
+        if (u->arrival_head == u->arrival_count) {
+            u->stats.rx_underruns++;
+            return 0;
+        }
+        line_sim_advance_to_ns(u->arrivals[u->arrival_head].at_ns);
+    }
+
+    uint8_t c = u->rx_fifo[u->rx_head];
+    u->rx_head = (u->rx_head + 1) % LINE_SIM_FIFO_DEPTH;
+    u->rx_level--;
+    if (u->rx_level == 0)
+        u->rx_timeout_armed = false;
+    return (char) c;
+}
+
+//
+// irq
+//
+
+void irq_set_exclusive_handler(unsigned num, irq_handler_t handler)
+{
+    if (num == UART0_IRQ || num == UART1_IRQ)
+        s_uarts[num - UART0_IRQ].handler = handler;
+}
+
+void irq_set_enabled(unsigned num, bool enabled)
+{
+    if (num == UART0_IRQ || num == UART1_IRQ)
+        s_uarts[num - UART0_IRQ].irq_enabled = enabled;
+}
+
+static void dispatch_irq(struct uart_inst *u)
+{
+    uint64_t start = s_now_ns;
+    u->stats.irqs++;
+    s_in_irq = true;
+    u->handler();
+    s_in_irq = false;
+    if (s_now_ns - start > u->stats.irq_max_ns)
+        u->stats.irq_max_ns = s_now_ns - start;
+}
+
+// RXINTR at >= 4 bytes (the SDK's RXIFLSEL=0), RTINTR once the line has
+// been idle for 32 bit periods with data in the FIFO
+static uint64_t rx_timeout_ns(const struct uart_inst *u)
+{
+    return u->rx_last_ns + 32 * bit_ns(u);
+}
+
+// TXINTR while the TX FIFO is down to 4 bytes (the SDK's TXIFLSEL=0)
+#define TX_IRQ_LEVEL 4
+
+static bool irq_can_fire(const struct uart_inst *u)
+{
+    return !s_in_irq && u->rx_irq_enabled && u->irq_enabled && u->handler;
+}
+
+static bool tx_irq_can_fire(const struct uart_inst *u)
+{
+    return !s_in_irq && u->tx_irq_enabled && u->irq_enabled && u->handler;
+}
+
+// when the FIFO next drops to TX_IRQ_LEVEL, if it's above it now
+static uint64_t tx_irq_ns(const struct uart_inst *u)
+{
+    if (u->tx_count <= TX_IRQ_LEVEL)
+        return 0;
+    return u->tx_log[u->tx_count - TX_IRQ_LEVEL - 1].start_ns;
+}
+
+static void check_irq(struct uart_inst *u)
+{
+    bool rx = irq_can_fire(u) && u->rx_level > 0 &&
+              (u->rx_level >= 4 || (u->rx_timeout_armed && s_now_ns >= rx_timeout_ns(u)));
+    bool tx = tx_irq_can_fire(u) && tx_fifo_level(u) <= TX_IRQ_LEVEL;
+
+    if (rx)
+        u->rx_timeout_armed = false;
+    if (rx || tx)
+        dispatch_irq(u);
+}
+
+static void deliver_arrivals(struct uart_inst *u)
+{
+    while (u->arrival_head < u->arrival_count && u->arrivals[u->arrival_head].at_ns <= s_now_ns) {
+        uint8_t c = u->arrivals[u->arrival_head++].byte;
+        u->stats.rx_bytes++;
+        if (u->rx_level == LINE_SIM_FIFO_DEPTH) {
+            u->stats.rx_overruns++;
+            continue;
+        }
+        u->rx_fifo[(u->rx_head + u->rx_level) % LINE_SIM_FIFO_DEPTH] = c;
+        u->rx_level++;
+        u->rx_last_ns = s_now_ns;
+        u->rx_timeout_armed = true;
+        check_irq(u);
+    }
+}
+
+void line_sim_advance_to_ns(uint64_t t_ns)
+{
+    if (t_ns < s_now_ns)
+        t_ns = s_now_ns;
+
+    for (;;) {
+        // next thing that happens on any line before t_ns
+        uint64_t next = t_ns;
+        for (unsigned i = 0; i < LINE_SIM_NUM_UARTS; i++) {
+            struct uart_inst *u = &s_uarts[i];
+            if (u->arrival_head < u->arrival_count && u->arrivals[u->arrival_head].at_ns < next)
+                next = u->arrivals[u->arrival_head].at_ns;
+            if (u->rx_timeout_armed && irq_can_fire(u) && rx_timeout_ns(u) < next)
+                next = rx_timeout_ns(u);
+            if (tx_irq_can_fire(u) && tx_irq_ns(u) > s_now_ns && tx_irq_ns(u) < next)
+                next = tx_irq_ns(u);
+        }
+        if (s_background && s_background_next_ns < next)
+            next = s_background_next_ns;
+        if (!s_in_irq && next_alarm_ns() < next)
+            next = next_alarm_ns();
+
+        if (next > s_now_ns)
+            s_now_ns = next;
+        for (unsigned i = 0; i < LINE_SIM_NUM_UARTS; i++) {
+            deliver_arrivals(&s_uarts[i]);
+            check_irq(&s_uarts[i]);
+        }
+        run_alarms();
+        run_background();
+
+        if (next >= t_ns)
+            break;
+    }
+}
+
+//
+// host side
+//
+
+void line_sim_host_send(unsigned uart, const uint8_t *bytes, unsigned len)
+{
+    struct uart_inst *u = &s_uarts[uart];
+    uint64_t frame = line_sim_frame_ns(uart);
+    uint64_t t = u->host_free_ns > s_now_ns ? u->host_free_ns : s_now_ns;
+
+    if (u->arrival_count + len > u->arrival_cap) {
+        while (u->arrival_count + len > u->arrival_cap)
+            u->arrival_cap = u->arrival_cap ? u->arrival_cap * 2 : 256;
+        u->arrivals = realloc(u->arrivals, u->arrival_cap * sizeof(Arrival));
+    }
+
+    for (unsigned i = 0; i < len; i++) {
+        t += frame;
+        u->arrivals[u->arrival_count++] = (Arrival) { bytes[i], t };
+    }
+    u->host_free_ns = t;
+}
+
+const LineByte *line_sim_tx_log(unsigned uart, unsigned *count)
+{
+    *count = s_uarts[uart].tx_count;
+    return s_uarts[uart].tx_log;
+}
+
+static uint8_t s_keyboard_leds = 0;
+
+// hid_app.c's, for the backends that forward the host's LEDs
+void set_keyboard_leds(uint8_t leds)
+{
+    s_keyboard_leds = leds;
+}
+
+uint8_t line_sim_keyboard_leds(void)
+{
+    return s_keyboard_leds;
+}
+
+const LineStats *line_sim_stats(unsigned uart)
+{
+    return &s_uarts[uart].stats;
+}
+
+void line_sim_reset(void)
+{
+    for (unsigned i = 0; i < LINE_SIM_NUM_UARTS; i++) {
+        struct uart_inst *u = &s_uarts[i];
+        u->tx_count = 0;
+        u->arrival_head = 0;
+        u->arrival_count = 0;
+        u->rx_head = 0;
+        u->rx_level = 0;
+        u->rx_timeout_armed = false;
+        if (u->tx_free_ns < s_now_ns)
+            u->tx_free_ns = s_now_ns;
+        if (u->host_free_ns < s_now_ns)
+            u->host_free_ns = s_now_ns;
+        memset(&u->stats, 0, sizeof(u->stats));
+    }
+}
@@ -0,0 +1,87 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Virtual clock and wire-level model of the two RP2040 UARTs, backing the
+ * shim hardware/uart.h. Every byte put with uart_putc_raw() gets a wire
+ * start/end time from the configured baud rate and frame format; the
+ * 32-entry TX FIFO blocks the caller (advancing the clock) when full, as
+ * on hardware. Bytes from the host computer arrive in the RX FIFO at the
+ * wire rate and raise the UART IRQ at the PL011's thresholds: 4 bytes in
+ * the FIFO, or 32 idle bit periods after the last one. With the TX
+ * interrupt enabled, the IRQ is also raised while the TX FIFO holds 4
+ * bytes or fewer.
+ */
+
+#ifndef LINE_SIM_H_
+#define LINE_SIM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hardware/uart.h"
+
+#define LINE_SIM_NUM_UARTS 2
+#define LINE_SIM_FIFO_DEPTH 32
+
+typedef struct {
+    unsigned baud;
+    unsigned data_bits;
+    unsigned stop_bits;
+    uart_parity_t parity;
+} LineFormat;
+
+typedef struct {
+    uint8_t byte;
+    uint64_t put_ns;    // when uart_putc_raw() was called
+    uint64_t start_ns;  // start bit on the wire
+    uint64_t end_ns;    // end of the stop bit(s); when the host has the byte
+} LineByte;
+
+typedef struct {
+    uint64_t tx_bytes;
+    uint64_t tx_busy_ns;        // time the TX line spent sending
+    uint64_t tx_blocked_ns;     // time uart_putc_raw() spent waiting on a full FIFO
+    unsigned tx_fifo_max;
+    uint64_t rx_bytes;
+    uint64_t rx_overruns;       // bytes lost to a full RX FIFO
+    uint64_t rx_underruns;      // uart_getc() with nothing received or coming (hangs on hardware)
+    uint64_t irqs;
+    uint64_t irq_max_ns;        // longest handler run; nothing else at its priority runs meanwhile
+} LineStats;
+
+uint64_t line_sim_now_ns(void);
+void line_sim_advance_to_ns(uint64_t t_ns);
+static inline void line_sim_advance_ns(uint64_t dt_ns) { line_sim_advance_to_ns(line_sim_now_ns() + dt_ns); }
+
+// Clears logs, queued host data and stats. The clock keeps running, since
+// backends keep their own timestamps in statics.
+void line_sim_reset(void);
+
+bool line_sim_uart_initialized(unsigned uart);
+LineFormat line_sim_format(unsigned uart);
+uint64_t line_sim_frame_ns(unsigned uart);
+void line_sim_format_str(unsigned uart, char *buf, unsigned len);
+
+// Pins the line format, ignoring what the backend asks for from now on.
+void line_sim_force_format(unsigned uart, const LineFormat *fmt);
+
+// The host computer sends bytes to us, starting now or after whatever it
+// is still sending.
+void line_sim_host_send(unsigned uart, const uint8_t *bytes, unsigned len);
+
+const LineByte *line_sim_tx_log(unsigned uart, unsigned *count);
+const LineStats *line_sim_stats(unsigned uart);
+
+bool line_sim_in_irq(void);
+
+// the last set_keyboard_leds() from a backend
+uint8_t line_sim_keyboard_leds(void);
+
+// Calls fn every period_ns of virtual time, including while the caller is
+// blocked in uart_putc_raw() or busy_wait_us(): the work core1 keeps doing
+// while the mainloop on core0 is stuck. NULL stops it.
+void line_sim_set_background(void (*fn)(void), uint64_t period_ns);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Checks the UART line model against PL011 behaviour: frame timing, the
+ * 32-entry TX FIFO blocking uart_putc_raw(), and RX interrupt thresholds.
+ * Also the TX ring in src/chan_uart.c, which the TX interrupt drains.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "pico/stdlib.h"
+#include "hardware/uart.h"
+#include "hardware/irq.h"
+
+#include "line_sim.h"
+#include "chan_uart.h"
+
+static int64_t on_never(alarm_id_t id, void *user_data)
+{
+    (void) id;
+    (void) user_data;
+    return 0;
+}
+
+static unsigned s_irq_count = 0;
+static uint64_t s_irq_at_ns = 0;
+static unsigned s_irq_read = 0;
+
+static void on_rx(void)
+{
+    s_irq_count++;
+    s_irq_at_ns = line_sim_now_ns();
+    while (uart_is_readable(uart1)) {
+        uart_getc(uart1);
+        s_irq_read++;
+    }
+}
+
+static void test_frame_time(void)
+{
+    uart_init(uart0, 1200);
+    uart_set_format(uart0, 8, 1, UART_PARITY_NONE);
+    CHECK(line_sim_frame_ns(0) == 8333333, "8N1 at 1200: %llu ns", (unsigned long long) line_sim_frame_ns(0));
+    uart_set_format(uart0, 8, 1, UART_PARITY_EVEN);
+    CHECK(line_sim_frame_ns(0) == 9166666, "8E1 at 1200: %llu ns", (unsigned long long) line_sim_frame_ns(0));
+}
+
+static void test_tx_fifo(void)
+{
+    uart_init(uart0, 1200);
+    line_sim_reset();
+    uint64_t t0 = line_sim_now_ns();
+    uint64_t frame = line_sim_frame_ns(0);
+
+    // one byte goes straight to the shift register, 32 more fit in the FIFO
+    for (int i = 0; i < 33; i++)
+        uart_putc_raw(uart0, (char) i);
+    CHECK(line_sim_now_ns() == t0, "33 bytes shouldn't block");
+    CHECK(!uart_is_writable(uart0), "FIFO should be full");
+    CHECK(line_sim_stats(0)->tx_fifo_max == 32, "fifo max %u", line_sim_stats(0)->tx_fifo_max);
+
+    // the 34th waits for the first to finish
+    uart_putc_raw(uart0, 33);
+    CHECK(line_sim_now_ns() == t0 + frame, "34th byte: blocked until %llu, expected %llu",
+            (unsigned long long) (line_sim_now_ns() - t0), (unsigned long long) frame);
+
+    unsigned count;
+    const LineByte *log = line_sim_tx_log(0, &count);
+    CHECK(count == 34, "logged %u bytes", count);
+    CHECK(log[33].start_ns == t0 + 33 * frame, "back-to-back bytes");
+    CHECK(line_sim_stats(0)->tx_blocked_ns == frame, "blocked %llu ns",
+            (unsigned long long) line_sim_stats(0)->tx_blocked_ns);
+}
+
+static void test_rx_irq(void)
+{
+    uart_init(uart1, 1200);
+    irq_set_exclusive_handler(UART1_IRQ, on_rx);
+    irq_set_enabled(UART1_IRQ, true);
+    uart_set_irq_enables(uart1, true, false);
+    line_sim_reset();
+    uint64_t frame = line_sim_frame_ns(1);
+    uint64_t bit = 1000000000ull / 1200;
+
+    // fewer than 4 bytes: the receive timeout fires 32 bit times after the last
+    s_irq_count = s_irq_read = 0;
+    uint64_t t0 = line_sim_now_ns();
+    const uint8_t three[] = { 1, 2, 3 };
+    line_sim_host_send(1, three, 3);
+    line_sim_advance_ns(3 * frame + 31 * bit);
+    CHECK(s_irq_count == 0, "irq before the rx timeout");
+    line_sim_advance_ns(2 * bit);
+    CHECK(s_irq_count == 1 && s_irq_read == 3, "rx timeout irq: %u irqs, %u bytes", s_irq_count, s_irq_read);
+    CHECK(s_irq_at_ns == t0 + 3 * frame + 32 * bit, "rx timeout at %llu",
+            (unsigned long long) (s_irq_at_ns - t0));
+
+    // the 4th byte raises it straight away
+    s_irq_count = s_irq_read = 0;
+    t0 = line_sim_now_ns();
+    const uint8_t four[] = { 1, 2, 3, 4 };
+    line_sim_host_send(1, four, 4);
+    line_sim_advance_ns(4 * frame);
+    CHECK(s_irq_count == 1 && s_irq_read == 4, "fifo level irq: %u irqs, %u bytes", s_irq_count, s_irq_read);
+    CHECK(s_irq_at_ns == t0 + 4 * frame, "fifo level irq at %llu", (unsigned long long) (s_irq_at_ns - t0));
+
+    // reading with nothing on the way would hang on hardware
+    uart_getc(uart1);
+    CHECK(line_sim_stats(1)->rx_underruns == 1, "underrun not counted");
+}
+
+static void on_rx_reply(void)
+{
+    while (uart_is_readable(uart1)) {
+        uint8_t c = uart_getc(uart1);
+        uint8_t reply[] = { c, c };
+        chan_uart_write(1, reply, sizeof(reply));
+    }
+}
+
+static void test_chan_uart(void)
+{
+    uart_init(uart0, 1200);
+    chan_uart_init(0, NULL);
+    // let the earlier tests' bytes finish going out
+    line_sim_advance_ns(1000000000ull);
+    line_sim_reset();
+    uint64_t t0 = line_sim_now_ns();
+    uint64_t frame = line_sim_frame_ns(0);
+
+    // a burst well past the FIFO is queued without the clock moving, and
+    // goes out back to back as the TX interrupt refills the FIFO
+    uint8_t buf[10];
+    for (int w = 0; w < 10; w++) {
+        for (int i = 0; i < 10; i++)
+            buf[i] = w * 10 + i;
+        CHECK(chan_uart_write(0, buf, sizeof(buf)), "write %d refused", w);
+    }
+    CHECK(line_sim_now_ns() == t0, "chan_uart_write blocked");
+
+    ChanUartStats st;
+    chan_uart_get_stats(0, &st);
+    CHECK(st.queued == 100 && st.level == 100 - 33, "queued %lu, ring %u", (unsigned long) st.queued, st.level);
+
+    line_sim_advance_ns(100 * frame);
+    unsigned count;
+    const LineByte *log = line_sim_tx_log(0, &count);
+    CHECK(count == 100, "sent %u bytes", count);
+    bool in_order = true;
+    for (unsigned i = 0; i < count; i++)
+        in_order &= log[i].byte == i && log[i].start_ns == t0 + i * frame;
+    CHECK(in_order, "bytes out of order or with gaps");
+    CHECK(line_sim_stats(0)->tx_blocked_ns == 0, "uart_putc_raw blocked");
+    chan_uart_get_stats(0, &st);
+    CHECK(st.level == 0 && st.irqs > 0, "ring %u after draining, %lu refills", st.level, (unsigned long) st.irqs);
+
+    // full: a write is refused whole, and nothing of it is sent
+    static uint8_t big[CHAN_UART_TX_RING_SIZE];
+    memset(big, 0x55, sizeof(big));
+    line_sim_reset();
+    chan_uart_reset_stats(0);
+    CHECK(chan_uart_write(0, big, 33), "FIFO fill refused");
+    CHECK(chan_uart_write(0, big, sizeof(big)), "ring fill refused");
+    const uint8_t packet[] = { 0xaa, 0xbb, 0xcc };
+    CHECK(!chan_uart_write(0, packet, sizeof(packet)), "write to a full ring accepted");
+    chan_uart_get_stats(0, &st);
+    CHECK(st.dropped == 3 && st.dropped_writes == 1, "dropped %lu bytes in %lu writes",
+            (unsigned long) st.dropped, (unsigned long) st.dropped_writes);
+
+    // accepted once the TX interrupt has moved some of the ring on, when
+    // the FIFO is down to its last few bytes
+    line_sim_advance_ns(32 * frame);
+    CHECK(chan_uart_write(0, packet, sizeof(packet)), "write refused with room");
+
+    line_sim_advance_ns((CHAN_UART_TX_RING_SIZE + 40) * frame);
+    log = line_sim_tx_log(0, &count);
+    CHECK(count == 33 + CHAN_UART_TX_RING_SIZE + 3 && log[count - 3].byte == 0xaa && log[count - 1].byte == 0xcc,
+          "%u bytes sent, packet not last", count);
+
+    // replies written from the RX handler, which shares the interrupt
+    uart_init(uart1, 1200);
+    chan_uart_init(1, on_rx_reply);
+    line_sim_reset();
+    const uint8_t cmds[] = { 1, 2, 3, 4, 5 };
+    line_sim_host_send(1, cmds, sizeof(cmds));
+    line_sim_advance_ns(30 * line_sim_frame_ns(1));
+    log = line_sim_tx_log(1, &count);
+    CHECK(count == 10 && log[0].byte == 1 && log[9].byte == 5, "%u reply bytes", count);
+
+    // paced: each byte waits for the line to have been idle for the gap,
+    // released by an alarm rather than by the writer waiting; an unpaced
+    // write behind them still goes out back to back
+    const uint64_t gap_ns = 1000000;
+    chan_uart_set_pacing(0, frame / 1000, gap_ns / 1000);
+    line_sim_advance_ns(10 * frame);
+    line_sim_reset();
+    chan_uart_reset_stats(0);
+    t0 = line_sim_now_ns();
+    const uint8_t ident[] = "ident\r";
+    CHECK(chan_uart_write_paced(0, ident, 6), "paced write refused");
+    CHECK(chan_uart_write(0, packet, sizeof(packet)), "write after paced refused");
+    CHECK(line_sim_now_ns() == t0, "paced write blocked");
+    line_sim_advance_ns(20 * frame);
+    log = line_sim_tx_log(0, &count);
+    CHECK(count == 9, "sent %u bytes", count);
+    // the channel only knows the frame time to the microsecond below
+    for (unsigned i = 1; i < 6 && i < count; i++)
+        CHECK(log[i].start_ns >= log[i - 1].end_ns + gap_ns - 2000, "paced byte %u %llu ns after the last",
+              i, (unsigned long long) (log[i].start_ns - log[i - 1].end_ns));
+    if (count == 9)
+        CHECK(log[7].start_ns == log[6].end_ns && log[8].start_ns == log[7].end_ns, "unpaced bytes gapped");
+    chan_uart_get_stats(0, &st);
+    CHECK(st.alarms >= 5, "%lu alarms", (unsigned long) st.alarms);
+
+    // with every alarm taken, a paced byte waits for the mainloop rather
+    // than for an alarm that was never set
+    alarm_id_t held[16];
+    unsigned nheld = 0;
+    while (nheld < 16) {
+        alarm_id_t id = add_alarm_in_us(1000000000, on_never, NULL, false);
+        if (id <= 0)
+            break;
+        held[nheld++] = id;
+    }
+    line_sim_reset();
+    CHECK(chan_uart_write_paced(0, ident, 2), "paced write refused");
+    line_sim_advance_ns(20 * frame);
+    line_sim_tx_log(0, &count);
+    CHECK(count == 1, "sent %u bytes with no alarm free", count);
+    chan_uart_task();
+    line_sim_advance_ns(2 * frame);
+    line_sim_tx_log(0, &count);
+    CHECK(count == 2, "sent %u bytes after the mainloop", count);
+    while (nheld)
+        cancel_alarm(held[--nheld]);
+    chan_uart_set_pacing(0, 0, 0);
+}
+
+int main(void)
+{
+    test_frame_time();
+    test_tx_fifo();
+    test_rx_irq();
+    test_chan_uart();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
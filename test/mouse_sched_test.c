@@ -0,0 +1,227 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The mouse packet scheduler in src/mouse_sched.c, on a model line: quiet
+ * when idle, slow motion batched, fast motion at the line's rate, and keys
+ * keeping their share of a shared line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "mouse_sched.h"
+
+// Apollo: three bytes of 8E1 at 1200, sharing the line with the keyboard
+#define APOLLO_BYTE_US 9167
+static const MouseSchedConfig s_apollo = {
+    .packet_us = 3 * APOLLO_BYTE_US,
+    .idle_us = 100000,
+    .fast_counts = 16,
+    .key_share = 50,
+    .queue_us = APOLLO_BYTE_US,
+};
+
+// Sun: five bytes of 8N1 at 1200, a line of its own
+#define SUN_BYTE_US 8333
+static const MouseSchedConfig s_sun = {
+    .packet_us = 5 * SUN_BYTE_US,
+    .idle_us = 50000,
+    .fast_counts = 8,
+    .queue_us = SUN_BYTE_US,
+};
+
+// A line and a mouse on a 1 ms mainloop: motion at counts_per_s, keys
+// every key_every_us if set, each a byte.
+typedef struct {
+    uint32_t now;
+    uint32_t line_free;
+    uint32_t busy_us;           // wire time used, mouse and keys
+    uint32_t mouse_us;
+    double motion;              // counts come in fractionally
+    uint32_t pending;
+    uint32_t sent;
+    uint32_t packets;
+    uint32_t max_gap;           // longest between packets while moving
+    uint32_t last_packet;
+} Line;
+
+static uint32_t
+backlog(const Line *l)
+{
+    int32_t us = (int32_t) (l->line_free - l->now);
+    return us > 0 ? us : 0;
+}
+
+static void
+line_send(Line *l, uint32_t us)
+{
+    if ((int32_t) (l->line_free - l->now) < 0)
+        l->line_free = l->now;
+    l->line_free += us;
+    l->busy_us += us;
+}
+
+static void
+run(Line *l, MouseSched *s, uint32_t ms, double counts_per_s, uint32_t key_every_us, bool *buttons)
+{
+    uint32_t last_key = 0;
+    for (uint32_t i = 0; i < ms; i++) {
+        l->now += 1000;
+        l->motion += counts_per_s / 1000;
+        while (l->motion >= 1) {
+            l->pending++;
+            l->motion -= 1;
+        }
+
+        bool keys = false;
+        if (key_every_us) {
+            if (l->now - last_key >= key_every_us) {
+                line_send(l, APOLLO_BYTE_US);
+                last_key = l->now;
+            }
+            keys = true;
+        }
+
+        bool b = buttons && *buttons;
+        if (mouse_sched_due(s, l->now, l->pending, b, backlog(l), keys)) {
+            uint32_t take = l->pending > 127 ? 127 : l->pending;
+            l->pending -= take;
+            l->sent += take;
+            if (l->packets && l->now - l->last_packet > l->max_gap)
+                l->max_gap = l->now - l->last_packet;
+            l->packets++;
+            l->last_packet = l->now;
+            line_send(l, s->cfg.packet_us);
+            l->mouse_us += s->cfg.packet_us;
+            mouse_sched_sent(s, l->now);
+            if (buttons)
+                *buttons = false;
+        }
+    }
+}
+
+static void
+test_idle(void)
+{
+    MouseSched s;
+    mouse_sched_init(&s, &s_apollo);
+    Line l = { 0 };
+    run(&l, &s, 5000, 0, 0, NULL);
+    CHECK(l.packets == 0 && l.busy_us == 0, "idle mouse sent %u packets", l.packets);
+}
+
+static void
+test_interval(void)
+{
+    MouseSched s;
+    mouse_sched_init(&s, &s_apollo);
+
+    CHECK(mouse_sched_interval_us(&s, 1, false) == 100000, "a count waits %u", mouse_sched_interval_us(&s, 1, false));
+    CHECK(mouse_sched_interval_us(&s, 16, false) == s_apollo.packet_us, "fast %u", mouse_sched_interval_us(&s, 16, false));
+    CHECK(mouse_sched_interval_us(&s, 500, false) == s_apollo.packet_us, "faster");
+
+    // more motion never waits longer, and never less than the wire time
+    uint32_t last = UINT32_MAX;
+    for (uint32_t p = 1; p < 40; p++) {
+        uint32_t iv = mouse_sched_interval_us(&s, p, false);
+        CHECK(iv <= last && iv >= s_apollo.packet_us, "%u pending: %u us", p, iv);
+        last = iv;
+        // keys hold it to half the line
+        CHECK(mouse_sched_interval_us(&s, p, true) >= 2 * s_apollo.packet_us, "%u pending with keys", p);
+    }
+}
+
+// A slow drag gets batched: a packet carries several counts, and none of
+// them wait much past idle_us.
+static void
+test_slow(void)
+{
+    MouseSched s;
+    mouse_sched_init(&s, &s_apollo);
+    Line l = { 0 };
+    run(&l, &s, 10000, 40, 0, NULL);
+    CHECK(l.sent + l.pending == 400, "slow: %u sent, %u pending", l.sent, l.pending);
+    CHECK(l.max_gap <= 100000, "slow: %u us between packets", l.max_gap);
+    CHECK(l.packets < 150 && l.packets > 80, "slow: %u packets for 400 counts", l.packets);
+    printf("slow, 40 counts/s: %u packets, %.1f counts each, line %u%% busy\n", l.packets,
+           (double) l.sent / l.packets, l.busy_us / 100000);
+}
+
+// Fast motion goes at the line's rate: packets back to back, the line all
+// but full, where a fixed 100 ms used 27%.
+static void
+test_fast(void)
+{
+    MouseSched s;
+    mouse_sched_init(&s, &s_apollo);
+    Line l = { 0 };
+    run(&l, &s, 10000, 2000, 0, NULL);
+    unsigned busy = l.busy_us / 100000;
+    CHECK(busy >= 90, "fast: line %u%% busy", busy);
+    CHECK(s.line_rate * 10 >= s.packets * 9, "fast: %u of %u packets at line rate", s.line_rate, s.packets);
+    CHECK(l.max_gap <= s_apollo.packet_us + 2000, "fast: %u us between packets", l.max_gap);
+    // what's held back is no more than a couple of packets' worth
+    CHECK(l.pending < 2 * 2000 * s_apollo.packet_us / 1000000 + 2, "fast: %u pending", l.pending);
+    printf("fast, 2000 counts/s: %u packets/s, line %u%% busy, %u pending at the end\n", l.packets / 10, busy,
+           l.pending);
+
+    // the Sun's own line is the same, at its own packet time
+    mouse_sched_init(&s, &s_sun);
+    memset(&l, 0, sizeof(l));
+    run(&l, &s, 10000, 2000, 0, NULL);
+    CHECK(l.busy_us / 100000 >= 90, "sun fast: line %u%% busy", l.busy_us / 100000);
+    CHECK(l.max_gap <= s_sun.packet_us + 2000, "sun fast: %u us between packets", l.max_gap);
+}
+
+// Typing while the mouse moves: keys never wait behind more than a byte
+// and a packet, and the mouse takes no more than its share.
+static void
+test_keys(void)
+{
+    MouseSched s;
+    mouse_sched_init(&s, &s_apollo);
+    Line l = { 0 };
+    // ten bytes of keys a second, a fast mouse
+    run(&l, &s, 10000, 2000, 100000, NULL);
+    unsigned mouse = l.mouse_us / 100000;
+    CHECK(mouse <= 50, "with keys the mouse took %u%% of the line", mouse);
+    CHECK(mouse >= 40, "with keys the mouse got only %u%%", mouse);
+    CHECK(s.yielded > 0, "nothing yielded to keys");
+    printf("fast with keys: mouse %u%% of the line, %u packets sent late for keys\n", mouse, s.yielded);
+}
+
+// A button change goes out at once, whatever the interval, but still
+// behind what's queued.
+static void
+test_buttons(void)
+{
+    MouseSched s;
+    mouse_sched_init(&s, &s_apollo);
+    CHECK(mouse_sched_due(&s, 0, 1, false, 0, false), "first motion");
+    mouse_sched_sent(&s, 0);
+    CHECK(!mouse_sched_due(&s, 1000, 1, false, 0, false), "a count right after a packet");
+    CHECK(mouse_sched_due(&s, 1000, 0, true, 0, false), "button right after a packet");
+    CHECK(!mouse_sched_due(&s, 1000, 0, true, s_apollo.packet_us, false), "button behind a packet");
+    CHECK(!mouse_sched_due(&s, 1000000, 0, false, 0, false), "nothing to send");
+}
+
+int main(void)
+{
+    test_idle();
+    test_interval();
+    test_slow();
+    test_fast();
+    test_keys();
+    test_buttons();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
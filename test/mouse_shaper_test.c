@@ -0,0 +1,300 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The mouse motion shaper in src/mouse_shaper.c: every count of USB motion
+ * comes out in some packet, slow and fast, against the divide-and-clamp
+ * the Apollo and NeXT backends used to do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "mouse_shaper.h"
+
+static const MouseShaperConfig s_flat = { .scale_q16 = MOUSE_Q16_ONE, .max_delta = 127 };
+static const MouseShaperConfig s_half = { .scale_q16 = MOUSE_Q16_ONE / 2, .max_delta = 127 };
+static const MouseShaperConfig s_third = { .scale_q16 = MOUSE_Q16_ONE / 3, .max_delta = 127 };
+static const MouseShaperConfig s_half_mild = {
+    .scale_q16 = MOUSE_Q16_ONE / 2, .curve = mouse_curve_mild, .curve_len = MOUSE_CURVE_MILD_LEN, .max_delta = 127,
+};
+
+// what the host sent
+typedef struct {
+    int64_t x, y;
+    unsigned packets;
+    int max_abs;
+} Sent;
+
+static void
+take_all(MouseShaper *m, Sent *s)
+{
+    while (mouse_shaper_pending(m)) {
+        int16_t dx, dy;
+        mouse_shaper_take(m, &dx, &dy);
+        CHECK(dx || dy, "a packet with nothing in it");
+        CHECK(abs(dx) <= m->cfg->max_delta && abs(dy) <= m->cfg->max_delta, "packet %d,%d", dx, dy);
+        s->x += dx;
+        s->y += dy;
+        s->packets++;
+        if (abs(dx) > s->max_abs)
+            s->max_abs = abs(dx);
+        if (abs(dy) > s->max_abs)
+            s->max_abs = abs(dy);
+        if (s->packets > 100000) {
+            CHECK(false, "still pending after %u packets", s->packets);
+            break;
+        }
+    }
+}
+
+// The shaper's books: what was sent plus what it still holds is exactly
+// what came in, scaled, in Q16.
+static void
+check_books(const MouseShaper *m, const char *name)
+{
+    int64_t want_x = m->in_x * (int64_t) m->cfg->scale_q16;
+    int64_t want_y = m->in_y * (int64_t) m->cfg->scale_q16;
+    CHECK(m->out_x * MOUSE_Q16_ONE + m->pending_x == want_x, "%s: x out %lld + pending %lld/65536 != in %lld",
+          name, (long long) m->out_x, (long long) m->pending_x, (long long) m->in_x);
+    CHECK(m->out_y * MOUSE_Q16_ONE + m->pending_y == want_y, "%s: y out %lld + pending %lld/65536 != in %lld",
+          name, (long long) m->out_y, (long long) m->pending_y, (long long) m->in_y);
+    // and what's held is at most half a count once it's all been taken
+    CHECK(m->pending_x * 2 <= MOUSE_Q16_ONE && m->pending_x * 2 >= -MOUSE_Q16_ONE, "%s: x pending %lld", name,
+          (long long) m->pending_x);
+}
+
+// What host_apollo.c and host_next.c did: divide, truncate, clamp, and
+// start over from zero.
+static int
+legacy_axis(int accumulated)
+{
+    int c = accumulated / 2;
+    return c > 127 ? 127 : c < -127 ? -127 : c;
+}
+
+//
+// slow
+//
+
+// A slow drag: one count every 25 ms, so four per 100 ms report window;
+// and one that moves an odd count each window.
+static void
+test_slow(void)
+{
+    MouseShaper m;
+    mouse_shaper_init(&m, &s_half);
+    Sent sent = { 0 };
+    int64_t legacy = 0;
+    uint32_t now = 0;
+
+    for (int window = 0; window < 100; window++) {
+        int acc = 0;
+        int counts = window % 2 ? 1 : 3;
+        for (int i = 0; i < counts; i++) {
+            mouse_shaper_add(&m, 1, -1, now);
+            acc++;
+            now += 100000 / counts;
+        }
+        legacy += legacy_axis(acc);
+        take_all(&m, &sent);
+    }
+    check_books(&m, "slow");
+    CHECK(sent.x == 100 && sent.y == -100, "slow: %lld,%lld sent for 200 counts at half speed", (long long) sent.x,
+          (long long) sent.y);
+    CHECK(legacy == 50, "legacy sent %lld", (long long) legacy);
+    printf("slow drag, 200 counts at half speed: %lld sent (was %lld)\n", (long long) sent.x, (long long) legacy);
+
+    // nudges of a count at a time at a third: they all get there
+    mouse_shaper_init(&m, &s_third);
+    memset(&sent, 0, sizeof(sent));
+    for (int i = 0; i < 300; i++) {
+        mouse_shaper_add(&m, 1, 0, now += 200000);
+        take_all(&m, &sent);
+    }
+    check_books(&m, "third");
+    CHECK(sent.x == 100 && sent.y == 0, "third: %lld sent for 300", (long long) sent.x);
+}
+
+// Half a count left over stays left over, rather than going back and
+// forth a count at a time.
+static void
+test_half(void)
+{
+    MouseShaper m;
+    mouse_shaper_init(&m, &s_half);
+    Sent sent = { 0 };
+    mouse_shaper_add(&m, 3, -1, 0);
+    take_all(&m, &sent);
+    CHECK(sent.packets == 1 && sent.x == 1 && sent.y == 0, "%u packets, %lld,%lld", sent.packets,
+          (long long) sent.x, (long long) sent.y);
+    CHECK(!mouse_shaper_pending(&m), "half a count pending");
+    mouse_shaper_add(&m, 1, -1, 1000);
+    take_all(&m, &sent);
+    CHECK(sent.x == 2 && sent.y == -1, "and the halves add up: %lld,%lld", (long long) sent.x, (long long) sent.y);
+    check_books(&m, "half");
+}
+
+// There and back comes back to where it started, at any scale: no drift
+// from rounding one way.
+static void
+test_round_trip(void)
+{
+    static const MouseShaperConfig *cfgs[] = { &s_flat, &s_half, &s_third };
+    for (int c = 0; c < 3; c++) {
+        MouseShaper m;
+        mouse_shaper_init(&m, cfgs[c]);
+        Sent sent = { 0 };
+        uint32_t now = 0;
+        for (int i = 0; i < 37; i++) {
+            mouse_shaper_add(&m, 1, -3, now += 8000);
+            take_all(&m, &sent);
+        }
+        for (int i = 0; i < 37; i++) {
+            mouse_shaper_add(&m, -1, 3, now += 8000);
+            take_all(&m, &sent);
+        }
+        check_books(&m, "round trip");
+        CHECK(sent.x == 0 && sent.y == 0, "config %d: round trip ends at %lld,%lld", c, (long long) sent.x,
+              (long long) sent.y);
+    }
+}
+
+//
+// fast
+//
+
+// A flick of 1000 counts in one report: eight packets rather than one
+// clamped to 127.
+static void
+test_split(void)
+{
+    MouseShaper m;
+    mouse_shaper_init(&m, &s_flat);
+    Sent sent = { 0 };
+
+    mouse_shaper_add(&m, 1000, -300, 0);
+    take_all(&m, &sent);
+    check_books(&m, "split");
+    CHECK(sent.x == 1000 && sent.y == -300, "split: %lld,%lld", (long long) sent.x, (long long) sent.y);
+    CHECK(sent.packets == 8 && sent.max_abs == 127, "split: %u packets, largest %d", sent.packets, sent.max_abs);
+    CHECK(m.splits == 7, "%u splits", m.splits);
+    printf("flick of 1000 counts: %lld sent in %u packets (was %d)\n", (long long) sent.x, sent.packets,
+           legacy_axis(2000));
+
+    // the y axis runs out first; x keeps going alone
+    mouse_shaper_init(&m, &s_flat);
+    mouse_shaper_add(&m, 300, 10, 0);
+    int16_t dx, dy;
+    mouse_shaper_take(&m, &dx, &dy);
+    CHECK(dx == 127 && dy == 10, "first packet %d,%d", dx, dy);
+    mouse_shaper_take(&m, &dx, &dy);
+    CHECK(dx == 127 && dy == 0, "second packet %d,%d", dx, dy);
+    mouse_shaper_take(&m, &dx, &dy);
+    CHECK(dx == 46 && dy == 0 && !mouse_shaper_pending(&m), "third packet %d,%d", dx, dy);
+    mouse_shaper_take(&m, &dx, &dy);
+    CHECK(dx == 0 && dy == 0, "nothing left, got %d,%d", dx, dy);
+}
+
+// Random motion, any scale, at USB rates: the books balance, and taking
+// everything leaves under half a count.
+static void
+test_random(void)
+{
+    static const MouseShaperConfig *cfgs[] = { &s_flat, &s_half, &s_third };
+    srand(44);
+    for (int c = 0; c < 3; c++) {
+        MouseShaper m;
+        mouse_shaper_init(&m, cfgs[c]);
+        Sent sent = { 0 };
+        uint32_t now = 0xfffff000u;     // across the clock wrap
+        for (int i = 0; i < 20000; i++) {
+            int dx = rand() % 601 - 300;
+            int dy = rand() % 21 - 10;
+            mouse_shaper_add(&m, dx, dy, now += 1000 + rand() % 7000);
+            // a packet now and then, not always everything
+            if (rand() % 4 == 0) {
+                int16_t tx, ty;
+                mouse_shaper_take(&m, &tx, &ty);
+                sent.x += tx;
+                sent.y += ty;
+            }
+        }
+        take_all(&m, &sent);
+        check_books(&m, "random");
+        CHECK(sent.x == m.out_x && sent.y == m.out_y, "out totals");
+    }
+}
+
+//
+// acceleration
+//
+
+static int64_t
+gain_at(const MouseShaperConfig *cfg, int counts_per_report, uint32_t report_us)
+{
+    MouseShaper m;
+    mouse_shaper_init(&m, cfg);
+    uint32_t now = 0;
+    // the first report is measured against a pause; the rest are steady
+    mouse_shaper_add(&m, counts_per_report, 0, now);
+    int64_t before = m.pending_x;
+    mouse_shaper_add(&m, counts_per_report, 0, now + report_us);
+    return (m.pending_x - before) * 2 / counts_per_report;
+}
+
+static void
+test_curve(void)
+{
+    // 8 ms reports: 2 counts is 250 counts/s, 40 is 5000
+    CHECK(gain_at(&s_half_mild, 2, 8000) == MOUSE_Q16_ONE, "slow gain %lld", (long long) gain_at(&s_half_mild, 2, 8000));
+    CHECK(gain_at(&s_half_mild, 40, 8000) == 2 * MOUSE_Q16_ONE, "fast gain %lld",
+          (long long) gain_at(&s_half_mild, 40, 8000));
+    // 700 counts/s: halfway between 400 and 1000
+    int64_t mid = gain_at(&s_half_mild, 7, 10000);
+    CHECK(mid == MOUSE_Q16_ONE * 5 / 4, "gain at 700 counts/s %lld", (long long) mid);
+
+    // never less under the curve for going faster
+    int64_t last = 0;
+    for (int c = 1; c < 60; c++) {
+        int64_t g = gain_at(&s_half_mild, c, 8000);
+        CHECK(g >= last, "gain drops at %d counts per report", c);
+        last = g;
+    }
+
+    // with a curve, everything accelerated still gets sent
+    MouseShaper m;
+    mouse_shaper_init(&m, &s_half_mild);
+    Sent sent = { 0 };
+    uint32_t now = 0;
+    for (int i = 0; i < 100; i++)
+        mouse_shaper_add(&m, 40, 0, now += 8000);
+    take_all(&m, &sent);
+    // the first report is measured against a pause, 800 counts/s; the
+    // other 99 are at the top of the curve, twice half speed
+    MouseShaper first;
+    mouse_shaper_init(&first, &s_half_mild);
+    mouse_shaper_add(&first, 40, 0, 0);
+    int64_t scaled = first.pending_x + 99 * (40 * MOUSE_Q16_ONE);
+    CHECK(sent.x * MOUSE_Q16_ONE + m.pending_x == scaled, "accelerated: %lld sent", (long long) sent.x);
+}
+
+int main(void)
+{
+    test_slow();
+    test_half();
+    test_round_trip();
+    test_split();
+    test_random();
+    test_curve();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,488 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Runs next_rx/next_tx from src/next.pio in the PIO model against a
+ * simulated NeXT: a 5 MHz clock on MCLK, commands on MOUT (sampled by
+ * us on the rising edge) and replies on MIN (sampled by the host on the
+ * rising edge). The soundbox side mirrors next_init(), the RX DMA ring
+ * and process_incoming() in host_next.c.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "pio_emu.h"
+#include "next.pio.h"
+
+// same pins and state machines as host_next.c
+#define SOUNDBOX_IN_GPIO 0
+#define SOUNDBOX_CLK_IN_GPIO 1
+#define SOUNDBOX_OUT_GPIO 8
+#define SM_RX 0
+#define SM_TX 1
+#define RX_RING_WORDS 64
+
+#define SYS_CLK_HZ 120000000
+#define NEXT_CLK_HZ 5000000
+#define CYCLES_PER_BIT (SYS_CLK_HZ / NEXT_CLK_HZ)
+#define CYCLES_PER_US (SYS_CLK_HZ / 1000000)
+
+#define MAX_BITS 65536
+#define MAX_FRAMES 256
+
+typedef struct {
+    uint8_t cmd;
+    uint32_t data;
+    bool has_data;
+} Frame;
+
+typedef struct {
+    pio_emu pio;
+    unsigned rx_offset;
+    unsigned tx_offset;
+
+    // host -> soundbox bit stream on MOUT, changed on the falling clock edge
+    uint8_t out_bits[MAX_BITS];
+    unsigned out_len;
+    unsigned out_pos;
+
+    // soundbox -> host bits on MIN, sampled on the rising clock edge
+    uint8_t in_bits[MAX_BITS];
+    unsigned in_len;
+
+    // soundbox CPU model: the RX DMA ring, and process_incoming() taking
+    // frames out of it each time around the mainloop
+    uint64_t mainloop_latency;  // cycles between trips around the mainloop
+    uint64_t mainloop_at;
+    uint32_t rx_ring[RX_RING_WORDS];
+    uint32_t rx_produced;
+    uint32_t rx_taken;
+    uint32_t rx_lost;
+
+    Frame frames[MAX_FRAMES];
+    unsigned frame_count;
+
+    // words waiting in a blocking pio_sm_put(SM_TX)
+    uint32_t tx_words[64];
+    unsigned tx_head;
+    unsigned tx_tail;
+} Sim;
+
+static bool frame_has_data(uint8_t cmd)
+{
+    return (cmd & 0b11000000) == 0b11000000;
+}
+
+static void host_send(Sim *sim, uint8_t cmd, uint32_t data)
+{
+    sim->out_bits[sim->out_len++] = 1;
+    for (int i = 7; i >= 0; i--)
+        sim->out_bits[sim->out_len++] = (cmd >> i) & 1;
+    if (frame_has_data(cmd)) {
+        for (int i = 31; i >= 0; i--)
+            sim->out_bits[sim->out_len++] = (data >> i) & 1;
+    }
+    sim->out_bits[sim->out_len++] = 0;
+    sim->out_bits[sim->out_len++] = 0;
+}
+
+static void host_idle(Sim *sim, unsigned bits)
+{
+    while (bits-- && sim->out_len < MAX_BITS)
+        sim->out_bits[sim->out_len++] = 0;
+}
+
+// Same layout as decode_words() in host_next.c
+static void decode_frame(Sim *sim, uint32_t a, uint32_t b)
+{
+    Frame *f = &sim->frames[sim->frame_count];
+    if ((a & 0b010000000000) == 0)
+        return;
+    f->cmd = (uint8_t) ((a & 0b01111111100) >> 2);
+    f->has_data = frame_has_data(f->cmd);
+    f->data = f->has_data ? ((a & 0b11) << 30) | (b >> 2) : 0;
+    if (sim->frame_count < MAX_FRAMES - 1)
+        sim->frame_count++;
+}
+
+static void sim_init(Sim *sim)
+{
+    memset(sim, 0, sizeof(*sim));
+    pio_emu *pio = &sim->pio;
+    pio_emu_init(pio);
+
+    // as in next_init(): clkdiv 2, input synchronizers bypassed on CLK and IN
+    pio->input_sync_bypass = (1u << SOUNDBOX_CLK_IN_GPIO) | (1u << SOUNDBOX_IN_GPIO);
+
+    int rx = pio_emu_add_program(pio, next_rx_program_instructions,
+            sizeof(next_rx_program_instructions) / 2, -1);
+    int tx = pio_emu_add_program(pio, next_tx_program_instructions,
+            sizeof(next_tx_program_instructions) / 2, -1);
+    CHECK(rx >= 0 && tx >= 0, "next_rx + next_tx don't fit in %d instructions", PIO_EMU_INSTR_MEM);
+    sim->rx_offset = rx;
+    sim->tx_offset = tx;
+
+    pio_emu_sm_config cfg = pio_emu_default_config(rx, next_rx_wrap_target, next_rx_wrap);
+    cfg.clkdiv_int = 2;
+    cfg.in_base = SOUNDBOX_IN_GPIO;
+    cfg.jmp_pin = SOUNDBOX_IN_GPIO;
+    cfg.in_shift_right = false;
+    pio_emu_sm_init(pio, SM_RX, rx, &cfg);
+
+    cfg = pio_emu_default_config(tx, next_tx_wrap_target, next_tx_wrap);
+    cfg.clkdiv_int = 2;
+    cfg.in_base = SOUNDBOX_CLK_IN_GPIO;
+    cfg.out_base = SOUNDBOX_OUT_GPIO;
+    cfg.out_count = 1;
+    cfg.set_base = SOUNDBOX_OUT_GPIO;
+    cfg.set_count = 1;
+    cfg.out_shift_right = false;
+    pio_emu_sm_init(pio, SM_TX, tx, &cfg);
+
+    pio_emu_set_pindirs(pio, SOUNDBOX_OUT_GPIO, 1, true);
+    pio_emu_set_pin(pio, SOUNDBOX_IN_GPIO, 0);
+    pio_emu_set_pin(pio, SOUNDBOX_CLK_IN_GPIO, 0);
+
+    pio_emu_sm_set_enabled(pio, SM_RX, true);
+    pio_emu_sm_set_enabled(pio, SM_TX, true);
+}
+
+// rx_take() in host_next.c; the DMA doesn't move while it runs here
+static bool rx_take(Sim *sim, uint32_t *words)
+{
+    uint32_t ahead = sim->rx_produced - sim->rx_taken;
+    if (ahead > RX_RING_WORDS) {
+        uint32_t over = (ahead - RX_RING_WORDS + 1) & ~1u;
+        sim->rx_lost += over / 2;
+        sim->rx_taken += over;
+        ahead -= over;
+    }
+    if (ahead < 2)
+        return false;
+    words[0] = sim->rx_ring[sim->rx_taken % RX_RING_WORDS];
+    words[1] = sim->rx_ring[(sim->rx_taken + 1) % RX_RING_WORDS];
+    sim->rx_taken += 2;
+    return true;
+}
+
+static void soundbox_cpu(Sim *sim)
+{
+    pio_emu *pio = &sim->pio;
+
+    // the RX DMA channel, paced by the FIFO's DREQ
+    uint32_t w;
+    while (pio_emu_sm_get(pio, SM_RX, &w))
+        sim->rx_ring[sim->rx_produced++ % RX_RING_WORDS] = w;
+
+    // process_incoming, each trip around mainloop
+    if (pio->cycle - sim->mainloop_at >= sim->mainloop_latency) {
+        uint32_t words[2];
+        while (rx_take(sim, words))
+            decode_frame(sim, words[0], words[1]);
+        sim->mainloop_at = pio->cycle;
+    }
+
+    // pio_sm_put(pio1, SM_TX, ...) spinning on a full FIFO
+    while (sim->tx_head != sim->tx_tail && pio_emu_sm_put(pio, SM_TX, sim->tx_words[sim->tx_tail % 64]))
+        sim->tx_tail++;
+}
+
+static void sim_run_bits(Sim *sim, unsigned bits)
+{
+    pio_emu *pio = &sim->pio;
+    for (unsigned b = 0; b < bits; b++) {
+        for (unsigned c = 0; c < CYCLES_PER_BIT; c++) {
+            if (c == 0) {
+                // rising edge: both sides sample
+                pio_emu_set_pin(pio, SOUNDBOX_CLK_IN_GPIO, 1);
+                if (sim->in_len < MAX_BITS)
+                    sim->in_bits[sim->in_len++] = pio_emu_get_pin(pio, SOUNDBOX_OUT_GPIO);
+            } else if (c == CYCLES_PER_BIT / 2) {
+                // falling edge: host shifts out its next bit
+                pio_emu_set_pin(pio, SOUNDBOX_CLK_IN_GPIO, 0);
+                uint8_t bit = sim->out_pos < sim->out_len ? sim->out_bits[sim->out_pos++] : 0;
+                pio_emu_set_pin(pio, SOUNDBOX_IN_GPIO, bit);
+            }
+            pio_emu_step(pio);
+            soundbox_cpu(sim);
+        }
+    }
+}
+
+static void sim_run_until_sent(Sim *sim, unsigned extra_bits)
+{
+    sim_run_bits(sim, sim->out_len - sim->out_pos + extra_bits);
+}
+
+// Host-side decode of MIN; returns the number of frames found
+static unsigned host_decode_in(Sim *sim, Frame *frames, unsigned max)
+{
+    unsigned n = 0;
+    unsigned i = 0;
+    while (i < sim->in_len && n < max) {
+        if (!sim->in_bits[i]) {
+            i++;
+            continue;
+        }
+        i++; // start bit
+        if (i + 10 > sim->in_len)
+            break;
+        uint8_t cmd = 0;
+        for (int b = 0; b < 8; b++)
+            cmd = (cmd << 1) | sim->in_bits[i++];
+        uint32_t data = 0;
+        if (frame_has_data(cmd)) {
+            if (i + 34 > sim->in_len)
+                break;
+            for (int b = 0; b < 32; b++)
+                data = (data << 1) | sim->in_bits[i++];
+        }
+        i += 2; // stop bits
+        frames[n].cmd = cmd;
+        frames[n].data = data;
+        frames[n].has_data = frame_has_data(cmd);
+        n++;
+    }
+    return n;
+}
+
+// send_command_with_data() / send_command() from host_next.c
+static void soundbox_put(Sim *sim, uint32_t word)
+{
+    sim->tx_words[sim->tx_head++ % 64] = word;
+}
+
+static void soundbox_send(Sim *sim, uint8_t command, uint32_t data)
+{
+    if (frame_has_data(command)) {
+        soundbox_put(sim, 8+32+3);
+        soundbox_put(sim, (1u<<31) | (command << 23) | (data >> 9));
+        soundbox_put(sim, data << 23);
+    } else {
+        soundbox_put(sim, 8+3);
+        soundbox_put(sim, (1u<<31) | (command << 23));
+    }
+}
+
+static void test_program_size(void)
+{
+    unsigned rx_len = sizeof(next_rx_program_instructions) / 2;
+    unsigned tx_len = sizeof(next_tx_program_instructions) / 2;
+    printf("program size: next_rx %u + next_tx %u = %u of %d instructions\n",
+            rx_len, tx_len, rx_len + tx_len, PIO_EMU_INSTR_MEM);
+    CHECK(rx_len + tx_len <= PIO_EMU_INSTR_MEM, "programs exceed instruction memory");
+}
+
+static void test_rx_framing(void)
+{
+    static Sim sim;
+    sim_init(&sim);
+    sim.mainloop_latency = 5 * CYCLES_PER_US;
+
+    // the boot sequence from NOTES.md, with generous gaps
+    const Frame sent[] = {
+        { 0xc5, 0xef000000, true },
+        { 0xc5, 0x00030000, true },
+        { 0xc6, 0x01fffff6, true },
+        { 0x00, 0, false },
+        { 0xc5, 0x00000000, true },
+    };
+    const unsigned n = sizeof(sent) / sizeof(sent[0]);
+
+    for (unsigned i = 0; i < n; i++) {
+        host_send(&sim, sent[i].cmd, sent[i].data);
+        host_idle(&sim, 200);
+    }
+    sim_run_until_sent(&sim, 100);
+
+    CHECK(sim.frame_count == n, "rx framing: expected %u frames, got %u", n, sim.frame_count);
+    for (unsigned i = 0; i < n && i < sim.frame_count; i++) {
+        CHECK(sim.frames[i].cmd == sent[i].cmd && sim.frames[i].data == sent[i].data,
+                "rx framing: frame %u: expected %02x %08x, got %02x %08x", i,
+                sent[i].cmd, sent[i].data, sim.frames[i].cmd, sim.frames[i].data);
+    }
+}
+
+// Finds the smallest idle gap (in bits) between back-to-back data commands
+// that loses nothing, for a given mainloop service latency.
+static unsigned min_lossless_gap(uint64_t latency_cycles, uint64_t *rx_stall_pct)
+{
+    static Sim sim;
+    const unsigned count = 32;
+
+    for (unsigned gap = 0; gap < 1024; gap += (gap < 64 ? 2 : gap / 8)) {
+        sim_init(&sim);
+        sim.mainloop_latency = latency_cycles;
+        host_idle(&sim, 4);
+        for (unsigned i = 0; i < count; i++) {
+            host_send(&sim, 0xc5, 0x01000000 | i);
+            host_idle(&sim, gap);
+        }
+        sim_run_until_sent(&sim, 64 + latency_cycles / CYCLES_PER_BIT);
+
+        bool ok = sim.frame_count == count;
+        for (unsigned i = 0; ok && i < count; i++)
+            ok = sim.frames[i].cmd == 0xc5 && sim.frames[i].data == (0x01000000 | i);
+        if (ok) {
+            pio_emu_sm *rx = &sim.pio.sm[SM_RX];
+            *rx_stall_pct = rx->cycles ? (100 * rx->pull_stall_cycles) / rx->cycles : 0;
+            return gap;
+        }
+    }
+    return ~0u;
+}
+
+static void test_rx_throughput(void)
+{
+    const unsigned latencies_us[] = { 1, 5, 20, 100 };
+    const unsigned frame_bits = 1 + 8 + 32 + 2;
+
+    printf("rx throughput, back-to-back data commands:\n");
+    printf("  mainloop period    min gap (bits)   commands/s   rx sm stalled\n");
+    for (unsigned i = 0; i < sizeof(latencies_us) / sizeof(latencies_us[0]); i++) {
+        uint64_t stall = 0;
+        unsigned gap = min_lossless_gap((uint64_t) latencies_us[i] * CYCLES_PER_US, &stall);
+        // the state machine goes straight back to looking for a start bit,
+        // however long the mainloop takes to get to the ring
+        CHECK(gap == 0, "rx throughput: needs a gap of %u bits with a %u us mainloop", gap, latencies_us[i]);
+        CHECK(stall == 0, "rx throughput: rx sm stalled %u%% waiting on the CPU", (unsigned) stall);
+        printf("  %10u us   %14u   %10u   %11u%%\n", latencies_us[i], gap,
+                (unsigned) (NEXT_CLK_HZ / (frame_bits + gap)), (unsigned) stall);
+    }
+}
+
+// A mainloop that doesn't come around for a whole ring's worth of frames
+// loses the oldest, and knows how many; the rest come through intact.
+static void test_rx_lost_frames(void)
+{
+    static Sim sim;
+    sim_init(&sim);
+    sim.mainloop_latency = 1000 * CYCLES_PER_US;
+    sim.mainloop_at = 0;
+
+    const unsigned count = 100;
+    host_idle(&sim, 4);
+    for (unsigned i = 0; i < count; i++)
+        host_send(&sim, 0xc5, 0x02000000 | i);
+    sim_run_until_sent(&sim, 1000 * (NEXT_CLK_HZ / 1000000));
+
+    const unsigned kept = RX_RING_WORDS / 2;
+    printf("rx ring: %u frames in %u us with a 1 ms mainloop: %u taken, %u lost\n", count,
+            count * 43 / (NEXT_CLK_HZ / 1000000), sim.frame_count, sim.rx_lost);
+    CHECK(sim.frame_count == kept && sim.rx_lost == count - kept, "rx ring: %u taken, %u lost",
+            sim.frame_count, sim.rx_lost);
+    for (unsigned i = 0; i < sim.frame_count; i++)
+        CHECK(sim.frames[i].cmd == 0xc5 && sim.frames[i].data == (0x02000000 | (count - kept + i)),
+                "rx ring: frame %u is %02x %08x", i, sim.frames[i].cmd, sim.frames[i].data);
+    CHECK(sim.pio.sm[SM_RX].rx_dropped == 0, "rx ring: %llu words dropped at the FIFO",
+            (unsigned long long) sim.pio.sm[SM_RX].rx_dropped);
+}
+
+static void test_rx_dataless_back_to_back(void)
+{
+    static Sim sim;
+    sim_init(&sim);
+    sim.mainloop_latency = 1 * CYCLES_PER_US;
+
+    // a data-less command is 11 bits, and the next one's start bit can
+    // be right behind its stop bits
+    host_send(&sim, 0x00, 0);
+    host_send(&sim, 0x01, 0);
+    host_idle(&sim, 200);
+    sim_run_until_sent(&sim, 100);
+
+    printf("back-to-back data-less commands: sent 2, received %u\n", sim.frame_count);
+    CHECK(sim.frame_count == 2 && sim.frames[0].cmd == 0x00 && sim.frames[1].cmd == 0x01,
+            "back-to-back data-less commands: got %u frames", sim.frame_count);
+}
+
+// Commands with and without data, every combination of the top two bits,
+// back to back with no idle at all: the whole of a 5 MHz line.
+static void test_rx_full_rate(void)
+{
+    static Sim sim;
+    sim_init(&sim);
+    sim.mainloop_latency = 20 * CYCLES_PER_US;
+
+    const unsigned count = MAX_FRAMES - 1;
+    static Frame sent[MAX_FRAMES];
+    uint32_t rng = 0x5eed;
+    unsigned bits = 0, with_data = 0;
+    host_idle(&sim, 4);
+    for (unsigned i = 0; i < count; i++) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        uint8_t cmd = (uint8_t) rng;
+        uint32_t data = frame_has_data(cmd) ? rng * 2654435761u : 0;
+        sent[i] = (Frame) { cmd, data, frame_has_data(cmd) };
+        host_send(&sim, cmd, data);
+        bits += frame_has_data(cmd) ? 43 : 11;
+        with_data += frame_has_data(cmd);
+    }
+    sim_run_until_sent(&sim, 200);
+
+    unsigned ok = 0;
+    while (ok < count && ok < sim.frame_count && sim.frames[ok].cmd == sent[ok].cmd &&
+            sim.frames[ok].data == sent[ok].data)
+        ok++;
+    printf("full rate: %u commands (%u with data) in %u bits back to back, %u decoded in order, "
+            "%u commands/s\n", count, with_data, bits, ok, (unsigned) ((uint64_t) NEXT_CLK_HZ * count / bits));
+    CHECK(ok == count && sim.frame_count == count, "full rate: %u of %u decoded (%u frames)", ok, count,
+            sim.frame_count);
+    CHECK(sim.rx_lost == 0 && sim.pio.sm[SM_RX].rx_dropped == 0, "full rate: %u lost, %llu dropped",
+            sim.rx_lost, (unsigned long long) sim.pio.sm[SM_RX].rx_dropped);
+}
+
+static void test_tx_framing(void)
+{
+    static Sim sim;
+    sim_init(&sim);
+
+    const Frame sent[] = {
+        { 0xc6, 0x70000000, true },
+        { 0x00, 0, false },
+        { 0xc6, 0x10008826, true },
+    };
+    const unsigned n = sizeof(sent) / sizeof(sent[0]);
+
+    for (unsigned i = 0; i < n; i++)
+        soundbox_send(&sim, sent[i].cmd, sent[i].data);
+
+    sim_run_bits(&sim, 400);
+
+    Frame got[8];
+    unsigned m = host_decode_in(&sim, got, 8);
+    CHECK(m == n, "tx framing: expected %u frames, got %u", n, m);
+    for (unsigned i = 0; i < n && i < m; i++) {
+        CHECK(got[i].cmd == sent[i].cmd && got[i].data == sent[i].data,
+                "tx framing: frame %u: expected %02x %08x, got %02x %08x", i,
+                sent[i].cmd, sent[i].data, got[i].cmd, got[i].data);
+    }
+
+    pio_emu_sm *tx = &sim.pio.sm[SM_TX];
+    printf("tx: %u frames in %u bit times, tx sm stalled %u%% (mostly waiting on clock edges)\n",
+            m, sim.in_len, (unsigned) (100 * tx->stall_cycles / tx->cycles));
+}
+
+int main(void)
+{
+    test_program_size();
+    test_rx_framing();
+    test_rx_throughput();
+    test_rx_lost_frames();
+    test_rx_dataless_back_to_back();
+    test_rx_full_rate();
+    test_tx_framing();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
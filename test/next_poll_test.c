@@ -0,0 +1,173 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * NeXT poll handling in src/next_poll.c, and the mouse replies host_next.c
+ * builds from it: the poll Previous sends, the measured poll rate, the
+ * mouse event word, and motion carried from poll to poll without loss.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "next_poll.h"
+#include "mouse_shaper.h"
+
+// what the host makes of a mouse word
+typedef struct {
+    uint8_t addr;
+    int dx, dy;
+    bool left, right;
+} Event;
+
+static int
+field(uint32_t bits)
+{
+    int v = bits & 0x40 ? (int) (bits & 0x7f) - 0x80 : (int) (bits & 0x7f);
+    return -v;
+}
+
+static Event
+decode(uint32_t w)
+{
+    Event e = {
+        .addr = w >> 24,
+        .dx = field(w),
+        .dy = field(w >> 8),
+        .left = !(w & 0x80),
+        .right = !(w & 0x8000),
+    };
+    return e;
+}
+
+static void
+test_poll(void)
+{
+    NextPoll p;
+    next_poll_init(&p);
+    CHECK(next_poll_wants_mouse(&p), "mouse off before the first poll");
+
+    // from NOTES.md
+    next_poll_seen(&p, 0x01fffff6, 0);
+    CHECK(p.mask == 0x01 && p.speed == 0xfffff6, "mask 0x%02x speed 0x%06x", p.mask, p.speed);
+    CHECK(next_poll_wants_mouse(&p), "mouse off for the usual poll");
+    CHECK(p.interval_us == 0, "interval %u after one poll", p.interval_us);
+
+    next_poll_seen(&p, 0x00fffff6, 0);
+    CHECK(!next_poll_wants_mouse(&p), "mouse on with a zero mask");
+}
+
+// Polls every 10 ms, give or take, settle on 10 ms; a long pause starts
+// over rather than dragging the average out.
+static void
+test_interval(void)
+{
+    NextPoll p;
+    next_poll_init(&p);
+    uint32_t now = 0xffff0000u;     // across the clock wrap
+    srand(46);
+    for (int i = 0; i < 200; i++) {
+        next_poll_seen(&p, 0x01fffff6, now);
+        now += 10000 + rand() % 1001 - 500;
+    }
+    CHECK(p.interval_us > 9500 && p.interval_us < 10500, "interval %u", p.interval_us);
+    CHECK(p.polls == 200, "%u polls", p.polls);
+
+    next_poll_seen(&p, 0x01fffff6, now + 5000000);
+    CHECK(p.interval_us == 0, "interval %u after a pause", p.interval_us);
+    next_poll_seen(&p, 0x01fffff6, now + 5000000 + 20000);
+    CHECK(p.interval_us == 20000, "interval %u after restarting", p.interval_us);
+}
+
+static void
+test_word(void)
+{
+    Event e = decode(next_mouse_word(5, -3, false, false));
+    CHECK(e.addr == 0x11, "address 0x%02x", e.addr);
+    CHECK(e.dx == 5 && e.dy == -3 && !e.left && !e.right, "%d,%d %d%d", e.dx, e.dy, e.left, e.right);
+
+    // released is the bit set; right and down are negative on the wire
+    uint32_t w = next_mouse_word(1, 1, false, false);
+    CHECK((w & 0x8080) == 0x8080, "buttons up 0x%08x", w);
+    CHECK((w & 0x7f) == 0x7f && (w >> 8 & 0x7f) == 0x7f, "right and down 0x%08x", w);
+
+    e = decode(next_mouse_word(0, 0, true, false));
+    CHECK(e.left && !e.right, "left");
+    e = decode(next_mouse_word(0, 0, false, true));
+    CHECK(!e.left && e.right, "right");
+
+    e = decode(next_mouse_word(NEXT_MOUSE_MAX_DELTA, -NEXT_MOUSE_MAX_DELTA, false, false));
+    CHECK(e.dx == NEXT_MOUSE_MAX_DELTA && e.dy == -NEXT_MOUSE_MAX_DELTA, "at the limit %d,%d", e.dx, e.dy);
+    e = decode(next_mouse_word(500, -500, false, false));
+    CHECK(e.dx == NEXT_MOUSE_MAX_DELTA && e.dy == -NEXT_MOUSE_MAX_DELTA, "past the limit %d,%d", e.dx, e.dy);
+}
+
+// USB reports every 1 ms, polls every 10 ms, fast and slow: every count
+// the host polled for arrives, split over polls when there's too much
+// for one.
+static void
+test_carry(void)
+{
+    static const MouseShaperConfig shaping = { .scale_q16 = MOUSE_Q16_ONE / 2, .max_delta = NEXT_MOUSE_MAX_DELTA };
+    MouseShaper m;
+    mouse_shaper_init(&m, &shaping);
+    NextPoll p;
+    next_poll_init(&p);
+
+    int64_t got_x = 0, got_y = 0;
+    unsigned replies = 0, polls = 0;
+    uint32_t now = 0;
+    srand(460);
+    for (int ms = 0; ms < 20000; ms++) {
+        now += 1000;
+        // a second of flicking, a second of creeping
+        int dx = (ms / 1000) % 2 ? rand() % 3 - 1 : rand() % 121 - 60;
+        int dy = (ms / 1000) % 2 ? rand() % 3 - 1 : rand() % 41 - 20;
+        mouse_shaper_add(&m, dx, dy, now);
+
+        if (ms % 10 == 9) {
+            next_poll_seen(&p, 0x01fffff6, now);
+            polls++;
+            if (next_poll_wants_mouse(&p) && mouse_shaper_pending(&m)) {
+                int16_t tx, ty;
+                mouse_shaper_take(&m, &tx, &ty);
+                Event e = decode(next_mouse_word(tx, ty, false, false));
+                CHECK(e.dx == tx && e.dy == ty, "sent %d,%d, host got %d,%d", tx, ty, e.dx, e.dy);
+                got_x += e.dx;
+                got_y += e.dy;
+                replies++;
+            }
+        }
+    }
+    // and let the polls catch up
+    while (mouse_shaper_pending(&m)) {
+        int16_t tx, ty;
+        mouse_shaper_take(&m, &tx, &ty);
+        Event e = decode(next_mouse_word(tx, ty, false, false));
+        got_x += e.dx;
+        got_y += e.dy;
+    }
+    CHECK(got_x == m.out_x && got_y == m.out_y, "host got %lld,%lld of %lld,%lld", (long long) got_x,
+          (long long) got_y, (long long) m.out_x, (long long) m.out_y);
+    CHECK(p.interval_us == 10000, "polled every %u us", p.interval_us);
+    CHECK(m.splits > 0, "no flick needed more than one poll");
+    printf("%u polls, %u answered with motion, %u split\n", polls, replies, m.splits);
+}
+
+int main(void)
+{
+    test_poll();
+    test_interval();
+    test_word();
+    test_carry();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,494 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Cycle-level RP2040 PIO model. See pio_emu.h.
+ */
+
+#include <string.h>
+#include <assert.h>
+
+#include "pio_emu.h"
+
+#define INSTR_JMP  0
+#define INSTR_WAIT 1
+#define INSTR_IN   2
+#define INSTR_OUT  3
+#define INSTR_PUSH_PULL 4
+#define INSTR_MOV  5
+#define INSTR_IRQ  6
+#define INSTR_SET  7
+
+static inline uint32_t threshold(uint8_t t) { return t == 0 ? 32 : t; }
+static inline uint32_t bitmask(unsigned n) { return n >= 32 ? 0xffffffffu : ((1u << n) - 1); }
+static inline uint32_t rotl(uint32_t v, unsigned n) { n &= 31; return n ? (v << n) | (v >> (32 - n)) : v; }
+static inline uint32_t rotr(uint32_t v, unsigned n) { n &= 31; return n ? (v >> n) | (v << (32 - n)) : v; }
+
+static bool fifo_push(pio_emu_fifo *f, uint32_t v)
+{
+    if (f->level == PIO_EMU_FIFO_DEPTH)
+        return false;
+    f->data[(f->head + f->level) % PIO_EMU_FIFO_DEPTH] = v;
+    f->level++;
+    return true;
+}
+
+static bool fifo_pop(pio_emu_fifo *f, uint32_t *v)
+{
+    if (f->level == 0)
+        return false;
+    *v = f->data[f->head];
+    f->head = (f->head + 1) % PIO_EMU_FIFO_DEPTH;
+    f->level--;
+    return true;
+}
+
+void pio_emu_init(pio_emu *pio)
+{
+    memset(pio, 0, sizeof(*pio));
+    // undriven pins float high (pull-ups); drivers pull them low
+    pio->pins_ext = 0xffffffffu;
+    pio->sync_stage[0] = pio->sync_stage[1] = pio->pins_visible = 0xffffffffu;
+}
+
+int pio_emu_add_program(pio_emu *pio, const uint16_t *instr, unsigned length, int origin)
+{
+    uint32_t mask = bitmask(length);
+    int offset = -1;
+
+    if (origin >= 0) {
+        if (origin + length <= PIO_EMU_INSTR_MEM && !(pio->used_mask & (mask << origin)))
+            offset = origin;
+    } else {
+        for (int o = PIO_EMU_INSTR_MEM - (int) length; o >= 0; o--) {
+            if (!(pio->used_mask & (mask << o))) {
+                offset = o;
+                break;
+            }
+        }
+    }
+
+    if (offset < 0)
+        return -1;
+
+    for (unsigned i = 0; i < length; i++) {
+        uint16_t in = instr[i];
+        // JMP targets are relative to the program start
+        if ((in >> 13) == INSTR_JMP)
+            in = (in & ~0x1f) | ((in + offset) & 0x1f);
+        pio->instr[offset + i] = in;
+    }
+    pio->used_mask |= mask << offset;
+    return offset;
+}
+
+pio_emu_sm_config pio_emu_default_config(unsigned offset, unsigned wrap_target, unsigned wrap)
+{
+    pio_emu_sm_config c;
+    memset(&c, 0, sizeof(c));
+    c.wrap_target = offset + wrap_target;
+    c.wrap = offset + wrap;
+    c.clkdiv_int = 1;
+    c.in_shift_right = true;
+    c.out_shift_right = true;
+    return c;
+}
+
+void pio_emu_sm_init(pio_emu *pio, unsigned sm, unsigned offset, const pio_emu_sm_config *cfg)
+{
+    pio_emu_sm *s = &pio->sm[sm];
+    memset(s, 0, sizeof(*s));
+    s->cfg = *cfg;
+    s->pc = offset;
+    // the SDK leaves the OSR "empty" after init, so the first 'pull ifempty' pulls
+    s->osr_count = 32;
+}
+
+void pio_emu_sm_set_enabled(pio_emu *pio, unsigned sm, bool enabled)
+{
+    pio->sm[sm].enabled = enabled;
+}
+
+void pio_emu_sm_exec(pio_emu *pio, unsigned sm, uint16_t instr)
+{
+    pio->sm[sm].exec_pending = true;
+    pio->sm[sm].exec_instr = instr;
+}
+
+bool pio_emu_sm_put(pio_emu *pio, unsigned sm, uint32_t value)
+{
+    return fifo_push(&pio->sm[sm].tx_fifo, value);
+}
+
+bool pio_emu_sm_get(pio_emu *pio, unsigned sm, uint32_t *value)
+{
+    return fifo_pop(&pio->sm[sm].rx_fifo, value);
+}
+
+unsigned pio_emu_sm_rx_level(const pio_emu *pio, unsigned sm)
+{
+    return pio->sm[sm].rx_fifo.level;
+}
+
+unsigned pio_emu_sm_tx_level(const pio_emu *pio, unsigned sm)
+{
+    return pio->sm[sm].tx_fifo.level;
+}
+
+void pio_emu_set_pindirs(pio_emu *pio, unsigned base, unsigned count, bool out)
+{
+    uint32_t m = rotl(bitmask(count), base);
+    if (out)
+        pio->pindirs |= m;
+    else
+        pio->pindirs &= ~m;
+}
+
+void pio_emu_set_pin(pio_emu *pio, unsigned pin, bool level)
+{
+    if (level)
+        pio->pins_ext |= 1u << pin;
+    else
+        pio->pins_ext &= ~(1u << pin);
+}
+
+static inline uint32_t pin_levels(const pio_emu *pio)
+{
+    return pio->pins_ext & (~pio->pindirs | pio->pins_out);
+}
+
+bool pio_emu_get_pin(const pio_emu *pio, unsigned pin)
+{
+    return (pin_levels(pio) >> pin) & 1;
+}
+
+static void write_pins(uint32_t *reg, unsigned base, unsigned count, uint32_t value)
+{
+    uint32_t m = rotl(bitmask(count), base);
+    *reg = (*reg & ~m) | (rotl(value, base) & m);
+}
+
+static unsigned irq_index(unsigned sm, unsigned field)
+{
+    unsigned idx = field & 7;
+    if (field & 0x10)
+        idx = (idx & 4) | ((idx + sm) & 3);
+    return idx;
+}
+
+static bool osr_empty(const pio_emu_sm *s)
+{
+    return s->osr_count >= threshold(s->cfg.pull_threshold);
+}
+
+static uint32_t mov_source(pio_emu *pio, pio_emu_sm *s, unsigned src)
+{
+    switch (src) {
+        case 0: return rotr(pio->pins_visible, s->cfg.in_base);
+        case 1: return s->x;
+        case 2: return s->y;
+        case 3: return 0;
+        case 5: {
+            unsigned level = s->cfg.status_sel == PioEmuStatusTxLevel ? s->tx_fifo.level : s->rx_fifo.level;
+            return level < s->cfg.status_n ? 0xffffffffu : 0;
+        }
+        case 6: return s->isr;
+        case 7: return s->osr;
+        default: return 0;
+    }
+}
+
+static uint32_t bit_reverse(uint32_t v)
+{
+    uint32_t r = 0;
+    for (int i = 0; i < 32; i++) {
+        r = (r << 1) | (v & 1);
+        v >>= 1;
+    }
+    return r;
+}
+
+// Executes one instruction. Returns false if the state machine stalled
+// (the instruction will be retried next cycle). *jumped is set if the
+// instruction wrote the PC.
+static bool execute(pio_emu *pio, unsigned sm, uint16_t in, bool *jumped)
+{
+    pio_emu_sm *s = &pio->sm[sm];
+    unsigned arg = in & 0xff;
+    *jumped = false;
+
+    switch (in >> 13) {
+    case INSTR_JMP: {
+        bool take;
+        switch ((arg >> 5) & 7) {
+            case 0: take = true; break;
+            case 1: take = s->x == 0; break;
+            case 2: take = s->x != 0; s->x--; break;
+            case 3: take = s->y == 0; break;
+            case 4: take = s->y != 0; s->y--; break;
+            case 5: take = s->x != s->y; break;
+            case 6: take = (pio->pins_visible >> s->cfg.jmp_pin) & 1; break;
+            default: take = !osr_empty(s); break;
+        }
+        if (take) {
+            s->pc = arg & 0x1f;
+            *jumped = true;
+        }
+        return true;
+    }
+
+    case INSTR_WAIT: {
+        unsigned pol = (arg >> 7) & 1;
+        unsigned idx = arg & 0x1f;
+        switch ((arg >> 5) & 3) {
+            case 0: return ((pio->pins_visible >> idx) & 1) == pol;
+            case 1: return ((pio->pins_visible >> ((s->cfg.in_base + idx) & 31)) & 1) == pol;
+            case 2: {
+                unsigned irq = irq_index(sm, idx);
+                bool set = (pio->irq >> irq) & 1;
+                if (set != pol)
+                    return false;
+                if (pol)
+                    pio->irq &= ~(1u << irq);
+                return true;
+            }
+            default: return true;
+        }
+    }
+
+    case INSTR_IN: {
+        if (!s->push_pending) {
+            unsigned n = arg & 0x1f;
+            if (n == 0) n = 32;
+            uint32_t data;
+            switch ((arg >> 5) & 7) {
+                case 0: data = rotr(pio->pins_visible, s->cfg.in_base); break;
+                case 1: data = s->x; break;
+                case 2: data = s->y; break;
+                case 6: data = s->isr; break;
+                case 7: data = s->osr; break;
+                default: data = 0; break;
+            }
+            data &= bitmask(n);
+            if (n == 32)
+                s->isr = data;
+            else if (s->cfg.in_shift_right)
+                s->isr = (s->isr >> n) | (data << (32 - n));
+            else
+                s->isr = (s->isr << n) | data;
+            s->isr_count = s->isr_count + n > 32 ? 32 : s->isr_count + n;
+            s->push_pending = s->cfg.autopush && s->isr_count >= threshold(s->cfg.push_threshold);
+        }
+        if (s->push_pending) {
+            if (!fifo_push(&s->rx_fifo, s->isr)) {
+                s->push_stall_cycles++;
+                return false;
+            }
+            s->push_pending = false;
+            s->isr = 0;
+            s->isr_count = 0;
+        }
+        return true;
+    }
+
+    case INSTR_OUT: {
+        if (s->cfg.autopull && osr_empty(s)) {
+            if (!fifo_pop(&s->tx_fifo, &s->osr)) {
+                s->pull_stall_cycles++;
+                return false;
+            }
+            s->osr_count = 0;
+        }
+        unsigned n = arg & 0x1f;
+        if (n == 0) n = 32;
+        uint32_t data;
+        if (n == 32) {
+            data = s->osr;
+            s->osr = 0;
+        } else if (s->cfg.out_shift_right) {
+            data = s->osr & bitmask(n);
+            s->osr >>= n;
+        } else {
+            data = s->osr >> (32 - n);
+            s->osr <<= n;
+        }
+        s->osr_count = s->osr_count + n > 32 ? 32 : s->osr_count + n;
+        switch ((arg >> 5) & 7) {
+            case 0: write_pins(&pio->pins_out, s->cfg.out_base, s->cfg.out_count, data); break;
+            case 1: s->x = data; break;
+            case 2: s->y = data; break;
+            case 3: break;
+            case 4: write_pins(&pio->pindirs, s->cfg.out_base, s->cfg.out_count, data); break;
+            case 5: s->pc = data & 0x1f; *jumped = true; break;
+            case 6: s->isr = data; s->isr_count = n; break;
+            case 7: s->exec_pending = true; s->exec_instr = data; break;
+        }
+        return true;
+    }
+
+    case INSTR_PUSH_PULL: {
+        bool is_pull = (arg >> 7) & 1;
+        bool if_flag = (arg >> 6) & 1;
+        bool block = (arg >> 5) & 1;
+        if (!is_pull) {
+            if (if_flag && s->isr_count < threshold(s->cfg.push_threshold))
+                return true;
+            if (!fifo_push(&s->rx_fifo, s->isr)) {
+                if (block) {
+                    s->push_stall_cycles++;
+                    return false;
+                }
+                s->rx_dropped++;
+            }
+            s->isr = 0;
+            s->isr_count = 0;
+        } else {
+            if (if_flag && !osr_empty(s))
+                return true;
+            if (!fifo_pop(&s->tx_fifo, &s->osr)) {
+                if (block) {
+                    s->pull_stall_cycles++;
+                    return false;
+                }
+                s->osr = s->x;
+            }
+            s->osr_count = 0;
+        }
+        return true;
+    }
+
+    case INSTR_MOV: {
+        uint32_t v = mov_source(pio, s, arg & 7);
+        switch ((arg >> 3) & 3) {
+            case 1: v = ~v; break;
+            case 2: v = bit_reverse(v); break;
+        }
+        switch ((arg >> 5) & 7) {
+            case 0: write_pins(&pio->pins_out, s->cfg.out_base, s->cfg.out_count, v); break;
+            case 1: s->x = v; break;
+            case 2: s->y = v; break;
+            case 4: s->exec_pending = true; s->exec_instr = v; break;
+            case 5: s->pc = v & 0x1f; *jumped = true; break;
+            case 6: s->isr = v; s->isr_count = 0; break;
+            case 7: s->osr = v; s->osr_count = 0; break;
+        }
+        return true;
+    }
+
+    case INSTR_IRQ: {
+        unsigned irq = irq_index(sm, arg & 0x1f);
+        bool clr = (arg >> 6) & 1;
+        bool wait = (arg >> 5) & 1;
+        if (clr) {
+            pio->irq &= ~(1u << irq);
+            return true;
+        }
+        if (!s->irq_waiting) {
+            pio->irq |= 1u << irq;
+            if (!wait)
+                return true;
+            s->irq_waiting = true;
+        }
+        if ((pio->irq >> irq) & 1)
+            return false;
+        s->irq_waiting = false;
+        return true;
+    }
+
+    case INSTR_SET: {
+        uint32_t data = arg & 0x1f;
+        switch ((arg >> 5) & 7) {
+            case 0: write_pins(&pio->pins_out, s->cfg.set_base, s->cfg.set_count, data); break;
+            case 1: s->x = data; break;
+            case 2: s->y = data; break;
+            case 4: write_pins(&pio->pindirs, s->cfg.set_base, s->cfg.set_count, data); break;
+        }
+        return true;
+    }
+    }
+
+    return true;
+}
+
+static void sm_cycle(pio_emu *pio, unsigned sm)
+{
+    pio_emu_sm *s = &pio->sm[sm];
+    s->cycles++;
+
+    if (s->delay) {
+        s->delay--;
+        return;
+    }
+
+    bool from_exec = s->exec_pending;
+    uint16_t in = from_exec ? s->exec_instr : pio->instr[s->pc];
+
+    // side-set takes effect at the start of the instruction, even if it stalls
+    unsigned ss_bits = s->cfg.sideset_bits;
+    unsigned delay_bits = 5 - ss_bits;
+    unsigned field = (in >> 8) & 0x1f;
+    if (ss_bits) {
+        unsigned value_bits = ss_bits - (s->cfg.sideset_opt ? 1 : 0);
+        bool enabled = !s->cfg.sideset_opt || (field & 0x10);
+        if (enabled && value_bits) {
+            uint32_t v = (field >> delay_bits) & bitmask(value_bits);
+            write_pins(s->cfg.sideset_pindirs ? &pio->pindirs : &pio->pins_out,
+                    s->cfg.sideset_base, value_bits, v);
+        }
+    }
+
+    bool jumped;
+    s->exec_pending = false;
+    if (!execute(pio, sm, in, &jumped)) {
+        if (from_exec && !s->exec_pending) {
+            s->exec_pending = true;
+            s->exec_instr = in;
+        }
+        s->stall_cycles++;
+        return;
+    }
+
+    if (!jumped && !from_exec) {
+        if (s->pc == s->cfg.wrap)
+            s->pc = s->cfg.wrap_target;
+        else
+            s->pc = (s->pc + 1) & 0x1f;
+    }
+
+    s->delay = field & bitmask(delay_bits);
+}
+
+void pio_emu_step(pio_emu *pio)
+{
+    uint32_t levels = pin_levels(pio);
+
+    // two-flop input synchronizer, unless bypassed per pin
+    pio->pins_visible = (levels & pio->input_sync_bypass) | (pio->sync_stage[1] & ~pio->input_sync_bypass);
+    pio->sync_stage[1] = pio->sync_stage[0];
+    pio->sync_stage[0] = levels;
+
+    for (unsigned sm = 0; sm < PIO_EMU_NUM_SM; sm++) {
+        pio_emu_sm *s = &pio->sm[sm];
+        if (!s->enabled)
+            continue;
+
+        uint32_t div = ((uint32_t) s->cfg.clkdiv_int << 8) | s->cfg.clkdiv_frac;
+        if (s->cfg.clkdiv_int == 0)
+            div = 65536u << 8;
+        s->div_acc += 256;
+        if (s->div_acc < div)
+            continue;
+        s->div_acc -= div;
+
+        sm_cycle(pio, sm);
+    }
+
+    pio->cycle++;
+}
+
+void pio_emu_run(pio_emu *pio, uint64_t cycles)
+{
+    while (cycles--)
+        pio_emu_step(pio);
+}
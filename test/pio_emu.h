@@ -0,0 +1,150 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Cycle-level model of one RP2040 PIO block, for running the programs
+ * from src/ .pio files on Linux. Programs are loaded straight from the
+ * pioasm-generated headers (built with PICO_NO_HARDWARE=1, so only the
+ * instruction arrays and wrap defines are visible).
+ *
+ * One call to pio_emu_step() is one system clock cycle. State machines
+ * advance according to their clock divider, see their pins through the
+ * input synchronizer (unless bypassed), and stall on WAIT, blocking
+ * PUSH/PULL and autopush/autopull exactly where the hardware would.
+ */
+
+#ifndef PIO_EMU_H_
+#define PIO_EMU_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PIO_EMU_NUM_SM 4
+#define PIO_EMU_INSTR_MEM 32
+#define PIO_EMU_FIFO_DEPTH 4
+
+typedef enum {
+    PioEmuStatusTxLevel = 0, // mov x, status: all-ones if TX level < status_n
+    PioEmuStatusRxLevel = 1, // mov x, status: all-ones if RX level < status_n
+} PioEmuStatusSel;
+
+typedef struct {
+    uint8_t wrap_target;
+    uint8_t wrap;
+
+    // clock divider: int + frac/256 system clocks per state machine cycle
+    uint16_t clkdiv_int;
+    uint8_t clkdiv_frac;
+
+    uint8_t in_base;
+    uint8_t out_base;
+    uint8_t out_count;
+    uint8_t set_base;
+    uint8_t set_count;
+    uint8_t sideset_base;
+    uint8_t jmp_pin;
+
+    // side-set bit count *including* the enable bit if optional,
+    // same as sm_config_set_sideset()
+    uint8_t sideset_bits;
+    bool sideset_opt;
+    bool sideset_pindirs;
+
+    bool in_shift_right;
+    bool autopush;
+    uint8_t push_threshold; // 0 means 32
+
+    bool out_shift_right;
+    bool autopull;
+    uint8_t pull_threshold; // 0 means 32
+
+    PioEmuStatusSel status_sel;
+    uint8_t status_n;
+} pio_emu_sm_config;
+
+typedef struct {
+    uint32_t data[PIO_EMU_FIFO_DEPTH];
+    uint8_t head;
+    uint8_t level;
+} pio_emu_fifo;
+
+typedef struct {
+    pio_emu_sm_config cfg;
+    bool enabled;
+
+    uint8_t pc;
+    uint32_t x, y;
+    uint32_t isr, osr;
+    uint8_t isr_count;
+    uint8_t osr_count;
+
+    pio_emu_fifo rx_fifo;
+    pio_emu_fifo tx_fifo;
+
+    uint32_t div_acc;   // fractional divider accumulator, 1/256 cycle units
+    uint32_t delay;     // delay cycles left on the current instruction
+
+    bool exec_pending;
+    uint16_t exec_instr;
+    bool push_pending;  // autopush hit a full RX FIFO; IN is stalled on it
+    bool irq_waiting;   // 'irq wait' has set its flag and is waiting for a clear
+
+    // statistics, in state machine cycles
+    uint64_t cycles;
+    uint64_t stall_cycles;
+    uint64_t push_stall_cycles;  // blocked on a full RX FIFO
+    uint64_t pull_stall_cycles;  // blocked on an empty TX FIFO
+    uint64_t rx_dropped;         // 'push noblock' into a full RX FIFO
+} pio_emu_sm;
+
+typedef struct {
+    uint16_t instr[PIO_EMU_INSTR_MEM];
+    uint32_t used_mask;
+
+    pio_emu_sm sm[PIO_EMU_NUM_SM];
+
+    uint8_t irq;            // IRQ flags 0-7; 0-3 are visible to the system
+
+    // Pins are wired-AND: a pin reads low if either the outside world
+    // (pins_ext) or a state machine driving it (pindirs/pins_out) pulls it low.
+    uint32_t pins_ext;
+    uint32_t pins_out;
+    uint32_t pindirs;
+
+    uint32_t input_sync_bypass;
+    uint32_t sync_stage[2];
+    uint32_t pins_visible;  // what the state machines see this cycle
+
+    uint64_t cycle;
+} pio_emu;
+
+void pio_emu_init(pio_emu *pio);
+
+// Loads a program the way pio_add_program() does: at the highest free
+// offset (or at origin, if >= 0), relocating JMP targets. Returns the
+// offset, or -1 if the instruction memory is full.
+int pio_emu_add_program(pio_emu *pio, const uint16_t *instr, unsigned length, int origin);
+
+// Equivalent of <prog>_program_get_default_config(offset)
+pio_emu_sm_config pio_emu_default_config(unsigned offset, unsigned wrap_target, unsigned wrap);
+void pio_emu_sm_init(pio_emu *pio, unsigned sm, unsigned offset, const pio_emu_sm_config *cfg);
+void pio_emu_sm_set_enabled(pio_emu *pio, unsigned sm, bool enabled);
+void pio_emu_sm_exec(pio_emu *pio, unsigned sm, uint16_t instr);
+
+bool pio_emu_sm_put(pio_emu *pio, unsigned sm, uint32_t value);
+bool pio_emu_sm_get(pio_emu *pio, unsigned sm, uint32_t *value);
+unsigned pio_emu_sm_rx_level(const pio_emu *pio, unsigned sm);
+unsigned pio_emu_sm_tx_level(const pio_emu *pio, unsigned sm);
+
+void pio_emu_set_pindirs(pio_emu *pio, unsigned base, unsigned count, bool out);
+void pio_emu_set_pin(pio_emu *pio, unsigned pin, bool level);
+bool pio_emu_get_pin(const pio_emu *pio, unsigned pin);
+
+static inline bool pio_emu_irq_get(const pio_emu *pio, unsigned irq) { return (pio->irq >> irq) & 1; }
+static inline void pio_emu_irq_clear(pio_emu *pio, unsigned irq) { pio->irq &= ~(1u << irq); }
+
+void pio_emu_step(pio_emu *pio);
+void pio_emu_run(pio_emu *pio, uint64_t cycles);
+
+#endif
@@ -0,0 +1,265 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Descriptor plan cache (src/plan_cache.c), with a sector of RAM standing
+ * in for flash: round trips, keys that must miss, entries that must not
+ * validate, replacement when full, and what a hit costs next to compiling.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "check.h"
+#include "babelfish.h"
+#include "plan_cache.h"
+#include "hid_corpus.h"
+
+// the cache only needs a clock for its write delay
+static uint64_t s_now_us = 1000000;
+
+uint64_t time_us_64(void)
+{
+    return s_now_us;
+}
+
+typedef struct {
+    const char *name;
+    const uint8_t *desc;
+    uint16_t len;
+} CorpusEntry;
+
+#define CORPUS(d) { #d, d, sizeof(d) }
+
+static const CorpusEntry corpus[] = {
+    CORPUS(desc_boot_keyboard),
+    CORPUS(desc_boot_mouse),
+    CORPUS(desc_logitech_receiver),
+    CORPUS(desc_hires_mouse),
+    CORPUS(desc_composite_keyboard),
+    CORPUS(desc_nkro_keyboard),
+    CORPUS(desc_nkro_keyboard_flat),
+    CORPUS(desc_nkro_keyboard_ids),
+    CORPUS(desc_absolute_pointer),
+};
+
+#define CORPUS_COUNT (sizeof(corpus) / sizeof(corpus[0]))
+
+static bool same_plan(const HidDevicePlan *a, const HidDevicePlan *b)
+{
+    return a->count == b->count && a->uses_ids == b->uses_ids &&
+           a->has_leds == b->has_leds && a->led_report_id == b->led_report_id &&
+           !memcmp(a->by_id, b->by_id, sizeof(a->by_id)) &&
+           !memcmp(a->reports, b->reports, a->count * sizeof(HidReportPlan));
+}
+
+static void test_round_trip(void)
+{
+    PlanCacheImage image;
+    plan_cache_image_clear(&image);
+
+    for (unsigned i = 0; i < CORPUS_COUNT; i++) {
+        HidDevicePlan plan;
+        PlanCacheKey key;
+        hid_plan_compile(&plan, corpus[i].desc, corpus[i].len);
+        plan_cache_key(&key, 0x046d, 0xc500 + i, corpus[i].desc, corpus[i].len);
+        plan_cache_image_put(&image, &key, &plan, i & 1);
+    }
+
+    for (unsigned i = 0; i < CORPUS_COUNT; i++) {
+        HidDevicePlan plan, cached;
+        PlanCacheKey key;
+        uint8_t protocol = 0xff;
+        hid_plan_compile(&plan, corpus[i].desc, corpus[i].len);
+        plan_cache_key(&key, 0x046d, 0xc500 + i, corpus[i].desc, corpus[i].len);
+        CHECK(plan_cache_image_find(&image, &key, &cached, &protocol), "%s: miss", corpus[i].name);
+        CHECK(same_plan(&plan, &cached), "%s: cached plan differs", corpus[i].name);
+        CHECK(protocol == (i & 1), "%s: protocol %u", corpus[i].name, protocol);
+    }
+}
+
+static void test_misses(void)
+{
+    PlanCacheImage image;
+    HidDevicePlan plan;
+    PlanCacheKey key;
+    uint8_t protocol;
+
+    plan_cache_image_clear(&image);
+    hid_plan_compile(&plan, desc_logitech_receiver, sizeof(desc_logitech_receiver));
+    plan_cache_key(&key, 0x046d, 0xc52b, desc_logitech_receiver, sizeof(desc_logitech_receiver));
+    plan_cache_image_put(&image, &key, &plan, 1);
+
+    PlanCacheKey other = key;
+    other.pid = 0xc52c;
+    CHECK(!plan_cache_image_find(&image, &other, &plan, &protocol), "other PID hit");
+
+    // same device after a firmware update that changed the descriptor
+    uint8_t changed[sizeof(desc_logitech_receiver)];
+    memcpy(changed, desc_logitech_receiver, sizeof(changed));
+    changed[sizeof(changed) / 2] ^= 1;
+    plan_cache_key(&other, 0x046d, 0xc52b, changed, sizeof(changed));
+    CHECK(!plan_cache_image_find(&image, &other, &plan, &protocol), "changed descriptor hit");
+
+    // corrupt the stored plan: the check no longer matches
+    PlanCacheImage bad = image;
+    bad.entries[0].reports[0].mouse.x.bit_offset ^= 0x40;
+    CHECK(plan_cache_image_scrub(&bad) == 1 && !plan_cache_image_find(&bad, &key, &plan, &protocol),
+          "corrupt entry kept");
+
+    // an entry that checks out but would read past the report
+    bad = image;
+    bad.entries[0].reports[0].mouse.x.bit_offset = 0x4000;
+    bad.entries[0].check = plan_cache_hash((const uint8_t *) &bad.entries[0], offsetof(PlanCacheEntry, check));
+    CHECK(plan_cache_image_scrub(&bad) == 1, "out of range field kept");
+
+    CHECK(plan_cache_image_scrub(&image) == 0 && plan_cache_image_find(&image, &key, &plan, &protocol),
+          "good entry dropped");
+
+    // erased flash, and an image from a build with another layout
+    memset(&image, 0xff, sizeof(image));
+    CHECK(!plan_cache_image_valid(&image), "erased sector is valid");
+    plan_cache_image_clear(&image);
+    image.entry_size++;
+    CHECK(!plan_cache_image_valid(&image), "other layout is valid");
+}
+
+static void test_replacement(void)
+{
+    PlanCacheImage image;
+    HidDevicePlan plan;
+    PlanCacheKey key;
+    uint8_t protocol;
+
+    plan_cache_image_clear(&image);
+    hid_plan_compile(&plan, desc_boot_keyboard, sizeof(desc_boot_keyboard));
+    for (unsigned i = 0; i < PLAN_CACHE_ENTRIES + 3; i++) {
+        plan_cache_key(&key, 0x1234, i, desc_boot_keyboard, sizeof(desc_boot_keyboard));
+        plan_cache_image_put(&image, &key, &plan, 0);
+        // storing a device again refreshes it rather than taking a slot
+        if (i == PLAN_CACHE_ENTRIES - 1) {
+            plan_cache_key(&key, 0x1234, 0, desc_boot_keyboard, sizeof(desc_boot_keyboard));
+            plan_cache_image_put(&image, &key, &plan, 1);
+        }
+    }
+
+    CHECK(image.count == PLAN_CACHE_ENTRIES, "%u entries", image.count);
+    for (unsigned i = 0; i < PLAN_CACHE_ENTRIES + 3; i++) {
+        plan_cache_key(&key, 0x1234, i, desc_boot_keyboard, sizeof(desc_boot_keyboard));
+        bool found = plan_cache_image_find(&image, &key, &plan, &protocol);
+        // 1, 2 and 3 are the oldest once 0 was refreshed
+        bool expect = !(i >= 1 && i <= 3);
+        CHECK(found == expect, "device %u: %s", i, found ? "hit" : "miss");
+    }
+}
+
+static void test_write_back(void)
+{
+    HidDevicePlan plan, cached;
+    PlanCacheKey key;
+    uint8_t protocol;
+
+    plan_cache_init();
+    hid_plan_compile(&plan, desc_composite_keyboard, sizeof(desc_composite_keyboard));
+    plan_cache_key(&key, 0x04d9, 0x0169, desc_composite_keyboard, sizeof(desc_composite_keyboard));
+    CHECK(!plan_cache_lookup(&key, &cached, &protocol), "hit before store");
+    plan_cache_store(&key, &plan, 1);
+
+    // hits from RAM straight away, before it's in flash
+    CHECK(plan_cache_lookup(&key, &cached, &protocol) && same_plan(&plan, &cached), "no hit after store");
+
+    PlanCacheStats stats;
+    plan_cache_task();
+    get_plan_cache_stats(&stats);
+    CHECK(stats.writes == 0, "wrote before the delay");
+
+    s_now_us += 3000000;
+    plan_cache_task();
+    get_plan_cache_stats(&stats);
+    CHECK(stats.writes == 1, "%u writes after the delay", stats.writes);
+
+    // as after a power cycle
+    plan_cache_init();
+    CHECK(plan_cache_lookup(&key, &cached, &protocol) && same_plan(&plan, &cached) && protocol == 1,
+          "not in flash");
+
+    plan_cache_set_enabled(false);
+    CHECK(!plan_cache_lookup(&key, &cached, &protocol), "hit while disabled");
+    plan_cache_set_enabled(true);
+
+    plan_cache_clear();
+    plan_cache_task();
+    plan_cache_init();
+    CHECK(!plan_cache_lookup(&key, &cached, &protocol), "hit after clear");
+}
+
+//
+// cost: what a hit (hash the descriptor, find the entry, rebuild by_id)
+// saves over compiling
+//
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench(void)
+{
+    const unsigned iters = 100000;
+    static PlanCacheImage image;
+    HidDevicePlan plan;
+    PlanCacheKey key;
+    uint8_t protocol;
+    volatile uint32_t sink = 0;
+
+    // a full cache, with what we look up in the last slot
+    plan_cache_image_clear(&image);
+    for (unsigned i = 0; i < PLAN_CACHE_ENTRIES; i++) {
+        const CorpusEntry *c = &corpus[i % CORPUS_COUNT];
+        hid_plan_compile(&plan, c->desc, c->len);
+        plan_cache_key(&key, 0x1000, i, c->desc, c->len);
+        plan_cache_image_put(&image, &key, &plan, 0);
+    }
+
+    printf("plan ready after mount, on this machine:\n");
+    for (unsigned c = 0; c < CORPUS_COUNT; c++) {
+        const CorpusEntry *ce = &corpus[c];
+        unsigned slot = PLAN_CACHE_ENTRIES - CORPUS_COUNT + c;
+
+        double t0 = now_ns();
+        for (unsigned i = 0; i < iters; i++)
+            sink += hid_plan_compile(&plan, ce->desc, ce->len);
+        double compile_ns = (now_ns() - t0) / iters;
+
+        t0 = now_ns();
+        for (unsigned i = 0; i < iters; i++) {
+            plan_cache_key(&key, 0x1000, slot, ce->desc, ce->len);
+            sink += plan_cache_image_find(&image, &key, &plan, &protocol);
+        }
+        double cached_ns = (now_ns() - t0) / iters;
+
+        printf("  %-26s %3u bytes: compile %6.0f ns, cached %6.0f ns\n", ce->name, ce->len, compile_ns, cached_ns);
+    }
+    (void) sink;
+}
+
+int main(void)
+{
+    test_round_trip();
+    test_misses();
+    test_replacement();
+    test_write_back();
+    bench();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,41 @@
+#ifndef SHIM_HARDWARE_GPIO_H_
+#define SHIM_HARDWARE_GPIO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum gpio_function {
+    GPIO_FUNC_UART = 2,
+    GPIO_FUNC_PIO0 = 6,
+    GPIO_FUNC_PIO1 = 7,
+    GPIO_FUNC_SIO = 5,
+    GPIO_FUNC_NULL = 0x1f,
+};
+
+enum gpio_override {
+    GPIO_OVERRIDE_NORMAL = 0,
+    GPIO_OVERRIDE_INVERT = 1,
+    GPIO_OVERRIDE_LOW = 2,
+    GPIO_OVERRIDE_HIGH = 3,
+};
+
+#define GPIO_OUT 1
+#define GPIO_IN 0
+
+#define GPIO_IRQ_LEVEL_LOW 0x1u
+#define GPIO_IRQ_LEVEL_HIGH 0x2u
+#define GPIO_IRQ_EDGE_FALL 0x4u
+#define GPIO_IRQ_EDGE_RISE 0x8u
+
+// Pins have no behaviour in the line model; these only need to build.
+static inline void gpio_init(unsigned gpio) { (void) gpio; }
+static inline void gpio_set_function(unsigned gpio, enum gpio_function fn) { (void) gpio; (void) fn; }
+static inline void gpio_set_dir(unsigned gpio, bool out) { (void) gpio; (void) out; }
+static inline void gpio_put(unsigned gpio, bool value) { (void) gpio; (void) value; }
+static inline bool gpio_get(unsigned gpio) { (void) gpio; return true; }
+static inline void gpio_pull_up(unsigned gpio) { (void) gpio; }
+static inline void gpio_disable_pulls(unsigned gpio) { (void) gpio; }
+static inline void gpio_set_inover(unsigned gpio, unsigned value) { (void) gpio; (void) value; }
+static inline void gpio_set_outover(unsigned gpio, unsigned value) { (void) gpio; (void) value; }
+
+#endif
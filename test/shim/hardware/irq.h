@@ -0,0 +1,14 @@
+#ifndef SHIM_HARDWARE_IRQ_H_
+#define SHIM_HARDWARE_IRQ_H_
+
+#include <stdbool.h>
+
+#define UART0_IRQ 20
+#define UART1_IRQ 21
+
+typedef void (*irq_handler_t)(void);
+
+void irq_set_exclusive_handler(unsigned num, irq_handler_t handler);
+void irq_set_enabled(unsigned num, bool enabled);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef SHIM_HARDWARE_UART_H_
+#define SHIM_HARDWARE_UART_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct uart_inst uart_inst_t;
+
+extern uart_inst_t *const sim_uart_instances[2];
+#define uart0 (sim_uart_instances[0])
+#define uart1 (sim_uart_instances[1])
+
+typedef enum {
+    UART_PARITY_NONE,
+    UART_PARITY_EVEN,
+    UART_PARITY_ODD
+} uart_parity_t;
+
+unsigned uart_get_index(uart_inst_t *uart);
+unsigned uart_init(uart_inst_t *uart, unsigned baudrate);
+unsigned uart_set_baudrate(uart_inst_t *uart, unsigned baudrate);
+void uart_set_format(uart_inst_t *uart, unsigned data_bits, unsigned stop_bits, uart_parity_t parity);
+void uart_set_hw_flow(uart_inst_t *uart, bool cts, bool rts);
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data, bool tx_needs_data);
+
+bool uart_is_writable(uart_inst_t *uart);
+bool uart_is_readable(uart_inst_t *uart);
+void uart_putc_raw(uart_inst_t *uart, char c);
+char uart_getc(uart_inst_t *uart);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Just enough of the Pico SDK to build the host backends on Linux, against
+ * the virtual clock and UART line model in test/line_sim.c.
+ */
+
+#ifndef SHIM_PICO_STDLIB_H_
+#define SHIM_PICO_STDLIB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+uint64_t time_us_64(void);
+static inline uint32_t time_us_32(void) { return (uint32_t) time_us_64(); }
+static inline absolute_time_t get_absolute_time(void) { return time_us_64(); }
+static inline uint32_t to_ms_since_boot(absolute_time_t t) { return (uint32_t) (t / 1000); }
+static inline uint64_t to_us_since_boot(absolute_time_t t) { return t; }
+static inline int64_t absolute_time_diff_us(absolute_time_t from, absolute_time_t to) { return (int64_t) (to - from); }
+
+// both advance the virtual clock; there's no difference between spinning
+// and sleeping here
+void busy_wait_us(uint64_t us);
+static inline void busy_wait_ms(uint32_t ms) { busy_wait_us((uint64_t) ms * 1000); }
+static inline void sleep_us(uint64_t us) { busy_wait_us(us); }
+static inline void sleep_ms(uint32_t ms) { busy_wait_us((uint64_t) ms * 1000); }
+
+// Hardware alarms: the callback runs as an interrupt once the virtual clock
+// gets there. As in the SDK, a positive return reschedules that many us
+// after the time it was due, a negative one that many us from now.
+typedef int32_t alarm_id_t;
+typedef int64_t (*alarm_callback_t)(alarm_id_t id, void *user_data);
+
+alarm_id_t add_alarm_at(absolute_time_t time, alarm_callback_t callback, void *user_data, bool fire_if_past);
+static inline alarm_id_t add_alarm_in_us(uint64_t us, alarm_callback_t callback, void *user_data, bool fire_if_past)
+{
+    return add_alarm_at(time_us_64() + us, callback, user_data, fire_if_past);
+}
+bool cancel_alarm(alarm_id_t id);
+
+#include "hardware/gpio.h"
+
+#endif
@@ -0,0 +1,24 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Everything runs on one thread in the host build; the "other core" in
+ * line_sim's background hook only runs between instructions of ours, so
+ * mutexes have nothing to do.
+ */
+
+#ifndef SHIM_PICO_SYNC_H_
+#define SHIM_PICO_SYNC_H_
+
+#include <stdbool.h>
+
+typedef struct {
+    bool locked;
+} mutex_t;
+
+static inline void mutex_init(mutex_t *m) { m->locked = false; }
+static inline void mutex_enter_blocking(mutex_t *m) { m->locked = true; }
+static inline void mutex_exit(mutex_t *m) { m->locked = false; }
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The parts of TinyUSB's HID headers the backends use: boot protocol report
+ * layouts, button/modifier bits, and TinyUSB's keycode names on top of the
+ * ones in src/hid_codes.h.
+ */
+
+#ifndef SHIM_TUSB_H_
+#define SHIM_TUSB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hid_codes.h"
+
+typedef struct __attribute__((packed)) {
+    uint8_t modifier;
+    uint8_t reserved;
+    uint8_t keycode[6];
+} hid_keyboard_report_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t buttons;
+    int8_t x;
+    int8_t y;
+    int8_t wheel;
+    int8_t pan;
+} hid_mouse_report_t;
+
+#define MOUSE_BUTTON_LEFT     (1u << 0)
+#define MOUSE_BUTTON_RIGHT    (1u << 1)
+#define MOUSE_BUTTON_MIDDLE   (1u << 2)
+#define MOUSE_BUTTON_BACKWARD (1u << 3)
+#define MOUSE_BUTTON_FORWARD  (1u << 4)
+
+#define KEYBOARD_MODIFIER_LEFTCTRL   (1u << 0)
+#define KEYBOARD_MODIFIER_LEFTSHIFT  (1u << 1)
+#define KEYBOARD_MODIFIER_LEFTALT    (1u << 2)
+#define KEYBOARD_MODIFIER_LEFTGUI    (1u << 3)
+#define KEYBOARD_MODIFIER_RIGHTCTRL  (1u << 4)
+#define KEYBOARD_MODIFIER_RIGHTSHIFT (1u << 5)
+#define KEYBOARD_MODIFIER_RIGHTALT   (1u << 6)
+#define KEYBOARD_MODIFIER_RIGHTGUI   (1u << 7)
+
+#define HID_KEY_1               0x1E
+#define HID_KEY_2               0x1F
+#define HID_KEY_3               0x20
+#define HID_KEY_4               0x21
+#define HID_KEY_5               0x22
+#define HID_KEY_6               0x23
+#define HID_KEY_7               0x24
+#define HID_KEY_8               0x25
+#define HID_KEY_9               0x26
+#define HID_KEY_0               0x27
+#define HID_KEY_SPACE           0x2C
+#define HID_KEY_MINUS           0x2D
+#define HID_KEY_EQUAL           0x2E
+#define HID_KEY_BRACKET_LEFT    0x2F
+#define HID_KEY_BRACKET_RIGHT   0x30
+#define HID_KEY_BACKSLASH       0x31
+#define HID_KEY_SEMICOLON       0x33
+#define HID_KEY_APOSTROPHE      0x34
+#define HID_KEY_GRAVE           0x35
+#define HID_KEY_COMMA           0x36
+#define HID_KEY_PERIOD          0x37
+#define HID_KEY_SLASH           0x38
+#define HID_KEY_PAGE_UP         0x4B
+#define HID_KEY_END             0x4D
+#define HID_KEY_PAGE_DOWN       0x4E
+#define HID_KEY_ARROW_RIGHT     0x4F
+#define HID_KEY_ARROW_LEFT      0x50
+#define HID_KEY_ARROW_DOWN      0x51
+#define HID_KEY_ARROW_UP        0x52
+#define HID_KEY_NUM_LOCK        0x53
+#define HID_KEY_KEYPAD_DIVIDE   0x54
+#define HID_KEY_KEYPAD_MULTIPLY 0x55
+#define HID_KEY_KEYPAD_SUBTRACT 0x56
+#define HID_KEY_KEYPAD_ADD      0x57
+#define HID_KEY_KEYPAD_1        0x59
+#define HID_KEY_KEYPAD_2        0x5A
+#define HID_KEY_KEYPAD_3        0x5B
+#define HID_KEY_KEYPAD_4        0x5C
+#define HID_KEY_KEYPAD_6        0x5E
+#define HID_KEY_KEYPAD_7        0x5F
+#define HID_KEY_KEYPAD_8        0x60
+#define HID_KEY_KEYPAD_9        0x61
+#define HID_KEY_KEYPAD_0        0x62
+#define HID_KEY_CONTROL_LEFT    0xE0
+#define HID_KEY_SHIFT_LEFT      0xE1
+#define HID_KEY_ALT_LEFT        0xE2
+#define HID_KEY_GUI_LEFT        0xE3
+#define HID_KEY_CONTROL_RIGHT   0xE4
+#define HID_KEY_SHIFT_RIGHT     0xE5
+#define HID_KEY_ALT_RIGHT       0xE6
+#define HID_KEY_GUI_RIGHT       0xE7
+
+#endif
@@ -0,0 +1,334 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Decoder for the line sniffer's CDC stream (src/sniff.c, framing in
+ * src/sniff_frame.h): one line per byte, with its time, the gap since the
+ * stream's previous byte, UART errors, and what it means on an Apollo
+ * line; the firmware's log lines in between.
+ *
+ * Usage: sniff_decode [options] [capture]
+ *
+ *   capture      a file of what the CDC sent, e.g. from
+ *                "cat /dev/ttyACM0 > capture"; stdin if not given
+ *   -f           follow: print frames as they come, rather than reading
+ *                to the end and putting the streams in time order
+ *   --apollo     annotate received bytes as Apollo keyboard commands
+ *   --no-text    leave out the firmware's log lines
+ *
+ * Output, times in seconds since the board booted:
+ *
+ *     12.345678  A rx  ff  .
+ *     12.354845  A rx  12  .     +9.167 ms
+ *     12.364012  A rx  21  !     +9.167 ms  ident
+ *     12.365678  # (apollo:0) ident
+ *     12.375678  A tx  ff  .
+ *     12.394845  A rx  55  U     +9.167 ms  parity error  unknown ff 55
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "sniff_frame.h"
+#include "apollo_cmd.h"
+
+typedef enum {
+    EvByte,
+    EvText,
+    EvLost,
+    EvInfo,
+} EventType;
+
+typedef struct {
+    EventType type;
+    uint8_t stream;
+    uint8_t byte;
+    uint8_t err;
+    uint64_t t_us;
+    uint32_t seq;               // arrival order, for a stable sort
+    uint32_t value;             // EvLost count, EvInfo baud
+    uint8_t info[4];
+    char *text;
+} Event;
+
+static bool s_follow = false;
+static bool s_apollo = false;
+static bool s_text = true;
+
+static Event *s_events = NULL;
+static uint32_t s_event_count = 0;
+static uint32_t s_event_cap = 0;
+
+// 32-bit board time carried on across its wrap, every 71 minutes
+static uint64_t s_last_us = 0;
+static bool s_have_time = false;
+
+static uint64_t
+unwrap(uint32_t t)
+{
+    if (!s_have_time) {
+        s_have_time = true;
+        s_last_us = t;
+        return t;
+    }
+    int32_t delta = (int32_t) (t - (uint32_t) s_last_us);
+    s_last_us += delta;
+    return s_last_us;
+}
+
+//
+// printing
+//
+
+static uint64_t s_prev_us[SNIFF_STREAMS];
+static bool s_have_prev[SNIFF_STREAMS];
+// a recognizer per channel, for --apollo
+static ApolloCmd s_apollo_cmd[2];
+
+// apollo_cmd.c times replies with the SDK clock; with no handlers there
+// are none to time
+uint64_t time_us_64(void)
+{
+    return 0;
+}
+
+static void
+print_time(uint64_t t_us)
+{
+    printf("%6llu.%06llu  ", (unsigned long long) (t_us / 1000000), (unsigned long long) (t_us % 1000000));
+}
+
+static const char *
+stream_name(uint8_t stream)
+{
+    static const char *names[SNIFF_STREAMS] = { "A rx", "B rx", "A tx", "B tx" };
+    return stream < SNIFF_STREAMS ? names[stream] : "? ??";
+}
+
+// what the byte finished, on a line from an Apollo host
+static void
+print_apollo(uint8_t ch, uint8_t byte, uint64_t t_us)
+{
+    ApolloCmd *p = &s_apollo_cmd[ch];
+    ApolloCmdStats before = p->stats;
+    apollo_cmd_feed(p, byte, (uint32_t) t_us);
+
+    if (p->stats.commands != before.commands) {
+        for (int i = 0; i < ApolloCmdCount; i++) {
+            if (p->stats.counts[i] != before.counts[i])
+                printf("  %s", apollo_cmd_table[i].name);
+        }
+    } else if (p->stats.unknown != before.unknown) {
+        printf("  unknown ff %lx", (unsigned long) p->stats.last_unknown);
+    }
+}
+
+static void
+print_event(const Event *e)
+{
+    print_time(e->t_us);
+
+    switch (e->type) {
+    case EvByte: {
+        printf("%s  %02x  %c", stream_name(e->stream), e->byte, isprint(e->byte) ? e->byte : '.');
+        if (s_have_prev[e->stream]) {
+            uint64_t gap = e->t_us - s_prev_us[e->stream];
+            printf("  %+9.3f ms", gap / 1000.0);
+        } else {
+            printf("  %12s", "");
+        }
+        s_prev_us[e->stream] = e->t_us;
+        s_have_prev[e->stream] = true;
+
+        if (e->err & SNIFF_ERR_FRAMING)
+            printf("  framing error");
+        if (e->err & SNIFF_ERR_PARITY)
+            printf("  parity error");
+        if (e->err & SNIFF_ERR_BREAK)
+            printf("  break");
+        if (e->err & SNIFF_ERR_OVERRUN)
+            printf("  overrun");
+        if (s_apollo && !SNIFF_STREAM_TX(e->stream))
+            print_apollo(SNIFF_STREAM_CH(e->stream), e->byte, e->t_us);
+        printf("\n");
+        break;
+    }
+    case EvText:
+        printf("# %s\n", e->text);
+        break;
+    case EvLost:
+        if (e->value)
+            printf("%s  -- %u bytes lost\n", stream_name(e->stream), e->value);
+        else
+            printf("%s  -- bytes lost, the capture ring overran\n", stream_name(e->stream));
+        // a gap after a loss means nothing
+        s_have_prev[e->stream] = false;
+        break;
+    case EvInfo: {
+        static const char parity[] = { 'N', 'E', 'O' };
+        printf("%s  %u baud %u%c%u%s%s\n", stream_name(e->stream), e->value, e->info[0],
+               e->info[1] < 3 ? parity[e->info[1]] : '?', e->info[2],
+               e->info[3] & SNIFF_INFO_CAPTURE ? ", captured" : ", not captured",
+               e->info[3] & SNIFF_INFO_BRIDGE ? ", bridged from the CDC" : "");
+        break;
+    }
+    }
+}
+
+//
+// collecting
+//
+
+static void
+add_event(const Event *e)
+{
+    if (s_follow) {
+        print_event(e);
+        fflush(stdout);
+        free(e->text);
+        return;
+    }
+
+    if (s_event_count == s_event_cap) {
+        s_event_cap = s_event_cap ? s_event_cap * 2 : 4096;
+        s_events = realloc(s_events, s_event_cap * sizeof(Event));
+        if (!s_events) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    s_events[s_event_count] = *e;
+    s_events[s_event_count].seq = s_event_count;
+    s_event_count++;
+}
+
+// log text comes in pieces; a line is an event, at its first piece's time
+static char s_line[512];
+static unsigned s_line_len = 0;
+static uint64_t s_line_us = 0;
+
+static void
+add_text(const uint8_t *text, unsigned len, uint64_t t_us)
+{
+    for (unsigned i = 0; i < len; i++) {
+        char c = text[i];
+        if (c == '\r')
+            continue;
+        if (s_line_len == 0)
+            s_line_us = t_us;
+        if (c != '\n' && s_line_len < sizeof(s_line) - 1) {
+            s_line[s_line_len++] = c;
+            continue;
+        }
+        if (c != '\n')
+            continue;
+
+        s_line[s_line_len] = '\0';
+        s_line_len = 0;
+        if (!s_text)
+            continue;
+        Event e = { .type = EvText, .t_us = s_line_us, .text = strdup(s_line) };
+        add_event(&e);
+    }
+}
+
+static void
+frame(const SniffFrameView *v)
+{
+    uint64_t t0 = unwrap(v->t_us);
+    uint16_t pos = 0;
+    Event e = { .stream = v->stream, .t_us = t0 };
+
+    switch (v->kind) {
+    case SniffFrameBytes: {
+        uint32_t t = v->t_us;
+        e.type = EvByte;
+        while (sniff_frame_next_byte(v, &pos, &t, &e.byte, &e.err)) {
+            e.t_us = t0 + (t - v->t_us);
+            add_event(&e);
+        }
+        break;
+    }
+    case SniffFrameText:
+        add_text(v->body, v->body_len, t0);
+        break;
+    case SniffFrameLost:
+        e.type = EvLost;
+        sniff_frame_get_varint(v->body, v->body_len, &pos, &e.value);
+        add_event(&e);
+        break;
+    case SniffFrameInfo:
+        e.type = EvInfo;
+        if (sniff_frame_get_varint(v->body, v->body_len, &pos, &e.value) && v->body_len - pos >= 4) {
+            memcpy(e.info, v->body + pos, 4);
+            add_event(&e);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static int
+by_time(const void *a, const void *b)
+{
+    const Event *ea = a, *eb = b;
+    if (ea->t_us != eb->t_us)
+        return ea->t_us < eb->t_us ? -1 : 1;
+    return ea->seq < eb->seq ? -1 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-f"))
+            s_follow = true;
+        else if (!strcmp(argv[i], "--apollo"))
+            s_apollo = true;
+        else if (!strcmp(argv[i], "--no-text"))
+            s_text = false;
+        else if (argv[i][0] == '-' && argv[i][1]) {
+            fprintf(stderr, "usage: sniff_decode [-f] [--apollo] [--no-text] [capture]\n");
+            return 2;
+        } else
+            path = argv[i];
+    }
+
+    FILE *f = path ? fopen(path, "rb") : stdin;
+    if (!f) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+
+    for (int ch = 0; ch < 2; ch++)
+        apollo_cmd_init(&s_apollo_cmd[ch], NULL);
+
+    SniffDecoder d;
+    sniff_decoder_init(&d);
+    uint8_t buf[4096];
+    size_t n;
+    // unbuffered when following, so a frame is printed as soon as it's in
+    while ((n = s_follow ? fread(buf, 1, 1, f) : fread(buf, 1, sizeof(buf), f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            SniffFrameView v;
+            if (sniff_decoder_push(&d, buf[i], &v))
+                frame(&v);
+        }
+    }
+
+    if (!s_follow) {
+        qsort(s_events, s_event_count, sizeof(Event), by_time);
+        for (uint32_t i = 0; i < s_event_count; i++) {
+            print_event(&s_events[i]);
+            free(s_events[i].text);
+        }
+    }
+
+    fprintf(stderr, "%u frames, %u bad\n", d.frames, d.bad);
+    return 0;
+}
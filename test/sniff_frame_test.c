@@ -0,0 +1,340 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The line sniffer's framing in src/sniff_frame.c: captures encoded the
+ * way sniff.c does and decoded the way test/sniff_decode does, including
+ * a stream picked up halfway and frames lost or torn on the way.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "check.h"
+#include "sniff_frame.h"
+
+typedef struct {
+    uint8_t stream;
+    uint8_t byte;
+    uint8_t err;
+    uint32_t t_us;
+} Entry;
+
+#define MAX_ENTRIES 4096
+#define MAX_WIRE (MAX_ENTRIES * 16)
+
+// a capture on its way to the PC
+typedef struct {
+    uint8_t wire[MAX_WIRE];
+    unsigned len;
+    unsigned frames;
+} Wire;
+
+static void
+wire_frame(Wire *w, const SniffFrame *f)
+{
+    uint8_t out[SNIFF_FRAME_WIRE_MAX];
+    uint16_t n = sniff_frame_finish(f, out);
+    CHECK(n <= SNIFF_FRAME_WIRE_MAX, "frame of %u bytes on the wire", n);
+    CHECK(out[n - 1] == 0x00 && !memchr(out, 0x00, n - 1), "zero inside a frame");
+    memcpy(w->wire + w->len, out, n);
+    w->len += n;
+    w->frames++;
+}
+
+// as sniff.c's stream_add(), with every stream's frame flushed at the end
+static void
+encode(Wire *w, const Entry *e, unsigned count)
+{
+    SniffFrame frames[SNIFF_STREAMS];
+    bool open[SNIFF_STREAMS] = { false };
+
+    for (unsigned i = 0; i < count; i++) {
+        SniffFrame *f = &frames[e[i].stream];
+        if (open[e[i].stream] && sniff_frame_add_byte(f, e[i].byte, e[i].err, e[i].t_us))
+            continue;
+        if (open[e[i].stream])
+            wire_frame(w, f);
+        sniff_frame_begin(f, SniffFrameBytes, e[i].stream, e[i].t_us);
+        CHECK(sniff_frame_add_byte(f, e[i].byte, e[i].err, e[i].t_us), "first byte of a frame refused");
+        open[e[i].stream] = true;
+    }
+    for (int s = 0; s < SNIFF_STREAMS; s++) {
+        if (open[s])
+            wire_frame(w, &frames[s]);
+    }
+}
+
+// everything the decoder gets out of the wire, by stream in arrival order
+static unsigned
+decode(const uint8_t *wire, unsigned len, Entry *out, unsigned max, SniffDecoder *d)
+{
+    unsigned n = 0;
+    sniff_decoder_init(d);
+    for (unsigned i = 0; i < len; i++) {
+        SniffFrameView v;
+        if (!sniff_decoder_push(d, wire[i], &v))
+            continue;
+        CHECK(v.kind == SniffFrameBytes, "frame kind %d", v.kind);
+        uint16_t pos = 0;
+        uint32_t t = v.t_us;
+        Entry e = { .stream = v.stream };
+        while (n < max && sniff_frame_next_byte(&v, &pos, &t, &e.byte, &e.err)) {
+            e.t_us = t;
+            out[n++] = e;
+        }
+        CHECK(pos == v.body_len, "frame body left over: %u of %u", pos, v.body_len);
+    }
+    return n;
+}
+
+// the entries of one stream, in order
+static unsigned
+only_stream(const Entry *in, unsigned count, uint8_t stream, Entry *out)
+{
+    unsigned n = 0;
+    for (unsigned i = 0; i < count; i++) {
+        if (in[i].stream == stream)
+            out[n++] = in[i];
+    }
+    return n;
+}
+
+static bool
+same_entries(const Entry *a, const Entry *b, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++) {
+        if (a[i].stream != b[i].stream || a[i].byte != b[i].byte || a[i].err != b[i].err || a[i].t_us != b[i].t_us) {
+            printf("  entry %u: %u %02x %x %u vs %u %02x %x %u\n", i, a[i].stream, a[i].byte, a[i].err, a[i].t_us,
+                   b[i].stream, b[i].byte, b[i].err, b[i].t_us);
+            return false;
+        }
+    }
+    return true;
+}
+
+static Entry s_in[MAX_ENTRIES], s_out[MAX_ENTRIES], s_a[MAX_ENTRIES], s_b[MAX_ENTRIES];
+static Wire s_wire;
+
+static void
+check_roundtrip(const char *name, unsigned count)
+{
+    s_wire.len = s_wire.frames = 0;
+    encode(&s_wire, s_in, count);
+
+    SniffDecoder d;
+    unsigned n = decode(s_wire.wire, s_wire.len, s_out, MAX_ENTRIES, &d);
+    CHECK(n == count, "%s: %u entries back of %u", name, n, count);
+    CHECK(d.bad == 0 && d.frames == s_wire.frames, "%s: %u frames, %u bad, %u sent", name, d.frames, d.bad, s_wire.frames);
+
+    for (uint8_t s = 0; s < SNIFF_STREAMS; s++) {
+        unsigned na = only_stream(s_in, count, s, s_a);
+        unsigned nb = only_stream(s_out, n, s, s_b);
+        CHECK(na == nb && same_entries(s_a, s_b, na), "%s: stream %u differs", name, s);
+    }
+}
+
+static void
+test_roundtrip(void)
+{
+    srand(1);
+
+    // a busy 1200 baud line, both ways on both channels, with errors and
+    // every byte value
+    uint32_t t = 0xfff00000u;       // wraps partway through
+    for (unsigned i = 0; i < MAX_ENTRIES; i++) {
+        t += 8333 + rand() % 200;
+        s_in[i].stream = rand() % SNIFF_STREAMS;
+        s_in[i].byte = i;
+        s_in[i].err = rand() % 16 == 0 ? 1 + rand() % 15 : 0;
+        s_in[i].t_us = t;
+    }
+    check_roundtrip("busy", MAX_ENTRIES);
+
+    // gaps of every size, up to well past what a frame can hold
+    t = 0;
+    for (unsigned i = 0; i < 200; i++) {
+        static const uint32_t gaps[] = { 0, 1, 63, 64, 127, 128, 8333, SNIFF_FRAME_MAX_DELTA_US - 1,
+                                         SNIFF_FRAME_MAX_DELTA_US, 0x7fffffff, 0x80000001 };
+        t += gaps[i % (sizeof(gaps) / sizeof(gaps[0]))];
+        s_in[i] = (Entry) { .stream = 0, .byte = 0, .err = i % 3 ? 0 : SNIFF_ERR_BREAK, .t_us = t };
+    }
+    check_roundtrip("gaps", 200);
+}
+
+// What a byte costs on a busy line, for the bandwidth the CDC needs: the
+// 12 Mbit USB has room, the point is not to wake the PC a frame per byte.
+static void
+test_density(void)
+{
+    static const struct { uint32_t byte_us; unsigned per_byte; } lines[] = {
+        { 9167, 4 },        // 1200 8E1
+        { 96, 3 },          // 115200 8N1
+    };
+    for (unsigned l = 0; l < 2; l++) {
+        for (unsigned i = 0; i < 1000; i++)
+            s_in[i] = (Entry) { .stream = 0, .byte = 0x55, .t_us = 1000 + i * lines[l].byte_us };
+        s_wire.len = s_wire.frames = 0;
+        encode(&s_wire, s_in, 1000);
+        unsigned per_kb = s_wire.len;
+        CHECK(per_kb <= 1000 * lines[l].per_byte * 110 / 100, "%u us bytes: %u bytes on the wire for 1000",
+              lines[l].byte_us, per_kb);
+        CHECK(s_wire.frames <= 1000 * lines[l].per_byte / (SNIFF_FRAME_MAX - 10) + 1, "%u frames", s_wire.frames);
+    }
+}
+
+// A stream picked up mid-frame, frames torn or lost to a full CDC buffer
+// and line noise: everything after the next delimiter is still read.
+static void
+test_resync(void)
+{
+    for (unsigned i = 0; i < 300; i++)
+        s_in[i] = (Entry) { .stream = i % 2, .byte = i, .t_us = i * 1000 };
+    s_wire.len = s_wire.frames = 0;
+    encode(&s_wire, s_in, 300);
+
+    SniffDecoder d;
+    Entry *all = s_b;
+    unsigned full = decode(s_wire.wire, s_wire.len, all, MAX_ENTRIES, &d);
+    CHECK(full == 300, "%u entries", full);
+
+    // starting 5 bytes in: the first frame is gone, no more
+    unsigned first_len = (uint8_t *) memchr(s_wire.wire, 0, s_wire.len) - s_wire.wire + 1;
+    unsigned n = decode(s_wire.wire + 5, s_wire.len - 5, s_out, MAX_ENTRIES, &d);
+    CHECK(d.bad == 1 && d.frames == s_wire.frames - 1, "mid-frame start: %u frames, %u bad", d.frames, d.bad);
+    SniffDecoder d0;
+    unsigned n_first = decode(s_wire.wire, first_len, s_a, MAX_ENTRIES, &d0);
+    CHECK(n == full - n_first && same_entries(s_out, all + n_first, n), "mid-frame start: %u of %u", n, full);
+
+    // the tail of the second frame lost: it and the one it runs into
+    uint8_t *second = s_wire.wire + first_len;
+    unsigned second_len = (uint8_t *) memchr(second, 0, s_wire.len - first_len) - second + 1;
+    static uint8_t torn[MAX_WIRE];
+    memcpy(torn, s_wire.wire, first_len + 4);
+    memcpy(torn + first_len + 4, second + second_len, s_wire.len - first_len - second_len);
+    unsigned torn_len = s_wire.len - second_len + 4;
+    n = decode(torn, torn_len, s_out, MAX_ENTRIES, &d);
+    CHECK(d.frames == s_wire.frames - 2 && d.bad == 1, "torn frame: %u frames of %u, %u bad", d.frames, s_wire.frames, d.bad);
+
+    // noise without delimiters, longer than any frame: dropped as one
+    static uint8_t noisy[MAX_WIRE];
+    memset(noisy, 0x41, 500);
+    memcpy(noisy + 500, s_wire.wire, s_wire.len);
+    n = decode(noisy, s_wire.len + 500, s_out, MAX_ENTRIES, &d);
+    CHECK(d.bad == 1 && n == 300 - n_first, "noise: %u bad, %u entries", d.bad, n);
+    (void) n;
+
+    // empty frames between delimiters are skipped, not counted
+    uint8_t zeros[4] = { 0 };
+    n = decode(zeros, sizeof(zeros), s_out, MAX_ENTRIES, &d);
+    CHECK(n == 0 && d.bad == 0 && d.frames == 0, "zeros");
+}
+
+static void
+test_other_kinds(void)
+{
+    SniffFrame f;
+    Wire w = { .len = 0 };
+
+    // zeros everywhere: in the time, and in the text
+    sniff_frame_begin(&f, SniffFrameText, 0, 0);
+    static const char text[] = "(sniff:0) hello\0world\r\n";
+    CHECK(sniff_frame_add(&f, text, sizeof(text) - 1) == sizeof(text) - 1, "text refused");
+    wire_frame(&w, &f);
+
+    // too much text: as much as fits, and the caller sends the rest
+    static char longtext[300];
+    memset(longtext, 'x', sizeof(longtext));
+    sniff_frame_begin(&f, SniffFrameText, 0, 0x80);
+    uint16_t took = sniff_frame_add(&f, longtext, sizeof(longtext));
+    CHECK(took == SNIFF_FRAME_MAX - 4 && f.len == SNIFF_FRAME_MAX - 1, "took %u of a long text", took);
+    wire_frame(&w, &f);
+
+    sniff_frame_begin(&f, SniffFrameLost, SNIFF_STREAM(1, false), 0xffffffff);
+    sniff_frame_add_varint(&f, 123456);
+    wire_frame(&w, &f);
+
+    sniff_frame_begin(&f, SniffFrameInfo, SNIFF_STREAM(0, true), 1);
+    sniff_frame_add_varint(&f, 1200);
+    uint8_t fmt[] = { 8, 2, 1, SNIFF_INFO_CAPTURE | SNIFF_INFO_BRIDGE };
+    sniff_frame_add(&f, fmt, sizeof(fmt));
+    wire_frame(&w, &f);
+
+    SniffDecoder d;
+    sniff_decoder_init(&d);
+    SniffFrameView v[4];
+    unsigned n = 0;
+    for (unsigned i = 0; i < w.len && n < 4; i++) {
+        if (sniff_decoder_push(&d, w.wire[i], &v[n])) {
+            // the view points into the decoder; keep a copy of the body
+            static uint8_t bodies[4][SNIFF_FRAME_MAX];
+            memcpy(bodies[n], v[n].body, v[n].body_len);
+            v[n].body = bodies[n];
+            n++;
+        }
+    }
+    CHECK(n == 4 && d.bad == 0, "%u frames, %u bad", n, d.bad);
+    if (n != 4)
+        return;
+
+    CHECK(v[0].kind == SniffFrameText && v[0].t_us == 0 && v[0].body_len == sizeof(text) - 1 &&
+          !memcmp(v[0].body, text, sizeof(text) - 1), "text frame");
+    CHECK(v[1].kind == SniffFrameText && v[1].t_us == 0x80 && v[1].body_len == took, "long text frame");
+
+    uint16_t pos = 0;
+    uint32_t lost = 0;
+    CHECK(v[2].kind == SniffFrameLost && v[2].stream == 1 && v[2].t_us == 0xffffffff &&
+          sniff_frame_get_varint(v[2].body, v[2].body_len, &pos, &lost) && lost == 123456, "lost frame");
+
+    pos = 0;
+    uint32_t baud = 0;
+    CHECK(v[3].kind == SniffFrameInfo && SNIFF_STREAM_TX(v[3].stream) && SNIFF_STREAM_CH(v[3].stream) == 0 &&
+          sniff_frame_get_varint(v[3].body, v[3].body_len, &pos, &baud) && baud == 1200 &&
+          v[3].body_len - pos == 4 && !memcmp(v[3].body + pos, fmt, 4), "info frame");
+
+    // varints off the end
+    static const uint8_t runs_off[] = { 0x80, 0x80 };
+    pos = 0;
+    CHECK(!sniff_frame_get_varint(runs_off, sizeof(runs_off), &pos, &lost), "unterminated varint");
+    static const uint8_t too_long[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 };
+    pos = 0;
+    CHECK(!sniff_frame_get_varint(too_long, sizeof(too_long), &pos, &lost), "six byte varint");
+}
+
+// TX stamps are chan_uart's estimates and can land a little before the
+// stream's last one; they're held at it rather than starting a frame.
+static void
+test_out_of_order(void)
+{
+    SniffFrame f;
+    sniff_frame_begin(&f, SniffFrameBytes, SNIFF_STREAM(0, true), 10000);
+    CHECK(sniff_frame_add_byte(&f, 1, 0, 10000), "first");
+    CHECK(sniff_frame_add_byte(&f, 2, 0, 9990), "10 us early");
+    CHECK(!sniff_frame_add_byte(&f, 3, 0, 10000 - SNIFF_FRAME_MAX_DELTA_US), "a long way back");
+    CHECK(f.entries == 2 && f.last_us == 10000, "%u entries, last %u", f.entries, f.last_us);
+
+    // filling up: refused before running over, never after
+    sniff_frame_begin(&f, SniffFrameBytes, 0, 0);
+    unsigned n = 0;
+    while (sniff_frame_add_byte(&f, 0xff, SNIFF_ERR_OVERRUN, n * 0x100000))
+        n++;
+    CHECK(f.len <= SNIFF_FRAME_MAX && n >= (SNIFF_FRAME_MAX - 6) / 6, "%u entries, %u bytes", n, f.len);
+}
+
+int main(void)
+{
+    test_roundtrip();
+    test_density();
+    test_resync();
+    test_other_kinds();
+    test_out_of_order();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
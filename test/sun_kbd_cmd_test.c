@@ -0,0 +1,236 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * The Sun keyboard command parser in src/sun_kbd_cmd.c, fed command
+ * streams a byte at a time the way the RX interrupt sees them.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "check.h"
+#include "sun_kbd_cmd.h"
+
+// Everything a stream did, in order
+typedef struct {
+    uint8_t replies[64];
+    unsigned reply_len;
+    uint8_t actions;            // all of them, or'd
+    unsigned leds_count;
+    uint8_t last_leds;
+    unsigned bell_count;
+    unsigned resets;
+} Outcome;
+
+// bytes 1 ms apart, as at 1200 baud they'd be ~8 ms apart anyway
+static void
+feed(SunKbdCmd *s, const uint8_t *bytes, unsigned len, uint32_t *now, Outcome *o)
+{
+    for (unsigned i = 0; i < len; i++) {
+        SunCmdResult res;
+        sun_kbd_cmd_feed(s, bytes[i], *now, &res);
+        *now += 1000;
+
+        o->actions |= res.actions;
+        if (res.actions & SunCmdActReply) {
+            CHECK(res.reply_len > 0 && res.reply_len <= SUN_CMD_MAX_REPLY, "reply length %u", res.reply_len);
+            memcpy(o->replies + o->reply_len, res.reply, res.reply_len);
+            o->reply_len += res.reply_len;
+        } else {
+            CHECK(res.reply_len == 0, "reply length %u without SunCmdActReply", res.reply_len);
+        }
+        if (res.actions & SunCmdActLeds) {
+            o->leds_count++;
+            o->last_leds = s->leds;
+        }
+        if (res.actions & SunCmdActBell)
+            o->bell_count++;
+        if (res.actions & SunCmdActReset)
+            o->resets++;
+    }
+}
+
+static bool
+replies_are(const Outcome *o, const uint8_t *want, unsigned len)
+{
+    return o->reply_len == len && memcmp(o->replies, want, len) == 0;
+}
+
+static void
+test_reset_and_layout(void)
+{
+    SunKbdCmd s;
+    sun_kbd_cmd_init(&s, SUN_LAYOUT_US4);
+    uint32_t now = 0;
+    Outcome o = { 0 };
+
+    static const uint8_t in[] = { SUN_CMD_RESET, SUN_CMD_LAYOUT };
+    feed(&s, in, sizeof(in), &now, &o);
+
+    static const uint8_t want[] = { 0xff, 0x04, 0x7f, 0xfe, 0x00 };
+    CHECK(replies_are(&o, want, sizeof(want)), "reset + layout replies (%u bytes)", o.reply_len);
+    CHECK(o.resets == 1, "%u resets", o.resets);
+    CHECK(s.commands == 2 && s.unknown == 0, "%u commands, %u unknown", s.commands, s.unknown);
+
+    // a type 5 answers with its own layout
+    sun_kbd_cmd_init(&s, 0x21);
+    memset(&o, 0, sizeof(o));
+    feed(&s, &in[1], 1, &now, &o);
+    static const uint8_t want5[] = { 0xfe, 0x21 };
+    CHECK(replies_are(&o, want5, sizeof(want5)), "type 5 layout reply");
+}
+
+static void
+test_bell_click(void)
+{
+    SunKbdCmd s;
+    sun_kbd_cmd_init(&s, SUN_LAYOUT_US4);
+    uint32_t now = 0;
+    Outcome o = { 0 };
+
+    uint8_t b = SUN_CMD_BELL_ON;
+    feed(&s, &b, 1, &now, &o);
+    CHECK(s.bell && o.bell_count == 1, "bell on");
+    b = SUN_CMD_CLICK_ON;
+    feed(&s, &b, 1, &now, &o);
+    CHECK(s.click && s.bell, "click on, bell still on");
+    b = SUN_CMD_BELL_OFF;
+    feed(&s, &b, 1, &now, &o);
+    CHECK(!s.bell && s.click, "bell off, click still on");
+    b = SUN_CMD_CLICK_OFF;
+    feed(&s, &b, 1, &now, &o);
+    CHECK(!s.click, "click off");
+    CHECK(o.reply_len == 0, "bell and click don't answer");
+
+    // reset silences the bell
+    static const uint8_t in[] = { SUN_CMD_BELL_ON, SUN_CMD_RESET };
+    memset(&o, 0, sizeof(o));
+    feed(&s, in, sizeof(in), &now, &o);
+    CHECK(!s.bell && o.bell_count == 2, "bell after reset %d, %u bell actions", s.bell, o.bell_count);
+}
+
+static void
+test_leds(void)
+{
+    SunKbdCmd s;
+    sun_kbd_cmd_init(&s, SUN_LAYOUT_US4);
+    uint32_t now = 0;
+    Outcome o = { 0 };
+
+    // the LED byte is taken as an argument even when it looks like a
+    // command, and doesn't count as one
+    static const uint8_t in[] = { SUN_CMD_LED, SUN_CMD_RESET, SUN_CMD_LED, SUN_LED_CAPS_LOCK | SUN_LED_NUM_LOCK };
+    feed(&s, in, sizeof(in), &now, &o);
+    CHECK(o.leds_count == 2, "%u LED updates", o.leds_count);
+    CHECK(o.last_leds == (SUN_LED_CAPS_LOCK | SUN_LED_NUM_LOCK), "leds 0x%02x", o.last_leds);
+    CHECK(o.reply_len == 0 && o.resets == 0, "LED argument 0x01 taken as a reset");
+    CHECK(s.commands == 2, "%u commands", s.commands);
+
+    // split across interrupts: one byte each, with the parser holding
+    // the state in between
+    memset(&o, 0, sizeof(o));
+    uint8_t b = SUN_CMD_LED;
+    feed(&s, &b, 1, &now, &o);
+    CHECK(o.actions == 0, "0x0e alone does nothing yet (0x%02x)", o.actions);
+    now += 8000;
+    b = SUN_LED_SCROLL_LOCK;
+    feed(&s, &b, 1, &now, &o);
+    CHECK(o.leds_count == 1 && s.leds == SUN_LED_SCROLL_LOCK, "late-ish LED byte");
+
+    // one that never comes: the next byte, well after, is a command
+    memset(&o, 0, sizeof(o));
+    b = SUN_CMD_LED;
+    feed(&s, &b, 1, &now, &o);
+    now += SUN_CMD_ARG_TIMEOUT_US;
+    b = SUN_CMD_LAYOUT;
+    feed(&s, &b, 1, &now, &o);
+    CHECK(o.leds_count == 0 && o.reply_len == 2 && o.replies[0] == SUN_RESP_LAYOUT,
+          "layout after an abandoned LED command: %u LED updates, %u reply bytes", o.leds_count, o.reply_len);
+    CHECK(s.arg_timeouts == 1 && s.leds == SUN_LED_SCROLL_LOCK, "%u timeouts, leds 0x%02x", s.arg_timeouts, s.leds);
+
+    // the timeout survives time_us_32() wrapping
+    now = 0xffffff00u;
+    memset(&o, 0, sizeof(o));
+    static const uint8_t wrap[] = { SUN_CMD_LED, SUN_LED_COMPOSE };
+    feed(&s, wrap, sizeof(wrap), &now, &o);
+    CHECK(o.leds_count == 1 && s.leds == SUN_LED_COMPOSE, "LED command across the clock wrap");
+}
+
+static void
+test_unknown(void)
+{
+    SunKbdCmd s;
+    sun_kbd_cmd_init(&s, SUN_LAYOUT_US4);
+    uint32_t now = 0;
+    Outcome o = { 0 };
+
+    // line noise, and the keyboard's own codes echoed back
+    static const uint8_t in[] = { 0x00, 0x7f, 0xff, 0x55, SUN_CMD_LAYOUT, 0x80 };
+    feed(&s, in, sizeof(in), &now, &o);
+    CHECK(s.unknown == 5 && s.commands == 1, "%u unknown, %u commands", s.unknown, s.commands);
+    CHECK(o.reply_len == 2 && o.actions == SunCmdActReply, "only the layout is answered");
+}
+
+// Every possible two-byte stream: each byte gives at most one reply, and
+// the parser never waits for more than one argument byte.
+static void
+test_all_pairs(void)
+{
+    unsigned max_pending = 0;
+
+    for (unsigned a = 0; a < 256; a++) {
+        for (unsigned b = 0; b < 256; b++) {
+            SunKbdCmd s;
+            sun_kbd_cmd_init(&s, SUN_LAYOUT_US4);
+            uint32_t now = 0;
+            Outcome o = { 0 };
+            uint8_t in[] = { a, b };
+            feed(&s, in, 2, &now, &o);
+            CHECK(o.reply_len <= 2 * SUN_CMD_MAX_REPLY, "%02x %02x: %u reply bytes", a, b, o.reply_len);
+
+            // after any pair, a reset is always recognized, unless it's
+            // an LED argument
+            Outcome r = { 0 };
+            uint8_t reset = SUN_CMD_RESET;
+            bool pending = s.want_led_arg;
+            feed(&s, &reset, 1, &now, &r);
+            if (pending) {
+                max_pending = 1;
+                CHECK(r.resets == 0 && r.leds_count == 1, "%02x %02x 01: reset as LED argument", a, b);
+            } else {
+                CHECK(r.resets == 1, "%02x %02x 01: reset not recognized", a, b);
+            }
+        }
+    }
+    CHECK(max_pending == 1, "never waited on an LED byte");
+}
+
+static void
+test_led_map(void)
+{
+    CHECK(sun_kbd_leds_to_hid(0) == 0, "no LEDs");
+    CHECK(sun_kbd_leds_to_hid(SUN_LED_NUM_LOCK) == 0x01, "num lock");
+    CHECK(sun_kbd_leds_to_hid(SUN_LED_CAPS_LOCK) == 0x02, "caps lock");
+    CHECK(sun_kbd_leds_to_hid(SUN_LED_SCROLL_LOCK) == 0x04, "scroll lock");
+    CHECK(sun_kbd_leds_to_hid(SUN_LED_COMPOSE) == 0x08, "compose");
+    CHECK(sun_kbd_leds_to_hid(0xff) == 0x0f, "unused Sun bits dropped: 0x%02x", sun_kbd_leds_to_hid(0xff));
+}
+
+int main(void)
+{
+    test_reset_and_layout();
+    test_bell_click();
+    test_leds();
+    test_unknown();
+    test_all_pairs();
+    test_led_map();
+
+    if (s_failures) {
+        printf("%d failure(s)\n", s_failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,603 @@
+/*
+ * Babelfish
+ *
+ * Copyright (C) 2023 Vladimir Vukicevic
+ *
+ * Wire-level timing simulator for the serial host links. Runs the real
+ * host backend code (host_sun*.c, host_apollo*.c) against the virtual
+ * UARTs in line_sim.c, driven by a simple model of mainloop(): every
+ * loop period, queued input events are handed to the host and then
+ * host->update() runs. Reports line utilization, how long each key event
+ * waits before (and until) its bytes are on the wire, and mouse report
+ * latency; --sweep ramps synthetic typing until the line can't keep up.
+ *
+ * Usage: wire_sim [options] <host> [trace]
+ *
+ *   host          sun, apollo or apollo_dn300
+ *   --baud N      override the baud rate the backend configures
+ *   --format 8E1  override data bits, parity and stop bits
+ *   --loop-us N   mainloop period in us (default 100)
+ *   --send HEX..  bytes the host computer sends at t=0, e.g. "ff 01"
+ *   --sweep       ramp typing rate and report where it exceeds the line
+ *   -v            print every byte on the wire
+ *
+ * Trace format, one event per line, times in ms from the start:
+ *
+ *   <ms> key <hid keycode> down|up
+ *   <ms> tap <hid keycode>          down, then up 30ms later
+ *   <ms> mouse <dx> <dy> [buttons]
+ *   <ms> send <hex bytes...>        from the host computer to us
+ *   <ms> end                        keep running until this time
+ *
+ * Blank lines and lines starting with '#' are ignored.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#include "babelfish.h"
+
+#include "line_sim.h"
+
+HOST_PROTOTYPES(sun);
+HOST_PROTOTYPES(apollo);
+HOST_PROTOTYPES(apollo_dn300);
+
+static HostDevice sim_hosts[] = {
+    HOST_ENTRY(sun, "Sun: keyboard on uart0, mouse on uart1"),
+    HOST_ENTRY(apollo, "Apollo: keyboard and mouse on uart0"),
+    HOST_ENTRY(apollo_dn300, "Apollo DN300: keyboard on uart0"),
+    { { 0 } }
+};
+
+typedef enum {
+    TraceKey,
+    TraceMouse,
+    TraceSend,
+    TraceEnd,
+} TraceType;
+
+typedef struct {
+    uint64_t at_ns;
+    TraceType type;
+    KeyboardEvent key;
+    MouseEvent mouse;
+    uint8_t bytes[16];
+    unsigned byte_count;
+} TraceEvent;
+
+typedef struct {
+    TraceEvent *events;
+    unsigned count;
+    unsigned cap;
+} Trace;
+
+typedef struct {
+    uint64_t *v;
+    unsigned count;
+    unsigned cap;
+} Samples;
+
+static HostDevice *s_host = NULL;
+static uint64_t s_loop_ns = 100000;
+static bool s_verbose = false;
+
+//
+// trace handling
+//
+
+static TraceEvent *trace_add(Trace *t, uint64_t at_ns, TraceType type)
+{
+    if (t->count == t->cap) {
+        t->cap = t->cap ? t->cap * 2 : 256;
+        t->events = realloc(t->events, t->cap * sizeof(TraceEvent));
+    }
+    TraceEvent *ev = &t->events[t->count++];
+    memset(ev, 0, sizeof(*ev));
+    ev->at_ns = at_ns;
+    ev->type = type;
+    return ev;
+}
+
+static void trace_add_key(Trace *t, uint64_t at_ns, uint8_t keycode, bool down)
+{
+    TraceEvent *ev = trace_add(t, at_ns, TraceKey);
+    ev->key.keycode = keycode;
+    ev->key.down = down;
+}
+
+static int trace_cmp(const void *a, const void *b)
+{
+    const TraceEvent *x = a, *y = b;
+    if (x->at_ns != y->at_ns)
+        return x->at_ns < y->at_ns ? -1 : 1;
+    return 0;
+}
+
+static unsigned parse_hex_bytes(char *s, uint8_t *out, unsigned max)
+{
+    unsigned n = 0;
+    char *tok = strtok(s, " \t\r\n,");
+    while (tok && n < max) {
+        out[n++] = (uint8_t) strtoul(tok, NULL, 16);
+        tok = strtok(NULL, " \t\r\n,");
+    }
+    return n;
+}
+
+static bool trace_load(Trace *t, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+
+    char line[256];
+    unsigned lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+            continue;
+
+        double ms;
+        char what[16];
+        int used = 0;
+        if (sscanf(p, "%lf %15s %n", &ms, what, &used) < 2) {
+            fprintf(stderr, "%s:%u: can't parse '%s'\n", path, lineno, p);
+            fclose(f);
+            return false;
+        }
+        uint64_t at_ns = (uint64_t) (ms * 1000000.0);
+        char *rest = p + used;
+
+        if (strcmp(what, "key") == 0) {
+            unsigned code;
+            char dir[8];
+            if (sscanf(rest, "%x %7s", &code, dir) != 2)
+                goto bad;
+            trace_add_key(t, at_ns, (uint8_t) code, strcmp(dir, "down") == 0);
+        } else if (strcmp(what, "tap") == 0) {
+            unsigned code;
+            if (sscanf(rest, "%x", &code) != 1)
+                goto bad;
+            trace_add_key(t, at_ns, (uint8_t) code, true);
+            trace_add_key(t, at_ns + 30000000, (uint8_t) code, false);
+        } else if (strcmp(what, "mouse") == 0) {
+            int dx, dy;
+            unsigned buttons = 0;
+            if (sscanf(rest, "%d %d %x", &dx, &dy, &buttons) < 2)
+                goto bad;
+            TraceEvent *ev = trace_add(t, at_ns, TraceMouse);
+            ev->mouse.dx = (int16_t) dx;
+            ev->mouse.dy = (int16_t) dy;
+            ev->mouse.buttons = (uint8_t) buttons;
+        } else if (strcmp(what, "send") == 0) {
+            TraceEvent *ev = trace_add(t, at_ns, TraceSend);
+            ev->byte_count = parse_hex_bytes(rest, ev->bytes, sizeof(ev->bytes));
+        } else if (strcmp(what, "end") == 0) {
+            trace_add(t, at_ns, TraceEnd);
+        } else {
+            goto bad;
+        }
+        continue;
+
+    bad:
+        fprintf(stderr, "%s:%u: bad event '%s'\n", path, lineno, p);
+        fclose(f);
+        return false;
+    }
+
+    fclose(f);
+    qsort(t->events, t->count, sizeof(TraceEvent), trace_cmp);
+    return true;
+}
+
+//
+// stats
+//
+
+static void samples_add(Samples *s, uint64_t v)
+{
+    if (s->count == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 256;
+        s->v = realloc(s->v, s->cap * sizeof(uint64_t));
+    }
+    s->v[s->count++] = v;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void samples_print(const char *name, Samples *s)
+{
+    if (s->count == 0) {
+        printf("  %-22s  (none)\n", name);
+        return;
+    }
+    qsort(s->v, s->count, sizeof(uint64_t), u64_cmp);
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < s->count; i++)
+        sum += s->v[i];
+    printf("  %-22s  n=%-5u avg %8.2f  p50 %8.2f  p99 %8.2f  max %8.2f ms\n", name, s->count,
+            sum / (double) s->count / 1e6, s->v[s->count / 2] / 1e6,
+            s->v[(s->count * 99) / 100] / 1e6, s->v[s->count - 1] / 1e6);
+}
+
+typedef struct {
+    Samples key_queue;      // key event -> its first byte starts on the wire
+    Samples key_done;       // key event -> its last byte is at the host
+    Samples mouse_done;     // oldest unreported motion -> report at the host
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t last_input_ns;
+} RunStats;
+
+static void run_stats_free(RunStats *r)
+{
+    free(r->key_queue.v);
+    free(r->key_done.v);
+    free(r->mouse_done.v);
+    memset(r, 0, sizeof(*r));
+}
+
+//
+// simulation
+//
+
+static void snapshot_tx(unsigned counts[LINE_SIM_NUM_UARTS])
+{
+    for (unsigned i = 0; i < LINE_SIM_NUM_UARTS; i++)
+        line_sim_tx_log(i, &counts[i]);
+}
+
+// bytes sent on any line since 'before'; returns false if none
+static bool tx_since(const unsigned before[LINE_SIM_NUM_UARTS], uint64_t *first_start, uint64_t *last_end)
+{
+    bool any = false;
+    for (unsigned i = 0; i < LINE_SIM_NUM_UARTS; i++) {
+        unsigned count;
+        const LineByte *log = line_sim_tx_log(i, &count);
+        if (count == before[i])
+            continue;
+        if (!any || log[before[i]].start_ns < *first_start)
+            *first_start = log[before[i]].start_ns;
+        if (!any || log[count - 1].end_ns > *last_end)
+            *last_end = log[count - 1].end_ns;
+        any = true;
+    }
+    return any;
+}
+
+static void run(const Trace *t, RunStats *r)
+{
+    uint64_t t0 = line_sim_now_ns();
+    unsigned next = 0;
+    uint64_t mouse_pending_since = 0;
+    bool mouse_pending = false;
+    uint64_t end_ns = t0;
+
+    for (unsigned i = 0; i < t->count; i++) {
+        if (t0 + t->events[i].at_ns > end_ns)
+            end_ns = t0 + t->events[i].at_ns;
+    }
+    r->start_ns = t0;
+    r->last_input_ns = end_ns;
+
+    // keep going until the input is done and the lines have drained
+    for (;;) {
+        uint64_t now = line_sim_now_ns();
+
+        for (; next < t->count && t0 + t->events[next].at_ns <= now; next++) {
+            const TraceEvent *ev = &t->events[next];
+            uint64_t at = t0 + ev->at_ns;
+            unsigned before[LINE_SIM_NUM_UARTS];
+            uint64_t first, last;
+
+            switch (ev->type) {
+            case TraceKey:
+                snapshot_tx(before);
+                s_host->kbd_event(ev->key);
+                if (tx_since(before, &first, &last)) {
+                    samples_add(&r->key_queue, first - at);
+                    samples_add(&r->key_done, last - at);
+                }
+                break;
+            case TraceMouse:
+                if (!mouse_pending) {
+                    mouse_pending = true;
+                    mouse_pending_since = at;
+                }
+                s_host->mouse_event(ev->mouse);
+                break;
+            case TraceSend:
+                line_sim_host_send(0, ev->bytes, ev->byte_count);
+                break;
+            case TraceEnd:
+                break;
+            }
+        }
+
+        unsigned before[LINE_SIM_NUM_UARTS];
+        uint64_t first, last;
+        snapshot_tx(before);
+        s_host->update();
+        if (tx_since(before, &first, &last) && mouse_pending) {
+            samples_add(&r->mouse_done, last - mouse_pending_since);
+            mouse_pending = false;
+        }
+
+        if (next == t->count && line_sim_now_ns() >= end_ns) {
+            bool busy = false;
+            for (unsigned i = 0; i < LINE_SIM_NUM_UARTS; i++) {
+                unsigned count;
+                const LineByte *log = line_sim_tx_log(i, &count);
+                if (count && log[count - 1].end_ns > line_sim_now_ns())
+                    busy = true;
+            }
+            if (!busy)
+                break;
+        }
+
+        line_sim_advance_ns(s_loop_ns);
+    }
+
+    r->end_ns = line_sim_now_ns();
+}
+
+static void print_wire(void)
+{
+    for (unsigned u = 0; u < LINE_SIM_NUM_UARTS; u++) {
+        unsigned count;
+        const LineByte *log = line_sim_tx_log(u, &count);
+        for (unsigned i = 0; i < count; i++) {
+            printf("  uart%u %10.3f ms  %02x  (put %.3f ms, done %.3f ms)\n", u,
+                    log[i].start_ns / 1e6, log[i].byte, log[i].put_ns / 1e6, log[i].end_ns / 1e6);
+        }
+    }
+}
+
+static void print_lines(const RunStats *r)
+{
+    uint64_t span = r->end_ns - r->start_ns;
+    for (unsigned u = 0; u < LINE_SIM_NUM_UARTS; u++) {
+        if (!line_sim_uart_initialized(u))
+            continue;
+        const LineStats *st = line_sim_stats(u);
+        char fmt[32];
+        line_sim_format_str(u, fmt, sizeof(fmt));
+        printf("  uart%u %-10s %.2f ms/byte: tx %llu bytes, line busy %.1f%%, "
+                "putc blocked %.1f ms, tx fifo max %u, rx %llu bytes, %llu irqs (longest %.2f ms)\n",
+                u, fmt, line_sim_frame_ns(u) / 1e6, (unsigned long long) st->tx_bytes,
+                span ? 100.0 * st->tx_busy_ns / span : 0.0, st->tx_blocked_ns / 1e6,
+                st->tx_fifo_max, (unsigned long long) st->rx_bytes, (unsigned long long) st->irqs,
+                st->irq_max_ns / 1e6);
+        if (st->rx_overruns || st->rx_underruns)
+            printf("    rx overruns %llu, uart_getc on empty fifo %llu\n",
+                    (unsigned long long) st->rx_overruns, (unsigned long long) st->rx_underruns);
+    }
+}
+
+//
+// capacity sweep
+//
+
+static const uint8_t s_sweep_keys[] = {
+    HID_KEY_A, HID_KEY_S, HID_KEY_D, HID_KEY_F, HID_KEY_J, HID_KEY_K, HID_KEY_L, HID_KEY_E,
+    HID_KEY_R, HID_KEY_U, HID_KEY_I, HID_KEY_O, HID_KEY_N, HID_KEY_M, HID_KEY_T, HID_KEY_H,
+};
+
+static uint64_t max_frame_ns(void)
+{
+    uint64_t frame = 0;
+    for (unsigned u = 0; u < LINE_SIM_NUM_UARTS; u++) {
+        if (line_sim_uart_initialized(u) && line_sim_frame_ns(u) > frame)
+            frame = line_sim_frame_ns(u);
+    }
+    return frame;
+}
+
+static void sweep(void)
+{
+    const unsigned rates[] = { 5, 10, 20, 30, 40, 50, 60, 70, 80, 90, 100, 120, 150, 200 };
+    const double seconds = 4.0;
+    const uint64_t frame = max_frame_ns();
+    unsigned saturated_at = 0;
+    unsigned past = 0;
+    double bytes_per_key = 0;
+
+    printf("typing sweep, %.0f s per rate, keys alternate so at most two are down:\n", seconds);
+    printf("  keys/s   bytes/key   offered load   key done avg    p99      max   putc blocked\n");
+
+    for (unsigned ri = 0; ri < sizeof(rates) / sizeof(rates[0]) && past < 2; ri++) {
+        Trace t = { 0 };
+        uint64_t period = 1000000000ull / rates[ri];
+        unsigned n = (unsigned) (seconds * rates[ri]);
+        for (unsigned i = 0; i < n; i++) {
+            uint8_t key = s_sweep_keys[i % sizeof(s_sweep_keys)];
+            trace_add_key(&t, i * period, key, true);
+            trace_add_key(&t, i * period + period * 3 / 2, key, false);
+        }
+        qsort(t.events, t.count, sizeof(TraceEvent), trace_cmp);
+
+        line_sim_reset();
+        RunStats r = { 0 };
+        run(&t, &r);
+
+        uint64_t bytes = 0, busy = 0, blocked = 0;
+        for (unsigned u = 0; u < LINE_SIM_NUM_UARTS; u++) {
+            bytes += line_sim_stats(u)->tx_bytes;
+            busy += line_sim_stats(u)->tx_busy_ns;
+            blocked += line_sim_stats(u)->tx_blocked_ns;
+        }
+
+        Samples *d = &r.key_done;
+        qsort(d->v, d->count, sizeof(uint64_t), u64_cmp);
+        uint64_t sum = 0;
+        for (unsigned i = 0; i < d->count; i++)
+            sum += d->v[i];
+        uint64_t max = d->count ? d->v[d->count - 1] : 0;
+        double input_span = (double) (r.last_input_ns - r.start_ns);
+
+        bytes_per_key = n ? (double) bytes / n : 0;
+        printf("  %6u   %9.1f   %11.1f%%   %9.1f  %8.1f %8.1f   %8.1f ms\n", rates[ri], bytes_per_key,
+                100.0 * busy / input_span, d->count ? sum / (double) d->count / 1e6 : 0,
+                d->count ? d->v[(d->count * 99) / 100] / 1e6 : 0, max / 1e6, blocked / 1e6);
+
+        // Below capacity a key waits at most a couple of frames behind the
+        // previous one; past it, the backlog grows for as long as the input
+        // keeps coming.
+        if (max > 10 * frame) {
+            if (!saturated_at)
+                saturated_at = rates[ri];
+            past++;
+        }
+
+        run_stats_free(&r);
+        free(t.events);
+    }
+
+    if (bytes_per_key > 0)
+        printf("line capacity: ~%.0f keys/s (%.0f bytes/s, %.1f bytes per key)\n",
+                1e9 / frame / bytes_per_key, 1e9 / frame, bytes_per_key);
+    if (saturated_at)
+        printf("input exceeds line capacity at %u keys/s\n", saturated_at);
+    else
+        printf("line kept up with every rate tried\n");
+}
+
+//
+// main
+//
+
+static bool parse_format(const char *s, LineFormat *f)
+{
+    if (strlen(s) != 3 || s[0] < '5' || s[0] > '8' || (s[2] != '1' && s[2] != '2'))
+        return false;
+    f->data_bits = s[0] - '0';
+    f->stop_bits = s[2] - '0';
+    switch (s[1]) {
+    case 'N': case 'n': f->parity = UART_PARITY_NONE; break;
+    case 'E': case 'e': f->parity = UART_PARITY_EVEN; break;
+    case 'O': case 'o': f->parity = UART_PARITY_ODD; break;
+    default: return false;
+    }
+    return true;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: wire_sim [--baud N] [--format 8N1] [--loop-us N] [--send HEX] [--sweep] [-v] <host> [trace]\n");
+    fprintf(stderr, "hosts:");
+    for (HostDevice *h = sim_hosts; h->name[0]; h++)
+        fprintf(stderr, " %s", h->name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned baud = 0;
+    LineFormat fmt = { 0 };
+    bool have_format = false;
+    bool do_sweep = false;
+    const char *host_name = NULL;
+    const char *trace_path = NULL;
+    uint8_t send[64];
+    unsigned send_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc) {
+            baud = (unsigned) atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (!parse_format(argv[++i], &fmt))
+                usage();
+            have_format = true;
+        } else if (strcmp(argv[i], "--loop-us") == 0 && i + 1 < argc) {
+            s_loop_ns = (uint64_t) atoi(argv[++i]) * 1000;
+        } else if (strcmp(argv[i], "--send") == 0 && i + 1 < argc) {
+            send_count = parse_hex_bytes(argv[++i], send, sizeof(send));
+        } else if (strcmp(argv[i], "--sweep") == 0) {
+            do_sweep = true;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            s_verbose = true;
+        } else if (argv[i][0] == '-') {
+            usage();
+        } else if (!host_name) {
+            host_name = argv[i];
+        } else if (!trace_path) {
+            trace_path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (!host_name || (!trace_path && !do_sweep))
+        usage();
+    for (HostDevice *h = sim_hosts; h->name[0]; h++) {
+        if (strcmp(h->name, host_name) == 0)
+            s_host = h;
+    }
+    if (!s_host)
+        usage();
+
+    s_host->init();
+
+    // apply overrides on top of whatever init() configured
+    for (unsigned u = 0; u < LINE_SIM_NUM_UARTS; u++) {
+        if (!line_sim_uart_initialized(u) || (!baud && !have_format))
+            continue;
+        LineFormat f = line_sim_format(u);
+        if (baud)
+            f.baud = baud;
+        if (have_format) {
+            f.data_bits = fmt.data_bits;
+            f.stop_bits = fmt.stop_bits;
+            f.parity = fmt.parity;
+        }
+        line_sim_force_format(u, &f);
+    }
+
+    printf("host %s (%s), mainloop every %.0f us\n", s_host->name, s_host->notes, s_loop_ns / 1e3);
+
+    // let init traffic and the host's setup bytes settle before measuring
+    if (send_count)
+        line_sim_host_send(0, send, send_count);
+    line_sim_advance_ns(200 * 1000000ull);
+    s_host->update();
+    line_sim_advance_ns(200 * 1000000ull);
+
+    if (do_sweep) {
+        sweep();
+        return 0;
+    }
+
+    Trace t = { 0 };
+    if (!trace_load(&t, trace_path))
+        return 1;
+
+    line_sim_reset();
+    RunStats r = { 0 };
+    run(&t, &r);
+
+    if (s_verbose)
+        print_wire();
+
+    printf("%s: %u events over %.1f ms\n", trace_path, t.count, (r.end_ns - r.start_ns) / 1e6);
+    print_lines(&r);
+    samples_print("key -> first byte out", &r.key_queue);
+    samples_print("key -> at host", &r.key_done);
+    samples_print("mouse -> at host", &r.mouse_done);
+
+    run_stats_free(&r);
+    free(t.events);
+    return 0;
+}